@@ -23,6 +23,7 @@
 
 
 #include <device/device_types.h>
+#include <mach/mach.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOCFSerialize.h>
 #include <IOKit/IOCFUnserialize.h>
@@ -33,25 +34,156 @@
 
 #include <assert.h>
 #include <syslog.h>
+#include <os/lock.h>
+
+/*
+ * IOCFSerializeIDTable maps objects to a value by address. Both serializers
+ * only need object identity to find repeated objects, so this skips the
+ * CFHash, equality and retain/release callbacks a CFDictionary would make for
+ * every node. It is open addressed with linear probing over a power of two
+ * slot array. The first slots are part of the table itself so small trees
+ * never allocate, and RemoveAll keeps whatever storage has been grown for the
+ * next pass. A value of zero reads the same as a missing key. Keys are not
+ * retained, everything recorded must outlive the table.
+ */
+#define kIOCFSerializeIDTableInlineSlots    64
+
+typedef struct {
+    const void * key;
+    uintptr_t    value;
+} IOCFSerializeIDTableSlot;
+
+typedef struct {
+    IOCFSerializeIDTableSlot * slots;
+    size_t                     mask;
+    size_t                     count;
+    IOCFSerializeIDTableSlot   inlineSlots[kIOCFSerializeIDTableInlineSlots];
+} IOCFSerializeIDTable;
+
+static void
+IOCFSerializeIDTableInit(IOCFSerializeIDTable * table)
+{
+    table->slots = table->inlineSlots;
+    table->mask  = kIOCFSerializeIDTableInlineSlots - 1;
+    table->count = 0;
+    bzero(table->inlineSlots, sizeof(table->inlineSlots));
+}
+
+static void
+IOCFSerializeIDTableFree(IOCFSerializeIDTable * table)
+{
+    if (table->slots != table->inlineSlots) free(table->slots);
+    table->slots = table->inlineSlots;
+}
+
+static void
+IOCFSerializeIDTableRemoveAll(IOCFSerializeIDTable * table)
+{
+    bzero(table->slots, (table->mask + 1) * sizeof(IOCFSerializeIDTableSlot));
+    table->count = 0;
+}
+
+static inline size_t
+IOCFSerializeIDTableHash(const void * key)
+{
+    uint64_t h = (uintptr_t) key;
+
+    // CF objects are 16 byte aligned, mix the high bits down (murmur3 fmix64)
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return ((size_t) h);
+}
+
+static inline IOCFSerializeIDTableSlot *
+IOCFSerializeIDTableFind(const IOCFSerializeIDTable * table, const void * key)
+{
+    IOCFSerializeIDTableSlot * slot;
+    size_t                     index;
+
+    for (index = IOCFSerializeIDTableHash(key) & table->mask;
+         (slot = &table->slots[index])->key && (slot->key != key);
+         index = (index + 1) & table->mask) {}
+
+    return (slot);
+}
+
+static uintptr_t
+IOCFSerializeIDTableGetValue(const IOCFSerializeIDTable * table, const void * key)
+{
+    return (IOCFSerializeIDTableFind(table, key)->value);
+}
+
+static Boolean
+IOCFSerializeIDTableGrow(IOCFSerializeIDTable * table)
+{
+    IOCFSerializeIDTableSlot * old = table->slots;
+    size_t                     oldCount = table->mask + 1;
+    size_t                     newCount = oldCount * 2;
+    size_t                     index;
+
+    if (newCount < oldCount) return (false);
+    table->slots = (IOCFSerializeIDTableSlot *) calloc(newCount, sizeof(IOCFSerializeIDTableSlot));
+    if (!table->slots)
+    {
+        table->slots = old;
+        return (false);
+    }
+    table->mask = newCount - 1;
+
+    for (index = 0; index < oldCount; index++)
+    {
+        if (old[index].key) *IOCFSerializeIDTableFind(table, old[index].key) = old[index];
+    }
+    if (old != table->inlineSlots) free(old);
+
+    return (true);
+}
+
+static Boolean
+IOCFSerializeIDTableSetValue(IOCFSerializeIDTable * table, const void * key, uintptr_t value)
+{
+    IOCFSerializeIDTableSlot * slot;
+
+    slot = IOCFSerializeIDTableFind(table, key);
+    if (!slot->key)
+    {
+        // keep the load under 3/4
+        if ((table->count + 1) > ((table->mask + 1) - ((table->mask + 1) >> 2)))
+        {
+            if (!IOCFSerializeIDTableGrow(table)) return (false);
+            slot = IOCFSerializeIDTableFind(table, key);
+        }
+        slot->key = key;
+        table->count++;
+    }
+    slot->value = value;
+
+    return (true);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* For each plist value we track whether it is referenced more than once,
+ * and what the id used for those refs is. The first time we see a given
+ * value it is recorded as kIDRefSeen, so we know we saw it, and then
+ * kIDRefShared if we see it again, so we know we need an id for it. On
+ * writing out the XML, we generate ids as we encounter the need and store
+ * them as kIDRefFirstID + id.
+ */
+enum {
+    kIDRefSeen    = 1,
+    kIDRefShared  = 2,
+    kIDRefFirstID = 3
+};
 
 typedef struct {
     CFMutableDataRef   data;
 
     int                idrefNumRefs;
 
-/* For each CFType, we track whether a given plist value hasRefs,
- * and what the ids used for those refs are. 'hasRefs' is set to
- * kCFBooleanFalse the first time we see a given value, so we know
- * we saw it, and then kCFBooleanTrue if we see it again, so we know
- * we need an id for it. On writing out the XML, we generate ids as
- * we encounter the need.
- */
-    CFMutableDictionaryRef stringIDRefDictionary;
-    CFMutableDictionaryRef numberIDRefDictionary;
-    CFMutableDictionaryRef dataIDRefDictionary;
-    CFMutableDictionaryRef dictionaryIDRefDictionary;
-    CFMutableDictionaryRef arrayIDRefDictionary;
-    CFMutableDictionaryRef setIDRefDictionary;
+    IOCFSerializeIDTable idrefs;
 
 } IOCFSerializeState;
 
@@ -62,6 +194,10 @@ DoCFSerialize(CFTypeRef object, IOCFSerializeState * state);
 static CFDataRef
 IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options);
 
+static size_t
+IOCFSerializeBinaryToBuffer(CFTypeRef object, CFOptionFlags options,
+                            void * buffer, size_t bufferSize);
+
 static Boolean
 addChar(char chr, IOCFSerializeState * state)
 {
@@ -98,33 +234,21 @@ getTagString(CFTypeRef object)
 	return "internal error";
 }
 
-static CFMutableDictionaryRef
-idRefDictionaryForObject(
-    CFTypeRef              object,
-    IOCFSerializeState   * state)
+static Boolean
+idRefTracksObject(CFTypeRef object)
 {
-    CFMutableDictionaryRef result     = NULL;
-    CFTypeID               objectType = CFNullGetTypeID();  // do not release
+    CFTypeID objectType;
 
     objectType = CFGetTypeID(object);
 
    /* Sorted by rough order of % occurence in big plists.
     */
-	if (objectType == CFDictionaryGetTypeID()) {
-        result = state->dictionaryIDRefDictionary;
-    } else if (objectType == CFStringGetTypeID()) {
-        result = state->stringIDRefDictionary;
-    } else if (objectType == CFArrayGetTypeID()) {
-        result = state->arrayIDRefDictionary;
-    } else if (objectType == CFNumberGetTypeID()) {
-        result = state->numberIDRefDictionary;
-    } else if (objectType == CFDataGetTypeID()) {
-        result = state->dataIDRefDictionary;
-    } else if (objectType == CFSetGetTypeID()) {
-        result = state->setIDRefDictionary;
-    }
-
-	return result;
+    return ((objectType == CFDictionaryGetTypeID())
+         || (objectType == CFStringGetTypeID())
+         || (objectType == CFArrayGetTypeID())
+         || (objectType == CFNumberGetTypeID())
+         || (objectType == CFDataGetTypeID())
+         || (objectType == CFSetGetTypeID()));
 }
 
 void
@@ -132,35 +256,30 @@ recordObjectInIDRefDictionary(
     CFTypeRef              object,
     IOCFSerializeState   * state)
 {
-    CFTypeRef              refEntry        = NULL;  // do not release
-    CFMutableDictionaryRef idRefDictionary = NULL;  // do not release
+    IOCFSerializeIDTableSlot * slot;
 
     if (!object || !state) {
         goto finish;
     }
 
-    idRefDictionary = idRefDictionaryForObject(object, state);
-    if (!idRefDictionary) {
+    if (!idRefTracksObject(object)) {
         goto finish;
     }
 
-	refEntry = CFDictionaryGetValue(idRefDictionary, object);
-
    /* If we have never seen this object value, then add an entry
-    * in the dictionary with value false, indicating we have seen
-    * it once.
+    * marking that we have seen it once.
     *
-    * If we have seen this object value, then set its entry to true
-    * to indicate that we have now seen a second occurrence
-    * of the object value, which means we will generate an ID and IDREFs
-    * in the XML.
+    * If we have seen this object value, then mark that we have now seen
+    * a second occurrence of the object value, which means we will
+    * generate an ID and IDREFs in the XML.
     */
-    if (!refEntry) {
-       /* Use AddValue here so as not to overwrite.
-        */
-        CFDictionaryAddValue(idRefDictionary, object, kCFBooleanFalse);
+    slot = IOCFSerializeIDTableFind(&state->idrefs, object);
+    if (slot->key) {
+        slot->value = kIDRefShared;
     } else {
-        CFDictionarySetValue(idRefDictionary, object, kCFBooleanTrue);
+       /* Failing to record only costs sharing in the output.
+        */
+        (void) IOCFSerializeIDTableSetValue(&state->idrefs, object, kIDRefSeen);
     }
 
 finish:
@@ -173,9 +292,7 @@ previouslySerialized(
     IOCFSerializeState * state)
 {
     Boolean                result     = FALSE;
-    CFMutableDictionaryRef idRefDict  = NULL;  // do not release
-    CFTypeRef              idRefEntry = NULL;  // do not release
-    CFTypeID               idRefType  = CFNullGetTypeID();  // do not release
+    uintptr_t              idRefEntry = 0;
     char                   temp[64];
     int                    idInt      = -1;
 
@@ -183,41 +300,18 @@ previouslySerialized(
         goto finish;
     }
 
-   /* If we don't get a lookup dict or an entry for the object,
-    * then no ID or IDREF will be involved,
-    * so treat is if never before serialized.
-    */
-    idRefDict = idRefDictionaryForObject(object, state);
-    if (!idRefDict) {
-        goto finish;
-    }
-
-    idRefEntry = (CFTypeRef)CFDictionaryGetValue(idRefDict, object);
-    if (!idRefEntry) {
-        goto finish;
-    }
-
-    idRefType = CFGetTypeID(idRefEntry);
-
-   /* If the entry is of Boolean type, then an ID/IDREF may be involved,
-    * but we haven't created one yet, so not yet serialized.
-    */
-    if (idRefType == CFBooleanGetTypeID()) {
-        goto finish;
-    }
-
-   /* At this point the entry should be a CFNumber.
+   /* If we don't have an entry for the object, or it hasn't been given
+    * an ID yet, then no IDREF will be involved, so treat it as if never
+    * before serialized.
     */
-    if (idRefType != CFNumberGetTypeID()) {
+    idRefEntry = IOCFSerializeIDTableGetValue(&state->idrefs, object);
+    if (idRefEntry < kIDRefFirstID) {
         goto finish;
     }
 
-   /* Finally, get the IDREF value out of the idRef entry and write the
-    * XML for it. Bail on extraction error.
+   /* Finally, write the XML for the IDREF.
     */
-    if (!CFNumberGetValue((CFNumberRef)idRefEntry, kCFNumberIntType, &idInt)) {
-        goto finish;
-    }
+    idInt = (int)(idRefEntry - kIDRefFirstID);
     snprintf(temp, sizeof(temp), "<%s IDREF=\"%d\"/>", getTagString(object), idInt);
     result = addString(temp, state);
 
@@ -231,29 +325,19 @@ addStartTag(
     const char         * additionalTags,
     IOCFSerializeState * state)
 {
-    CFMutableDictionaryRef idRefDict  = NULL;  // do not release
-    CFTypeRef              idRefEntry = NULL;  // do not release
-	CFNumberRef            idRef = NULL;  // must release
+    IOCFSerializeIDTableSlot * slot;
 	char                   temp[128];
 
-    idRefDict = idRefDictionaryForObject(object, state);
-    if (idRefDict) {
-        idRefEntry = (CFTypeRef)CFDictionaryGetValue(idRefDict, object);
-    }
+    slot = IOCFSerializeIDTableFind(&state->idrefs, object);
 
-   /* If the IDRef entry is 'true', then we know we have an object value
+   /* If the IDRef entry is kIDRefShared, then we know we have an object value
     * with multiple references and need to emit an ID. So we create one
-    * by incrementing the state's counter, making a CFNumber, and *replacing*
-    * the boolean value in the IDRef dictionary with that number.
+    * by incrementing the state's counter and *replacing* the entry with it.
     */
-	if (idRefEntry == kCFBooleanTrue) {
+	if (slot->key && (slot->value == kIDRefShared)) {
         int idInt = state->idrefNumRefs++;
 
-        idRef = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &idInt);
-        assert(idRef);
-
-        CFDictionarySetValue(idRefDict, object, idRef);
-        CFRelease(idRef);
+        slot->value = kIDRefFirstID + idInt;
 
 		if (additionalTags) {
 			snprintf(temp, sizeof(temp) * sizeof(char),
@@ -731,7 +815,6 @@ IOCFSerialize(CFTypeRef object, CFOptionFlags options)
 {
     IOCFSerializeState       state;
     Boolean			         ok   = FALSE;
-    CFDictionaryKeyCallBacks idrefKeyCallbacks;
 
     if (!object) return 0;
 #if IOKIT_SERVER_VERSION >= 20140421
@@ -744,39 +827,7 @@ IOCFSerialize(CFTypeRef object, CFOptionFlags options)
 
     state.idrefNumRefs = 0;
 
-    idrefKeyCallbacks = kCFTypeDictionaryKeyCallBacks;
-    // only use pointer equality for these keys
-    idrefKeyCallbacks.equal = NULL;
-
-    state.stringIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.stringIDRefDictionary);
-
-    state.numberIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.numberIDRefDictionary);
-
-    state.dataIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.dataIDRefDictionary);
-
-    state.dictionaryIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.dictionaryIDRefDictionary);
-
-    state.arrayIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.arrayIDRefDictionary);
-
-    state.setIDRefDictionary = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &idrefKeyCallbacks, &kCFTypeDictionaryValueCallBacks);
-    assert(state.setIDRefDictionary);
+    IOCFSerializeIDTableInit(&state.idrefs);
 
     ok = DoIdrefScan(object, &state);
     if (!ok) {
@@ -798,16 +849,23 @@ finish:
         state.data = NULL;  // it's returned
     }
 
-    if (state.stringIDRefDictionary)     CFRelease(state.stringIDRefDictionary);
-    if (state.numberIDRefDictionary)     CFRelease(state.numberIDRefDictionary);
-    if (state.dataIDRefDictionary)       CFRelease(state.dataIDRefDictionary);
-    if (state.dictionaryIDRefDictionary) CFRelease(state.dictionaryIDRefDictionary);
-    if (state.arrayIDRefDictionary)      CFRelease(state.arrayIDRefDictionary);
-    if (state.setIDRefDictionary)        CFRelease(state.setIDRefDictionary);
+    IOCFSerializeIDTableFree(&state.idrefs);
 
     return state.data;
 }
 
+size_t
+IOCFSerializeToBuffer(CFTypeRef object, CFOptionFlags options,
+                      void * buffer, size_t bufferSize)
+{
+    if (!object) return 0;
+#if IOKIT_SERVER_VERSION >= 20140421
+    if (kIOCFSerializeToBinary & options) return IOCFSerializeBinaryToBuffer(object, options, buffer, bufferSize);
+#endif /* IOKIT_SERVER_VERSION >= 20140421 */
+
+    return 0;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #if IOKIT_SERVER_VERSION >= 20140421
@@ -822,30 +880,140 @@ finish:
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * The binary writer runs in two passes over the same tree. The sizing pass
+ * (bytes == NULL) only advances length, so once it completes we know the exact
+ * encoded size including padding and back-references, and the encode pass can
+ * write into a single buffer allocated up front. If the encode pass runs out of
+ * room it drops back to sizing so the caller still learns the size it needs.
+ */
 struct IOCFSerializeBinaryState
 {
-    CFMutableDataRef       data;
-	CFMutableDictionaryRef tags;
+    UInt8 *                bytes;
+    size_t                 capacity;
+    size_t                 length;
+    IOCFSerializeIDTable   tags;
+    CFMutableArrayRef      temporaries;     // keeps their addresses unique
     Boolean                endCollection;
     uintptr_t              tag;
+    // kIOCFSerializeIndexed
+    Boolean                indexed;
+    uint32_t *             index;           // word offsets of the root's keys or elements
+    CFIndex                indexCount;
+    CFIndex                indexCapacity;
 };
 typedef struct IOCFSerializeBinaryState IOCFSerializeBinaryState;
 
+/*
+ * The indexed format (kOSSerializeIndexedBinarySignature) differs from the plain
+ * one in three ways: object references are the word offset of the referenced
+ * object rather than its sequence number, every collection is followed by the
+ * number of words its contents take, and the writer appends an index after the
+ * root object. IOCFUnserializeBinary stops at the end of the root, so it never
+ * sees the index. The index is a count followed by the word offset of each
+ * top level dictionary key, sorted by key bytes, or of each array element, in
+ * order. Together they let IOCFUnserializeBinaryValueForKey() and
+ * IOCFUnserializeBinaryValueAtIndex() find and create one value without
+ * scanning the buffer.
+ */
+
+// the UTF-8 bytes of the dictionary key at pos, following a reference
+static Boolean
+IOCFIndexedKeyBytes(const uint32_t * words, uint32_t wordCount, uint32_t pos,
+                    const UInt8 ** bytes, uint32_t * length)
+{
+    uint32_t key, len;
+
+    if (pos >= wordCount) return (false);
+    key = words[pos];
+    if (kOSSerializeObject == (kOSSerializeTypeMask & key))
+    {
+        pos = (key & kOSSerializeDataMask);
+        if (pos >= wordCount) return (false);
+        key = words[pos];
+    }
+    len = (key & kOSSerializeDataMask);
+    if (((len + 3) >> 2) > (wordCount - pos - 1)) return (false);
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeSymbol:
+            if (len < 1) return (false);
+            len--;
+            break;
+        case kOSSerializeString:
+            break;
+        default:
+            return (false);
+    }
+    *bytes  = (const UInt8 *) &words[pos + 1];
+    *length = len;
+
+    return (true);
+}
+
+static int
+IOCFIndexedCompareKeys(const UInt8 * bytes1, uint32_t length1, const UInt8 * bytes2, uint32_t length2)
+{
+    int result;
+
+    result = memcmp(bytes1, bytes2, (length1 < length2) ? length1 : length2);
+    if (!result) result = (length1 < length2) ? -1 : (length1 > length2);
+
+    return (result);
+}
+
+static Boolean
+IOCFSerializeBinaryReserve(IOCFSerializeBinaryState * state, size_t size, UInt8 ** bits)
+{
+    size_t padded = (size + 3) & ~((size_t) 3);
+
+    *bits = NULL;
+    if (padded < size) return (false);
+
+    if (state->bytes)
+    {
+        if (padded > (state->capacity - state->length))
+        {
+            // out of room, keep measuring
+            state->bytes = NULL;
+        }
+        else
+        {
+            *bits = state->bytes + state->length;
+            if (padded != size) bzero(*bits + size, padded - size);
+        }
+    }
+    state->length += padded;
+
+    return (true);
+}
+
 static Boolean
 IOCFSerializeBinaryAdd(IOCFSerializeBinaryState * state, const void * bits, size_t size)
 {
-	CFDataAppendBytes(state->data, bits, size);
-    if (3 & size) CFDataIncreaseLength(state->data, 4 - (3 & size));
-	return true;
+    UInt8 * dst;
+
+    if (!IOCFSerializeBinaryReserve(state, size, &dst)) return (false);
+    if (dst) bcopy(bits, dst, size);
+
+	return (true);
 }
 
 static Boolean
-IOCFSerializeBinaryAddObject(IOCFSerializeBinaryState * state,
+IOCFSerializeBinaryAddObjectBytes(IOCFSerializeBinaryState * state,
 								  CFTypeRef o, uint32_t key,
-								  const void * bits, size_t size, size_t zero)
+								  size_t size, UInt8 ** bits)
 {
-    // add to tag dictionary
-	CFDictionarySetValue(state->tags, o, (const void *)state->tag);
+    UInt8 * dst;
+
+    // add to tag table, indexed references are word offsets
+    if (state->indexed)
+    {
+        state->tag = state->length / sizeof(uint32_t);
+        if (state->tag > kOSSerializeDataMask) return (false);
+    }
+	if (!IOCFSerializeIDTableSetValue(&state->tags, o, state->tag)) return (false);
 	state->tag++;
 
     if (state->endCollection)
@@ -854,10 +1022,30 @@ IOCFSerializeBinaryAddObject(IOCFSerializeBinaryState * state,
          key |= kOSSerializeEndCollecton;
     }
 
-	CFDataAppendBytes(state->data, (const UInt8 *) &key, sizeof(key));
-	CFDataAppendBytes(state->data, bits, size - zero);
-    if (zero) CFDataIncreaseLength(state->data, zero);
-    if (3 & size) CFDataIncreaseLength(state->data, 4 - (3 & size));
+    if (!IOCFSerializeBinaryReserve(state, sizeof(key) + size, &dst)) return (false);
+    if (dst)
+    {
+        bcopy(&key, dst, sizeof(key));
+        dst += sizeof(key);
+    }
+    *bits = dst;
+
+	return (true);
+}
+
+static Boolean
+IOCFSerializeBinaryAddObject(IOCFSerializeBinaryState * state,
+								  CFTypeRef o, uint32_t key,
+								  const void * bits, size_t size, size_t zero)
+{
+    UInt8 * dst;
+
+    if (!IOCFSerializeBinaryAddObjectBytes(state, o, key, size, &dst)) return (false);
+    if (dst)
+    {
+        if (size > zero) bcopy(bits, dst, size - zero);
+        if (zero) bzero(dst + size - zero, zero);
+    }
 
 	return (true);
 }
@@ -868,9 +1056,128 @@ struct ApplierState
     CFIndex                    index;
     CFIndex                    count;
     Boolean					   ok;
+    Boolean                    recordIndex;
+    size_t                     lengthOffset;
 };
 typedef struct ApplierState ApplierState;
 
+static Boolean
+IOCFSerializeBinaryBeginCollection(IOCFSerializeBinaryState * state, ApplierState * applierState,
+                                   CFIndex count, Boolean recordIndex)
+{
+    uint32_t * index;
+    uint32_t   length = 0;
+
+    applierState->state        = state;
+    applierState->ok           = true;
+    applierState->index        = 0;
+    applierState->count        = count;
+    applierState->recordIndex  = false;
+    applierState->lengthOffset = state->length;
+
+    if (!state->indexed) return (true);
+
+    // patched by IOCFSerializeBinaryEndCollection
+    if (!IOCFSerializeBinaryAdd(state, &length, sizeof(length))) return (false);
+
+    if (recordIndex)
+    {
+        if (count > state->indexCapacity)
+        {
+            index = (uint32_t *) reallocf(state->index, count * sizeof(uint32_t));
+            state->index = index;
+            if (!index)
+            {
+                state->indexCapacity = 0;
+                return (false);
+            }
+            state->indexCapacity = count;
+        }
+        applierState->recordIndex = true;
+    }
+
+    return (true);
+}
+
+static void
+IOCFSerializeBinaryEndCollection(IOCFSerializeBinaryState * state, ApplierState * applierState)
+{
+    uint32_t length;
+
+    if (!state->indexed || !state->bytes) return;
+
+    length = (uint32_t) ((state->length - applierState->lengthOffset - sizeof(length)) / sizeof(uint32_t));
+    bcopy(&length, state->bytes + applierState->lengthOffset, sizeof(length));
+}
+
+static void
+IOCFSerializeBinaryRecordIndex(ApplierState * applierState)
+{
+    IOCFSerializeBinaryState * state = applierState->state;
+
+    if (!applierState->recordIndex) return;
+    if (state->indexCount < state->indexCapacity)
+    {
+        state->index[state->indexCount++] = (uint32_t) (state->length / sizeof(uint32_t));
+    }
+}
+
+struct IOCFIndexedEntry
+{
+    const UInt8 * bytes;
+    uint32_t      length;
+    uint32_t      offset;
+};
+typedef struct IOCFIndexedEntry IOCFIndexedEntry;
+
+static int
+IOCFIndexedCompareEntries(const void * a, const void * b)
+{
+    const IOCFIndexedEntry * entry1 = (const IOCFIndexedEntry *) a;
+    const IOCFIndexedEntry * entry2 = (const IOCFIndexedEntry *) b;
+
+    return (IOCFIndexedCompareKeys(entry1->bytes, entry1->length, entry2->bytes, entry2->length));
+}
+
+static Boolean
+IOCFSerializeBinaryAddIndex(IOCFSerializeBinaryState * state, CFTypeRef object)
+{
+    IOCFIndexedEntry * entries;
+    UInt8 *            dst;
+    uint32_t *         words;
+    uint32_t           count, wordCount, idx;
+
+    count = (uint32_t) state->indexCount;
+    wordCount = (uint32_t) (state->length / sizeof(uint32_t));
+    if (!IOCFSerializeBinaryReserve(state, (1 + count) * sizeof(uint32_t), &dst)) return (false);
+    if (!dst) return (true);
+
+    words = (uint32_t *) state->bytes;
+    if (count && (CFDictionaryGetTypeID() == CFGetTypeID(object)))
+    {
+        entries = (IOCFIndexedEntry *) malloc(count * sizeof(IOCFIndexedEntry));
+        if (!entries) return (false);
+        for (idx = 0; idx < count; idx++)
+        {
+            entries[idx].offset = state->index[idx];
+            if (!IOCFIndexedKeyBytes(words, wordCount, entries[idx].offset,
+                                     &entries[idx].bytes, &entries[idx].length))
+            {
+                free(entries);
+                return (false);
+            }
+        }
+        qsort(entries, count, sizeof(IOCFIndexedEntry), &IOCFIndexedCompareEntries);
+        for (idx = 0; idx < count; idx++) state->index[idx] = entries[idx].offset;
+        free(entries);
+    }
+
+    bcopy(&count, dst, sizeof(count));
+    if (count) bcopy(state->index, dst + sizeof(count), count * sizeof(uint32_t));
+
+    return (true);
+}
+
 static Boolean
 DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey);
 
@@ -880,6 +1187,7 @@ IOCFSerializeBinaryCFDictionaryFunction(const void *key, const void *value, void
     ApplierState * ctx = (typeof(ctx)) context;
 
     ctx->index++;
+	IOCFSerializeBinaryRecordIndex(ctx);
 	ctx->ok &= DoCFSerializeBinary(ctx->state, key, true);
 	ctx->state->endCollection = (ctx->index == ctx->count);
 	ctx->ok &= DoCFSerializeBinary(ctx->state, value, false);
@@ -891,6 +1199,7 @@ IOCFSerializeBinaryCFArraySetFunction(const void *value, void *context)
     ApplierState * ctx = (typeof(ctx)) context;
 
     ctx->index++;
+	IOCFSerializeBinaryRecordIndex(ctx);
 	ctx->state->endCollection = (ctx->index == ctx->count);
 	ctx->ok &= DoCFSerializeBinary(ctx->state, value, false);
 }
@@ -905,9 +1214,10 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
     uint32_t     key;
     size_t       len;
     uintptr_t    tag;
+    Boolean      isRoot;
 
 	// look it up
-	tag = (uintptr_t) CFDictionaryGetValue(state->tags, o);
+	tag = IOCFSerializeIDTableGetValue(&state->tags, o);
 	// does it exist?
 	if (tag)
 	{
@@ -922,49 +1232,46 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
 	}
 
     type = CFGetTypeID(o);
-	applierState.state = state;
+    isRoot = (state->length == sizeof(kOSSerializeBinarySignature));
 
     if (type == CFDictionaryGetTypeID())
 	{
 		count = CFDictionaryGetCount(o);
 		key = (kOSSerializeDictionary | count);
 		ok = IOCFSerializeBinaryAddObject(state, o, key, NULL, 0, 0);
+		if (ok) ok = IOCFSerializeBinaryBeginCollection(state, &applierState, count, isRoot);
 		if (ok)
 		{
-			applierState.ok    = true;
-			applierState.index = 0;
-			applierState.count = count;
 			CFDictionaryApplyFunction(o, &IOCFSerializeBinaryCFDictionaryFunction, &applierState);
 			ok = applierState.ok;
 		}
+		if (ok) IOCFSerializeBinaryEndCollection(state, &applierState);
 	}
     else if (type == CFArrayGetTypeID())
 	{
 		count = CFArrayGetCount(o);
 		key = (kOSSerializeArray | count);
 		ok = IOCFSerializeBinaryAddObject(state, o, key, NULL, 0, 0);
+		if (ok) ok = IOCFSerializeBinaryBeginCollection(state, &applierState, count, isRoot);
 		if (ok)
 		{
-			applierState.ok    = true;
-			applierState.index = 0;
-			applierState.count = count;
 			CFArrayApplyFunction(o, CFRangeMake(0, count), &IOCFSerializeBinaryCFArraySetFunction, &applierState);
 			ok = applierState.ok;
 		}
+		if (ok) IOCFSerializeBinaryEndCollection(state, &applierState);
 	}
     else if (type == CFSetGetTypeID())
 	{
 		count = CFArrayGetCount(o);
 		key = (kOSSerializeSet | count);
 		ok = IOCFSerializeBinaryAddObject(state, o, key, NULL, 0, 0);
+		if (ok) ok = IOCFSerializeBinaryBeginCollection(state, &applierState, count, false);
 		if (ok)
 		{
-			applierState.ok    = true;
-			applierState.index = 0;
-			applierState.count = count;
 			CFSetApplyFunction(o, &IOCFSerializeBinaryCFArraySetFunction, &applierState);
 			ok = applierState.ok;
 		}
+		if (ok) IOCFSerializeBinaryEndCollection(state, &applierState);
 	}
     else if (type == CFNumberGetTypeID())
 	{
@@ -1053,58 +1360,58 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
 	}
     else if (type == CFStringGetTypeID())
 	{
-		CFDataRef dataBuffer = 0;
 		const char * buffer;
-		bool conversionFailed = false;
+		CFRange      range;
+		CFIndex      used;
+		UInt8        lossByte = 0;
+		UInt8      * bits;
 
-		if ((buffer = CFStringGetCStringPtr(o, kCFStringEncodingUTF8))) len = CFStringGetLength(o);
-		else
+		if ((buffer = CFStringGetCStringPtr(o, kCFStringEncodingUTF8)))
 		{
-			dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, o, kCFStringEncodingUTF8, 0);
-			if (!dataBuffer)
+			len = CFStringGetLength(o);
+			if (isKey)
 			{
-				dataBuffer = CFStringCreateExternalRepresentation(kCFAllocatorDefault, o, kCFStringEncodingUTF8, (UInt8)'?');
-				conversionFailed = true;
-			}
-
-			if (dataBuffer)
-			{
-				len = CFDataGetLength(dataBuffer);
-				buffer = (char *) CFDataGetBytePtr(dataBuffer);
+				key = (kOSSerializeSymbol | (len + 1));
+				ok  = IOCFSerializeBinaryAddObject(state, o, key, buffer, len + 1, 1);
 			}
 			else
 			{
-				len = 0;
-				buffer = "";
-				conversionFailed = true;
+				key = (kOSSerializeString | len);
+				ok  = IOCFSerializeBinaryAddObject(state, o, key, buffer, len, 0);
 			}
 		}
-
-		if (conversionFailed)
+		else
 		{
-			char * tempBuffer;
-			if (buffer && (tempBuffer = malloc(len + 1)))
+			// measure the UTF-8 form, then convert straight into the output
+			range = CFRangeMake(0, CFStringGetLength(o));
+			if (range.length != CFStringGetBytes(o, range, kCFStringEncodingUTF8, 0, false, NULL, 0, &used))
 			{
-				bcopy(buffer, tempBuffer, len);
-				tempBuffer[len] = 0;
-				syslog(LOG_ERR, "FIXME: IOCFSerialize has detected a string that can not be converted to UTF-8, \"%s\"", tempBuffer);
-				free(tempBuffer);
+				lossByte = (UInt8)'?';
+				CFStringGetBytes(o, range, kCFStringEncodingUTF8, lossByte, false, NULL, 0, &used);
 			}
-		}
+			len = used;
 
-		if (isKey)
-		{
-			len++;
-			key = (kOSSerializeSymbol | len);
-			ok  = IOCFSerializeBinaryAddObject(state, o, key, buffer, len, 1);
-		}
-		else
-		{
-			key = (kOSSerializeString | len);
-			ok  = IOCFSerializeBinaryAddObject(state, o, key, buffer, len, 0);
-		}
+			if (isKey) key = (kOSSerializeSymbol | (len + 1));
+			else       key = (kOSSerializeString | len);
+			ok = IOCFSerializeBinaryAddObjectBytes(state, o, key, len + (isKey ? 1 : 0), &bits);
+			if (ok && bits)
+			{
+				CFStringGetBytes(o, range, kCFStringEncodingUTF8, lossByte, false, bits, len, NULL);
+				if (isKey) bits[len] = 0;
 
-		if (dataBuffer) CFRelease(dataBuffer);
+				if (lossByte)
+				{
+					char * tempBuffer;
+					if ((tempBuffer = malloc(len + 1)))
+					{
+						bcopy(bits, tempBuffer, len);
+						tempBuffer[len] = 0;
+						syslog(LOG_ERR, "FIXME: IOCFSerialize has detected a string that can not be converted to UTF-8, \"%s\"", tempBuffer);
+						free(tempBuffer);
+					}
+				}
+			}
+		}
 	}
     else if (type == CFDataGetTypeID())
 	{
@@ -1120,6 +1427,10 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
         if ((ok = (NULL != temp)))
         {
             ok = DoCFSerializeBinary(state, temp, false);
+            // the tag table doesn't retain, hold on to it for the rest of the pass
+            if (!state->temporaries) state->temporaries = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+            if (state->temporaries) CFArrayAppendValue(state->temporaries, temp);
+            else                    ok = false;
             CFRelease(temp);
         }
     }
@@ -1127,57 +1438,215 @@ DoCFSerializeBinary(IOCFSerializeBinaryState * state, CFTypeRef o, Boolean isKey
     return (ok);
 }
 
-CFDataRef
-IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options __unused)
+static void
+IOCFSerializeBinaryStateFree(IOCFSerializeBinaryState * state)
+{
+    IOCFSerializeIDTableFree(&state->tags);
+    if (state->temporaries) CFRelease(state->temporaries);
+    if (state->index)       free(state->index);
+}
+
+static Boolean
+IOCFSerializeBinaryPass(IOCFSerializeBinaryState * state, CFTypeRef object)
 {
     Boolean ok;
-    IOCFSerializeBinaryState state;
 
-    bzero(&state, sizeof(state));
+    IOCFSerializeIDTableRemoveAll(&state->tags);
+    if (state->temporaries) CFArrayRemoveAllValues(state->temporaries);
+    state->tag           = 0;
+    state->length        = 0;
+    state->indexCount    = 0;
+	state->endCollection = true;
 
-	state.endCollection = true;
-    state.data = CFDataCreateMutable(kCFAllocatorDefault, 0);
-    assert(state.data);
+    if (state->indexed)
+    {
+        const uint8_t signature[sizeof(kOSSerializeBinarySignature)] = { kOSSerializeIndexedBinarySignature };
+        ok = IOCFSerializeBinaryAdd(state, signature, sizeof(signature));
+    }
+    else
+    {
+        ok = IOCFSerializeBinaryAdd(state, kOSSerializeBinarySignature, sizeof(kOSSerializeBinarySignature));
+    }
+	if (ok) ok = DoCFSerializeBinary(state, object, false);
+	if (ok && state->indexed) ok = IOCFSerializeBinaryAddIndex(state, object);
 
-    CFDictionaryKeyCallBacks keyCallbacks;
-    keyCallbacks = kCFTypeDictionaryKeyCallBacks;
-    // only use pointer equality for these keys
-    keyCallbacks.equal = NULL;
+    return (ok);
+}
 
-    state.tags = CFDictionaryCreateMutable(
-        kCFAllocatorDefault, 0,
-        &keyCallbacks,
-        (CFDictionaryValueCallBacks *) NULL);
+CFDataRef
+IOCFSerializeBinary(CFTypeRef object, CFOptionFlags options)
+{
+    Boolean          ok;
+    CFMutableDataRef data = NULL;
+    size_t           size;
+    IOCFSerializeBinaryState state;
 
-    assert(state.tags);
+    bzero(&state, sizeof(state));
+    IOCFSerializeIDTableInit(&state.tags);
+    state.indexed = (0 != (kIOCFSerializeIndexed & options));
 
-	IOCFSerializeBinaryAdd(&state, kOSSerializeBinarySignature, sizeof(kOSSerializeBinarySignature));
+    // sizing pass
+    ok = IOCFSerializeBinaryPass(&state, object);
 
-	ok = DoCFSerializeBinary(&state, object, false);
+    if (ok)
+    {
+        size = state.length;
+        data = CFDataCreateMutable(kCFAllocatorDefault, size);
+        assert(data);
+        CFDataSetLength(data, size);
+
+        // encode pass
+        state.bytes    = CFDataGetMutableBytePtr(data);
+        state.capacity = size;
+        ok = IOCFSerializeBinaryPass(&state, object);
+        ok = (ok && state.bytes && (state.length == size));
+    }
 
-    if (!ok && state.data)
+    if (!ok && data)
     {
-        CFRelease(state.data);
-        state.data = NULL;  // it's returned
+        CFRelease(data);
+        data = NULL;
     }
-    if (state.tags) CFRelease(state.tags);
+    IOCFSerializeBinaryStateFree(&state);
 
-    return (state.data);
+    return (data);
 }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static size_t
+IOCFSerializeBinaryToBuffer(CFTypeRef object, CFOptionFlags options,
+                            void * buffer, size_t bufferSize)
+{
+    Boolean ok;
+    IOCFSerializeBinaryState state;
 
-#define setAtIndex(v, idx, o)													    \
-	if (idx >= v##Capacity)														    \
-	{																			    \
-        if (v##Capacity >= v##CapacityMax) ok = false;                              \
-        else																		\
-        {																			\
-            uint32_t ncap = v##Capacity + 64;										\
-            typeof(v##Array) nbuf = (typeof(v##Array)) malloc(ncap * sizeof(o));	\
-            if (!nbuf) ok = false;													\
-            else																	\
-            {																		\
+    bzero(&state, sizeof(state));
+    IOCFSerializeIDTableInit(&state.tags);
+    state.indexed = (0 != (kIOCFSerializeIndexed & options));
+
+    state.bytes    = buffer;
+    state.capacity = buffer ? bufferSize : 0;
+    ok = IOCFSerializeBinaryPass(&state, object);
+
+    IOCFSerializeBinaryStateFree(&state);
+
+    return (ok ? state.length : 0);
+}
+
+/*
+ * Dictionary keys repeat across every registry entry, so IOCFUnserializeBinary
+ * can hand out shared key strings from a process wide table instead of creating
+ * them on each call. The table is off until IOCFUnserializeSetKeyInterning()
+ * turns it on. It only grows: strings are never evicted, and once
+ * kIOCFInternTableMaxCount keys are in it further keys are created as before.
+ * Only keys from kOSSerializeSymbol objects are interned, and only when the
+ * caller's allocator is the default one since the shared strings outlive it.
+ */
+#define kIOCFInternTableSlots       4096
+#define kIOCFInternTableMaxCount    (kIOCFInternTableSlots / 2)
+#define kIOCFInternTableMaxLength   128
+
+typedef struct {
+    CFStringRef string;
+    char *      bytes;
+    uint32_t    length;
+    uint32_t    hash;
+} IOCFInternTableSlot;
+
+static os_unfair_lock        gIOCFInternLock = OS_UNFAIR_LOCK_INIT;
+static IOCFInternTableSlot * gIOCFInternSlots;
+static uint32_t              gIOCFInternCount;
+static uint64_t              gIOCFInternHits;
+static uint64_t              gIOCFInternMisses;
+static volatile Boolean      gIOCFInternEnabled;
+
+void
+IOCFUnserializeSetKeyInterning(Boolean enable)
+{
+    gIOCFInternEnabled = enable;
+}
+
+void
+IOCFUnserializeGetKeyInterningStatistics(IOCFUnserializeKeyInterningStatistics * statistics)
+{
+    os_unfair_lock_lock(&gIOCFInternLock);
+    statistics->hits     = gIOCFInternHits;
+    statistics->misses   = gIOCFInternMisses;
+    statistics->count    = gIOCFInternCount;
+    statistics->capacity = kIOCFInternTableMaxCount;
+    os_unfair_lock_unlock(&gIOCFInternLock);
+}
+
+// returns a retained string for the symbol, or NULL to have the caller create one.
+static CFStringRef
+IOCFInternKey(CFAllocatorRef allocator, const UInt8 * bytes, uint32_t length)
+{
+    IOCFInternTableSlot * slot;
+    CFStringRef           string;
+    uint32_t              hash, idx;
+
+    if (!gIOCFInternEnabled) return (NULL);
+    if ((allocator != kCFAllocatorDefault) && (allocator != CFAllocatorGetDefault())) return (NULL);
+    if (length > kIOCFInternTableMaxLength) return (NULL);
+
+    // FNV-1a
+    hash = 2166136261U;
+    for (idx = 0; idx < length; idx++) hash = (hash ^ bytes[idx]) * 16777619U;
+
+    string = NULL;
+    os_unfair_lock_lock(&gIOCFInternLock);
+    do
+    {
+        if (!gIOCFInternSlots) {
+            gIOCFInternSlots = calloc(kIOCFInternTableSlots, sizeof(IOCFInternTableSlot));
+            if (!gIOCFInternSlots) break;
+        }
+        for (idx = hash & (kIOCFInternTableSlots - 1);
+             (slot = &gIOCFInternSlots[idx])->string;
+             idx = (idx + 1) & (kIOCFInternTableSlots - 1))
+        {
+            if ((slot->hash == hash) && (slot->length == length)
+             && !memcmp(slot->bytes, bytes, length)) {
+                string = CFRetain(slot->string);
+                break;
+            }
+        }
+        if (string) {
+            gIOCFInternHits++;
+            break;
+        }
+        gIOCFInternMisses++;
+        if (gIOCFInternCount >= kIOCFInternTableMaxCount) break;
+
+        // not valid UTF-8 is left to the caller's fallback
+        string = CFStringCreateWithBytes(kCFAllocatorDefault, bytes, length, kCFStringEncodingUTF8, false);
+        if (!string) break;
+        slot->bytes = malloc(length ? length : 1);
+        if (!slot->bytes) break;
+        bcopy(bytes, slot->bytes, length);
+        slot->length = length;
+        slot->hash   = hash;
+        slot->string = CFRetain(string);
+        gIOCFInternCount++;
+    }
+    while (false);
+    os_unfair_lock_unlock(&gIOCFInternLock);
+
+    return (string);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define setAtIndex(v, idx, o)													    \
+	if (idx >= v##Capacity)														    \
+	{																			    \
+        if (v##Capacity >= v##CapacityMax) ok = false;                              \
+        else																		\
+        {																			\
+            uint32_t ncap = v##Capacity + 64;										\
+            typeof(v##Array) nbuf = (typeof(v##Array)) malloc(ncap * sizeof(o));	\
+            if (!nbuf) ok = false;													\
+            else																	\
+            {																		\
                 if (v##Array)														\
                 {																	\
                     bcopy(v##Array, nbuf, v##Capacity * sizeof(o));					\
@@ -1333,7 +1802,9 @@ IOCFUnserializeBinary(const char	* buffer,
 				if (bufferPos > bufferSize) break;
 				if ((kOSSerializeSymbol == (kOSSerializeTypeMask & key))
 					&& (0 != ((const UInt8 *)next)[len])) break;
-				o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingUTF8, false);
+				if (kOSSerializeSymbol == (kOSSerializeTypeMask & key))
+					o = IOCFInternKey(allocator, (const UInt8 *) next, len);
+				if (!o) o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingUTF8, false);
 				if (!o)
 				{
 					o = CFStringCreateWithBytes(allocator, (const UInt8 *) next, len, kCFStringEncodingMacRoman, false);
@@ -1425,6 +1896,8 @@ IOCFUnserializeBinary(const char	* buffer,
 			parent = stackArray[stackIdx];
 			DEBG("--stack[%d] %p\n", stackIdx, parent);
 			stackIdx--;
+			// a root collection without its end flag pushed a null parent
+			if (!(ok = (parent != NULL))) break;
 
 			type = CFGetTypeID(parent);
 			set   = NULL;
@@ -1454,6 +1927,1462 @@ IOCFUnserializeBinary(const char	* buffer,
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * Creating single values out of an indexed buffer. Only the words the value
+ * and its references touch are read and checked, so a buffer that
+ * IOCFUnserializeBinary would reject elsewhere can still give up a value here.
+ * Buffers without a usable index, and values nested deeper than
+ * kIOCFIndexedMaxDepth, fall back to IOCFUnserializeBinary.
+ */
+
+#define kIOCFIndexedMaxDepth	512
+
+typedef struct
+{
+    const uint32_t *     words;
+    uint32_t             wordCount;
+    CFAllocatorRef       allocator;
+    IOCFSerializeIDTable objects;       // header word -> object, holds a reference
+    uint32_t             depth;
+    Boolean              tooDeep;
+} IOCFIndexedDecoder;
+
+// words the object at pos occupies, or 0 if it doesn't fit
+static uint32_t
+IOCFIndexedObjectSize(const uint32_t * words, uint32_t wordCount, uint32_t pos)
+{
+    uint32_t key, size;
+
+    if (pos >= wordCount) return (0);
+    key = words[pos];
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeDictionary:
+        case kOSSerializeArray:
+        case kOSSerializeSet:
+            if ((wordCount - pos) < 2) return (0);
+            size = words[pos + 1];
+            if (size > (wordCount - pos - 2)) return (0);
+            return (2 + size);
+        case kOSSerializeNumber:
+            size = 1 + (sizeof(long long) / sizeof(uint32_t));
+            break;
+        case kOSSerializeSymbol:
+        case kOSSerializeString:
+        case kOSSerializeData:
+            size = 1 + (((key & kOSSerializeDataMask) + 3) >> 2);
+            break;
+        case kOSSerializeBoolean:
+        case kOSSerializeObject:
+            size = 1;
+            break;
+        default:
+            return (0);
+    }
+
+    return ((size <= (wordCount - pos)) ? size : 0);
+}
+
+static CFTypeRef
+IOCFIndexedDecode(IOCFIndexedDecoder * decoder, uint32_t pos);
+
+static CFTypeRef
+IOCFIndexedDecodeCollection(IOCFIndexedDecoder * decoder, uint32_t pos, uint32_t size)
+{
+    CFMutableDictionaryRef dict  = NULL;
+    CFMutableArrayRef      array = NULL;
+    CFMutableSetRef        set   = NULL;
+    CFTypeRef              o, child, sym;
+    uint32_t               key, len, next, end, childSize;
+    Boolean                last;
+
+    key = decoder->words[pos];
+    len = (key & kOSSerializeDataMask);
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeDictionary:
+            o = dict = CFDictionaryCreateMutable(decoder->allocator, len,
+                                                 &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+            break;
+        case kOSSerializeArray:
+            o = array = CFArrayCreateMutable(decoder->allocator, len, &kCFTypeArrayCallBacks);
+            break;
+        default:
+            o = set = CFSetCreateMutable(decoder->allocator, len, &kCFTypeSetCallBacks);
+            break;
+    }
+    if (!o) return (NULL);
+
+    // recorded before the contents, which may refer back to it
+    if (!IOCFSerializeIDTableSetValue(&decoder->objects, &decoder->words[pos], (uintptr_t) o))
+    {
+        CFRelease(o);
+        return (NULL);
+    }
+    if (!len) return (o);
+
+    sym  = NULL;
+    next = pos + 2;
+    end  = pos + size;
+    do
+    {
+        if (next >= end) return (NULL);
+        last  = (0 != (kOSSerializeEndCollecton & decoder->words[next]));
+        child = IOCFIndexedDecode(decoder, next);
+        if (!child) return (NULL);
+        childSize = IOCFIndexedObjectSize(decoder->words, end, next);
+        if (!childSize) return (NULL);
+        next += childSize;
+
+        if (dict)
+        {
+            if (sym)
+            {
+                if (child != dict) CFDictionarySetValue(dict, sym, child);
+                sym = NULL;
+            }
+            else
+            {
+                if (CFStringGetTypeID() != CFGetTypeID(child)) return (NULL);
+                sym = child;
+            }
+        }
+        else if (array) CFArrayAppendValue(array, child);
+        else            CFSetAddValue(set, child);
+    }
+    while (!last);
+
+    return (o);
+}
+
+static CFTypeRef
+IOCFIndexedDecodeObject(IOCFIndexedDecoder * decoder, uint32_t pos)
+{
+    CFTypeRef     o;
+    const UInt8 * bytes;
+    uint32_t      key, len, size;
+
+    o = (CFTypeRef) IOCFSerializeIDTableGetValue(&decoder->objects, &decoder->words[pos]);
+    if (o) return (o);
+
+    size = IOCFIndexedObjectSize(decoder->words, decoder->wordCount, pos);
+    if (!size) return (NULL);
+
+    key   = decoder->words[pos];
+    len   = (key & kOSSerializeDataMask);
+    bytes = (const UInt8 *) &decoder->words[pos + 1];
+    o     = NULL;
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeDictionary:
+        case kOSSerializeArray:
+        case kOSSerializeSet:
+            return (IOCFIndexedDecodeCollection(decoder, pos, size));
+
+        case kOSSerializeObject:
+            // references only point back, at objects
+            if (len >= pos) return (NULL);
+            if (kOSSerializeObject == (kOSSerializeTypeMask & decoder->words[len])) return (NULL);
+            return (IOCFIndexedDecode(decoder, len));
+
+        case kOSSerializeNumber:
+            if (len == 31) {
+                double doubleValue = *((const double *) bytes);
+                float floatValue = (float) doubleValue;
+                o = CFNumberCreate(decoder->allocator, kCFNumberFloat32Type, &floatValue);
+            } else if (len == 63) {
+                o = CFNumberCreate(decoder->allocator, kCFNumberFloat64Type, (const void *) bytes);
+            } else if (len <= 32) {
+                o = CFNumberCreate(decoder->allocator, kCFNumberSInt32Type, (const void *) bytes);
+            } else {
+                o = CFNumberCreate(decoder->allocator, kCFNumberSInt64Type, (const void *) bytes);
+            }
+            break;
+
+        case kOSSerializeSymbol:
+            if (len < 1) break;
+            len--;
+            if (0 != bytes[len]) break;
+            /* fall thru */
+        case kOSSerializeString:
+            if (kOSSerializeSymbol == (kOSSerializeTypeMask & key))
+                o = IOCFInternKey(decoder->allocator, bytes, len);
+            if (!o) o = CFStringCreateWithBytes(decoder->allocator, bytes, len, kCFStringEncodingUTF8, false);
+            if (!o)
+            {
+                o = CFStringCreateWithBytes(decoder->allocator, bytes, len, kCFStringEncodingMacRoman, false);
+                syslog(LOG_ERR, "FIXME: IOUnserialize has detected a string that is not valid UTF-8, \"%s\".",
+                                CFStringGetCStringPtr(o, kCFStringEncodingMacRoman));
+            }
+            break;
+
+        case kOSSerializeData:
+            o = CFDataCreate(decoder->allocator, bytes, len);
+            break;
+
+        case kOSSerializeBoolean:
+            o = (len ? kCFBooleanTrue : kCFBooleanFalse);
+            CFRetain(o);
+            break;
+    }
+    if (!o) return (NULL);
+
+    if (!IOCFSerializeIDTableSetValue(&decoder->objects, &decoder->words[pos], (uintptr_t) o))
+    {
+        CFRelease(o);
+        return (NULL);
+    }
+
+    return (o);
+}
+
+// the result belongs to the decoder
+static CFTypeRef
+IOCFIndexedDecode(IOCFIndexedDecoder * decoder, uint32_t pos)
+{
+    CFTypeRef o;
+
+    if (decoder->depth >= kIOCFIndexedMaxDepth)
+    {
+        decoder->tooDeep = true;
+        return (NULL);
+    }
+    decoder->depth++;
+    o = IOCFIndexedDecodeObject(decoder, pos);
+    decoder->depth--;
+
+    return (o);
+}
+
+enum {
+    kIOCFIndexedFound,
+    kIOCFIndexedMissing,
+    kIOCFIndexedUnusable
+};
+
+// finds the word offset of a top level value through the index
+static int
+IOCFIndexedFindValue(const uint32_t * words, uint32_t wordCount,
+                     const UInt8 * keyBytes, uint32_t keyLength, CFIndex keyIndex,
+                     uint32_t * valuePos)
+{
+    const uint32_t * entries;
+    const UInt8 *    bytes;
+    uint32_t         rootSize, indexPos, count, lo, hi, mid, pos, length;
+    Boolean          isDict;
+    int              order;
+
+    if (wordCount < 3) return (kIOCFIndexedUnusable);
+    switch (kOSSerializeTypeMask & words[1])
+    {
+        case kOSSerializeDictionary: isDict = true;  break;
+        case kOSSerializeArray:      isDict = false; break;
+        default:                     return (kIOCFIndexedUnusable);
+    }
+    rootSize = IOCFIndexedObjectSize(words, wordCount, 1);
+    if (!rootSize) return (kIOCFIndexedUnusable);
+    indexPos = 1 + rootSize;
+    if (indexPos >= wordCount) return (kIOCFIndexedUnusable);
+    count = words[indexPos];
+    if ((count > (wordCount - indexPos - 1))
+     || (count != (words[1] & kOSSerializeDataMask))) return (kIOCFIndexedUnusable);
+    entries = &words[indexPos + 1];
+
+    if (!isDict)
+    {
+        if (keyBytes) return (kIOCFIndexedMissing);
+        if ((keyIndex < 0) || (keyIndex >= count)) return (kIOCFIndexedMissing);
+        pos = entries[keyIndex];
+        if ((pos < 3) || (pos >= indexPos)) return (kIOCFIndexedUnusable);
+        *valuePos = pos;
+        return (kIOCFIndexedFound);
+    }
+
+    if (!keyBytes) return (kIOCFIndexedMissing);
+    lo = 0;
+    hi = count;
+    while (lo < hi)
+    {
+        mid = lo + ((hi - lo) >> 1);
+        pos = entries[mid];
+        if ((pos < 3) || (pos >= indexPos)) return (kIOCFIndexedUnusable);
+        if (!IOCFIndexedKeyBytes(words, indexPos, pos, &bytes, &length)) return (kIOCFIndexedUnusable);
+
+        order = IOCFIndexedCompareKeys(keyBytes, keyLength, bytes, length);
+        if (order < 0)      hi = mid;
+        else if (order > 0) lo = mid + 1;
+        else
+        {
+            pos += IOCFIndexedObjectSize(words, indexPos, pos);
+            if (pos >= indexPos) return (kIOCFIndexedUnusable);
+            *valuePos = pos;
+            return (kIOCFIndexedFound);
+        }
+    }
+
+    return (kIOCFIndexedMissing);
+}
+
+static CFTypeRef
+IOCFUnserializeBinaryValue(const char	  * buffer,
+                           size_t           bufferSize,
+                           CFStringRef      key,
+                           CFIndex          index,
+                           CFAllocatorRef   allocator,
+                           CFOptionFlags    options,
+                           CFStringRef    * errorString)
+{
+    IOCFIndexedDecoder decoder;
+    IOCFSerializeIDTableSlot * slot;
+    CFTypeRef          result, collection;
+    const UInt8 *      keyBytes  = NULL;
+    UInt8 *            keyBuffer = NULL;
+    CFIndex            keyLength = 0;
+    CFRange            range;
+    uint32_t           pos;
+    size_t             idx;
+    int                found;
+
+	if (errorString) *errorString = NULL;
+
+	if (!buffer || (3 & ((uintptr_t) buffer))) return (NULL);
+	if (bufferSize < sizeof(kOSSerializeBinarySignature)) return (NULL);
+
+    found = kIOCFIndexedUnusable;
+    if (kOSSerializeIndexedBinarySignature == (((const uint8_t *) buffer)[0]))
+    {
+        if (key)
+        {
+            // the same bytes the writer uses
+            if ((keyBytes = (const UInt8 *) CFStringGetCStringPtr(key, kCFStringEncodingUTF8)))
+            {
+                keyLength = CFStringGetLength(key);
+            }
+            else
+            {
+                range = CFRangeMake(0, CFStringGetLength(key));
+                CFStringGetBytes(key, range, kCFStringEncodingUTF8, '?', false, NULL, 0, &keyLength);
+                keyBuffer = (UInt8 *) malloc(keyLength + 1);
+                if (!keyBuffer) return (NULL);
+                CFStringGetBytes(key, range, kCFStringEncodingUTF8, '?', false, keyBuffer, keyLength, NULL);
+                keyBytes = keyBuffer;
+            }
+        }
+        found = IOCFIndexedFindValue((const uint32_t *) buffer,
+                                     ((bufferSize / sizeof(uint32_t)) > UINT32_MAX) ? UINT32_MAX : (uint32_t) (bufferSize / sizeof(uint32_t)),
+                                     keyBytes, (uint32_t) keyLength, index, &pos);
+        if (keyBuffer) free(keyBuffer);
+        if (kIOCFIndexedMissing == found) return (NULL);
+    }
+
+    result = NULL;
+    if (kIOCFIndexedFound == found)
+    {
+        bzero(&decoder, sizeof(decoder));
+        decoder.words     = (const uint32_t *) buffer;
+        decoder.wordCount = ((bufferSize / sizeof(uint32_t)) > UINT32_MAX) ? UINT32_MAX : (uint32_t) (bufferSize / sizeof(uint32_t));
+        decoder.allocator = allocator;
+        IOCFSerializeIDTableInit(&decoder.objects);
+
+        result = IOCFIndexedDecode(&decoder, pos);
+        if (result) CFRetain(result);
+
+        for (idx = 0; idx <= decoder.objects.mask; idx++)
+        {
+            slot = &decoder.objects.slots[idx];
+            if (slot->key) CFRelease((CFTypeRef) slot->value);
+        }
+        IOCFSerializeIDTableFree(&decoder.objects);
+
+        if (result || !decoder.tooDeep) return (result);
+    }
+
+    collection = IOCFUnserializeBinary(buffer, bufferSize, allocator, options, errorString);
+    if (!collection) return (NULL);
+    if (key)
+    {
+        if (CFDictionaryGetTypeID() == CFGetTypeID(collection))
+        {
+            result = CFDictionaryGetValue((CFDictionaryRef) collection, key);
+        }
+    }
+    else if (CFArrayGetTypeID() == CFGetTypeID(collection))
+    {
+        if ((index >= 0) && (index < CFArrayGetCount((CFArrayRef) collection)))
+        {
+            result = CFArrayGetValueAtIndex((CFArrayRef) collection, index);
+        }
+    }
+    if (result) CFRetain(result);
+    CFRelease(collection);
+
+    return (result);
+}
+
+CFTypeRef
+IOCFUnserializeBinaryValueForKey(const char	  * buffer,
+                                 size_t         bufferSize,
+                                 CFStringRef    key,
+                                 CFAllocatorRef allocator,
+                                 CFOptionFlags  options,
+                                 CFStringRef  * errorString)
+{
+    if (errorString) *errorString = NULL;
+    if (!key) return (NULL);
+
+    return (IOCFUnserializeBinaryValue(buffer, bufferSize, key, 0, allocator, options, errorString));
+}
+
+CFTypeRef
+IOCFUnserializeBinaryValueAtIndex(const char	* buffer,
+                                  size_t          bufferSize,
+                                  CFIndex         index,
+                                  CFAllocatorRef  allocator,
+                                  CFOptionFlags   options,
+                                  CFStringRef   * errorString)
+{
+    return (IOCFUnserializeBinaryValue(buffer, bufferSize, NULL, index, allocator, options, errorString));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * IOCFBinaryView is a read-only view over a kOSSerializeBinary buffer. Creating
+ * a view makes one validating pass that records where each object starts and
+ * where its subtree ends, so lookups can step over siblings without decoding
+ * them. Nodes are word offsets into the buffer; references are resolved to the
+ * node they point at, so callers never see kOSSerializeObject entries.
+ */
+
+struct IOCFBinaryView
+{
+    const uint32_t * words;
+    uint32_t         wordCount;
+    CFOptionFlags    options;
+    size_t           bufferSize;
+
+    uint32_t         objectCount;
+    uint32_t         objectCapacity;
+    uint32_t       * offsets;       // word offset of each object, in stream order
+    uint32_t       * ends;          // word offset just past each object's subtree
+    uint32_t       * counts;        // entries held by each collection
+    Boolean          hasRefs;
+};
+
+enum { kIOCFBinaryViewMaxDepth = 512 };
+
+static uint32_t
+IOCFBinaryEntrySize(const uint32_t * words, uint32_t wordCount, uint32_t pos)
+{
+    uint32_t key, len, size;
+
+    key = words[pos];
+    len = (key & kOSSerializeDataMask);
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeDictionary:
+        case kOSSerializeArray:
+        case kOSSerializeSet:
+        case kOSSerializeBoolean:
+        case kOSSerializeObject:
+            size = 1;
+            break;
+        case kOSSerializeNumber:
+            size = 1 + (sizeof(long long) / sizeof(uint32_t));
+            break;
+        case kOSSerializeSymbol:
+            if (len < 1) return (0);
+            /* fall thru */
+        case kOSSerializeString:
+        case kOSSerializeData:
+            size = 1 + ((len + 3) >> 2);
+            break;
+        default:
+            return (0);
+    }
+
+    if (size > (wordCount - pos)) return (0);
+    if ((kOSSerializeSymbol == (kOSSerializeTypeMask & key))
+        && (0 != ((const UInt8 *) &words[pos + 1])[len - 1])) return (0);
+
+    return (size);
+}
+
+static uint32_t
+IOCFBinaryViewEntrySize(IOCFBinaryViewRef view, uint32_t pos)
+{
+    return (IOCFBinaryEntrySize(view->words, view->wordCount, pos));
+}
+
+static Boolean
+IOCFBinaryViewIsString(IOCFBinaryViewRef view, uint32_t pos)
+{
+    uint32_t type = (kOSSerializeTypeMask & view->words[pos]);
+
+    return ((kOSSerializeSymbol == type) || (kOSSerializeString == type));
+}
+
+static Boolean
+IOCFBinaryViewScan(IOCFBinaryViewRef view)
+{
+    struct Frame { uint32_t index; Boolean last; };
+    struct Frame * stackArray;
+    uint32_t       stackCapacity;
+    enum         { stackCapacityMax = 64*1024 };
+    uint32_t       stackIdx;
+
+    uint32_t pos, key, len, type, size, target, parent, idx;
+    Boolean  ok, end, isRef, haveRoot, done;
+
+    stackArray = NULL;
+    stackIdx   = stackCapacity = 0;
+    haveRoot   = done = false;
+    ok         = true;
+    pos        = sizeof(kOSSerializeBinarySignature) / sizeof(uint32_t);
+
+    while (ok && !done)
+    {
+        if (!(ok = (pos < view->wordCount))) break;
+        if (!(ok = (0 != (size = IOCFBinaryViewEntrySize(view, pos))))) break;
+
+        key   = view->words[pos];
+        len   = (key & kOSSerializeDataMask);
+        type  = (kOSSerializeTypeMask & key);
+        end   = (0 != (kOSSerializeEndCollecton & key));
+        isRef = (kOSSerializeObject == type);
+        idx   = 0;
+
+        if (isRef)
+        {
+            if (!(ok = (len < view->objectCount))) break;
+            target = view->offsets[len];
+            view->hasRefs = true;
+        }
+        else
+        {
+            if (view->objectCount >= view->objectCapacity)
+            {
+                uint32_t   ncap = view->objectCapacity ? (2 * view->objectCapacity) : 64;
+                uint32_t * noffsets, * nends, * ncounts;
+
+                noffsets = realloc(view->offsets, ncap * sizeof(uint32_t));
+                if (noffsets) view->offsets = noffsets;
+                nends = realloc(view->ends, ncap * sizeof(uint32_t));
+                if (nends) view->ends = nends;
+                ncounts = realloc(view->counts, ncap * sizeof(uint32_t));
+                if (ncounts) view->counts = ncounts;
+                if (!(ok = (noffsets && nends && ncounts))) break;
+                view->objectCapacity = ncap;
+            }
+            idx = view->objectCount++;
+            view->offsets[idx] = pos;
+            view->ends[idx]    = pos + size;
+            view->counts[idx]  = 0;
+            target = pos;
+        }
+
+        if (stackIdx)
+        {
+            parent = stackArray[stackIdx - 1].index;
+            // dictionary keys must be strings
+            if ((kOSSerializeDictionary == (kOSSerializeTypeMask & view->words[view->offsets[parent]]))
+                && !(1 & view->counts[parent]))
+            {
+                if (!(ok = IOCFBinaryViewIsString(view, target))) break;
+            }
+            view->counts[parent]++;
+        }
+        else if (!(ok = !haveRoot)) break;
+        haveRoot = true;
+
+        pos += size;
+
+        if (!isRef && len
+            && ((kOSSerializeDictionary == type) || (kOSSerializeArray == type) || (kOSSerializeSet == type)))
+        {
+            if (stackIdx >= stackCapacity)
+            {
+                struct Frame * nbuf;
+                if (!(ok = (stackCapacity < stackCapacityMax))) break;
+                nbuf = realloc(stackArray, (stackCapacity + 64) * sizeof(struct Frame));
+                if (!(ok = (NULL != nbuf))) break;
+                stackArray     = nbuf;
+                stackCapacity += 64;
+            }
+            stackArray[stackIdx].index = idx;
+            stackArray[stackIdx].last  = end;
+            stackIdx++;
+            continue;
+        }
+
+        if (end)
+        {
+            while (stackIdx)
+            {
+                stackIdx--;
+                view->ends[stackArray[stackIdx].index] = pos;
+                if (!stackArray[stackIdx].last) break;
+            }
+            done = (0 == stackIdx);
+        }
+    }
+
+    if (stackArray) free(stackArray);
+
+    return (ok && done);
+}
+
+static Boolean
+IOCFBinaryViewObjectIndex(IOCFBinaryViewRef view, uint32_t pos, uint32_t * index)
+{
+    uint32_t lo, hi, mid;
+
+    lo = 0;
+    hi = view->objectCount;
+    while (lo < hi)
+    {
+        mid = lo + ((hi - lo) >> 1);
+        if (view->offsets[mid] < pos)      lo = mid + 1;
+        else if (view->offsets[mid] > pos) hi = mid;
+        else
+        {
+            *index = mid;
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+static IOCFBinaryViewNode
+IOCFBinaryViewResolve(IOCFBinaryViewRef view, uint32_t pos)
+{
+    uint32_t key = view->words[pos];
+
+    if (kOSSerializeObject == (kOSSerializeTypeMask & key)) pos = view->offsets[key & kOSSerializeDataMask];
+
+    return (pos);
+}
+
+static uint32_t
+IOCFBinaryViewNextSibling(IOCFBinaryViewRef view, uint32_t pos)
+{
+    uint32_t index;
+
+    if (kOSSerializeObject == (kOSSerializeTypeMask & view->words[pos])) return (pos + 1);
+    if (!IOCFBinaryViewObjectIndex(view, pos, &index)) return (view->wordCount);
+
+    return (view->ends[index]);
+}
+
+static Boolean
+IOCFBinaryViewIsNode(IOCFBinaryViewRef view, IOCFBinaryViewNode node, uint32_t * index)
+{
+    uint32_t scratch;
+
+    if (!view || !node) return (false);
+
+    return (IOCFBinaryViewObjectIndex(view, node, index ? index : &scratch));
+}
+
+IOCFBinaryViewRef
+IOCFBinaryViewCreate(const void	* buffer,
+					 size_t       bufferSize,
+					 CFOptionFlags options,
+					 CFStringRef * errorString)
+{
+    IOCFBinaryViewRef view;
+
+	if (errorString) *errorString = NULL;
+
+	if (!buffer || (3 & ((uintptr_t) buffer))) return (NULL);
+	if (bufferSize < sizeof(kOSSerializeBinarySignature)) return (NULL);
+	if (0 != strcmp(kOSSerializeBinarySignature, buffer)) return (NULL);
+
+    view = calloc(1, sizeof(*view));
+    if (!view) return (NULL);
+
+    view->words      = (const uint32_t *) buffer;
+    view->wordCount  = ((bufferSize / sizeof(uint32_t)) > UINT32_MAX) ? UINT32_MAX : (uint32_t) (bufferSize / sizeof(uint32_t));
+    view->bufferSize = bufferSize;
+
+    if (!IOCFBinaryViewScan(view))
+    {
+        if (errorString) *errorString = CFSTR("IOCFBinaryViewCreate: malformed binary serialization");
+        IOCFBinaryViewRelease(view);
+        return (NULL);
+    }
+
+    // the view only takes ownership of the buffer once it is known to be good
+    view->options = options;
+
+    return (view);
+}
+
+void
+IOCFBinaryViewRelease(IOCFBinaryViewRef view)
+{
+    if (!view) return;
+
+    if (kIOCFBinaryViewDeallocateBuffer & view->options)
+    {
+        vm_deallocate(mach_task_self(), (vm_address_t) view->words, view->bufferSize);
+    }
+    else if (kIOCFBinaryViewFreeBuffer & view->options)
+    {
+        free((void *) view->words);
+    }
+
+    if (view->offsets) free(view->offsets);
+    if (view->ends)    free(view->ends);
+    if (view->counts)  free(view->counts);
+    free(view);
+}
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetRoot(IOCFBinaryViewRef view)
+{
+    if (!view || !view->objectCount) return (kIOCFBinaryViewNodeNull);
+
+    return (view->offsets[0]);
+}
+
+CFTypeID
+IOCFBinaryViewGetTypeID(IOCFBinaryViewRef view, IOCFBinaryViewNode node)
+{
+    if (!IOCFBinaryViewIsNode(view, node, NULL)) return (0);
+
+    switch (kOSSerializeTypeMask & view->words[node])
+    {
+        case kOSSerializeDictionary: return (CFDictionaryGetTypeID());
+        case kOSSerializeArray:      return (CFArrayGetTypeID());
+        case kOSSerializeSet:        return (CFSetGetTypeID());
+        case kOSSerializeNumber:     return (CFNumberGetTypeID());
+        case kOSSerializeSymbol:
+        case kOSSerializeString:     return (CFStringGetTypeID());
+        case kOSSerializeData:       return (CFDataGetTypeID());
+        case kOSSerializeBoolean:    return (CFBooleanGetTypeID());
+        default:                     return (0);
+    }
+}
+
+CFIndex
+IOCFBinaryViewGetCount(IOCFBinaryViewRef view, IOCFBinaryViewNode node)
+{
+    uint32_t index;
+
+    if (!IOCFBinaryViewIsNode(view, node, &index)) return (0);
+
+    if (kOSSerializeDictionary == (kOSSerializeTypeMask & view->words[node])) return (view->counts[index] >> 1);
+
+    return (view->counts[index]);
+}
+
+void
+IOCFBinaryViewApplyFunction(IOCFBinaryViewRef view, IOCFBinaryViewNode node,
+							IOCFBinaryViewApplierFunction applier, void * context)
+{
+    uint32_t index, count, pos, key, i;
+    Boolean  isDict;
+
+    if (!applier || !IOCFBinaryViewIsNode(view, node, &index)) return;
+
+    isDict = (kOSSerializeDictionary == (kOSSerializeTypeMask & view->words[node]));
+    count  = view->counts[index];
+    if (isDict) count &= ~1U;
+
+    pos = node + 1;
+    for (i = 0; i < count; i++)
+    {
+        if (isDict)
+        {
+            key = IOCFBinaryViewResolve(view, pos);
+            pos = IOCFBinaryViewNextSibling(view, pos);
+            i++;
+        }
+        else key = kIOCFBinaryViewNodeNull;
+
+        (*applier)(view, key, IOCFBinaryViewResolve(view, pos), context);
+        pos = IOCFBinaryViewNextSibling(view, pos);
+    }
+}
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetValueAtIndex(IOCFBinaryViewRef view, IOCFBinaryViewNode node, CFIndex idx)
+{
+    uint32_t index, count, pos, skip, i;
+
+    if (!IOCFBinaryViewIsNode(view, node, &index) || (idx < 0)) return (kIOCFBinaryViewNodeNull);
+
+    count = view->counts[index];
+    skip  = (uint32_t) idx;
+    if (kOSSerializeDictionary == (kOSSerializeTypeMask & view->words[node]))
+    {
+        if (skip >= (count >> 1)) return (kIOCFBinaryViewNodeNull);
+        skip = (2 * skip) + 1;
+    }
+    else if (skip >= count) return (kIOCFBinaryViewNodeNull);
+
+    for (pos = node + 1, i = 0; i < skip; i++) pos = IOCFBinaryViewNextSibling(view, pos);
+
+    return (IOCFBinaryViewResolve(view, pos));
+}
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetKeyAtIndex(IOCFBinaryViewRef view, IOCFBinaryViewNode node, CFIndex idx)
+{
+    uint32_t index, pos, skip, i;
+
+    if (!IOCFBinaryViewIsNode(view, node, &index) || (idx < 0)) return (kIOCFBinaryViewNodeNull);
+    if (kOSSerializeDictionary != (kOSSerializeTypeMask & view->words[node])) return (kIOCFBinaryViewNodeNull);
+    if ((uint32_t) idx >= (view->counts[index] >> 1)) return (kIOCFBinaryViewNodeNull);
+
+    skip = 2 * ((uint32_t) idx);
+    for (pos = node + 1, i = 0; i < skip; i++) pos = IOCFBinaryViewNextSibling(view, pos);
+
+    return (IOCFBinaryViewResolve(view, pos));
+}
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetValue(IOCFBinaryViewRef view, IOCFBinaryViewNode node, const char * key)
+{
+    IOCFBinaryViewNode value;
+    uint32_t           index, count, pos, keyPos, i;
+    size_t             keyLen, len;
+    const char *       str;
+
+    if (!key || !IOCFBinaryViewIsNode(view, node, &index)) return (kIOCFBinaryViewNodeNull);
+    if (kOSSerializeDictionary != (kOSSerializeTypeMask & view->words[node])) return (kIOCFBinaryViewNodeNull);
+
+    // a repeated key replaces the earlier value when unserialized, so the last one wins
+    value  = kIOCFBinaryViewNodeNull;
+    keyLen = strlen(key);
+    count  = (view->counts[index] >> 1);
+    pos    = node + 1;
+    for (i = 0; i < count; i++)
+    {
+        keyPos = IOCFBinaryViewResolve(view, pos);
+        pos    = IOCFBinaryViewNextSibling(view, pos);
+        str    = IOCFBinaryViewGetStringPtr(view, keyPos, &len);
+        if (str && (len == keyLen) && !memcmp(str, key, len)) value = IOCFBinaryViewResolve(view, pos);
+        pos    = IOCFBinaryViewNextSibling(view, pos);
+    }
+
+    return (value);
+}
+
+const char *
+IOCFBinaryViewGetStringPtr(IOCFBinaryViewRef view, IOCFBinaryViewNode node, size_t * length)
+{
+    uint32_t key, len;
+
+    if (!IOCFBinaryViewIsNode(view, node, NULL) || !IOCFBinaryViewIsString(view, node)) return (NULL);
+
+    key = view->words[node];
+    len = (key & kOSSerializeDataMask);
+    // symbols carry their terminating zero
+    if (kOSSerializeSymbol == (kOSSerializeTypeMask & key)) len--;
+    if (length) *length = len;
+
+    return ((const char *) &view->words[node + 1]);
+}
+
+const void *
+IOCFBinaryViewGetBytePtr(IOCFBinaryViewRef view, IOCFBinaryViewNode node, size_t * length)
+{
+    uint32_t key;
+
+    if (!IOCFBinaryViewIsNode(view, node, NULL)) return (NULL);
+
+    key = view->words[node];
+    if (kOSSerializeData != (kOSSerializeTypeMask & key)) return (NULL);
+    if (length) *length = (key & kOSSerializeDataMask);
+
+    return (&view->words[node + 1]);
+}
+
+Boolean
+IOCFBinaryViewGetNumber(IOCFBinaryViewRef view, IOCFBinaryViewNode node, SInt64 * value)
+{
+    uint32_t key, len;
+    union {
+        long long value;
+        double    fpValue;
+    } bits;
+
+    if (!value || !IOCFBinaryViewIsNode(view, node, NULL)) return (false);
+
+    key = view->words[node];
+    if (kOSSerializeNumber != (kOSSerializeTypeMask & key)) return (false);
+
+    len = (key & kOSSerializeDataMask);
+    bcopy(&view->words[node + 1], &bits, sizeof(bits));
+    if ((len == 31) || (len == 63))  *value = (SInt64) bits.fpValue;
+    else if (len <= 32)              *value = (SInt32) bits.value;
+    else                             *value = bits.value;
+
+    return (true);
+}
+
+Boolean
+IOCFBinaryViewGetDouble(IOCFBinaryViewRef view, IOCFBinaryViewNode node, double * value)
+{
+    uint32_t key, len;
+    SInt64   integer;
+    union {
+        long long value;
+        double    fpValue;
+    } bits;
+
+    if (!value || !IOCFBinaryViewIsNode(view, node, NULL)) return (false);
+
+    key = view->words[node];
+    if (kOSSerializeNumber != (kOSSerializeTypeMask & key)) return (false);
+
+    len = (key & kOSSerializeDataMask);
+    if (len == 31)
+    {
+        bcopy(&view->words[node + 1], &bits, sizeof(bits));
+        *value = (float) bits.fpValue;
+    }
+    else if (len == 63)
+    {
+        bcopy(&view->words[node + 1], &bits, sizeof(bits));
+        *value = bits.fpValue;
+    }
+    else
+    {
+        IOCFBinaryViewGetNumber(view, node, &integer);
+        *value = (double) integer;
+    }
+
+    return (true);
+}
+
+Boolean
+IOCFBinaryViewGetBoolean(IOCFBinaryViewRef view, IOCFBinaryViewNode node, Boolean * value)
+{
+    uint32_t key;
+
+    if (!value || !IOCFBinaryViewIsNode(view, node, NULL)) return (false);
+
+    key = view->words[node];
+    if (kOSSerializeBoolean != (kOSSerializeTypeMask & key)) return (false);
+    *value = (0 != (key & kOSSerializeDataMask));
+
+    return (true);
+}
+
+static CFTypeRef
+IOCFBinaryViewCreateObject(IOCFBinaryViewRef view, uint32_t pos, CFAllocatorRef allocator,
+						   CFTypeRef * memo, uint32_t depth)
+{
+    CFTypeRef      o, child, sym;
+    const UInt8  * bytes;
+    uint32_t       key, len, index, count, i;
+
+    key = view->words[pos];
+    len = (key & kOSSerializeDataMask);
+
+    if (kOSSerializeObject == (kOSSerializeTypeMask & key))
+    {
+        index = len;
+        pos   = view->offsets[index];
+        key   = view->words[pos];
+        len   = (key & kOSSerializeDataMask);
+    }
+    else if (!IOCFBinaryViewObjectIndex(view, pos, &index)) return (NULL);
+
+    if (memo && memo[index]) return (CFRetain(memo[index]));
+    if (depth > kIOCFBinaryViewMaxDepth) return (NULL);
+
+    o     = NULL;
+    bytes = (const UInt8 *) &view->words[pos + 1];
+    count = view->counts[index];
+
+    switch (kOSSerializeTypeMask & key)
+    {
+        case kOSSerializeDictionary:
+            o = CFDictionaryCreateMutable(allocator, count >> 1,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+            break;
+        case kOSSerializeArray:
+            o = CFArrayCreateMutable(allocator, count, &kCFTypeArrayCallBacks);
+            break;
+        case kOSSerializeSet:
+            o = CFSetCreateMutable(allocator, count, &kCFTypeSetCallBacks);
+            break;
+
+        case kOSSerializeNumber:
+            if (len == 31) {
+                double doubleValue;
+                float  floatValue;
+                bcopy(bytes, &doubleValue, sizeof(doubleValue));
+                floatValue = (float) doubleValue;
+                o = CFNumberCreate(allocator, kCFNumberFloat32Type, &floatValue);
+            } else if (len == 63) {
+                o = CFNumberCreate(allocator, kCFNumberFloat64Type, (const void *) bytes);
+            } else if (len <= 32) {
+                o = CFNumberCreate(allocator, kCFNumberSInt32Type, (const void *) bytes);
+            } else {
+                o = CFNumberCreate(allocator, kCFNumberSInt64Type, (const void *) bytes);
+            }
+            break;
+
+        case kOSSerializeSymbol:
+            len--;
+            /* fall thru */
+        case kOSSerializeString:
+            if (kOSSerializeSymbol == (kOSSerializeTypeMask & key))
+                o = IOCFInternKey(allocator, bytes, len);
+            if (!o) o = CFStringCreateWithBytes(allocator, bytes, len, kCFStringEncodingUTF8, false);
+            if (!o) o = CFStringCreateWithBytes(allocator, bytes, len, kCFStringEncodingMacRoman, false);
+            break;
+
+        case kOSSerializeData:
+            o = CFDataCreate(allocator, bytes, len);
+            break;
+
+        case kOSSerializeBoolean:
+            o = CFRetain(len ? kCFBooleanTrue : kCFBooleanFalse);
+            break;
+
+        default:
+            break;
+    }
+
+    if (!o) return (NULL);
+    if (memo) memo[index] = o;
+
+    if (count && ((kOSSerializeTypeMask & key) <= kOSSerializeSet))
+    {
+        sym = NULL;
+        pos = pos + 1;
+        for (i = 0; i < count; i++)
+        {
+            child = IOCFBinaryViewCreateObject(view, pos, allocator, memo, depth + 1);
+            pos   = IOCFBinaryViewNextSibling(view, pos);
+            if (!child)
+            {
+                if (sym) CFRelease(sym);
+                if (memo) memo[index] = NULL;
+                CFRelease(o);
+                return (NULL);
+            }
+
+            switch (kOSSerializeTypeMask & key)
+            {
+                case kOSSerializeDictionary:
+                    if (!sym)
+                    {
+                        sym = child;
+                        continue;
+                    }
+                    if (child != o) CFDictionarySetValue((CFMutableDictionaryRef) o, sym, child);
+                    CFRelease(sym);
+                    sym = NULL;
+                    break;
+                case kOSSerializeArray:
+                    CFArrayAppendValue((CFMutableArrayRef) o, child);
+                    break;
+                case kOSSerializeSet:
+                    CFSetAddValue((CFMutableSetRef) o, child);
+                    break;
+            }
+            CFRelease(child);
+        }
+        if (sym) CFRelease(sym);
+    }
+
+    return (o);
+}
+
+CFTypeRef
+IOCFBinaryViewCreateCFObject(IOCFBinaryViewRef view, IOCFBinaryViewNode node, CFAllocatorRef allocator)
+{
+    CFTypeRef   result;
+    CFTypeRef * memo = NULL;
+
+    if (!IOCFBinaryViewIsNode(view, node, NULL)) return (NULL);
+
+    // shared objects are only worth tracking if the stream has references
+    if (view->hasRefs)
+    {
+        memo = calloc(view->objectCount, sizeof(CFTypeRef));
+        if (!memo) return (NULL);
+    }
+
+    result = IOCFBinaryViewCreateObject(view, node, allocator, memo, 0);
+
+    if (memo) free(memo);
+
+    return (result);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * IOCFUnserializeBinaryValueForKeyPath walks a kOSSerializeBinary stream down a
+ * path of dictionary keys. The plain format has no subtree lengths, so the
+ * walk steps over values it doesn't want entry by entry, keeping only a bit
+ * per open collection; nothing is created or allocated until the value at the
+ * end of the path is found, and only that value is created. Anything the walk
+ * can't handle - indexed or XML buffers, keys that are references, a value
+ * that refers to objects outside itself - falls back to unserializing it all.
+ */
+#define kIOCFKeyPathMaxDepth    512
+
+enum {
+    kIOCFKeyPathFound    = 0,
+    kIOCFKeyPathMissing  = 1,
+    kIOCFKeyPathUnusable = 2
+};
+
+typedef struct {
+    const uint32_t * words;
+    uint32_t         wordCount;
+    uint32_t         pos;            // next entry
+    uint32_t         objectCount;    // objects before pos, references aside
+} IOCFKeyPathStream;
+
+typedef struct {
+    IOCFKeyPathStream * stream;
+    CFAllocatorRef      allocator;
+    uint32_t            base;        // object index of the value being created
+    CFTypeRef         * objects;     // not retained, the value holds them
+    uint32_t            objectCount;
+    uint32_t            objectCapacity;
+} IOCFKeyPathDecoder;
+
+// steps over the entry at the stream's position and everything below it,
+// setting end to the entry's kOSSerializeEndCollecton bit.
+static Boolean
+IOCFKeyPathSkip(IOCFKeyPathStream * stream, Boolean * end)
+{
+    uint64_t last[kIOCFKeyPathMaxDepth / 64];
+    uint32_t depth, key, len, type, size;
+    Boolean  isEnd;
+
+    depth = 0;
+    do
+    {
+        if (stream->pos >= stream->wordCount) return (false);
+        size = IOCFBinaryEntrySize(stream->words, stream->wordCount, stream->pos);
+        if (!size) return (false);
+
+        key   = stream->words[stream->pos];
+        len   = (key & kOSSerializeDataMask);
+        type  = (kOSSerializeTypeMask & key);
+        isEnd = (0 != (kOSSerializeEndCollecton & key));
+        stream->pos += size;
+        if (kOSSerializeObject != type) stream->objectCount++;
+
+        if (len && ((kOSSerializeDictionary == type) || (kOSSerializeArray == type) || (kOSSerializeSet == type)))
+        {
+            if (depth >= kIOCFKeyPathMaxDepth) return (false);
+            if (isEnd) last[depth >> 6] |= (1ULL << (depth & 63));
+            else       last[depth >> 6] &= ~(1ULL << (depth & 63));
+            depth++;
+            continue;
+        }
+
+        // the first entry closes nothing
+        if (!depth) break;
+        while (isEnd && depth)
+        {
+            depth--;
+            isEnd = (0 != (last[depth >> 6] & (1ULL << (depth & 63))));
+        }
+    }
+    while (depth);
+
+    *end = isEnd;
+
+    return (true);
+}
+
+static CFTypeRef
+IOCFKeyPathDecode(IOCFKeyPathDecoder * decoder, uint32_t depth, Boolean * end)
+{
+    IOCFKeyPathStream * stream = decoder->stream;
+    CFTypeRef           o, child, dictKey;
+    const UInt8 *       bytes;
+    uint32_t            key, len, type, size, count;
+    Boolean             ok, childEnd;
+
+    if (depth > kIOCFKeyPathMaxDepth) return (NULL);
+    if (stream->pos >= stream->wordCount) return (NULL);
+    size = IOCFBinaryEntrySize(stream->words, stream->wordCount, stream->pos);
+    if (!size) return (NULL);
+
+    key   = stream->words[stream->pos];
+    len   = (key & kOSSerializeDataMask);
+    type  = (kOSSerializeTypeMask & key);
+    bytes = (const UInt8 *) &stream->words[stream->pos + 1];
+    *end  = (0 != (kOSSerializeEndCollecton & key));
+    stream->pos += size;
+    o = NULL;
+
+    switch (type)
+    {
+        case kOSSerializeObject:
+            // only objects inside the value can be shared
+            if ((len < decoder->base) || ((len - decoder->base) >= decoder->objectCount)) return (NULL);
+            return (CFRetain(decoder->objects[len - decoder->base]));
+
+        case kOSSerializeDictionary:
+            o = CFDictionaryCreateMutable(decoder->allocator, len,
+                                          &kCFTypeDictionaryKeyCallBacks,
+                                          &kCFTypeDictionaryValueCallBacks);
+            break;
+        case kOSSerializeArray:
+            o = CFArrayCreateMutable(decoder->allocator, len, &kCFTypeArrayCallBacks);
+            break;
+        case kOSSerializeSet:
+            o = CFSetCreateMutable(decoder->allocator, len, &kCFTypeSetCallBacks);
+            break;
+
+        case kOSSerializeNumber:
+            if (len == 31) {
+                double doubleValue;
+                float  floatValue;
+                bcopy(bytes, &doubleValue, sizeof(doubleValue));
+                floatValue = (float) doubleValue;
+                o = CFNumberCreate(decoder->allocator, kCFNumberFloat32Type, &floatValue);
+            } else if (len == 63) {
+                o = CFNumberCreate(decoder->allocator, kCFNumberFloat64Type, (const void *) bytes);
+            } else if (len <= 32) {
+                o = CFNumberCreate(decoder->allocator, kCFNumberSInt32Type, (const void *) bytes);
+            } else {
+                o = CFNumberCreate(decoder->allocator, kCFNumberSInt64Type, (const void *) bytes);
+            }
+            break;
+
+        case kOSSerializeSymbol:
+            len--;
+            /* fall thru */
+        case kOSSerializeString:
+            if (kOSSerializeSymbol == type) o = IOCFInternKey(decoder->allocator, bytes, len);
+            if (!o) o = CFStringCreateWithBytes(decoder->allocator, bytes, len, kCFStringEncodingUTF8, false);
+            if (!o) o = CFStringCreateWithBytes(decoder->allocator, bytes, len, kCFStringEncodingMacRoman, false);
+            break;
+
+        case kOSSerializeData:
+            o = CFDataCreate(decoder->allocator, bytes, len);
+            break;
+
+        case kOSSerializeBoolean:
+            o = CFRetain(len ? kCFBooleanTrue : kCFBooleanFalse);
+            break;
+    }
+    if (!o) return (NULL);
+
+    if (decoder->objectCount >= decoder->objectCapacity)
+    {
+        uint32_t    ncap = decoder->objectCapacity ? (2 * decoder->objectCapacity) : 64;
+        CFTypeRef * nbuf = realloc(decoder->objects, ncap * sizeof(CFTypeRef));
+        if (!nbuf)
+        {
+            CFRelease(o);
+            return (NULL);
+        }
+        decoder->objects        = nbuf;
+        decoder->objectCapacity = ncap;
+    }
+    decoder->objects[decoder->objectCount++] = o;
+
+    if (!len || !((kOSSerializeDictionary == type) || (kOSSerializeArray == type) || (kOSSerializeSet == type)))
+    {
+        return (o);
+    }
+
+    ok       = true;
+    childEnd = false;
+    dictKey  = NULL;
+    for (count = 0; ok && !childEnd; count++)
+    {
+        child = IOCFKeyPathDecode(decoder, depth + 1, &childEnd);
+        if (!(ok = (NULL != child))) break;
+
+        if (kOSSerializeDictionary == type)
+        {
+            if (!dictKey)
+            {
+                ok = ((CFStringGetTypeID() == CFGetTypeID(child)) && !childEnd);
+                if (ok) dictKey = child;
+                else    CFRelease(child);
+                continue;
+            }
+            CFDictionarySetValue((CFMutableDictionaryRef) o, dictKey, child);
+            CFRelease(dictKey);
+            dictKey = NULL;
+        }
+        else if (kOSSerializeArray == type) CFArrayAppendValue((CFMutableArrayRef) o, child);
+        else                                CFSetAddValue((CFMutableSetRef) o, child);
+        CFRelease(child);
+    }
+    if (dictKey) CFRelease(dictKey);
+    if (!ok)
+    {
+        CFRelease(o);
+        o = NULL;
+    }
+
+    return (o);
+}
+
+// leaves the stream at the value for keys[0], keys[1]... keys[count - 1].
+static int
+IOCFKeyPathFind(IOCFKeyPathStream * stream, CFArrayRef keyPath)
+{
+    CFStringRef   pathKey;
+    const UInt8 * keyBytes;
+    UInt8       * keyBuffer;
+    CFIndex       keyLength, idx, count;
+    CFRange       range;
+    uint32_t      key, len, type;
+    uint32_t      matchPos, matchObjectCount;
+    Boolean       end, match;
+    int           found;
+
+    found = kIOCFKeyPathFound;
+    count = CFArrayGetCount(keyPath);
+    for (idx = 0; (kIOCFKeyPathFound == found) && (idx < count); idx++)
+    {
+        pathKey = (CFStringRef) CFArrayGetValueAtIndex(keyPath, idx);
+        if (CFStringGetTypeID() != CFGetTypeID(pathKey)) return (kIOCFKeyPathMissing);
+
+        if (stream->pos >= stream->wordCount) return (kIOCFKeyPathUnusable);
+        key = stream->words[stream->pos];
+        if (kOSSerializeObject == (kOSSerializeTypeMask & key)) return (kIOCFKeyPathUnusable);
+        if (kOSSerializeDictionary != (kOSSerializeTypeMask & key)) return (kIOCFKeyPathMissing);
+        if (!(key & kOSSerializeDataMask)) return (kIOCFKeyPathMissing);
+        stream->pos++;
+        stream->objectCount++;
+
+        // the same bytes the writer uses
+        keyBuffer = NULL;
+        if ((keyBytes = (const UInt8 *) CFStringGetCStringPtr(pathKey, kCFStringEncodingUTF8)))
+        {
+            keyLength = CFStringGetLength(pathKey);
+        }
+        else
+        {
+            range = CFRangeMake(0, CFStringGetLength(pathKey));
+            CFStringGetBytes(pathKey, range, kCFStringEncodingUTF8, '?', false, NULL, 0, &keyLength);
+            keyBuffer = (UInt8 *) malloc(keyLength + 1);
+            if (!keyBuffer) return (kIOCFKeyPathUnusable);
+            CFStringGetBytes(pathKey, range, kCFStringEncodingUTF8, '?', false, keyBuffer, keyLength, NULL);
+            keyBytes = keyBuffer;
+        }
+
+        // IOCFUnserializeBinary lets a repeated key replace the earlier
+        // value, so the whole dictionary is scanned and the last match used
+        found    = kIOCFKeyPathUnusable;
+        matchPos = 0;
+        matchObjectCount = 0;
+        while (true)
+        {
+            if (stream->pos >= stream->wordCount) break;
+            if (!IOCFBinaryEntrySize(stream->words, stream->wordCount, stream->pos)) break;
+            key  = stream->words[stream->pos];
+            len  = (key & kOSSerializeDataMask);
+            type = (kOSSerializeTypeMask & key);
+            // a key that is a reference would need every earlier object's offset
+            if ((kOSSerializeSymbol != type) && (kOSSerializeString != type)) break;
+            if (kOSSerializeEndCollecton & key) break;
+            if (kOSSerializeSymbol == type) len--;
+            match = ((len == keyLength) && !memcmp(&stream->words[stream->pos + 1], keyBytes, len));
+            stream->pos += IOCFBinaryEntrySize(stream->words, stream->wordCount, stream->pos);
+            stream->objectCount++;
+
+            if (match)
+            {
+                matchPos         = stream->pos;
+                matchObjectCount = stream->objectCount;
+            }
+            if (!IOCFKeyPathSkip(stream, &end)) break;
+            if (end)
+            {
+                found = matchPos ? kIOCFKeyPathFound : kIOCFKeyPathMissing;
+                break;
+            }
+        }
+        if (kIOCFKeyPathFound == found)
+        {
+            stream->pos         = matchPos;
+            stream->objectCount = matchObjectCount;
+        }
+        if (keyBuffer) free(keyBuffer);
+    }
+
+    return (found);
+}
+
+CFTypeRef
+IOCFUnserializeBinaryValueForKeyPath(const char	* buffer,
+                                     size_t          bufferSize,
+                                     CFArrayRef      keyPath,
+                                     CFAllocatorRef  allocator,
+                                     CFOptionFlags   options,
+                                     CFStringRef   * errorString)
+{
+    IOCFKeyPathStream  stream;
+    IOCFKeyPathDecoder decoder;
+    CFTypeRef          result, value;
+    CFIndex            idx;
+    Boolean            end;
+    int                found;
+
+	if (errorString) *errorString = NULL;
+	if (!buffer || !keyPath) return (NULL);
+
+    found = kIOCFKeyPathUnusable;
+    if (!(3 & ((uintptr_t) buffer))
+        && (bufferSize >= sizeof(kOSSerializeBinarySignature))
+        && !strcmp(kOSSerializeBinarySignature, buffer))
+    {
+        bzero(&stream, sizeof(stream));
+        stream.words     = (const uint32_t *) buffer;
+        stream.wordCount = ((bufferSize / sizeof(uint32_t)) > UINT32_MAX) ? UINT32_MAX : (uint32_t) (bufferSize / sizeof(uint32_t));
+        stream.pos       = sizeof(kOSSerializeBinarySignature) / sizeof(uint32_t);
+
+        found = IOCFKeyPathFind(&stream, keyPath);
+        if (kIOCFKeyPathMissing == found) return (NULL);
+    }
+
+    if (kIOCFKeyPathFound == found)
+    {
+        bzero(&decoder, sizeof(decoder));
+        decoder.stream    = &stream;
+        decoder.allocator = allocator;
+        decoder.base      = stream.objectCount;
+
+        result = IOCFKeyPathDecode(&decoder, 0, &end);
+        if (decoder.objects) free(decoder.objects);
+        if (result) return (result);
+    }
+
+    value = result = IOCFUnserializeWithSize(buffer, bufferSize, allocator, options, errorString);
+    for (idx = 0; value && (idx < CFArrayGetCount(keyPath)); idx++)
+    {
+        if (CFDictionaryGetTypeID() != CFGetTypeID(value)) value = NULL;
+        else value = CFDictionaryGetValue((CFDictionaryRef) value, CFArrayGetValueAtIndex(keyPath, idx));
+    }
+    if (value) CFRetain(value);
+    if (result) CFRelease(result);
+
+    return (value);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 #endif /* IOKIT_SERVER_VERSION >= 20140421 */
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -39,13 +39,28 @@ extern "C" {
 #endif
 
 enum {
-    kIOCFSerializeToBinary	= 0x00000001
+    kIOCFSerializeToBinary	= 0x00000001,
+    // with kIOCFSerializeToBinary, write the indexed binary format, see
+    // IOCFUnserializeBinaryValueForKey()
+    kIOCFSerializeIndexed	= 0x00000002
 };
 
 CF_RETURNS_RETAINED
 CFDataRef
 IOCFSerialize( CFTypeRef object, CFOptionFlags options );
 
+// IOCFSerializeToBuffer serializes object into a caller supplied buffer.
+// Only the binary format is supported, so options must include
+// kIOCFSerializeToBinary. The result is the number of bytes the serialized
+// object occupies, or 0 on failure. If the result is larger than bufferSize
+// the buffer contents are undefined and the call should be repeated with a
+// buffer of at least that size; pass a NULL buffer to just measure. The
+// buffer should be 4 byte aligned to be handed to IOCFUnserializeBinary.
+
+size_t
+IOCFSerializeToBuffer( CFTypeRef object, CFOptionFlags options,
+                       void * buffer, size_t bufferSize );
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+
+measures IOCFSerialize() in both formats on generated trees
+
+to build:
+
+cc -O2 -framework IOKit -framework CoreFoundation IOCFSerializeBench.c -o IOCFSerializeBench
+
+to run:
+
+./IOCFSerializeBench [nodes]
+
+The trees are
+    wide    - one dictionary of personality like dictionaries
+    deep    - a chain of nested dictionaries, each with a few leaves,
+              ending in a wide one for whatever doesn't fit kMaxDepth
+    shared  - like wide, but the leaves are a small set of shared objects,
+              so most of the output is back references
+Each is round tripped through IOCFUnserialize() to check the output.
+
+*/
+
+#include <IOKit/IOCFSerialize.h>
+#include <IOKit/IOCFUnserialize.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mach/mach_time.h>
+
+#define kMinimumNodes	(4 * 1000 * 1000)	// serialized per tree per format
+#define kLeaves		8			// per dictionary
+#define kMaxDepth	2000			// well inside the XML parser's stack
+
+static double
+nanoseconds(uint64_t delta)
+{
+	static mach_timebase_info_data_t timebase;
+
+	if (!timebase.denom) mach_timebase_info(&timebase);
+	return ((double) delta * timebase.numer / timebase.denom);
+}
+
+static CFMutableDictionaryRef
+createDictionary(void)
+{
+	return (CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+					  &kCFTypeDictionaryKeyCallBacks,
+					  &kCFTypeDictionaryValueCallBacks));
+}
+
+static void
+setValue(CFMutableDictionaryRef dict, const char * key, CFTypeRef value)
+{
+	CFStringRef string;
+
+	string = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingUTF8);
+	CFDictionarySetValue(dict, string, value);
+	CFRelease(string);
+	CFRelease(value);
+}
+
+// kLeaves + 1 nodes, leaves come from shared when it is given
+static CFMutableDictionaryRef
+createPersonality(int index, CFArrayRef shared)
+{
+	CFMutableDictionaryRef dict;
+	char		       name[64];
+	SInt64		       number;
+	int		       i;
+
+	dict = createDictionary();
+	for (i = 0; i < kLeaves; i++) {
+		snprintf(name, sizeof(name), "IOKey%d", i);
+		if (shared) {
+			setValue(dict, name, CFRetain(CFArrayGetValueAtIndex(shared, (index + i) % CFArrayGetCount(shared))));
+		} else if (i & 1) {
+			number = index * kLeaves + i;
+			setValue(dict, name, CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &number));
+		} else {
+			snprintf(name + 32, sizeof(name) - 32, "com.apple.driver.%d.%d", index, i);
+			setValue(dict, name, CFStringCreateWithCString(kCFAllocatorDefault, name + 32, kCFStringEncodingUTF8));
+		}
+	}
+
+	return (dict);
+}
+
+static CFTypeRef
+createWide(int nodes, CFArrayRef shared)
+{
+	CFMutableDictionaryRef root;
+	char		       name[32];
+	int		       i;
+
+	root = createDictionary();
+	for (i = 0; i < (nodes / (kLeaves + 1)); i++) {
+		snprintf(name, sizeof(name), "Personality%d", i);
+		setValue(root, name, createPersonality(i, shared));
+	}
+
+	return (root);
+}
+
+static CFTypeRef
+createDeep(int nodes)
+{
+	CFMutableDictionaryRef root, parent, child;
+	int		       depth, i;
+
+	depth = nodes / (kLeaves + 1);
+	if (depth > kMaxDepth) depth = kMaxDepth;
+
+	root = parent = createPersonality(0, NULL);
+	for (i = 1; i < depth; i++) {
+		child = createPersonality(i, NULL);
+		CFDictionarySetValue(parent, CFSTR("IOChild"), child);
+		CFRelease(child);
+		parent = child;
+	}
+	nodes -= depth * (kLeaves + 1);
+	if (nodes) setValue(parent, "IOChildren", createWide(nodes, NULL));
+
+	return (root);
+}
+
+static void
+measure(const char * name, CFTypeRef tree, int nodes, CFOptionFlags options)
+{
+	CFDataRef   data;
+	CFTypeRef   copy;
+	CFStringRef errorString;
+	uint64_t    start, best;
+	int	    iterations, i, pass;
+	size_t	    length;
+
+	data = IOCFSerialize(tree, options);
+	if (!data) {
+		printf("%-8s %-6s serialize failed\n", name, options ? "binary" : "xml");
+		return;
+	}
+	length = CFDataGetLength(data);
+
+	if (options) copy = IOCFUnserializeBinary((const char *) CFDataGetBytePtr(data), length,
+						  kCFAllocatorDefault, 0, &errorString);
+	else         copy = IOCFUnserialize((const char *) CFDataGetBytePtr(data),
+					    kCFAllocatorDefault, 0, &errorString);
+	if (!copy || !CFEqual(copy, tree)) printf("%-8s %-6s round trip failed\n", name, options ? "binary" : "xml");
+	if (copy) CFRelease(copy);
+	if (errorString) CFRelease(errorString);
+	CFRelease(data);
+
+	iterations = (kMinimumNodes / nodes) + 1;
+	best = UINT64_MAX;
+	for (pass = 0; pass < 3; pass++) {
+		start = mach_absolute_time();
+		for (i = 0; i < iterations; i++) {
+			data = IOCFSerialize(tree, options);
+			if (data) CFRelease(data);
+		}
+		start = mach_absolute_time() - start;
+		if (start < best) best = start;
+	}
+
+	printf("%-8s %-6s %8d nodes %10ld bytes %8.2f Mnodes/s %8.1f MB/s\n",
+	       name, options ? "binary" : "xml", nodes, (long) length,
+	       ((double) nodes * iterations * 1000.0) / nanoseconds(best),
+	       ((double) length * iterations * 1000.0) / nanoseconds(best));
+}
+
+int
+main(int argc, char **argv)
+{
+	CFMutableArrayRef shared;
+	CFTypeRef	  tree;
+	CFNumberRef	  value;
+	SInt64		  number;
+	int		  nodes, i;
+
+	nodes = (argc > 1) ? atoi(argv[1]) : 50000;
+	if (nodes < (kLeaves + 1)) nodes = kLeaves + 1;
+	nodes -= nodes % (kLeaves + 1);
+
+	shared = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	for (i = 0; i < 16; i++) {
+		number = i;
+		value = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &number);
+		CFArrayAppendValue(shared, value);
+		CFRelease(value);
+	}
+
+	tree = createWide(nodes, NULL);
+	measure("wide", tree, nodes, kNilOptions);
+	measure("wide", tree, nodes, kIOCFSerializeToBinary);
+	CFRelease(tree);
+
+	tree = createDeep(nodes);
+	measure("deep", tree, nodes, kNilOptions);
+	measure("deep", tree, nodes, kIOCFSerializeToBinary);
+	CFRelease(tree);
+
+	tree = createWide(nodes, shared);
+	measure("shared", tree, nodes, kNilOptions);
+	measure("shared", tree, nodes, kIOCFSerializeToBinary);
+	CFRelease(tree);
+
+	CFRelease(shared);
+
+	return (0);
+}
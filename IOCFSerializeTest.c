@@ -30,10 +30,22 @@ cc -g -framework IOKit -framework CoreFoundation IOCFSerializeTest.c -o IOCFSeri
 cc -g IOCFSerializeTest.c -framework CoreFoundation /local/build/IOKit/IOKit.build/objects-optimized/IOCFSerialize.o \
  /local/build/IOKit/IOKit.build/objects-optimized/IOCFUnserialize.tab.o -o IOCFSerializeTest
 
+on other platforms, against a CoreFoundation port (swift-corelibs-foundation or CF-Lite)
+with IOCFSerialize.c and IOCFUnserialize.tab.c:
+
+cc -g -I. IOCFSerializeTest.c IOCFSerialize.c IOCFUnserialize.tab.c -lCoreFoundation -lpthread -o IOCFSerializeTest
+
 to run: 
 
 ./IOCFSerializeTest
+./IOCFSerializeTest -j 4 -m
 find /System/Library/Extensions -name Info.plist  | xargs -n 1 ./IOCFSerializeTest
+find /System/Library/Extensions -name Info.plist  | xargs ./IOCFSerializeTest -r
+
+the self check and -r mutate every byte of the buffer to every value and reparse,
+for both the xml and binary formats, the bytes are split across -j threads
+(one per cpu by default). each buffer is then round tripped through every
+serializer, and unless -m is given, parse and serialize throughput is reported.
 
 */
 
@@ -45,6 +57,9 @@ find /System/Library/Extensions -name Info.plist  | xargs -n 1 ./IOCFSerializeTe
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -125,98 +140,178 @@ char *testBuffer =
 ;
 
 
-int
-main(int argc, char **argv)
+// shared by the mutation threads
+static int		gThreads = 1;
+
+typedef struct {
+	const char *	buffer;			// unmutated
+	size_t		size;
+	int		binary;			// IOCFUnserializeBinary instead of IOCFUnserialize
+	int		shard;			// this thread mutates bytes shard, shard + gThreads, ...
+	long		parses;
+	int		failed;
+} shard_t;
+
+static double
+now(void)
 {
-	CFTypeRef	properties0, properties1, properties2, properties3, properties4, properties5;
-	CFDataRef	data1, data2, data3, data4;
-	CFStringRef  	errorString;
-	int i, j;
-	int fd = 0;
-	char * bufPtr;
-	struct stat sb;
-	size_t size;
-	int usingFile = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double) ts.tv_sec + ((double) ts.tv_nsec / 1e9));
+}
 
-	if (argc == 2) {
+static char *
+copyAligned(const void * bytes, size_t size)
+{
+	// IOCFUnserializeBinary wants 4 byte alignment, malloc does better
+	char * buffer = (char *)malloc(size + 1);
 
-		if (stat(argv[1], &sb)) exit(1);
-		size = (size_t)sb.st_size;
-		    
-		printf("checking file %s, file size %ld\n", argv[1], size);
+	if (!buffer) exit(1);
+	memcpy(buffer, bytes, size);
+	buffer[size] = 0;
 
-		bufPtr = (char *)malloc(size);
-		if (!bufPtr) exit(1);
+	return buffer;
+}
 
-		fd = open(argv[1], O_RDONLY | O_NDELAY, 0);
-		if (fd <= 0) exit(1);
+static void *
+mutateShard(void * arg)
+{
+	shard_t *	shard = (shard_t *) arg;
+	CFTypeRef	properties0;
+	CFStringRef	errorString;
+	char *		randomBuffer;
+	size_t		i;
+	int		j;
 
-		if ((read(fd, bufPtr, size) != size) || errno) exit(1);
+	randomBuffer = copyAligned(shard->buffer, shard->size);
 
-		testBuffer = bufPtr;
+	for (i = shard->shard; i < shard->size; i += gThreads) {
 
-		usingFile = 1;
-	    
-	} else {
+		for (j = 0; j < 256; j++) {
 
-		printf("running self check testing...\n");
-	    
-		// random error injection testing, this is painfully slow
-#if 1
-		char * randomBuffer = (char *)strdup(testBuffer);
-		int randomBufferSize = strlen(randomBuffer);
-
-		for (i=0; i < randomBufferSize; i++) { 
-
-			for (j=0; j < 256; j++) { 
-
-				randomBuffer[i] = (char)j;
-				
-//				printf("testBuffer[%d] = %c, randomBuffer[%d] = %c\n", i, testBuffer[i], i, randomBuffer[i]);
-
-				properties0 = IOCFUnserialize(randomBuffer, kCFAllocatorDefault, 0, &errorString);
-				if (properties0) {
-					CFRelease(properties0);
-					if (errorString) {
-						printf("random testing failed - errorString is set\n");
-						printf("testBuffer[%d] = %c, randomBuffer[%d] = %c\n", i, testBuffer[i], i, randomBuffer[i]);
-						exit(1);
-					}
+			randomBuffer[i] = (char)j;
+			shard->parses++;
+
+			if (shard->binary) {
+				// nothing to check but that it survives, mutated references
+				// can make cycles so the result isn't reserialized
+				properties0 = IOCFUnserializeBinary(randomBuffer, shard->size, kCFAllocatorDefault, 0, &errorString);
+				if (properties0) CFRelease(properties0);
+				if (errorString) CFRelease(errorString);
+				continue;
+			}
+
+			properties0 = IOCFUnserialize(randomBuffer, kCFAllocatorDefault, 0, &errorString);
+			if (properties0) {
+				CFRelease(properties0);
+				if (errorString) {
+					printf("random testing failed - errorString is set\n");
+					printf("testBuffer[%ld] = %c, randomBuffer[%ld] = %c\n", (long) i, shard->buffer[i], (long) i, randomBuffer[i]);
+					shard->failed = 1;
+					break;
+				}
+			} else {
+				if (errorString) {
+					CFRelease(errorString);
 				} else {
-					if (errorString) {
-						CFRelease(errorString);
-					} else {
-						printf("random testing failed - errorString is null\n");
-						printf("testBuffer[%d] = %c, randomBuffer[%d] = %c\n", i, testBuffer[i], i, randomBuffer[i]);
-						exit(1);
-					}
+					printf("random testing failed - errorString is null\n");
+					printf("testBuffer[%ld] = %c, randomBuffer[%ld] = %c\n", (long) i, shard->buffer[i], (long) i, randomBuffer[i]);
+					shard->failed = 1;
+					break;
 				}
 			}
-			randomBuffer[i] = testBuffer[i];
 		}
-		if (!usingFile) printf("random syntax error testing successful\n");
-#endif		
+		if (shard->failed) break;
+		randomBuffer[i] = shard->buffer[i];
 	}
 
+	free(randomBuffer);
+	return NULL;
+}
 
-	// unserialize test buffer and then re-serialize it
+// random error injection testing, every byte is set to every value and the
+// buffer reparsed, the bytes are spread over gThreads threads
+static void
+randomTest(const char * name, const char * buffer, size_t size, int binary)
+{
+	pthread_t *	threads;
+	shard_t *	shards;
+	double		start;
+	long		parses = 0;
+	int		i, failed = 0;
+
+	threads = (pthread_t *)calloc(gThreads, sizeof(pthread_t));
+	shards  = (shard_t *)calloc(gThreads, sizeof(shard_t));
+	if (!threads || !shards) exit(1);
+
+	start = now();
+	for (i = 0; i < gThreads; i++) {
+		shards[i].buffer = buffer;
+		shards[i].size   = size;
+		shards[i].binary = binary;
+		shards[i].shard  = i;
+		if (pthread_create(&threads[i], NULL, &mutateShard, &shards[i])) exit(1);
+	}
+	for (i = 0; i < gThreads; i++) {
+		pthread_join(threads[i], NULL);
+		parses += shards[i].parses;
+		failed |= shards[i].failed;
+	}
 
+	if (failed) exit(1);
+	printf("%s: random %s error testing successful, %ld parses in %.1fs on %d threads\n",
+	       name, binary ? "binary" : "syntax", parses, now() - start, gThreads);
 
-	properties1 = IOCFUnserialize(testBuffer, kCFAllocatorDefault, 0, &errorString);
-	if (!properties1) {
-		CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
-		       kCFStringEncodingUTF8) + sizeof('\0');
-		char *buffer = malloc(bufSize);
-		if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, 
-						   kCFStringEncodingUTF8)) {
-			exit(1);
-		}
+	free(threads);
+	free(shards);
+}
+
+static CFTypeRef
+unserializeBinaryData(CFDataRef data, CFAllocatorRef allocator)
+{
+	CFTypeRef	properties;
+	char *		buffer;
+
+	buffer = copyAligned(CFDataGetBytePtr(data), CFDataGetLength(data));
+	properties = IOCFUnserializeBinary(buffer, CFDataGetLength(data), allocator, 0, NULL);
+	free(buffer);
+
+	return properties;
+}
 
-		printf("prop1 error: %s\n", buffer);
-		CFRelease(errorString);
+static void
+printErrorAndExit(const char * name, CFStringRef errorString)
+{
+	CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
+	       kCFStringEncodingUTF8) + sizeof('\0');
+	char *buffer = malloc(bufSize);
+	if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, 
+					   kCFStringEncodingUTF8)) {
 		exit(1);
 	}
 
+	printf("%s error: %s\n", name, buffer);
+	CFRelease(errorString);
+	exit(1);
+}
+
+// unserialize the buffer, re-serialize it every way we can, and check that
+// unserializing those gives the same objects again
+static void
+roundTripTest(const char * buffer, size_t size, int usingFile)
+{
+	CFTypeRef	properties1, properties2, properties3, properties4, properties5, properties6;
+	CFDataRef	data1, data2, data3, data4, data5;
+	CFStringRef  	errorString;
+	CFOptionFlags	options;
+
+	// unserialize test buffer and then re-serialize it
+
+
+	properties1 = IOCFUnserialize(buffer, kCFAllocatorDefault, 0, &errorString);
+	if (!properties1) printErrorAndExit("prop1", errorString);
+
 	data1 = IOCFSerialize(properties1, kNilOptions);
 	if (!data1) {
 		printf("serialize on prop1 failed\n");
@@ -228,24 +323,13 @@ main(int argc, char **argv)
 
 
 	properties2 = IOCFUnserialize((char *)CFDataGetBytePtr(data1), kCFAllocatorDefault, 0, &errorString);
-	if (!properties2) {
-		CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
-		       kCFStringEncodingUTF8) + sizeof('\0');
-		char *buffer = malloc(bufSize);
-		if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, kCFStringEncodingUTF8)) {
-			exit(1);
-		}
-
-		printf("prop2 error: %s\n", buffer);
-		CFRelease(errorString);
-		exit(1);
-	}
+	if (!properties2) printErrorAndExit("prop2", errorString);
 
 	if (CFEqual(properties1, properties2)) {
 		if (!usingFile) printf("test successful, prop1 == prop2\n");
 	} else {
 		printf("test failed, prop1 == prop2\n");
-//		printf("%s\n", testBuffer);
+//		printf("%s\n", buffer);
 //		printf("%s\n", (char *)CFDataGetBytePtr(data1));
 		exit(1);
 	}
@@ -259,18 +343,7 @@ main(int argc, char **argv)
 	// unserialize again, using the previous re-serialization compare resulting objects
 
 	properties3 = IOCFUnserialize((char *)CFDataGetBytePtr(data2), kCFAllocatorDefault, 0, &errorString);
-	if (!properties3) {
-		CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
-		       kCFStringEncodingUTF8) + sizeof('\0');
-		char *buffer = malloc(bufSize);
-		if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, kCFStringEncodingUTF8)) {
-		    exit(1);
-		}
-
-		printf("prop3 error: %s\n", buffer);
-		CFRelease(errorString);
-		exit(1);
-	}
+	if (!properties3) printErrorAndExit("prop3", errorString);
 
 	if (CFEqual(properties2, properties3)) {
 		if (!usingFile) printf("test successful, prop2 == prop3\n");
@@ -290,19 +363,7 @@ main(int argc, char **argv)
 	}
 
 	properties4 = IOCFUnserialize((char *)CFDataGetBytePtr(data3), kCFAllocatorDefault, 0, &errorString);
-	if (!properties4) {
-		CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
-		       kCFStringEncodingUTF8) + sizeof('\0');
-		char *buffer = malloc(bufSize);
-		if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, kCFStringEncodingUTF8)) {
-		    exit(1);
-		}
-
-		printf("prop4 error: %s\n", buffer);
-//		printf("%s\n", (char *)CFDataGetBytePtr(data3));
-		CFRelease(errorString);
-		exit(1);
-	}
+	if (!properties4) printErrorAndExit("prop4", errorString);
 
 	if (CFEqual(properties3, properties4)) {
 		if (!usingFile) printf("test successful, prop3 == prop4\n");
@@ -313,29 +374,42 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	// re-serialize to both binary formats, unserialize again and compare resulting objects
+
+	for (options = kIOCFSerializeToBinary;
+	     options <= (kIOCFSerializeToBinary | kIOCFSerializeIndexed);
+	     options += kIOCFSerializeIndexed) {
+
+		data5 = IOCFSerialize(properties1, options);
+		if (!data5) {
+			printf("binary serialize on prop1 failed\n");
+			exit(1);
+		}
+
+		properties6 = unserializeBinaryData(data5, kCFAllocatorDefault);
+		if (properties6 && CFEqual(properties1, properties6)) {
+			if (!usingFile) printf("test successful, prop1 == prop6 (%s)\n",
+					       (kIOCFSerializeIndexed & options) ? "indexed" : "binary");
+		} else {
+			printf("test failed, prop1 == prop6\n");
+			exit(1);
+		}
+		CFRelease(properties6);
+		CFRelease(data5);
+	}
+
 	// unserialize test buffer using CF and compare objects
 
 	if (usingFile) {
 
-		data4 = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, testBuffer, size, kCFAllocatorNull);
+		data4 = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *) buffer, size, kCFAllocatorNull);
 		if (!data4) {
 			printf("serialize on prop 4 failed\n");
 			exit(1);
 		}
 
 		properties5 = CFPropertyListCreateFromXMLData(kCFAllocatorDefault, data4, kCFPropertyListImmutable, &errorString);
-		if (!properties5) {
-			CFIndex bufSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),
-			       kCFStringEncodingUTF8) + sizeof('\0');
-			char *buffer = malloc(bufSize);
-			if (!buffer || !CFStringGetCString(errorString, buffer, bufSize, kCFStringEncodingUTF8)) {
-			    exit(1);
-			}
-
-			printf("prop5 error: %s\n", buffer);
-			CFRelease(errorString);
-			exit(1);
-		}
+		if (!properties5) printErrorAndExit("prop5", errorString);
 
 		if (CFEqual(properties1, properties5)) {
 			if (!usingFile) printf("test successful, prop1 == prop5\n");
@@ -343,6 +417,8 @@ main(int argc, char **argv)
 			printf("test failed, prop3 == prop4\n");
 			exit(1);
 		}
+		CFRelease(data4);
+		CFRelease(properties5);
 	}
 
 	CFRelease(data1);
@@ -352,9 +428,226 @@ main(int argc, char **argv)
 	CFRelease(properties2);
 	CFRelease(properties3);
 	CFRelease(properties4);
-	if (usingFile) {
-		CFRelease(data4);
-		CFRelease(properties5);
+}
+
+// counts CF allocations made while measuring
+static void *
+countingAllocate(CFIndex size, CFOptionFlags hint __unused, void * info)
+{
+	(*(long *) info)++;
+	return malloc(size);
+}
+
+static void *
+countingReallocate(void * ptr, CFIndex size, CFOptionFlags hint __unused, void * info)
+{
+	(*(long *) info)++;
+	return realloc(ptr, size);
+}
+
+static void
+countingDeallocate(void * ptr, void * info __unused)
+{
+	free(ptr);
+}
+
+#define kMinimumBytes	(16 * 1024 * 1024)	// per buffer per measurement
+
+enum {
+	kMeasureUnserialize,
+	kMeasureUnserializeBinary,
+	kMeasureSerialize,
+	kMeasureSerializeBinary,
+	kMeasureCount
+};
+
+// parse and serialize throughput, and CF allocations per call, for a buffer.
+// IOCFSerialize allocates from the default allocator, so that is swapped for
+// the counting one while it runs.
+static void
+measure(const char * name, const char * buffer, size_t size)
+{
+	static const char * titles[kMeasureCount] = {
+		"IOCFUnserialize", "IOCFUnserializeBinary", "IOCFSerialize", "IOCFSerialize binary" };
+	CFAllocatorContext	context;
+	CFAllocatorRef		allocator, defaultAllocator;
+	CFTypeRef		properties, object;
+	CFDataRef		data;
+	char *			binary;
+	size_t			binarySize, length;
+	long			allocations, iterations, i;
+	double			start, elapsed;
+	int			which;
+
+	properties = IOCFUnserialize(buffer, kCFAllocatorDefault, 0, NULL);
+	data = properties ? IOCFSerialize(properties, kIOCFSerializeToBinary) : NULL;
+	if (!data) {
+		printf("%s: can't measure\n", name);
+		if (properties) CFRelease(properties);
+		return;
+	}
+	binarySize = CFDataGetLength(data);
+	binary = copyAligned(CFDataGetBytePtr(data), binarySize);
+	CFRelease(data);
+
+	bzero(&context, sizeof(context));
+	context.info       = &allocations;
+	context.allocate   = &countingAllocate;
+	context.reallocate = &countingReallocate;
+	context.deallocate = &countingDeallocate;
+	allocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+	if (!allocator) exit(1);
+
+	printf("%s: %ld bytes xml, %ld bytes binary\n", name, (long) size, (long) binarySize);
+
+	for (which = 0; which < kMeasureCount; which++) {
+
+		length = ((kMeasureUnserialize == which) || (kMeasureSerialize == which)) ? size : binarySize;
+		iterations = (long)(kMinimumBytes / (length + 1)) + 1;
+
+		defaultAllocator = CFAllocatorGetDefault();
+		CFRetain(defaultAllocator);
+		if (which >= kMeasureSerialize) CFAllocatorSetDefault(allocator);
+
+		allocations = 0;
+		start = now();
+		for (i = 0; i < iterations; i++) {
+			switch (which) {
+			case kMeasureUnserialize:
+				object = IOCFUnserialize(buffer, allocator, 0, NULL);
+				break;
+			case kMeasureUnserializeBinary:
+				object = IOCFUnserializeBinary(binary, binarySize, allocator, 0, NULL);
+				break;
+			case kMeasureSerialize:
+				object = IOCFSerialize(properties, kNilOptions);
+				break;
+			default:
+				object = IOCFSerialize(properties, kIOCFSerializeToBinary);
+				break;
+			}
+			if (!object) {
+				printf("%s: %s failed\n", name, titles[which]);
+				exit(1);
+			}
+			CFRelease(object);
+		}
+		elapsed = now() - start;
+
+		CFAllocatorSetDefault(defaultAllocator);
+		CFRelease(defaultAllocator);
+
+		printf("    %-24s %8.1f MB/s %8ld CF allocations\n", titles[which],
+		       ((double) length * iterations) / (elapsed * 1024 * 1024),
+		       allocations / iterations);
+	}
+
+	CFRelease(allocator);
+	CFRelease(properties);
+	free(binary);
+}
+
+static char *
+readFile(const char * path, size_t * size)
+{
+	struct stat sb;
+	char * bufPtr;
+	int fd;
+
+	if (stat(path, &sb)) exit(1);
+	*size = (size_t)sb.st_size;
+
+	bufPtr = (char *)malloc(*size + 1);
+	if (!bufPtr) exit(1);
+
+	fd = open(path, O_RDONLY | O_NDELAY, 0);
+	if (fd <= 0) exit(1);
+
+	if ((read(fd, bufPtr, *size) != (ssize_t) *size) || errno) exit(1);
+	close(fd);
+	bufPtr[*size] = 0;
+
+	return bufPtr;
+}
+
+static void
+usage(const char * name)
+{
+	printf("usage: %s [-j threads] [-r] [-m] [file ...]\n", name);
+	printf("    -j  threads for random error injection, defaults to one per cpu\n");
+	printf("    -r  random error injection on files too, it's on for the self check\n");
+	printf("    -m  skip the throughput measurements\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	CFTypeRef	properties;
+	CFDataRef	data;
+	char *		buffer;
+	size_t		size;
+	int		ch, i;
+	int		randomFiles = 0, measureFiles = 1;
+
+	gThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (gThreads < 1) gThreads = 1;
+
+	while ((ch = getopt(argc, argv, "j:rm")) != -1) {
+		switch (ch) {
+		case 'j':
+			gThreads = atoi(optarg);
+			if (gThreads < 1) usage(argv[0]);
+			break;
+		case 'r':
+			randomFiles = 1;
+			break;
+		case 'm':
+			measureFiles = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
+	argc -= optind;
+	argv += optind;
+
+	if (!argc) {
+
+		printf("running self check testing...\n");
+
+		size = strlen(testBuffer);
+		randomTest("testBuffer", testBuffer, size, 0);
+
+		properties = IOCFUnserialize(testBuffer, kCFAllocatorDefault, 0, NULL);
+		data = properties ? IOCFSerialize(properties, kIOCFSerializeToBinary) : NULL;
+		if (!data) {
+			printf("binary serialize on testBuffer failed\n");
+			exit(1);
+		}
+		buffer = copyAligned(CFDataGetBytePtr(data), CFDataGetLength(data));
+		randomTest("testBuffer", buffer, CFDataGetLength(data), 1);
+		free(buffer);
+		CFRelease(data);
+		CFRelease(properties);
+
+		roundTripTest(testBuffer, size, 0);
+		if (measureFiles) measure("testBuffer", testBuffer, size);
+
+		return 0;
+	}
+
+	for (i = 0; i < argc; i++) {
+
+		buffer = readFile(argv[i], &size);
+		printf("checking file %s, file size %ld\n", argv[i], (long) size);
+
+		if (randomFiles) randomTest(argv[i], buffer, size, 0);
+		roundTripTest(buffer, size, 1);
+		if (measureFiles) measure(argv[i], buffer, size);
+
+		free(buffer);
+	}
+
 	return 0;
 }
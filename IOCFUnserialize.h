@@ -33,12 +33,20 @@
 extern "C" {
 #endif
 
+enum {
+    kIOCFUnserializeLegacyXMLParser	= 0x00000100
+};
+
 // on success IOCFUnserialize sets errorString to 0 and returns
 // the unserialized object.
 
 // on failure IOCFUnserialize sets errorString to a CFString object 
 // containing a error message suitable for logging and returns 0
 
+// kIOCFUnserializeLegacyXMLParser selects the original yacc based parser
+// in place of the default one, they accept the same input and return the
+// same objects and errors.
+
 CF_RETURNS_RETAINED
 CFTypeRef
 IOCFUnserialize(const char *buffer,
@@ -54,6 +62,46 @@ IOCFUnserializeBinary(const char	* buffer,
 					  CFOptionFlags	  options,
 					  CFStringRef	* errorString);
 
+// IOCFUnserializeBinaryValueForKey and IOCFUnserializeBinaryValueAtIndex
+// create one value of a serialized dictionary or array. For buffers written
+// with kIOCFSerializeIndexed the value is found through the index and only it
+// is created; other buffers are unserialized in full. They return 0 if the key
+// or index isn't there.
+
+CF_RETURNS_RETAINED
+CFTypeRef
+IOCFUnserializeBinaryValueForKey(const char	  * buffer,
+								 size_t          bufferSize,
+								 CFStringRef     key,
+								 CFAllocatorRef  allocator,
+								 CFOptionFlags	 options,
+								 CFStringRef	* errorString);
+
+CF_RETURNS_RETAINED
+CFTypeRef
+IOCFUnserializeBinaryValueAtIndex(const char	* buffer,
+								  size_t          bufferSize,
+								  CFIndex         index,
+								  CFAllocatorRef  allocator,
+								  CFOptionFlags	  options,
+								  CFStringRef	* errorString);
+
+// IOCFUnserializeBinaryValueForKeyPath creates the value found by looking up
+// each key of keyPath, an array of CFStrings, in turn from the root dictionary.
+// For kOSSerializeBinary buffers only that value is created, the rest of the
+// buffer is stepped over; other buffers are unserialized in full. It returns 0
+// if a key along the path isn't there or its value isn't a dictionary. An
+// empty keyPath gives the root.
+
+CF_RETURNS_RETAINED
+CFTypeRef
+IOCFUnserializeBinaryValueForKeyPath(const char	* buffer,
+									 size_t          bufferSize,
+									 CFArrayRef      keyPath,
+									 CFAllocatorRef  allocator,
+									 CFOptionFlags   options,
+									 CFStringRef   * errorString);
+
 CF_RETURNS_RETAINED
 CFTypeRef
 IOCFUnserializeWithSize(const char	  * buffer,
@@ -62,6 +110,111 @@ IOCFUnserializeWithSize(const char	  * buffer,
 						CFOptionFlags	options,
 						CFStringRef	  * errorString);
 
+// IOCFUnserializeSetKeyInterning(true) makes the binary unserializers share
+// dictionary key strings across calls, from a process wide table bounded to a
+// few thousand keys, whenever they are given the default allocator. Keys past
+// the bound, and all keys while interning is off, are created per call.
+
+typedef struct {
+    uint64_t hits;          // keys returned from the table
+    uint64_t misses;        // keys looked up and not found
+    uint32_t count;         // keys in the table
+    uint32_t capacity;      // most keys the table will hold
+} IOCFUnserializeKeyInterningStatistics;
+
+void
+IOCFUnserializeSetKeyInterning(Boolean enable);
+
+void
+IOCFUnserializeGetKeyInterningStatistics(IOCFUnserializeKeyInterningStatistics * statistics);
+
+/*
+ * IOCFBinaryView provides read-only access to a binary serialized buffer
+ * (kOSSerializeBinarySignature) without creating CF objects for it. The view
+ * does not copy the buffer, which must stay valid and unmodified for the life
+ * of the view unless ownership is handed over with one of the options below.
+ * Nodes are only meaningful for the view that returned them; a null node
+ * (kIOCFBinaryViewNodeNull) is returned for missing keys, out of range indexes
+ * and type mismatches.
+ */
+
+typedef struct IOCFBinaryView * IOCFBinaryViewRef;
+typedef uint32_t                IOCFBinaryViewNode;
+
+enum {
+    kIOCFBinaryViewNodeNull = 0
+};
+
+enum {
+    // on IOCFBinaryViewRelease, free() the buffer
+    kIOCFBinaryViewFreeBuffer       = 0x00000001,
+    // on IOCFBinaryViewRelease, vm_deallocate() the buffer
+    kIOCFBinaryViewDeallocateBuffer = 0x00000002
+};
+
+typedef void (*IOCFBinaryViewApplierFunction)(IOCFBinaryViewRef view,
+                                              IOCFBinaryViewNode key,
+                                              IOCFBinaryViewNode value,
+                                              void * context);
+
+// on failure the buffer is left to the caller, whatever the options.
+IOCFBinaryViewRef
+IOCFBinaryViewCreate(const void    * buffer,
+                     size_t          bufferSize,
+                     CFOptionFlags   options,
+                     CFStringRef   * errorString);
+
+void
+IOCFBinaryViewRelease(IOCFBinaryViewRef view);
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetRoot(IOCFBinaryViewRef view);
+
+// returns the CFTypeID the node would have once created, or 0.
+CFTypeID
+IOCFBinaryViewGetTypeID(IOCFBinaryViewRef view, IOCFBinaryViewNode node);
+
+// number of key/value pairs of a dictionary, or elements of an array or set.
+CFIndex
+IOCFBinaryViewGetCount(IOCFBinaryViewRef view, IOCFBinaryViewNode node);
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetValue(IOCFBinaryViewRef view, IOCFBinaryViewNode dictionary, const char * key);
+
+// indexes follow serialization order; for a dictionary this returns the value.
+IOCFBinaryViewNode
+IOCFBinaryViewGetValueAtIndex(IOCFBinaryViewRef view, IOCFBinaryViewNode collection, CFIndex index);
+
+IOCFBinaryViewNode
+IOCFBinaryViewGetKeyAtIndex(IOCFBinaryViewRef view, IOCFBinaryViewNode dictionary, CFIndex index);
+
+// key is kIOCFBinaryViewNodeNull for arrays and sets.
+void
+IOCFBinaryViewApplyFunction(IOCFBinaryViewRef view, IOCFBinaryViewNode collection,
+                            IOCFBinaryViewApplierFunction applier, void * context);
+
+// the string is UTF-8 and not necessarily zero terminated.
+const char *
+IOCFBinaryViewGetStringPtr(IOCFBinaryViewRef view, IOCFBinaryViewNode node, size_t * length);
+
+const void *
+IOCFBinaryViewGetBytePtr(IOCFBinaryViewRef view, IOCFBinaryViewNode node, size_t * length);
+
+Boolean
+IOCFBinaryViewGetNumber(IOCFBinaryViewRef view, IOCFBinaryViewNode node, SInt64 * value);
+
+Boolean
+IOCFBinaryViewGetDouble(IOCFBinaryViewRef view, IOCFBinaryViewNode node, double * value);
+
+Boolean
+IOCFBinaryViewGetBoolean(IOCFBinaryViewRef view, IOCFBinaryViewNode node, Boolean * value);
+
+// creates the CF objects for node and everything below it.
+CF_RETURNS_RETAINED
+CFTypeRef
+IOCFBinaryViewCreateCFObject(IOCFBinaryViewRef view, IOCFBinaryViewNode node,
+                             CFAllocatorRef allocator);
+
 #if defined(__cplusplus)
 }
 #endif
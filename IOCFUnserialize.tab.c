@@ -170,6 +170,11 @@
 #include <CoreFoundation/CFSet.h>
 #include <CoreFoundation/CFDictionary.h>
 
+#include <IOKit/IOCFUnserialize.h>
+
+// the default front end, in IOCFUnserializeXML.c
+__private_extern__ CFTypeRef _IOCFUnserializeXML(const char *buffer, CFAllocatorRef allocator, CFOptionFlags options, CFStringRef *errorString);
+
 #define YYSTYPE object_t *
 #define YYPARSE_PARAM	state
 #define YYLEX_PARAM	(parser_state_t *)state
@@ -189,6 +194,17 @@ typedef	struct object {
 	int		idref;
 } object_t;
 
+// objects, strings and the tag table are carved out of an arena that is
+// only given back once the parse is done, its first block is inline in the
+// parser state so small buffers don't call malloc for them at all
+#define ARENA_INLINE_SIZE	(8 * 1024)
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+
+typedef struct arena_block {
+	struct arena_block	*next;
+	size_t			size;
+} arena_block_t;
+
 // this code is reentrant, this structure contains all
 // state information for the parsing of a single buffer
 typedef struct parser_state {
@@ -198,9 +214,16 @@ typedef struct parser_state {
 	CFAllocatorRef 	allocator;		// which allocator to use
 	object_t	*objects;		// internal objects in use
 	object_t	*freeObjects;		// internal objects that are free
-	CFMutableDictionaryRef tags;		// used to remember "ID" tags
+	char		*arenaNext;		// free space in the current arena block
+	char		*arenaEnd;
+	arena_block_t	*arenaBlocks;		// malloc'ed arena blocks
+	CFTypeRef	*tags;			// used to remember "ID" tags, by tag
+	int		tagCapacity;
+	int		tagCount;
+	CFMutableDictionaryRef sparseTags;	// "ID" tags too large for tags
 	CFStringRef 	*errorString;		// parse error with line
 	CFTypeRef	parsedObject;		// resultant object of parsed text
+	long long	arenaInline[ARENA_INLINE_SIZE / sizeof(long long)];
 } parser_state_t;
 
 #define STATE		((parser_state_t *)state)
@@ -211,11 +234,14 @@ static int		IOCFUnserializeerror(parser_state_t *state, const char *s);
 
 static int		yylex(YYSTYPE *lvalp, parser_state_t *state);
 
+static void		*arenaAlloc(parser_state_t *state, size_t size);
+static void		freeArena(parser_state_t *state);
 static object_t 	*newObject(parser_state_t *state);
 static void 		freeObject(parser_state_t *state, object_t *o);
 static void		rememberObject(parser_state_t *state, intptr_t tag, CFTypeRef o);
 static object_t		*retrieveObject(parser_state_t *state, intptr_t tag);
 static void		cleanupObjects(parser_state_t *state);
+static void		cleanupTags(parser_state_t *state);
 
 static object_t		*buildDictionary(parser_state_t *state, object_t *o);
 static object_t		*buildArray(parser_state_t *state, object_t *o);
@@ -258,7 +284,7 @@ typedef int YYSTYPE;
 
 
 /* Line 216 of yacc.c.  */
-#line 211 "IOCFUnserialize.temp"
+#line 237 "IOCFUnserialize.temp"
 
 #ifdef short
 # undef short
@@ -1491,14 +1517,14 @@ yyreduce:
   switch (yyn)
     {
         case 2:
-#line 139 "IOCFUnserialize.yacc"
+#line 165 "IOCFUnserialize.yacc"
     { yyerror("unexpected end of buffer");
 				  YYERROR;
 				;}
     break;
 
   case 3:
-#line 142 "IOCFUnserialize.yacc"
+#line 168 "IOCFUnserialize.yacc"
     { STATE->parsedObject = (yyvsp[(1) - (1)])->object;
 				  (yyvsp[(1) - (1)])->object = 0;
 				  freeObject(STATE, (yyvsp[(1) - (1)]));
@@ -1507,49 +1533,49 @@ yyreduce:
     break;
 
   case 4:
-#line 147 "IOCFUnserialize.yacc"
+#line 173 "IOCFUnserialize.yacc"
     { yyerror("syntax error");
 				  YYERROR;
 				;}
     break;
 
   case 5:
-#line 152 "IOCFUnserialize.yacc"
+#line 178 "IOCFUnserialize.yacc"
     { (yyval) = buildDictionary(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 6:
-#line 153 "IOCFUnserialize.yacc"
+#line 179 "IOCFUnserialize.yacc"
     { (yyval) = buildArray(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 7:
-#line 154 "IOCFUnserialize.yacc"
+#line 180 "IOCFUnserialize.yacc"
     { (yyval) = buildSet(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 8:
-#line 155 "IOCFUnserialize.yacc"
+#line 181 "IOCFUnserialize.yacc"
     { (yyval) = buildString(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 9:
-#line 156 "IOCFUnserialize.yacc"
+#line 182 "IOCFUnserialize.yacc"
     { (yyval) = buildData(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 10:
-#line 157 "IOCFUnserialize.yacc"
+#line 183 "IOCFUnserialize.yacc"
     { (yyval) = buildNumber(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 11:
-#line 158 "IOCFUnserialize.yacc"
+#line 184 "IOCFUnserialize.yacc"
     { (yyval) = buildBoolean(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 12:
-#line 159 "IOCFUnserialize.yacc"
+#line 185 "IOCFUnserialize.yacc"
     { (yyval) = retrieveObject(STATE, (yyvsp[(1) - (1)])->idref);
 				  if ((yyval)) {
 				    CFRetain((yyval)->object);
@@ -1562,28 +1588,28 @@ yyreduce:
     break;
 
   case 13:
-#line 172 "IOCFUnserialize.yacc"
+#line 198 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (2)]);
 				  (yyval)->elements = NULL;
 				;}
     break;
 
   case 14:
-#line 175 "IOCFUnserialize.yacc"
+#line 201 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (3)]);
 				  (yyval)->elements = (yyvsp[(2) - (3)]);
 				;}
     break;
 
   case 17:
-#line 182 "IOCFUnserialize.yacc"
+#line 208 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(2) - (2)]);
 				  (yyval)->next = (yyvsp[(1) - (2)]);
 				;}
     break;
 
   case 18:
-#line 187 "IOCFUnserialize.yacc"
+#line 213 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (2)]);
 				  (yyval)->key = (CFStringRef)(yyval)->object;
 				  (yyval)->object = (yyvsp[(2) - (2)])->object;
@@ -1594,47 +1620,47 @@ yyreduce:
     break;
 
   case 19:
-#line 196 "IOCFUnserialize.yacc"
+#line 222 "IOCFUnserialize.yacc"
     { (yyval) = buildString(STATE, (yyvsp[(1) - (1)])); ;}
     break;
 
   case 20:
-#line 201 "IOCFUnserialize.yacc"
+#line 227 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (2)]);
 				  (yyval)->elements = NULL;
 				;}
     break;
 
   case 21:
-#line 204 "IOCFUnserialize.yacc"
+#line 230 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (3)]);
 				  (yyval)->elements = (yyvsp[(2) - (3)]);
 				;}
     break;
 
   case 23:
-#line 210 "IOCFUnserialize.yacc"
+#line 236 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (2)]);
 				  (yyval)->elements = NULL;
 				;}
     break;
 
   case 24:
-#line 213 "IOCFUnserialize.yacc"
+#line 239 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (3)]);
 				  (yyval)->elements = (yyvsp[(2) - (3)]);
 				;}
     break;
 
   case 26:
-#line 219 "IOCFUnserialize.yacc"
+#line 245 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(1) - (1)]); 
 				  (yyval)->next = NULL; 
 				;}
     break;
 
   case 27:
-#line 222 "IOCFUnserialize.yacc"
+#line 248 "IOCFUnserialize.yacc"
     { (yyval) = (yyvsp[(2) - (2)]);
 				  (yyval)->next = (yyvsp[(1) - (2)]);
 				;}
@@ -1642,7 +1668,7 @@ yyreduce:
 
 
 /* Line 1267 of yacc.c.  */
-#line 1595 "IOCFUnserialize.temp"
+#line 1621 "IOCFUnserialize.temp"
       default: break;
     }
   YY_SYMBOL_PRINT ("-> $$ =", yyr1[yyn], &yyval, &yyloc);
@@ -1856,7 +1882,7 @@ yyreturn:
 }
 
 
-#line 244 "IOCFUnserialize.yacc"
+#line 270 "IOCFUnserialize.yacc"
 
 
 int
@@ -2038,7 +2064,7 @@ getString(parser_state_t *state)
 	length = state->parseBufferIndex - start;
 
 	/* copy to null terminated buffer */
-	tempString = (char *)malloc(length + 1);
+	tempString = (char *)arenaAlloc(state, length + 1);
 	if (tempString == 0) {
 		printf("IOCFUnserialize: can't alloc temp memory\n");
 		goto error;
@@ -2085,7 +2111,7 @@ getString(parser_state_t *state)
 	return tempString;
 
 error:
-	if (tempString) free(tempString);
+	// the arena gets it back
 	return 0;
 }
 
@@ -2336,7 +2362,7 @@ yylex(YYSTYPE *lvalp, parser_state_t *state)
 	case 's':
 		if (!strcmp(tag, "string")) {
 			if (tagType == TAG_EMPTY) {
-			    	object->string = (char *)malloc(1);
+			    	object->string = (char *)arenaAlloc(STATE, 1);
 			    	object->string[0] = 0;
 				return STRING;
 			}
@@ -2379,6 +2405,44 @@ yylex(YYSTYPE *lvalp, parser_state_t *state)
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 
+void *
+arenaAlloc(parser_state_t *state, size_t size)
+{
+	arena_block_t *block;
+	size_t blockSize;
+	void *p;
+
+	size = (size + 15) & ~((size_t) 15);
+	if (size > (size_t)(state->arenaEnd - state->arenaNext)) {
+		blockSize = (size > (ARENA_BLOCK_SIZE / 4)) ? size : ARENA_BLOCK_SIZE;
+		block = (arena_block_t *)malloc(sizeof(arena_block_t) + blockSize);
+		if (!block) return 0;
+		block->next = state->arenaBlocks;
+		block->size = blockSize;
+		state->arenaBlocks = block;
+
+		// large requests get a block to themselves
+		if (blockSize == size) return (void *)(block + 1);
+		state->arenaNext = (char *)(block + 1);
+		state->arenaEnd = state->arenaNext + blockSize;
+	}
+	p = state->arenaNext;
+	state->arenaNext += size;
+
+	return p;
+}
+
+void
+freeArena(parser_state_t *state)
+{
+	arena_block_t *block;
+
+	while ((block = state->arenaBlocks)) {
+		state->arenaBlocks = block->next;
+		free(block);
+	}
+}
+
 // "java" like allocation, if this code hits a syntax error in the
 // the middle of the parsed string we just bail with pointers hanging
 // all over place, this code helps keeps it all together
@@ -2394,7 +2458,7 @@ newObject(parser_state_t *state)
 		o = state->freeObjects;
 		state->freeObjects = state->freeObjects->next;
 	} else {
-		o = (object_t *)malloc(sizeof(object_t));
+		o = (object_t *)arenaAlloc(state, sizeof(object_t));
 //		object_count++;
 		memset(o, 0, sizeof(object_t));
 		o->free = state->objects;
@@ -2414,7 +2478,7 @@ freeObject(parser_state_t * state, object_t *o)
 void
 cleanupObjects(parser_state_t *state)
 {
-	object_t *t, *o = state->objects;
+	object_t *o = state->objects;
 
 	while (o) {
 		if (o->object) {
@@ -2429,19 +2493,25 @@ cleanupObjects(parser_state_t *state)
 //			printf("IOCFUnserialize: releasing object o=%x key=%x\n", (int)o, (int)o->key);
 			CFRelease(o->key);
 		}
-		if (o->string) {
-//			printf("IOCFUnserialize: freeing   object o=%x string=%x\n", (int)o, (int)o->string);
-			free(o->string);
-		}
 
-		t = o;
+		// the object and its string belong to the arena
 		o = o->free;
-		free(t);
 //		object_count--;
 	}
 //	printf("object_count = %d\n", object_count);
 }
 
+void
+cleanupTags(parser_state_t *state)
+{
+	int i;
+
+	for (i = 0; i < state->tagCapacity; i++) {
+		if (state->tags[i]) CFRelease(state->tags[i]);
+	}
+	if (state->sparseTags) CFRelease(state->sparseTags);
+}
+
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
 // !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
@@ -2449,9 +2519,40 @@ cleanupObjects(parser_state_t *state)
 static void 
 rememberObject(parser_state_t *state, intptr_t tag, CFTypeRef o)
 {
+	CFTypeRef *tags;
+	int capacity;
+
 //	printf("remember idref %d\n", tag);
 
-	CFDictionarySetValue(state->tags, (void *) tag,  o);
+	// IOCFSerialize numbers "ID"s from 0 so they are close to dense, anything
+	// far beyond the ones seen so far goes to the dictionary
+	if ((tag >= state->tagCapacity) && (tag < (2 * (intptr_t) state->tagCount) + 64)) {
+		capacity = 2 * state->tagCapacity;
+		if (capacity <= tag) capacity = (int) tag + 1;
+		if (capacity < 64) capacity = 64;
+		tags = (CFTypeRef *)arenaAlloc(state, capacity * sizeof(CFTypeRef));
+		if (tags) {
+			if (state->tagCapacity) memcpy(tags, state->tags, state->tagCapacity * sizeof(CFTypeRef));
+			bzero(tags + state->tagCapacity, (capacity - state->tagCapacity) * sizeof(CFTypeRef));
+			state->tags = tags;
+			state->tagCapacity = capacity;
+		}
+	}
+
+	if (tag < state->tagCapacity) {
+		CFRetain(o);
+		if (state->tags[tag]) CFRelease(state->tags[tag]);
+		else                  state->tagCount++;
+		state->tags[tag] = o;
+		return;
+	}
+
+	if (!state->sparseTags) {
+		state->sparseTags = CFDictionaryCreateMutable(state->allocator, 0, 0, /* key callbacks */
+							      &kCFTypeDictionaryValueCallBacks);
+		if (!state->sparseTags) return;
+	}
+	CFDictionarySetValue(state->sparseTags, (void *) tag,  o);
 }
 
 static object_t *
@@ -2462,7 +2563,10 @@ retrieveObject(parser_state_t *state, intptr_t tag)
 
 //	printf("retrieve idref '%d'\n", tag);
 
-	ref = (CFTypeRef) CFDictionaryGetValue(state->tags, (void *) tag);
+	if (tag < 0) return 0;
+	if (tag < state->tagCapacity) ref = state->tags[tag];
+	else                          ref = 0;
+	if (!ref && state->sparseTags) ref = (CFTypeRef) CFDictionaryGetValue(state->sparseTags, (void *) tag);
 	if (!ref) return 0;
 
 	o = newObject(state);
@@ -2607,7 +2711,6 @@ buildString(parser_state_t *state, object_t *o)
 	    
 	if (o->idref >= 0) rememberObject(state, o->idref, string);
 
-	free(o->string);
 	o->string = 0;
 	o->object = string;
 
@@ -2673,7 +2776,12 @@ IOCFUnserialize(const char	*buffer,
 	// just in case
 	if (errorString) *errorString = NULL;
 
-	if ((!buffer) || options) return 0;
+	if (!buffer) return 0;
+
+	if (!(kIOCFUnserializeLegacyXMLParser & options)) {
+		return _IOCFUnserializeXML(buffer, allocator, options, errorString);
+	}
+	if (options & ~kIOCFUnserializeLegacyXMLParser) return 0;
 
 	state = (parser_state_t *) malloc(sizeof(parser_state_t));
 
@@ -2685,8 +2793,13 @@ IOCFUnserialize(const char	*buffer,
 	state->allocator = allocator;
 	state->objects = 0;
 	state->freeObjects = 0;
-	state->tags = CFDictionaryCreateMutable(allocator, 0, 0, /* key callbacks */
-						&kCFTypeDictionaryValueCallBacks);
+	state->arenaNext = (char *) state->arenaInline;
+	state->arenaEnd = state->arenaNext + sizeof(state->arenaInline);
+	state->arenaBlocks = 0;
+	state->tags = 0;
+	state->tagCapacity = 0;
+	state->tagCount = 0;
+	state->sparseTags = 0;
 	state->errorString = errorString;
 	state->parsedObject = 0;
 
@@ -2695,7 +2808,8 @@ IOCFUnserialize(const char	*buffer,
 	object = state->parsedObject;
 
 	cleanupObjects(state);
-	CFRelease(state->tags);
+	cleanupTags(state);
+	freeArena(state);
 	free(state);
 
 	return object;
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+
+compares the throughput of the XML front ends of IOCFUnserialize()
+
+to build:
+
+cc -O2 -framework IOKit -framework CoreFoundation IOCFUnserializeBench.c -o IOCFUnserializeBench
+
+to run:
+
+./IOCFUnserializeBench
+find /System/Library/Extensions -name Info.plist | xargs ./IOCFUnserializeBench
+ioreg -a -l > ioreg.xml; ./IOCFUnserializeBench ioreg.xml
+
+With no arguments the properties of every registry entry are serialized
+into one XML buffer and that is used. Each buffer is parsed by both the
+default and the legacy (yacc) parser, the results and errors must match.
+
+*/
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOCFSerialize.h>
+#include <IOKit/IOCFUnserialize.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fcntl.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define kMinimumBytes	(64 * 1024 * 1024)	// parsed per buffer per parser
+
+static double
+nanoseconds(uint64_t delta)
+{
+	static mach_timebase_info_data_t timebase;
+
+	if (!timebase.denom) mach_timebase_info(&timebase);
+	return ((double) delta * timebase.numer / timebase.denom);
+}
+
+static char *
+registryBuffer(size_t * size)
+{
+	CFMutableArrayRef	array;
+	CFDictionaryRef		properties;
+	CFDataRef		data;
+	io_iterator_t		iter;
+	io_registry_entry_t	entry;
+	char *			buffer;
+
+	if (KERN_SUCCESS != IORegistryCreateIterator(kIOMainPortDefault, kIOServicePlane,
+						     kIORegistryIterateRecursively, &iter)) return (NULL);
+
+	array = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	while ((entry = IOIteratorNext(iter))) {
+		if (KERN_SUCCESS == IORegistryEntryCreateCFProperties(entry,
+				(CFMutableDictionaryRef *) &properties, kCFAllocatorDefault, kNilOptions)) {
+			CFArrayAppendValue(array, properties);
+			CFRelease(properties);
+		}
+		IOObjectRelease(entry);
+	}
+	IOObjectRelease(iter);
+
+	data = IOCFSerialize(array, kNilOptions);
+	CFRelease(array);
+	if (!data) return (NULL);
+
+	*size = CFDataGetLength(data);
+	buffer = (char *) malloc(*size + 1);
+	if (buffer) {
+		memcpy(buffer, CFDataGetBytePtr(data), *size);
+		buffer[*size] = 0;
+	}
+	CFRelease(data);
+
+	return (buffer);
+}
+
+static char *
+fileBuffer(const char * path, size_t * size)
+{
+	struct stat sb;
+	char *	    buffer;
+	int	    fd;
+
+	if (stat(path, &sb)) return (NULL);
+	*size = (size_t) sb.st_size;
+
+	buffer = (char *) malloc(*size + 1);
+	if (!buffer) return (NULL);
+
+	fd = open(path, O_RDONLY, 0);
+	if ((fd < 0) || (read(fd, buffer, *size) != (ssize_t) *size)) {
+		if (fd >= 0) close(fd);
+		free(buffer);
+		return (NULL);
+	}
+	close(fd);
+	buffer[*size] = 0;
+
+	return (buffer);
+}
+
+static double
+measure(const char * buffer, size_t size, CFOptionFlags options)
+{
+	CFTypeRef   object;
+	CFStringRef errorString;
+	uint64_t    start, best;
+	int	    iterations, i, pass;
+
+	iterations = (int)(kMinimumBytes / (size + 1)) + 1;
+	best = UINT64_MAX;
+
+	for (pass = 0; pass < 3; pass++) {
+		start = mach_absolute_time();
+		for (i = 0; i < iterations; i++) {
+			object = IOCFUnserialize(buffer, kCFAllocatorDefault, options, &errorString);
+			if (object) CFRelease(object);
+			if (errorString) CFRelease(errorString);
+		}
+		start = mach_absolute_time() - start;
+		if (start < best) best = start;
+	}
+
+	// MB/s
+	return (((double) size * iterations * 1000.0) / nanoseconds(best));
+}
+
+static int
+compare(const char * name, const char * buffer)
+{
+	CFTypeRef   object1, object2;
+	CFStringRef error1, error2;
+	int	    ok;
+
+	object1 = IOCFUnserialize(buffer, kCFAllocatorDefault, 0, &error1);
+	object2 = IOCFUnserialize(buffer, kCFAllocatorDefault, kIOCFUnserializeLegacyXMLParser, &error2);
+
+	ok = (object1 && object2) ? CFEqual(object1, object2) : (object1 == object2);
+	if (error1 || error2) ok &= (error1 && error2 && CFEqual(error1, error2));
+	if (!ok) printf("%s: parsers disagree\n", name);
+	if (error1) {
+		CFShow(error1);
+		CFRelease(error1);
+	}
+
+	if (object1) CFRelease(object1);
+	if (object2) CFRelease(object2);
+	if (error2)  CFRelease(error2);
+
+	return (ok);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char * name;
+	char *	     buffer;
+	size_t	     size;
+	double	     fast, legacy;
+	double	     totalBytes = 0, totalFast = 0, totalLegacy = 0;
+	int	     i, failed = 0;
+
+	for (i = (argc > 1) ? 1 : 0; i < argc; i++) {
+
+		if (argc > 1) {
+			name = argv[i];
+			buffer = fileBuffer(name, &size);
+		} else {
+			name = "IORegistry";
+			buffer = registryBuffer(&size);
+		}
+		if (!buffer) {
+			printf("%s: can't read\n", name);
+			failed++;
+			continue;
+		}
+
+		if (!compare(name, buffer)) failed++;
+
+		fast   = measure(buffer, size, 0);
+		legacy = measure(buffer, size, kIOCFUnserializeLegacyXMLParser);
+		printf("%10ld bytes %8.1f MB/s %8.1f MB/s legacy %5.2fx  %s\n",
+		       (long) size, fast, legacy, fast / legacy, name);
+
+		totalBytes  += size;
+		totalFast   += size / fast;
+		totalLegacy += size / legacy;
+		free(buffer);
+	}
+
+	if (totalBytes > 0) {
+		printf("total %.0f bytes %8.1f MB/s %8.1f MB/s legacy %5.2fx\n",
+		       totalBytes, totalBytes / totalFast, totalBytes / totalLegacy,
+		       totalLegacy / totalFast);
+	}
+
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,1030 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+// hand written front end for unserializing CF objects serialized to XML
+//
+// This accepts exactly the language of IOCFUnserialize.yacc and produces
+// the same objects and error strings, it is the default for IOCFUnserialize()
+// and kIOCFUnserializeLegacyXMLParser selects the yacc parser instead.
+// The tag lexer is a straight port of the yacc one so that line numbers
+// and error positions match. The speed comes from scanning text runs a
+// vector at a time, building CF objects directly as the tokens arrive
+// rather than through a list of object_t's, and not copying text that
+// has no entities in it.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <CoreFoundation/CFBase.h>
+#include <CoreFoundation/CFNumber.h>
+#include <CoreFoundation/CFData.h>
+#include <CoreFoundation/CFString.h>
+#include <CoreFoundation/CFArray.h>
+#include <CoreFoundation/CFSet.h>
+#include <CoreFoundation/CFDictionary.h>
+
+#include <IOKit/IOCFUnserialize.h>
+
+// the yacc parser's stack is limited to YYMAXDEPTH entries, stackDepth
+// follows what its depth would be so that deep nesting fails the same way
+#define XML_MAX_DEPTH		10000
+
+enum {
+	kXMLTokenEOF		= 0,
+	kXMLTokenSyntaxError,
+	kXMLTokenDictionaryStart,
+	kXMLTokenDictionaryEnd,
+	kXMLTokenDictionary,
+	kXMLTokenArrayStart,
+	kXMLTokenArrayEnd,
+	kXMLTokenArray,
+	kXMLTokenSetStart,
+	kXMLTokenSetEnd,
+	kXMLTokenSet,
+	kXMLTokenKey,
+	kXMLTokenString,
+	kXMLTokenData,
+	kXMLTokenNumber,
+	kXMLTokenBoolean,
+	kXMLTokenIDRef
+};
+
+// a token only lives until the next call to the lexer, text and data
+// point either into the parse buffer or into the scratch buffer
+typedef struct xml_token {
+	const char	*text;			// for string & key
+	size_t		length;
+	const UInt8	*data;			// for data
+	size_t		size;
+	long long	number;			// for number & boolean
+	int		numberSize;
+	int		idref;
+} xml_token_t;
+
+// an open collection
+typedef struct xml_frame {
+	CFTypeRef	object;
+	CFStringRef	key;			// for dictionary
+	int		type;			// token that opened it
+	int		idref;
+	bool		hasElements;
+} xml_frame_t;
+
+typedef struct xml_state {
+	const char	*parseBuffer;		// current position in text to be parsed
+	int		lineNumber;		// current line number
+	CFAllocatorRef 	allocator;		// which allocator to use
+	CFTypeRef	*tags;			// used to remember "ID" tags, by tag
+	int		tagCapacity;
+	int		tagCount;
+	CFMutableDictionaryRef sparseTags;	// "ID" tags too large for tags
+	CFStringRef 	*errorString;		// parse error with line
+	char		*scratch;		// decoded strings and data
+	size_t		scratchSize;
+	xml_frame_t	*frames;		// open collections
+	int		frameCount;
+	int		frameCapacity;
+	int		stackDepth;		// of the equivalent yacc parser
+} xml_state_t;
+
+static void
+xmlError(xml_state_t *state, const char *s)
+{
+    if (state->errorString) {
+	*(state->errorString) = CFStringCreateWithFormat(state->allocator, NULL,
+							 CFSTR("IOCFUnserialize: %s near line %d"),
+							 s, state->lineNumber);
+    }
+}
+
+static char *
+reserveScratch(xml_state_t *state, size_t size)
+{
+	char *scratch;
+
+	if (size <= state->scratchSize) return state->scratch;
+
+	if (size < 4096) size = 4096;
+	scratch = (char *)realloc(state->scratch, size);
+	if (!scratch) return 0;
+	state->scratch = scratch;
+	state->scratchSize = size;
+
+	return scratch;
+}
+
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+
+// scanText returns the first '<' or NUL at or after p, adding the number
+// of '\n's skipped over to lines and noting whether an '&' was seen.
+// The vector versions use aligned loads, these never cross into the next
+// page so reading beyond the terminating NUL is harmless.
+
+#if defined(__SSE2__)
+
+__attribute__((no_sanitize("address")))
+static const char *
+scanText(const char *p, int *lines, bool *entity)
+{
+	const __m128i	lt	= _mm_set1_epi8('<');
+	const __m128i	amp	= _mm_set1_epi8('&');
+	const __m128i	nl	= _mm_set1_epi8('\n');
+	const __m128i	zero	= _mm_setzero_si128();
+	uintptr_t	offset	= ((uintptr_t) p) & 15;
+	const char	*block	= p - offset;
+	unsigned int	valid	= (0xffff << offset) & 0xffff;
+
+	for (;; block += 16, valid = 0xffff) {
+		__m128i v = _mm_load_si128((const __m128i *) block);
+		unsigned int stop, newline, ampersand;
+
+		stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, zero))) & valid;
+		newline = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) & valid;
+		ampersand = _mm_movemask_epi8(_mm_cmpeq_epi8(v, amp)) & valid;
+		if (stop) {
+			unsigned int before = (stop & -stop) - 1;
+
+			*lines += __builtin_popcount(newline & before);
+			if (ampersand & before) *entity = true;
+			return block + __builtin_ctz(stop);
+		}
+		*lines += __builtin_popcount(newline);
+		if (ampersand) *entity = true;
+	}
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+// NEON has no movemask, narrowing each 16 bit lane by 4 leaves a 64 bit
+// mask with four bits per byte instead
+#define neonMask(v)	vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+
+__attribute__((no_sanitize("address")))
+static const char *
+scanText(const char *p, int *lines, bool *entity)
+{
+	const uint8x16_t lt	= vdupq_n_u8('<');
+	const uint8x16_t amp	= vdupq_n_u8('&');
+	const uint8x16_t nl	= vdupq_n_u8('\n');
+	uintptr_t	offset	= ((uintptr_t) p) & 15;
+	const char	*block	= p - offset;
+	uint64_t	valid	= ~0ULL << (offset * 4);
+
+	for (;; block += 16, valid = ~0ULL) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) block);
+		uint64_t stop, newline, ampersand;
+
+		stop = neonMask(vorrq_u8(vceqq_u8(v, lt), vceqzq_u8(v))) & valid;
+		newline = neonMask(vceqq_u8(v, nl)) & valid;
+		ampersand = neonMask(vceqq_u8(v, amp)) & valid;
+		if (stop) {
+			uint64_t before = (stop & -stop) - 1;
+
+			*lines += __builtin_popcountll(newline & before) >> 2;
+			if (ampersand & before) *entity = true;
+			return block + (__builtin_ctzll(stop) >> 2);
+		}
+		*lines += __builtin_popcountll(newline) >> 2;
+		if (ampersand) *entity = true;
+	}
+}
+
+#else
+
+static const char *
+scanText(const char *p, int *lines, bool *entity)
+{
+	int c;
+
+	while ((c = *p) && (c != '<')) {
+		if (c == '\n') (*lines)++;
+		else if (c == '&') *entity = true;
+		p++;
+	}
+	return p;
+}
+
+#endif
+
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+
+#define TAG_MAX_LENGTH		32
+#define TAG_MAX_ATTRIBUTES	32
+#define TAG_BAD			0
+#define TAG_START		1
+#define TAG_END			2
+#define TAG_EMPTY		3
+#define TAG_IGNORE		4
+
+#define currentChar()	(*state->parseBuffer)
+#define nextChar()	(*++state->parseBuffer)
+
+#define isSpace(c)	((c) == ' ' || (c) == '\t')
+#define isAlpha(c)	(((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z'))
+#define isDigit(c)	((c) >= '0' && (c) <= '9')
+#define isAlphaDigit(c)	((c) >= 'a' && (c) <= 'f')
+#define isHexDigit(c)	(isDigit(c) || isAlphaDigit(c))
+#define isAlphaNumeric(c) (isAlpha(c) || isDigit(c) || ((c) == '-'))
+
+static int
+getTag(xml_state_t *state,
+       char tag[TAG_MAX_LENGTH],
+       int *attributeCount,
+       char attributes[TAG_MAX_ATTRIBUTES][TAG_MAX_LENGTH],
+       char values[TAG_MAX_ATTRIBUTES][TAG_MAX_LENGTH] )
+{
+	int length = 0;
+	int c = currentChar();
+	int tagType = TAG_START;
+
+	*attributeCount = 0;
+
+	if (c != '<') return TAG_BAD;
+        c = nextChar();		// skip '<'
+
+
+	// <!TAG   declarations     >
+	// <!--     comments      -->
+        if (c == '!') {
+	    c = nextChar();
+	    bool isComment = (c == '-') && ((c = nextChar()) != 0) && (c == '-');
+	    if (!isComment && !isAlpha(c)) return TAG_BAD;   // <!1, <!-A, <!eos
+
+	    while (c && (c = nextChar()) != 0) {
+		if (c == '\n') state->lineNumber++;
+		if (isComment) {
+		    if (c != '-') continue;
+		    c = nextChar();
+		    if (c != '-') continue;
+		    c = nextChar();
+		}
+		if (c == '>') {
+		    (void)nextChar();
+		    return TAG_IGNORE;
+		}
+		if (isComment) break;
+	    }
+	    return TAG_BAD;
+	}
+
+	else
+
+	// <? Processing Instructions  ?>
+        if (c == '?') {
+                while ((c = nextChar()) != 0) {
+                        if (c == '\n') state->lineNumber++;
+		if (c != '?') continue;
+			c = nextChar();
+                        if (c == '>') {
+                                (void)nextChar();
+		    return TAG_IGNORE;
+                        }
+                }
+	    return TAG_BAD;
+        }
+
+	else
+
+	// </ end tag >
+	if (c == '/') {
+		c = nextChar();		// skip '/'
+		tagType = TAG_END;
+	}
+        if (!isAlpha(c)) return TAG_BAD;
+
+	/* find end of tag while copying it */
+	while (isAlphaNumeric(c)) {
+		tag[length++] = c;
+		c = nextChar();
+		if (length >= (TAG_MAX_LENGTH - 1)) return TAG_BAD;
+	}
+
+	tag[length] = 0;
+
+	// look for attributes of the form attribute = "value" ...
+	while ((c != '>') && (c != '/')) {
+		while (isSpace(c)) c = nextChar();
+
+		length = 0;
+		while (isAlphaNumeric(c)) {
+			attributes[*attributeCount][length++] = c;
+			if (length >= (TAG_MAX_LENGTH - 1)) return TAG_BAD;
+			c = nextChar();
+		}
+		attributes[*attributeCount][length] = 0;
+
+		while (isSpace(c)) c = nextChar();
+
+		if (c != '=') return TAG_BAD;
+		c = nextChar();
+
+		while (isSpace(c)) c = nextChar();
+
+		if (c != '"') return TAG_BAD;
+		c = nextChar();
+		length = 0;
+		while (c != '"') {
+			// the yacc lexer walks off the end of the buffer here
+			if (!c) return TAG_BAD;
+			values[*attributeCount][length++] = c;
+			if (length >= (TAG_MAX_LENGTH - 1)) return TAG_BAD;
+			c = nextChar();
+		}
+		values[*attributeCount][length] = 0;
+
+		c = nextChar(); // skip closing quote
+
+		(*attributeCount)++;
+		if (*attributeCount >= TAG_MAX_ATTRIBUTES) return TAG_BAD;
+	}
+
+	if (c == '/') {
+		c = nextChar();		// skip '/'
+		tagType = TAG_EMPTY;
+	}
+	if (c != '>') return TAG_BAD;
+	c = nextChar();		// skip '>'
+
+	return tagType;
+}
+
+// text up to the next tag, "&amp;" -> '&', "&lt;" -> '<', "&gt;" -> '>'
+static bool
+getString(xml_state_t *state, xml_token_t *token)
+{
+	const char *start = state->parseBuffer;
+	bool entity = false;
+	size_t length, i, j;
+	char *string;
+	int c;
+
+	state->parseBuffer = scanText(start, &state->lineNumber, &entity);
+	if (currentChar() != '<') return false;
+
+	length = state->parseBuffer - start;
+	token->text = start;
+	token->length = length;
+	if (!entity) return true;
+
+	string = reserveScratch(state, length);
+	if (!string) return false;
+
+	i = j = 0;
+	while (i < length) {
+		const char *amp = (const char *) memchr(start + i, '&', length - i);
+		size_t run = amp ? (size_t)(amp - (start + i)) : (length - i);
+
+		memcpy(string + j, start + i, run);
+		i += run;
+		j += run;
+		if (i == length) break;
+
+		i++;	// skip '&'
+		if ((i+3) > length) return false;
+		c = start[i++];
+		if (c == 'l') {
+			if (start[i++] != 't') return false;
+			if (start[i++] != ';') return false;
+			string[j++] = '<';
+			continue;
+		}
+		if (c == 'g') {
+			if (start[i++] != 't') return false;
+			if (start[i++] != ';') return false;
+			string[j++] = '>';
+			continue;
+		}
+		if ((i+3) > length) return false;
+		if (c == 'a') {
+			if (start[i++] != 'm') return false;
+			if (start[i++] != 'p') return false;
+			if (start[i++] != ';') return false;
+			string[j++] = '&';
+			continue;
+		}
+		return false;
+	}
+
+	token->text = string;
+	token->length = j;
+
+	return true;
+}
+
+static long long
+getNumber(xml_state_t *state)
+{
+	unsigned long long n = 0;
+	int base = 10;
+	bool negate = false;
+	int c = currentChar();
+
+	if (c == '0') {
+		c = nextChar();
+		if (c == 'x') {
+			base = 16;
+			c = nextChar();
+		}
+	}
+	if (base == 10) {
+		if (c == '-') {
+			negate = true;
+			c = nextChar();
+		}
+		while(isDigit(c)) {
+			n = (n * base + c - '0');
+			c = nextChar();
+		}
+		if (negate) {
+			n = (unsigned long long)((long long)n * (long long)-1);
+		}
+	} else {
+		while(isHexDigit(c)) {
+			if (isDigit(c)) {
+				n = (n * base + c - '0');
+			} else {
+				n = (n * base + 0xa + c - 'a');
+			}
+			c = nextChar();
+		}
+	}
+	return n;
+}
+
+// taken from CFXMLParsing/CFPropertyList.c
+
+static const signed char __CFPLDataDecodeTable[128] = {
+    /* 000 */ -1, -1, -1, -1, -1, -1, -1, -1,
+    /* 010 */ -1, -1, -1, -1, -1, -1, -1, -1,
+    /* 020 */ -1, -1, -1, -1, -1, -1, -1, -1,
+    /* 030 */ -1, -1, -1, -1, -1, -1, -1, -1,
+    /* ' ' */ -1, -1, -1, -1, -1, -1, -1, -1,
+    /* '(' */ -1, -1, -1, 62, -1, -1, -1, 63,
+    /* '0' */ 52, 53, 54, 55, 56, 57, 58, 59,
+    /* '8' */ 60, 61, -1, -1, -1,  0, -1, -1,
+    /* '@' */ -1,  0,  1,  2,  3,  4,  5,  6,
+    /* 'H' */  7,  8,  9, 10, 11, 12, 13, 14,
+    /* 'P' */ 15, 16, 17, 18, 19, 20, 21, 22,
+    /* 'X' */ 23, 24, 25, -1, -1, -1, -1, -1,
+    /* '`' */ -1, 26, 27, 28, 29, 30, 31, 32,
+    /* 'h' */ 33, 34, 35, 36, 37, 38, 39, 40,
+    /* 'p' */ 41, 42, 43, 44, 45, 46, 47, 48,
+    /* 'x' */ 49, 50, 51, -1, -1, -1, -1, -1
+};
+
+static bool
+getCFEncodedData(xml_state_t *state, xml_token_t *token)
+{
+    int numeq = 0, cntr = 0;
+    unsigned int acc = 0;
+    size_t tmpbufpos = 0;
+    unsigned char *tmpbuf;
+    const char *end;
+    bool entity = false;
+    int lines = 0;
+    int c;
+
+    token->data = NULL;
+    token->size = 0;
+
+    // every 4 characters decode to at most 3 bytes, so size the
+    // buffer once from the extent of the text
+    end = scanText(state->parseBuffer, &lines, &entity);
+    tmpbuf = (unsigned char *)reserveScratch(state, ((end - state->parseBuffer) / 4) * 3 + 3);
+    if (!tmpbuf) return false;
+
+    c = currentChar();
+    while (c != '<') {
+        c &= 0x7f;
+	if (c == 0) return false;
+	if (c == '=') numeq++; else numeq = 0;
+	if (c == '\n') state->lineNumber++;
+        if (__CFPLDataDecodeTable[c] < 0) {
+	    c = nextChar();
+            continue;
+	}
+        cntr++;
+        acc <<= 6;
+        acc += __CFPLDataDecodeTable[c];
+        if (0 == (cntr & 0x3)) {
+            tmpbuf[tmpbufpos++] = (acc >> 16) & 0xff;
+            if (numeq < 2)
+                tmpbuf[tmpbufpos++] = (acc >> 8) & 0xff;
+            if (numeq < 1)
+                tmpbuf[tmpbufpos++] = acc & 0xff;
+        }
+	c = nextChar();
+    }
+    if (tmpbufpos) {
+	token->data = tmpbuf;
+	token->size = tmpbufpos;
+    }
+    return true;
+}
+
+static int
+xmlLex(xml_state_t *state, xml_token_t *token)
+{
+	int c, i;
+	int tagType;
+	char tag[TAG_MAX_LENGTH];
+	int attributeCount;
+	char attributes[TAG_MAX_ATTRIBUTES][TAG_MAX_LENGTH];
+	char values[TAG_MAX_ATTRIBUTES][TAG_MAX_LENGTH];
+
+ top:
+	c = currentChar();
+
+	/* skip white space  */
+	if (isSpace(c)) while ((c = nextChar()) != 0 && isSpace(c)) {};
+
+	/* keep track of line number, don't return \n's */
+	if (c == '\n') {
+		state->lineNumber++;
+		(void)nextChar();
+		goto top;
+	}
+
+	// end of the buffer?
+	if (!c)	return kXMLTokenEOF;
+
+	tagType = getTag(state, tag, &attributeCount, attributes, values);
+	if (tagType == TAG_BAD) return kXMLTokenSyntaxError;
+	if (tagType == TAG_IGNORE) goto top;
+
+	// check for "ID" and "IDREF" tags up front
+	token->idref = -1;
+	for (i=0; i < attributeCount; i++) {
+	    if (attributes[i][0] == 'I' && attributes[i][1] == 'D') {
+		// check for idref's, note: we ignore the tag, for
+		// this to work correctly, all idrefs must be unique
+		// across the whole serialization
+		if (attributes[i][2] == 'R' && attributes[i][3] == 'E' &&
+		    attributes[i][4] == 'F' && !attributes[i][5]) {
+		    if (tagType != TAG_EMPTY) return kXMLTokenSyntaxError;
+		    token->idref = strtol(values[i], NULL, 0);
+		    return kXMLTokenIDRef;
+		}
+		// check for id's
+		if (!attributes[i][2]) {
+		    token->idref = strtol(values[i], NULL, 0);
+		} else {
+		    return kXMLTokenSyntaxError;
+		}
+	    }
+	}
+
+	switch (*tag) {
+	case 'a':
+		if (!strcmp(tag, "array")) {
+			if (tagType == TAG_EMPTY) return kXMLTokenArray;
+			return (tagType == TAG_START) ? kXMLTokenArrayStart : kXMLTokenArrayEnd;
+		}
+		break;
+	case 'd':
+		if (!strcmp(tag, "dict")) {
+			if (tagType == TAG_EMPTY) return kXMLTokenDictionary;
+			return (tagType == TAG_START) ? kXMLTokenDictionaryStart : kXMLTokenDictionaryEnd;
+		}
+		if (!strcmp(tag, "data")) {
+			if (tagType == TAG_EMPTY) {
+				token->data = NULL;
+				token->size = 0;
+				return kXMLTokenData;
+			}
+			if (!getCFEncodedData(state, token)) return kXMLTokenSyntaxError;
+			if ((getTag(state, tag, &attributeCount, attributes, values) != TAG_END) || strcmp(tag, "data")) {
+				return kXMLTokenSyntaxError;
+			}
+			return kXMLTokenData;
+		}
+		break;
+	case 'f':
+		if (!strcmp(tag, "false")) {
+			if (tagType == TAG_EMPTY) {
+				token->number = 0;
+				return kXMLTokenBoolean;
+			}
+		}
+		break;
+	case 'i':
+		if (!strcmp(tag, "integer")) {
+			token->numberSize = 64;	// default
+			for (i=0; i < attributeCount; i++) {
+				if (!strcmp(attributes[i], "size")) {
+					token->numberSize = strtoul(values[i], NULL, 0);
+				}
+			}
+			if (tagType == TAG_EMPTY) {
+				token->number = 0;
+				return kXMLTokenNumber;
+			}
+			token->number = getNumber(state);
+			if ((getTag(state, tag, &attributeCount, attributes, values) != TAG_END) || strcmp(tag, "integer")) {
+				return kXMLTokenSyntaxError;
+			}
+			return kXMLTokenNumber;
+		}
+		break;
+	case 'k':
+		if (!strcmp(tag, "key")) {
+			if (tagType == TAG_EMPTY) return kXMLTokenSyntaxError;
+			if (!getString(state, token)) {
+				return kXMLTokenSyntaxError;
+			}
+			if ((getTag(state, tag, &attributeCount, attributes, values) != TAG_END)
+			   || strcmp(tag, "key")) {
+				return kXMLTokenSyntaxError;
+			}
+			return kXMLTokenKey;
+		}
+		break;
+	case 'p':
+		if (!strcmp(tag, "plist")) {
+			goto top;
+		}
+		break;
+	case 's':
+		if (!strcmp(tag, "string")) {
+			if (tagType == TAG_EMPTY) {
+				token->text = "";
+				token->length = 0;
+				return kXMLTokenString;
+			}
+			if (!getString(state, token)) {
+				return kXMLTokenSyntaxError;
+			}
+			if ((getTag(state, tag, &attributeCount, attributes, values) != TAG_END)
+			   || strcmp(tag, "string")) {
+				return kXMLTokenSyntaxError;
+			}
+			return kXMLTokenString;
+		}
+		if (!strcmp(tag, "set")) {
+			if (tagType == TAG_EMPTY) return kXMLTokenSet;
+			return (tagType == TAG_START) ? kXMLTokenSetStart : kXMLTokenSetEnd;
+		}
+		break;
+	case 't':
+		if (!strcmp(tag, "true")) {
+			if (tagType == TAG_EMPTY) {
+				token->number = 1;
+				return kXMLTokenBoolean;
+			}
+		}
+		break;
+	}
+
+	return kXMLTokenSyntaxError;
+}
+
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+// !@$&)(^Q$&*^!$(*!@$_(^%_(*Q#$(_*&!$_(*&!$_(*&!#$(*!@&^!@#%!_!#
+
+// same scheme as the yacc parser, "ID"s close to the ones already seen
+// index an array, the rest go to a dictionary
+static void
+rememberObject(xml_state_t *state, intptr_t tag, CFTypeRef o)
+{
+	CFTypeRef *tags;
+	int capacity;
+
+	if ((tag >= state->tagCapacity) && (tag < (2 * (intptr_t) state->tagCount) + 64)) {
+		capacity = 2 * state->tagCapacity;
+		if (capacity <= tag) capacity = (int) tag + 1;
+		if (capacity < 64) capacity = 64;
+		tags = (CFTypeRef *)realloc(state->tags, capacity * sizeof(CFTypeRef));
+		if (tags) {
+			bzero(tags + state->tagCapacity, (capacity - state->tagCapacity) * sizeof(CFTypeRef));
+			state->tags = tags;
+			state->tagCapacity = capacity;
+		}
+	}
+
+	if (tag < state->tagCapacity) {
+		CFRetain(o);
+		if (state->tags[tag]) CFRelease(state->tags[tag]);
+		else                  state->tagCount++;
+		state->tags[tag] = o;
+		return;
+	}
+
+	if (!state->sparseTags) {
+		state->sparseTags = CFDictionaryCreateMutable(state->allocator, 0, 0, /* key callbacks */
+							      &kCFTypeDictionaryValueCallBacks);
+		if (!state->sparseTags) return;
+	}
+	CFDictionarySetValue(state->sparseTags, (void *) tag,  o);
+}
+
+static CFTypeRef
+retrieveObject(xml_state_t *state, intptr_t tag)
+{
+	CFTypeRef ref = 0;
+
+	if (tag < 0) return 0;
+	if (tag < state->tagCapacity) ref = state->tags[tag];
+	if (!ref && state->sparseTags) ref = CFDictionaryGetValue(state->sparseTags, (void *) tag);
+
+	return ref;
+}
+
+static CFStringRef
+buildString(xml_state_t *state, xml_token_t *token)
+{
+	CFStringRef string;
+
+	string = CFStringCreateWithBytes(state->allocator, (const UInt8 *) token->text,
+					 token->length, kCFStringEncodingUTF8, false);
+	if (!string) {
+	    syslog(LOG_ERR, "FIXME: IOUnserialize has detected a string that is not valid UTF-8, \"%.*s\".",
+		   (int) token->length, token->text);
+	    string = CFStringCreateWithBytes(state->allocator, (const UInt8 *) token->text,
+					     token->length, kCFStringEncodingMacRoman, false);
+	}
+
+	if (string && (token->idref >= 0)) rememberObject(state, token->idref, string);
+
+	return string;
+}
+
+static CFNumberRef
+buildNumber(xml_state_t *state, xml_token_t *token)
+{
+	CFNumberRef number;
+
+	if (token->numberSize <= 32) {
+		SInt32 value = (SInt32) token->number;
+		number = CFNumberCreate(state->allocator, kCFNumberSInt32Type, &value);
+	} else {
+		SInt64 value = (SInt64) token->number;
+		number = CFNumberCreate(state->allocator, kCFNumberSInt64Type, &value);
+	}
+
+	if (number && (token->idref >= 0)) rememberObject(state, token->idref, number);
+
+	return number;
+}
+
+static CFTypeRef
+buildCollection(xml_state_t *state, int type)
+{
+	switch (type) {
+	case kXMLTokenDictionaryStart:
+	case kXMLTokenDictionary:
+		return CFDictionaryCreateMutable(state->allocator, 0,
+						 &kCFTypeDictionaryKeyCallBacks,
+						 &kCFTypeDictionaryValueCallBacks);
+	case kXMLTokenArrayStart:
+	case kXMLTokenArray:
+		return CFArrayCreateMutable(state->allocator, 0, &kCFTypeArrayCallBacks);
+	default:
+		return CFSetCreateMutable(state->allocator, 0, &kCFTypeSetCallBacks);
+	}
+}
+
+static bool
+pushFrame(xml_state_t *state, CFTypeRef object, int type, int idref)
+{
+	xml_frame_t *frame;
+
+	if (state->frameCount == state->frameCapacity) {
+		int capacity = state->frameCapacity ? (state->frameCapacity * 2) : 16;
+
+		frame = (xml_frame_t *)realloc(state->frames, capacity * sizeof(xml_frame_t));
+		if (!frame) return false;
+		state->frames = frame;
+		state->frameCapacity = capacity;
+	}
+	frame = &state->frames[state->frameCount++];
+	frame->object = object;
+	frame->key = 0;
+	frame->type = type;
+	frame->idref = idref;
+	frame->hasElements = false;
+
+	return true;
+}
+
+// Objects are built as soon as their tokens are read and added to the
+// innermost open collection, collections are remembered for "IDREF"s when
+// they close, just as the yacc parser does when it reduces them.
+static CFTypeRef
+parseObject(xml_state_t *state)
+{
+	xml_token_t token;
+	xml_frame_t *frame;
+	CFTypeRef object;
+	const char *error = "syntax error";
+	bool needKey;
+	int type;
+
+	// the yacc parser takes its empty input rule for any outermost token
+	// that can't start an object, not just for the end of the buffer
+	type = xmlLex(state, &token);
+	switch (type) {
+	case kXMLTokenEOF:
+	case kXMLTokenDictionaryEnd:
+	case kXMLTokenArrayEnd:
+	case kXMLTokenSetEnd:
+	case kXMLTokenKey:
+		xmlError(state, "unexpected end of buffer");
+		return 0;
+	}
+
+	for (;;) {
+		frame = state->frameCount ? &state->frames[state->frameCount - 1] : 0;
+
+		// dictionaries alternate between keys and values
+		needKey = frame && (frame->type == kXMLTokenDictionaryStart) && !frame->key;
+		if (needKey) {
+			if ((type != kXMLTokenKey) && (type != kXMLTokenDictionaryEnd)) break;
+		} else if ((type == kXMLTokenEOF) || (type == kXMLTokenSyntaxError) || (type == kXMLTokenKey)) {
+			break;
+		}
+		if ((type == kXMLTokenDictionaryEnd) || (type == kXMLTokenArrayEnd) || (type == kXMLTokenSetEnd)) {
+			if (!frame || (frame->type != (type - 1)) || frame->key) break;
+		}
+
+		// every token is shifted onto the yacc parser's stack
+		if ((state->stackDepth + 1) >= XML_MAX_DEPTH) {
+			error = "memory exhausted";
+			break;
+		}
+
+		object = 0;
+		switch (type) {
+		case kXMLTokenKey:
+			frame->key = buildString(state, &token);
+			if (!frame->key) break;
+			state->stackDepth++;
+			type = xmlLex(state, &token);
+			continue;
+
+		case kXMLTokenDictionaryStart:
+		case kXMLTokenArrayStart:
+		case kXMLTokenSetStart:
+			object = buildCollection(state, type);
+			if (!object || !pushFrame(state, object, type, token.idref)) {
+				if (object) CFRelease(object);
+				object = 0;
+				error = "memory exhausted";
+				break;
+			}
+			state->stackDepth++;
+			type = xmlLex(state, &token);
+			continue;
+
+		case kXMLTokenDictionaryEnd:
+		case kXMLTokenArrayEnd:
+		case kXMLTokenSetEnd:
+			object = frame->object;
+			if (frame->idref >= 0) rememberObject(state, frame->idref, object);
+			state->stackDepth -= frame->hasElements ? 2 : 1;
+			state->frameCount--;
+			break;
+
+		case kXMLTokenDictionary:
+		case kXMLTokenArray:
+		case kXMLTokenSet:
+			object = buildCollection(state, type);
+			if (object && (token.idref >= 0)) rememberObject(state, token.idref, object);
+			break;
+
+		case kXMLTokenString:
+			object = buildString(state, &token);
+			break;
+
+		case kXMLTokenData:
+			object = CFDataCreate(state->allocator, token.data, token.size);
+			if (object && (token.idref >= 0)) rememberObject(state, token.idref, object);
+			break;
+
+		case kXMLTokenNumber:
+			object = buildNumber(state, &token);
+			break;
+
+		case kXMLTokenBoolean:
+			object = CFRetain((token.number == 0) ? kCFBooleanFalse : kCFBooleanTrue);
+			break;
+
+		case kXMLTokenIDRef:
+			object = retrieveObject(state, token.idref);
+			if (object) {
+				CFRetain(object);
+			} else {
+				error = "forward reference detected";
+			}
+			break;
+		}
+		if (!object) break;
+
+		// done when the outermost object is complete, the yacc parser
+		// doesn't look beyond it either
+		if (!state->frameCount) return object;
+
+		// the first element becomes "elements" or "pairs" on the yacc
+		// parser's stack, a key is folded into its pair
+		frame = &state->frames[state->frameCount - 1];
+		switch (frame->type) {
+		case kXMLTokenDictionaryStart:
+			CFDictionarySetValue((CFMutableDictionaryRef) frame->object, frame->key, object);
+			CFRelease(frame->key);
+			frame->key = 0;
+			state->stackDepth--;
+			break;
+		case kXMLTokenArrayStart:
+			CFArrayAppendValue((CFMutableArrayRef) frame->object, object);
+			break;
+		default:
+			CFSetAddValue((CFMutableSetRef) frame->object, object);
+			break;
+		}
+		CFRelease(object);
+		if (!frame->hasElements) {
+			frame->hasElements = true;
+			state->stackDepth++;
+		}
+
+		type = xmlLex(state, &token);
+	}
+
+	xmlError(state, error);
+	return 0;
+}
+
+__private_extern__ CFTypeRef
+_IOCFUnserializeXML(const char		*buffer,
+                    CFAllocatorRef	allocator,
+                    CFOptionFlags	options,
+                    CFStringRef		*errorString)
+{
+	CFTypeRef object;
+	xml_state_t state;
+
+	// just in case
+	if (errorString) *errorString = NULL;
+
+	if ((!buffer) || options) return 0;
+
+	bzero(&state, sizeof(state));
+	state.parseBuffer = buffer;
+	state.lineNumber = 1;
+	state.stackDepth = 1;
+	state.allocator = allocator;
+	state.errorString = errorString;
+
+	object = parseObject(&state);
+
+	// anything still open is left over from an error
+	while (state.frameCount--) {
+		xml_frame_t *frame = &state.frames[state.frameCount];
+
+		CFRelease(frame->object);
+		if (frame->key) CFRelease(frame->key);
+	}
+	if (state.frames) free(state.frames);
+	if (state.scratch) free(state.scratch);
+	while (state.tagCapacity--) {
+		if (state.tags[state.tagCapacity]) CFRelease(state.tags[state.tagCapacity]);
+	}
+	if (state.tags) free(state.tags);
+	if (state.sparseTags) CFRelease(state.sparseTags);
+
+	return object;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+
+compares small method calls made one round trip each with the same calls
+sent through an IOConnectBatch ring
+
+to build:
+
+cc -O2 -framework IOKit IOConnectBatchBench.c -o IOConnectBatchBench
+
+to run:
+
+./IOConnectBatchBench
+./IOConnectBatchBench 100000 64
+
+The arguments are the number of calls and the calls per batch. The user
+client is a mock: a child process that shares the ring memory and serves it
+with IOConnectBatchRingServe() each time a byte arrives on a pipe, answering
+with another byte. It uses nothing but POSIX, so the protocol can be tested
+and timed apart from the kernel. Each mock call returns its scalar inputs
+plus one, and the results are checked.
+
+*/
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOKitLibPrivate.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define kRingSize	(sizeof(IOConnectBatchRing) + 128 * 1024)
+
+typedef struct {
+	int	request;
+	int	reply;
+} mock_t;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static IOReturn
+handler(void * context, uint32_t selector,
+	const uint64_t * input, uint32_t inputCnt,
+	const void * inputStruct, uint32_t inputStructCnt,
+	uint64_t * output, uint32_t * outputCnt,
+	void * outputStruct, uint32_t * outputStructCnt)
+{
+	uint32_t idx;
+
+	if (*outputCnt > inputCnt) *outputCnt = inputCnt;
+	for (idx = 0; idx < *outputCnt; idx++) output[idx] = input[idx] + selector;
+	*outputStructCnt = 0;
+
+	return (kIOReturnSuccess);
+}
+
+static void
+serve(void * ring, int request, int reply)
+{
+	char byte;
+
+	while (1 == read(request, &byte, 1)) {
+		byte = (kIOReturnSuccess == IOConnectBatchRingServe(ring, kRingSize, &handler, NULL));
+		if (1 != write(reply, &byte, 1)) break;
+	}
+	_exit(0);
+}
+
+static kern_return_t
+transport(void * ring, void * context)
+{
+	mock_t * mock = (mock_t *) context;
+	char     byte = 0;
+
+	if ((1 != write(mock->request, &byte, 1)) || (1 != read(mock->reply, &byte, 1)))
+		return (kIOReturnNotResponding);
+
+	return (byte ? kIOReturnSuccess : kIOReturnBadArgument);
+}
+
+// calls in batches of perBatch, a batch of one being a plain round trip
+static double
+run(IOConnectBatchRef batch, long calls, long perBatch, long * errors)
+{
+	uint64_t input[2], output[2];
+	uint32_t outputCnt, index;
+	uint64_t start;
+	long	 call, done, idx;
+
+	start = now();
+	for (call = 0; call < calls; call += done) {
+		done = ((calls - call) < perBatch) ? (calls - call) : perBatch;
+		for (idx = 0; idx < done; idx++) {
+			input[0] = call + idx;
+			input[1] = ~input[0];
+			IOConnectBatchAppend(batch, 1, input, 2, NULL, 0, 2, 0, NULL);
+		}
+		if (kIOReturnSuccess != IOConnectBatchSubmit(batch)) (*errors)++;
+		for (index = 0; index < done; index++) {
+			outputCnt = 2;
+			if ((kIOReturnSuccess != IOConnectBatchGetResult(batch, index, output, &outputCnt, NULL, NULL))
+			 || (2 != outputCnt) || (output[0] != (uint64_t) (call + index + 1))) (*errors)++;
+		}
+	}
+
+	return ((double) (now() - start) / calls);
+}
+
+int
+main(int argc, char **argv)
+{
+	IOConnectBatchRef batch;
+	mock_t		  mock;
+	void *		  ring;
+	int		  request[2], reply[2];
+	pid_t		  child;
+	long		  calls = 100000, perBatch = 64, errors = 0;
+	double		  one, all;
+
+	if (argc > 1) calls    = strtol(argv[1], NULL, 0);
+	if (argc > 2) perBatch = strtol(argv[2], NULL, 0);
+	if ((calls <= 0) || (perBatch <= 0)) {
+		printf("usage: %s [calls] [calls per batch]\n", argv[0]);
+		return (1);
+	}
+
+	ring = mmap(NULL, kRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if ((MAP_FAILED == ring) || (kIOReturnSuccess != IOConnectBatchRingInitialize(ring, kRingSize))) {
+		printf("can't make the ring\n");
+		return (1);
+	}
+	if (pipe(request) || pipe(reply)) return (1);
+
+	child = fork();
+	if (child < 0) return (1);
+	if (!child) {
+		close(request[1]);
+		close(reply[0]);
+		serve(ring, request[0], reply[1]);
+	}
+	close(request[0]);
+	close(reply[1]);
+	mock.request = request[1];
+	mock.reply   = reply[0];
+
+	if (kIOReturnSuccess != IOConnectBatchCreateWithTransport(ring, kRingSize, &transport, &mock, &batch)) {
+		printf("can't make the batch\n");
+		return (1);
+	}
+
+	one = run(batch, calls, 1, &errors);
+	all = run(batch, calls, perBatch, &errors);
+
+	printf("%ld calls, %ld per batch\n", calls, perBatch);
+	printf("one at a time %8.1f ns/call\n", one);
+	printf("batched       %8.1f ns/call %5.2fx\n", all, one / all);
+	if (errors) printf("%ld errors\n", errors);
+
+	IOConnectBatchRelease(batch);
+	close(mock.request);
+	close(mock.reply);
+	waitpid(child, NULL, 0);
+	munmap(ring, kRingSize);
+
+	return (errors ? 1 : 0);
+}
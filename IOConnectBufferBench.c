@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+
+compares large structure outputs of 8KB to 4MB read into a fresh buffer on
+each call with the same outputs read into a buffer registered with an
+IOConnectBufferPool
+
+to build:
+
+cc -O2 -framework IOKit IOConnectBufferBench.c -o IOConnectBufferBench
+
+to run:
+
+./IOConnectBufferBench
+./IOConnectBufferBench 200
+./IOConnectBufferBench 200 AppleFooUserClientService 3
+./IOConnectBufferBench 200 AppleFooUserClientService 3 1
+
+The first argument is the number of calls at each size. With no service the
+user client is a mock that fills the output buffer, which times what the
+kernel's wiring of a buffer costs: faulting in and zero filling pages that a
+registered buffer already has resident. Given the class of a service, its
+user client is opened and the selector called with the output size as its
+only scalar input; with a memory type as well, the registered buffer is
+mapped from the user client rather than wired in the caller.
+
+*/
+
+#include <IOKit/IOKitLib.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define kMinSize	(8 * 1024)
+#define kMaxSize	(4 * 1024 * 1024)
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static kern_return_t
+mockCall(void * output, size_t size)
+{
+	memset(output, 0x5a, size);
+	return (kIOReturnSuccess);
+}
+
+// a fresh buffer each call, as callers reading into malloc'd memory have
+static double
+runFresh(io_connect_t connect, uint32_t selector, size_t size, long calls, long * errors)
+{
+	uint64_t start, input = size;
+	size_t	 outputSize;
+	void *	 buffer;
+	long	 call;
+
+	start = now();
+	for (call = 0; call < calls; call++) {
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (MAP_FAILED == buffer) {
+			(*errors)++;
+			continue;
+		}
+		outputSize = size;
+		if (kIOReturnSuccess != (connect
+		    ? IOConnectCallMethod(connect, selector, &input, 1, NULL, 0, NULL, NULL, buffer, &outputSize)
+		    : mockCall(buffer, size))) (*errors)++;
+		munmap(buffer, size);
+	}
+
+	return ((double) (now() - start) / calls);
+}
+
+static double
+runRegistered(IOConnectBufferPoolRef pool, uint32_t selector, uint32_t handle,
+	      void * address, size_t size, long calls, long * errors)
+{
+	uint64_t start, input = size;
+	size_t	 outputSize;
+	long	 call;
+
+	start = now();
+	for (call = 0; call < calls; call++) {
+		outputSize = size;
+		if (kIOReturnSuccess != (pool
+		    ? IOConnectCallMethodWithBuffers(pool, selector, &input, 1, kIOConnectBufferNone, 0, 0,
+						     NULL, NULL, handle, 0, &outputSize)
+		    : mockCall(address, size))) (*errors)++;
+	}
+
+	return ((double) (now() - start) / calls);
+}
+
+int
+main(int argc, char **argv)
+{
+	IOConnectBufferPoolRef	pool = NULL;
+	IOConnectBufferPoolStatistics stats;
+	io_service_t		service;
+	io_connect_t		connect = MACH_PORT_NULL;
+	uint32_t		selector = 0, memoryType = 0, handle = kIOConnectBufferNone;
+	boolean_t		mapped = false;
+	void *			buffer;
+	size_t			size, bufferSize;
+	long			calls = 200, errors = 0;
+	double			fresh, registered;
+
+	if (argc > 1) calls = strtol(argv[1], NULL, 0);
+	if (argc > 3) selector = (uint32_t) strtoul(argv[3], NULL, 0);
+	if (argc > 4) {
+		memoryType = (uint32_t) strtoul(argv[4], NULL, 0);
+		mapped	   = true;
+	}
+	if ((calls <= 0) || (argc == 3)) {
+		printf("usage: %s [calls] [service class selector [memory type]]\n", argv[0]);
+		return (1);
+	}
+
+	if (argc > 2) {
+		service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(argv[2]));
+		if (!service || (kIOReturnSuccess != IOServiceOpen(service, mach_task_self(), 0, &connect))) {
+			printf("can't open %s\n", argv[2]);
+			return (1);
+		}
+		IOObjectRelease(service);
+		if (kIOReturnSuccess != IOConnectBufferPoolCreate(connect, 0, &pool)) {
+			printf("can't make the pool\n");
+			return (1);
+		}
+	}
+
+	if (mapped) {
+		if (kIOReturnSuccess != IOConnectBufferPoolRegisterMemoryType(pool, memoryType, &handle, &buffer, &bufferSize)) {
+			printf("can't map memory type %u\n", memoryType);
+			return (1);
+		}
+	} else {
+		bufferSize = kMaxSize;
+		buffer	   = mmap(NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if ((MAP_FAILED == buffer)
+		 || (pool && (kIOReturnSuccess != IOConnectBufferPoolRegister(pool, buffer, bufferSize, &handle)))) {
+			printf("can't register the buffer\n");
+			return (1);
+		}
+		if (!pool) mlock(buffer, bufferSize);
+	}
+
+	printf("%ld calls per size, %s\n", calls, pool ? argv[2] : "mock user client");
+	printf("%10s %14s %14s\n", "size", "fresh ns/call", "registered");
+	for (size = kMinSize; (size <= kMaxSize) && (size <= bufferSize); size *= 2) {
+		fresh	   = runFresh(connect, selector, size, calls, &errors);
+		registered = runRegistered(pool, selector, handle, buffer, size, calls, &errors);
+		printf("%10zu %14.0f %14.0f %5.2fx %8.2f GB/s\n", size, fresh, registered,
+		       fresh / registered, size / registered);
+	}
+	if (errors) printf("%ld errors\n", errors);
+
+	if (pool) {
+		IOConnectBufferPoolGetStatistics(pool, &stats);
+		printf("%llu calls, %llu reuses, %llu bytes out, %llu bytes wired\n",
+		       stats.calls, stats.reuses, stats.outputBytes, stats.wiredBytes);
+		IOConnectBufferPoolRelease(pool);
+		IOServiceClose(connect);
+	}
+	if (!mapped) munmap(buffer, bufferSize);
+
+	return (errors ? 1 : 0);
+}
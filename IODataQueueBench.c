@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+
+compares draining an IODataQueue one entry at a time with IODataQueueDequeue
+against draining it in batches, copying with IODataQueueDequeueBatch and in
+place with IODataQueueDequeueBatchWithCallback, for entries of 16B to 4KB
+
+to build:
+
+cc -O2 -framework IOKit IODataQueueBench.c -o IODataQueueBench
+
+to run:
+
+./IODataQueueBench
+./IODataQueueBench 1000 64
+
+The arguments are the number of times the queue is filled and drained at
+each entry size, and the entries per batch. The queue is plain memory with
+no notification port, so only the queue protocol is timed. Each entry holds
+its sequence number, and the order is checked.
+
+*/
+
+#include <IOKit/IODataQueueClient.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define kQueueSize	(256 * 1024)
+#define kMaxBatch	256
+#define kMinEntry	16
+#define kMaxEntry	4096
+
+typedef struct {
+	uint32_t	next;
+	long		errors;
+} check_t;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint32_t
+fill(IODataQueueMemory * queue, uint32_t entrySize, uint32_t sequence)
+{
+	uint8_t	 data[kMaxEntry];
+	uint32_t count;
+
+	memset(data, 0x5a, entrySize);
+	for (count = 0; ; count++) {
+		memcpy(data, &sequence, sizeof(sequence));
+		if (kIOReturnSuccess != IODataQueueEnqueue(queue, data, entrySize)) break;
+		sequence++;
+	}
+
+	return (count);
+}
+
+static void
+callback(void * refcon, const void * data, uint32_t dataSize __unused)
+{
+	check_t * check = (check_t *) refcon;
+
+	if (memcmp(data, &check->next, sizeof(check->next))) check->errors++;
+	check->next++;
+}
+
+// mode 0 is one at a time, 1 batches copied out, 2 batches in place
+static double
+run(IODataQueueMemory * queue, int mode, uint32_t entrySize, long rounds, uint32_t perBatch, long * errors)
+{
+	static uint8_t	      buffers[kMaxBatch][kMaxEntry];
+	IODataQueueBatchEntry entries[kMaxBatch];
+	check_t		      check = { 0, 0 };
+	uint64_t	      elapsed = 0, start;
+	uint32_t	      count, filled, done, idx, size;
+	long		      round, total = 0;
+
+	for (round = 0; round < rounds; round++) {
+		filled = fill(queue, entrySize, check.next);
+		start  = now();
+		for (done = 0; done < filled; done += count) {
+			if (0 == mode) {
+				// into the same buffers a batch would use
+				idx   = done % perBatch;
+				size  = kMaxEntry;
+				count = (kIOReturnSuccess == IODataQueueDequeue(queue, buffers[idx], &size));
+				if (count && memcmp(buffers[idx], &check.next, sizeof(check.next))) check.errors++;
+				check.next += count;
+			} else if (1 == mode) {
+				for (idx = 0; idx < perBatch; idx++) {
+					entries[idx].data     = buffers[idx];
+					entries[idx].dataSize = kMaxEntry;
+				}
+				count = perBatch;
+				if (kIOReturnSuccess != IODataQueueDequeueBatch(queue, entries, &count)) count = 0;
+				for (idx = 0; idx < count; idx++, check.next++) {
+					if (memcmp(buffers[idx], &check.next, sizeof(check.next))) check.errors++;
+				}
+			} else {
+				count = perBatch;
+				if (kIOReturnSuccess != IODataQueueDequeueBatchWithCallback(queue, &count, &callback, &check)) count = 0;
+			}
+			if (!count) {
+				check.errors++;
+				break;
+			}
+		}
+		elapsed += now() - start;
+		total	+= filled;
+	}
+	*errors += check.errors;
+
+	return (total ? ((double) elapsed / total) : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	IODataQueueMemory * queue;
+	uint32_t	    entrySize, perBatch = 64;
+	long		    rounds = 1000, errors = 0;
+	double		    one, copied, inPlace;
+
+	if (argc > 1) rounds   = strtol(argv[1], NULL, 0);
+	if (argc > 2) perBatch = (uint32_t) strtoul(argv[2], NULL, 0);
+	if ((rounds <= 0) || !perBatch || (perBatch > kMaxBatch)) {
+		printf("usage: %s [rounds] [entries per batch, at most %d]\n", argv[0], kMaxBatch);
+		return (1);
+	}
+
+	// the appendix after the queue has no notification port
+	queue = calloc(1, DATA_QUEUE_MEMORY_HEADER_SIZE + kQueueSize + DATA_QUEUE_MEMORY_APPENDIX_SIZE);
+	if (!queue) return (1);
+	queue->queueSize = kQueueSize;
+
+	printf("%ld rounds, %u per batch\n", rounds, perBatch);
+	printf("%6s %12s %12s %12s\n", "size", "ns/entry", "batch copy", "batch in place");
+	for (entrySize = kMinEntry; entrySize <= kMaxEntry; entrySize *= 2) {
+		one	= run(queue, 0, entrySize, rounds, perBatch, &errors);
+		copied	= run(queue, 1, entrySize, rounds, perBatch, &errors);
+		inPlace = run(queue, 2, entrySize, rounds, perBatch, &errors);
+		printf("%6u %12.1f %7.1f %4.2fx %7.1f %4.2fx\n", entrySize, one,
+		       copied, one / copied, inPlace, one / inPlace);
+	}
+	if (errors) printf("%ld errors\n", errors);
+
+	free(queue);
+
+	return (errors ? 1 : 0);
+}
@@ -22,16 +22,199 @@
  */
 
 #include "IODataQueueClientPrivate.h"
+#if __MACH__
 #include <IOKit/IODataQueueShared.h>
 
 #include <mach/mach.h>
 #include <IOKit/OSMessageNotification.h>
 #include <libkern/OSAtomic.h>
+#endif /* __MACH__ */
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 
 Boolean IODataQueueDataAvailable(IODataQueueMemory *dataQueue)
 {
-    return (dataQueue && (dataQueue->head != dataQueue->tail));
+    return (dataQueue && (__c11_atomic_load((_Atomic UInt32 *)&dataQueue->head, __ATOMIC_RELAXED) !=
+                          __c11_atomic_load((_Atomic UInt32 *)&dataQueue->tail, __ATOMIC_RELAXED)));
+}
+
+#define kIODataQueueTelemetryMax    32
+
+static IODataQueueTelemetry *   __ioDataQueueTelemetry[kIODataQueueTelemetryMax];
+static uint32_t                 __ioDataQueueTelemetryCount;
+static pthread_mutex_t          __ioDataQueueTelemetryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static IODataQueueTelemetry *
+__IODataQueueGetTelemetry(IODataQueueMemory *dataQueue)
+{
+    IODataQueueTelemetry *  telemetry;
+    uint32_t                idx;
+    
+    // The common case, with no telemetry anywhere, is a single load
+    if (!__c11_atomic_load((_Atomic uint32_t *)&__ioDataQueueTelemetryCount, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    
+    for (idx = 0; idx < kIODataQueueTelemetryMax; idx++) {
+        telemetry = __c11_atomic_load((_Atomic(IODataQueueTelemetry *) *)&__ioDataQueueTelemetry[idx], __ATOMIC_ACQUIRE);
+        if (telemetry && (telemetry->dataQueue == dataQueue)) {
+            return telemetry;
+        }
+    }
+    
+    return NULL;
+}
+
+static inline uint64_t
+__IODataQueueTelemetryRead(uint64_t *counter)
+{
+    return __c11_atomic_load((_Atomic uint64_t *)counter, __ATOMIC_RELAXED);
+}
+
+// Each counter is only written by the queue's one producer or its one consumer,
+// so a relaxed load and store, without a locked add, keeps it exact
+static inline void
+__IODataQueueTelemetryAdd(uint64_t *counter, uint64_t value)
+{
+    __c11_atomic_store((_Atomic uint64_t *)counter, __IODataQueueTelemetryRead(counter) + value, __ATOMIC_RELAXED);
+}
+
+// Bytes from head to tail, not counting any unused space at the end before a wrap
+static uint64_t
+__IODataQueueUsedBytes(UInt32 head, UInt32 tail, uint64_t queueSize)
+{
+    return (tail >= head) ? (tail - head) : (queueSize - head + tail);
+}
+
+static void
+__IODataQueueTelemetryEnqueue(IODataQueueTelemetry *telemetry, uint32_t dataSize, bool wrapped, uint64_t used)
+{
+    __IODataQueueTelemetryAdd(&telemetry->enqueues, 1);
+    __IODataQueueTelemetryAdd(&telemetry->enqueueBytes, dataSize);
+    if (wrapped) {
+        __IODataQueueTelemetryAdd(&telemetry->wraps, 1);
+    }
+    if (used > __IODataQueueTelemetryRead(&telemetry->highWater)) {
+        __c11_atomic_store((_Atomic uint64_t *)&telemetry->highWater, used, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+__IODataQueueTelemetryDequeue(IODataQueueTelemetry *telemetry, uint32_t dataSize)
+{
+    uint32_t bucket = 0;
+    
+    if (dataSize > 16) {
+        bucket = 32 - __builtin_clz(dataSize - 1) - 4;
+        if (bucket >= kIODataQueueTelemetrySizeBuckets) {
+            bucket = kIODataQueueTelemetrySizeBuckets - 1;
+        }
+    }
+    
+    __IODataQueueTelemetryAdd(&telemetry->dequeues, 1);
+    __IODataQueueTelemetryAdd(&telemetry->dequeueBytes, dataSize);
+    __IODataQueueTelemetryAdd(&telemetry->dequeueSizes[bucket], 1);
+}
+
+IOReturn
+IODataQueueTelemetryStart(IODataQueueMemory *dataQueue, IODataQueueTelemetry *telemetry)
+{
+    IOReturn    ret     = kIOReturnNoResources;
+    uint32_t    slot    = kIODataQueueTelemetryMax;
+    uint32_t    idx;
+    
+    if (!dataQueue || !telemetry) {
+        return kIOReturnBadArgument;
+    }
+    
+    pthread_mutex_lock(&__ioDataQueueTelemetryLock);
+    for (idx = 0; idx < kIODataQueueTelemetryMax; idx++) {
+        if (!__ioDataQueueTelemetry[idx]) {
+            if (slot == kIODataQueueTelemetryMax) {
+                slot = idx;
+            }
+        } else if ((__ioDataQueueTelemetry[idx]->dataQueue == dataQueue) || (__ioDataQueueTelemetry[idx] == telemetry)) {
+            slot = kIODataQueueTelemetryMax;
+            ret  = kIOReturnExclusiveAccess;
+            break;
+        }
+    }
+    if (slot < kIODataQueueTelemetryMax) {
+        memset(telemetry, 0, sizeof(*telemetry));
+        telemetry->dataQueue = dataQueue;
+        telemetry->queueSize = dataQueue->queueSize;
+        
+        // The counters are zeroed before the release store makes them visible
+        __c11_atomic_store((_Atomic(IODataQueueTelemetry *) *)&__ioDataQueueTelemetry[slot], telemetry, __ATOMIC_RELEASE);
+        __c11_atomic_fetch_add((_Atomic uint32_t *)&__ioDataQueueTelemetryCount, 1, __ATOMIC_RELAXED);
+        ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&__ioDataQueueTelemetryLock);
+    
+    return ret;
+}
+
+IOReturn
+IODataQueueTelemetryStop(IODataQueueTelemetry *telemetry)
+{
+    IOReturn    ret = kIOReturnNotFound;
+    uint32_t    idx;
+    
+    if (!telemetry) {
+        return kIOReturnBadArgument;
+    }
+    
+    pthread_mutex_lock(&__ioDataQueueTelemetryLock);
+    for (idx = 0; idx < kIODataQueueTelemetryMax; idx++) {
+        if (__ioDataQueueTelemetry[idx] == telemetry) {
+            __c11_atomic_store((_Atomic(IODataQueueTelemetry *) *)&__ioDataQueueTelemetry[idx], NULL, __ATOMIC_RELAXED);
+            __c11_atomic_fetch_sub((_Atomic uint32_t *)&__ioDataQueueTelemetryCount, 1, __ATOMIC_RELAXED);
+            ret = kIOReturnSuccess;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&__ioDataQueueTelemetryLock);
+    
+    return ret;
+}
+
+void
+IODataQueueTelemetryGetSnapshot(IODataQueueTelemetry *telemetry, IODataQueueTelemetry *snapshot)
+{
+    IODataQueueMemory * dataQueue;
+    UInt32              head;
+    UInt32              tail;
+    uint32_t            idx;
+    
+    if (!telemetry || !snapshot) {
+        return;
+    }
+    
+    dataQueue = telemetry->dataQueue;
+    
+    snapshot->dataQueue     = dataQueue;
+    snapshot->queueSize     = telemetry->queueSize;
+    snapshot->occupancy     = 0;
+    snapshot->highWater     = __IODataQueueTelemetryRead(&telemetry->highWater);
+    snapshot->enqueues      = __IODataQueueTelemetryRead(&telemetry->enqueues);
+    snapshot->enqueueBytes  = __IODataQueueTelemetryRead(&telemetry->enqueueBytes);
+    snapshot->overruns      = __IODataQueueTelemetryRead(&telemetry->overruns);
+    snapshot->wraps         = __IODataQueueTelemetryRead(&telemetry->wraps);
+    snapshot->dequeues      = __IODataQueueTelemetryRead(&telemetry->dequeues);
+    snapshot->dequeueBytes  = __IODataQueueTelemetryRead(&telemetry->dequeueBytes);
+    for (idx = 0; idx < kIODataQueueTelemetrySizeBuckets; idx++) {
+        snapshot->dequeueSizes[idx] = __IODataQueueTelemetryRead(&telemetry->dequeueSizes[idx]);
+    }
+    
+    if (dataQueue) {
+        head = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->head, __ATOMIC_RELAXED);
+        tail = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->tail, __ATOMIC_RELAXED);
+        if ((head <= telemetry->queueSize) && (tail <= telemetry->queueSize)) {
+            snapshot->occupancy = __IODataQueueUsedBytes(head, tail, telemetry->queueSize);
+        }
+    }
 }
 
 IODataQueueEntry *__IODataQueuePeek(IODataQueueMemory *dataQueue, uint64_t qSize, size_t *entrySize)
@@ -118,6 +301,7 @@ __IODataQueueDequeue(IODataQueueMemory *dataQueue, uint64_t qSize, void *data, u
     UInt32              headOffset      = 0;
     UInt32              tailOffset      = 0;
     UInt32              newHeadOffset   = 0;
+    IODataQueueTelemetry * telemetry    = 0;
     
     if (!dataQueue || (data && !dataSize)) {
         return kIOReturnBadArgument;
@@ -191,6 +375,10 @@ __IODataQueueDequeue(IODataQueueMemory *dataQueue, uint64_t qSize, void *data, u
         __c11_atomic_thread_fence(__ATOMIC_SEQ_CST);
     }
     
+    if ((telemetry = __IODataQueueGetTelemetry(dataQueue))) {
+        __IODataQueueTelemetryDequeue(telemetry, entrySize);
+    }
+    
     return retVal;
 }
 
@@ -205,8 +393,269 @@ IOReturn _IODataQueueDequeue(IODataQueueMemory *dataQueue, uint64_t queueSize, v
     return __IODataQueueDequeue(dataQueue, queueSize, data, dataSize);
 }
 
+// Finds the entry at headOffset following the wrap rules of __IODataQueueDequeue,
+// and the head offset past it. Returns NULL if the entry is not valid.
+static IODataQueueEntry *
+__IODataQueueEntryAt(IODataQueueMemory *dataQueue, UInt32 queueSize, UInt32 headOffset, UInt32 *entrySize, UInt32 *newHeadOffset)
+{
+    IODataQueueEntry *  entry       = 0;
+    IODataQueueEntry *  head        = 0;
+    UInt32              headSize    = 0;
+    
+    if (headOffset > queueSize) {
+        return NULL;
+    }
+    
+    head         = (IODataQueueEntry *)((char *)dataQueue->queue + headOffset);
+    headSize     = head->size;
+    
+    if ((headOffset > UINT32_MAX - DATA_QUEUE_ENTRY_HEADER_SIZE) ||
+        (headOffset + DATA_QUEUE_ENTRY_HEADER_SIZE > queueSize) ||
+        (headOffset + DATA_QUEUE_ENTRY_HEADER_SIZE > UINT32_MAX - headSize) ||
+        (headOffset + headSize + DATA_QUEUE_ENTRY_HEADER_SIZE > queueSize)) {
+        entry           = dataQueue->queue;
+        *entrySize      = entry->size;
+        if ((*entrySize > UINT32_MAX - DATA_QUEUE_ENTRY_HEADER_SIZE) ||
+            (*entrySize + DATA_QUEUE_ENTRY_HEADER_SIZE > queueSize)) {
+            return NULL;
+        }
+        *newHeadOffset  = *entrySize + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    } else {
+        entry           = head;
+        *entrySize      = headSize;
+        *newHeadOffset  = headOffset + headSize + DATA_QUEUE_ENTRY_HEADER_SIZE;
+    }
+    
+    return entry;
+}
+
+static void
+__IODataQueuePublishHead(IODataQueueMemory *dataQueue, UInt32 headOffset, UInt32 tailOffset)
+{
+    __c11_atomic_store((_Atomic UInt32 *)&dataQueue->head, headOffset, __ATOMIC_RELEASE);
+    
+    if (headOffset == tailOffset) {
+        // As in __IODataQueueDequeue, pairs with the enqueuer's fence
+        __c11_atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+// Returns false to stop the walk before index, which is then not consumed.
+typedef bool (*IODataQueueWalkFunction)(void *context, uint32_t index, IODataQueueEntry *entry, uint32_t entrySize);
+
+static IOReturn
+__IODataQueueWalk(IODataQueueMemory *dataQueue, uint64_t qSize, uint32_t *entryCount, bool consume, IODataQueueWalkFunction function, void *context)
+{
+    IODataQueueEntry *  entry           = 0;
+    UInt32              entrySize       = 0;
+    UInt32              headOffset      = 0;
+    UInt32              tailOffset      = 0;
+    UInt32              newHeadOffset   = 0;
+    UInt32              queueSize       = 0;
+    uint32_t            count           = 0;
+    bool                refused         = false;
+    IODataQueueTelemetry * telemetry    = 0;
+    
+    if (!dataQueue || !entryCount) {
+        return kIOReturnBadArgument;
+    }
+    
+    // Read head and tail once for the whole batch
+    headOffset = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->head, __ATOMIC_RELAXED);
+    tailOffset = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->tail, __ATOMIC_ACQUIRE);
+    queueSize  = qSize ? qSize : dataQueue->queueSize;
+    
+    if (headOffset == tailOffset) {
+        *entryCount = 0;
+        return kIOReturnUnderrun;
+    }
+    
+    if (consume) {
+        telemetry = __IODataQueueGetTelemetry(dataQueue);
+    }
+    
+    while ((count < *entryCount) && (headOffset != tailOffset)) {
+        entry = __IODataQueueEntryAt(dataQueue, queueSize, headOffset, &entrySize, &newHeadOffset);
+        if (!entry) {
+            break;
+        }
+        if (function && !(*function)(context, count, entry, entrySize)) {
+            refused = true;
+            break;
+        }
+        if (telemetry) {
+            __IODataQueueTelemetryDequeue(telemetry, entrySize);
+        }
+        headOffset = newHeadOffset;
+        count++;
+    }
+    
+    *entryCount = count;
+    if (!count) {
+        // the first entry was bad, or the caller had no room for it
+        return refused ? kIOReturnNoSpace : kIOReturnError;
+    }
+    
+    if (consume) {
+        // Publish the new head once for the whole batch
+        __IODataQueuePublishHead(dataQueue, headOffset, tailOffset);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+static bool
+__IODataQueuePeekEntry(void *context, uint32_t index, IODataQueueEntry *entry, uint32_t entrySize __unused)
+{
+    ((IODataQueueEntry **)context)[index] = entry;
+    return true;
+}
+
+static bool
+__IODataQueueCopyEntry(void *context, uint32_t index, IODataQueueEntry *entry, uint32_t entrySize)
+{
+    IODataQueueBatchEntry * batchEntry = &((IODataQueueBatchEntry *)context)[index];
+    
+    if (entrySize > batchEntry->dataSize) {
+        // not enough space, report the size needed
+        batchEntry->dataSize = entrySize;
+        return false;
+    }
+    memcpy(batchEntry->data, &(entry->data), entrySize);
+    batchEntry->dataSize = entrySize;
+    return true;
+}
+
+typedef struct {
+    IODataQueueBatchCallback    callback;
+    void *                      refcon;
+} IODataQueueCallbackContext;
+
+static bool
+__IODataQueueCallEntry(void *context, uint32_t index __unused, IODataQueueEntry *entry, uint32_t entrySize)
+{
+    IODataQueueCallbackContext * callbackContext = (IODataQueueCallbackContext *)context;
+    
+    (*callbackContext->callback)(callbackContext->refcon, &(entry->data), entrySize);
+    return true;
+}
+
+IOReturn
+IODataQueuePeekBatch(IODataQueueMemory *dataQueue, IODataQueueEntry **entries, uint32_t *entryCount)
+{
+    return _IODataQueuePeekBatch(dataQueue, 0, entries, entryCount);
+}
+
+IOReturn
+_IODataQueuePeekBatch(IODataQueueMemory *dataQueue, uint64_t queueSize, IODataQueueEntry **entries, uint32_t *entryCount)
+{
+    if (!entries) {
+        return kIOReturnBadArgument;
+    }
+    return __IODataQueueWalk(dataQueue, queueSize, entryCount, false, &__IODataQueuePeekEntry, entries);
+}
+
+IOReturn
+IODataQueueDequeueBatch(IODataQueueMemory *dataQueue, IODataQueueBatchEntry *entries, uint32_t *entryCount)
+{
+    return __IODataQueueWalk(dataQueue, 0, entryCount, true, entries ? &__IODataQueueCopyEntry : NULL, entries);
+}
+
+IOReturn
+IODataQueueDequeueBatchWithCallback(IODataQueueMemory *dataQueue, uint32_t *entryCount, IODataQueueBatchCallback callback, void *refcon)
+{
+    return _IODataQueueDequeueBatchWithCallback(dataQueue, 0, entryCount, callback, refcon);
+}
+
+IOReturn
+_IODataQueueDequeueBatchWithCallback(IODataQueueMemory *dataQueue, uint64_t queueSize, uint32_t *entryCount, IODataQueueBatchCallback callback, void *refcon)
+{
+    IODataQueueCallbackContext context = { callback, refcon };
+    
+    if (!callback) {
+        return kIOReturnBadArgument;
+    }
+    return __IODataQueueWalk(dataQueue, queueSize, entryCount, true, &__IODataQueueCallEntry, &context);
+}
+
+IOReturn
+IODataQueueIteratorBegin(IODataQueueMemory *dataQueue, IODataQueueIterator *iterator)
+{
+    return _IODataQueueIteratorBegin(dataQueue, 0, iterator);
+}
+
+IOReturn
+_IODataQueueIteratorBegin(IODataQueueMemory *dataQueue, uint64_t queueSize, IODataQueueIterator *iterator)
+{
+    if (!dataQueue || !iterator) {
+        return kIOReturnBadArgument;
+    }
+    
+    iterator->dataQueue = dataQueue;
+    iterator->queueSize = queueSize ? queueSize : dataQueue->queueSize;
+    iterator->head      = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->head, __ATOMIC_RELAXED);
+    iterator->tail      = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->tail, __ATOMIC_ACQUIRE);
+    iterator->next      = iterator->head;
+    
+    return (iterator->head == iterator->tail) ? kIOReturnUnderrun : kIOReturnSuccess;
+}
+
+const void *
+IODataQueueIteratorNext(IODataQueueIterator *iterator, uint32_t *dataSize)
+{
+    IODataQueueEntry *  entry           = 0;
+    UInt32              entrySize       = 0;
+    UInt32              newHeadOffset   = 0;
+    
+    if (!iterator || !iterator->dataQueue || (iterator->next == iterator->tail)) {
+        return NULL;
+    }
+    
+    entry = __IODataQueueEntryAt(iterator->dataQueue, iterator->queueSize, iterator->next, &entrySize, &newHeadOffset);
+    if (!entry) {
+        // a bad entry ends the iteration, and is never committed
+        return NULL;
+    }
+    
+    iterator->next = newHeadOffset;
+    if (dataSize) {
+        *dataSize = entrySize;
+    }
+    
+    return &(entry->data);
+}
+
+IOReturn
+IODataQueueIteratorCommit(IODataQueueIterator *iterator)
+{
+    IODataQueueTelemetry *  telemetry       = 0;
+    UInt32                  headOffset      = 0;
+    UInt32                  newHeadOffset   = 0;
+    UInt32                  entrySize       = 0;
+    
+    if (!iterator || !iterator->dataQueue) {
+        return kIOReturnBadArgument;
+    }
+    
+    if (iterator->next != iterator->head) {
+        if ((telemetry = __IODataQueueGetTelemetry(iterator->dataQueue))) {
+            // Count the entries IODataQueueIteratorNext already checked
+            for (headOffset = iterator->head; headOffset != iterator->next; headOffset = newHeadOffset) {
+                if (!__IODataQueueEntryAt(iterator->dataQueue, iterator->queueSize, headOffset, &entrySize, &newHeadOffset)) {
+                    break;
+                }
+                __IODataQueueTelemetryDequeue(telemetry, entrySize);
+            }
+        }
+        iterator->head = iterator->next;
+        __IODataQueuePublishHead(iterator->dataQueue, iterator->head, iterator->tail);
+    }
+    
+    return kIOReturnSuccess;
+}
+
 static IOReturn
-__IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, mach_msg_header_t *msgh, uint32_t dataSize, void *data, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options)
+__IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, IODataQueueClientNotifyCallback notify, void * notifyContext, uint32_t dataSize, void *data, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options)
 {
     UInt32              head;
     UInt32              tail;
@@ -217,6 +666,8 @@ __IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, mach_msg_head
     IODataQueueEntry *  entry;
     bool                suppressNotify = (options & kIODataQueueDeliveryNotificationSuppress);
     bool                forceNotify = (options & kIODataQueueDeliveryNotificationForce);
+    bool                wrapped     = false;
+    IODataQueueTelemetry * telemetry = __IODataQueueGetTelemetry(dataQueue);
     
     // Force a single read of head and tail
     tail = __c11_atomic_load((_Atomic UInt32 *)&dataQueue->tail, __ATOMIC_RELAXED);
@@ -276,6 +727,7 @@ __IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, mach_msg_head
             }
 
             newTail = entrySize;
+            wrapped = true;
         }
         else
         {
@@ -312,6 +764,10 @@ __IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, mach_msg_head
         // Publish the data we just enqueued
         __c11_atomic_store((_Atomic UInt32 *)&dataQueue->tail, newTail, __ATOMIC_RELEASE);
         
+        if (telemetry) {
+            __IODataQueueTelemetryEnqueue(telemetry, dataSize, wrapped, __IODataQueueUsedBytes(head, newTail, queueSize));
+        }
+        
         if (tail != head) {
             //
             // The memory barrier below pairs with the one in dequeue
@@ -328,42 +784,181 @@ __IODataQueueEnqueue(IODataQueueMemory *dataQueue, uint64_t qSize, mach_msg_head
         
         if (forceNotify || (!suppressNotify && tail == head)) {
             // Send notification (via mach message) that data is now available.
-            retVal = _IODataQueueSendDataAvailableNotification(dataQueue, msgh);
+            retVal = notify ? (*notify)(dataQueue, notifyContext) : kIOReturnSuccess;
         }
 #if TARGET_OS_SIMULATOR
         else
         {
-            retVal = _IODataQueueSendDataAvailableNotification(dataQueue, msgh);
+            retVal = notify ? (*notify)(dataQueue, notifyContext) : kIOReturnSuccess;
         }
 #endif
     }
 
     else if ( retVal == kIOReturnOverrun ) {
+        if (telemetry) {
+            __IODataQueueTelemetryAdd(&telemetry->overruns, 1);
+        }
         // Send extra data available notification, this will fail and we will
         // get a send possible notification when the client starts responding
-        (void) _IODataQueueSendDataAvailableNotification(dataQueue, msgh);
+        if (notify) {
+            (void) (*notify)(dataQueue, notifyContext);
+        }
     }
 
     return retVal;
 }
 
+IOReturn
+_IODataQueueEnqueueWithNotifier(IODataQueueMemory *dataQueue, uint64_t queueSize, uint32_t dataSize, void *data, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options, IODataQueueClientNotifyCallback notify, void * notifyContext)
+{
+    return __IODataQueueEnqueue(dataQueue, queueSize, notify, notifyContext, dataSize, data, callback, refcon, options);
+}
+
+static uint64_t
+__IODataQueueNow(void)
+{
+#if __MACH__
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+static inline void
+__IODataQueuePause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__arm64__) || defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+#define kIODataQueueWaitMinSpin     1000ULL     // ns
+#define kIODataQueueWaitMaxPauses   64
+
+void
+IODataQueueWaiterInitialize(IODataQueueWaiter *waiter, uint64_t maxSpin)
+{
+    if (!waiter) {
+        return;
+    }
+    
+    memset(waiter, 0, sizeof(*waiter));
+    waiter->maxSpin              = maxSpin;
+    waiter->statistics.spinLimit = maxSpin;
+}
+
+void
+IODataQueueWaiterGetStatistics(IODataQueueWaiter *waiter, IODataQueueWaitStatistics *statistics)
+{
+    if (waiter && statistics) {
+        *statistics = waiter->statistics;
+    }
+}
+
+IOReturn
+_IODataQueueWaitAdaptive(IODataQueueMemory *dataQueue, IODataQueueWaiter *waiter, IODataQueueClientBlockCallback block, void *context)
+{
+    IOReturn    ret         = kIOReturnSuccess;
+    uint64_t    start       = 0;
+    uint64_t    now         = 0;
+    uint64_t    waited      = 0;
+    uint64_t    limit       = 0;
+    uint32_t    pauses      = 1;
+    uint32_t    idx;
+    bool        available   = false;
+    bool        blocked     = false;
+    
+    if (!dataQueue || !waiter || !block) {
+        return kIOReturnBadArgument;
+    }
+    
+    waiter->statistics.waits++;
+    start = now = __IODataQueueNow();
+    limit = waiter->statistics.spinLimit;
+    
+    // Poll the tail, pausing longer each time, then yielding, until the spin limit
+    while (!(available = IODataQueueDataAvailable(dataQueue))) {
+        now = __IODataQueueNow();
+        if (now - start >= limit) {
+            break;
+        }
+        if (pauses < kIODataQueueWaitMaxPauses) {
+            for (idx = 0; idx < pauses; idx++) {
+                __IODataQueuePause();
+            }
+            pauses *= 2;
+        } else {
+            sched_yield();
+        }
+    }
+    waiter->statistics.spinTime += now - start;
+    
+    if (available) {
+        waiter->statistics.spinHits++;
+    } else {
+        // The producer sends a notification when it finds the queue empty,
+        // which one sent for an entry found while spinning may already have.
+        waiter->statistics.blocks++;
+        while (!IODataQueueDataAvailable(dataQueue)) {
+            if (blocked) {
+                waiter->statistics.spuriousWakeups++;
+            }
+            ret = (*block)(context);
+            if (ret != kIOReturnSuccess) {
+                return ret;
+            }
+            blocked = true;
+        }
+        now = __IODataQueueNow();
+    }
+    
+    // Spin for up to twice the average wait, if that is within the maximum;
+    // longer waits are better spent blocked
+    waited = now - start;
+    waiter->averageWait = waiter->averageWait ? ((7 * waiter->averageWait + waited) / 8) : waited;
+    if (waiter->averageWait > waiter->maxSpin) {
+        waiter->statistics.spinLimit = 0;
+    } else {
+        limit = 2 * waiter->averageWait;
+        if (limit < kIODataQueueWaitMinSpin) {
+            limit = kIODataQueueWaitMinSpin;
+        }
+        waiter->statistics.spinLimit = (limit < waiter->maxSpin) ? limit : waiter->maxSpin;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+#if __MACH__
+
+static IOReturn
+__IODataQueueNotifyMach(IODataQueueMemory *dataQueue, void * context)
+{
+    return _IODataQueueSendDataAvailableNotification(dataQueue, (mach_msg_header_t *)context);
+}
+
 IOReturn
 IODataQueueEnqueue(IODataQueueMemory *dataQueue, void *data, uint32_t dataSize)
 {
-    return __IODataQueueEnqueue(dataQueue, 0, NULL, dataSize, data, NULL, NULL, 0);
+    return __IODataQueueEnqueue(dataQueue, 0, &__IODataQueueNotifyMach, NULL, dataSize, data, NULL, NULL, 0);
 }
 
 
 IOReturn
 _IODataQueueEnqueueWithReadCallback(IODataQueueMemory *dataQueue, uint64_t queueSize, mach_msg_header_t *msgh, uint32_t dataSize, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon)
 {
-    return __IODataQueueEnqueue(dataQueue, queueSize, msgh, dataSize, NULL, callback, refcon, 0);
+    return __IODataQueueEnqueue(dataQueue, queueSize, &__IODataQueueNotifyMach, msgh, dataSize, NULL, callback, refcon, 0);
 }
 
 IOReturn
 _IODataQueueEnqueueWithReadCallbackOptions(IODataQueueMemory *dataQueue, uint64_t queueSize, mach_msg_header_t *msgh, uint32_t dataSize, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options)
 {
-    return __IODataQueueEnqueue(dataQueue, queueSize, msgh, dataSize, NULL, callback, refcon, options);
+    return __IODataQueueEnqueue(dataQueue, queueSize, &__IODataQueueNotifyMach, msgh, dataSize, NULL, callback, refcon, options);
 }
 
 
@@ -385,6 +980,82 @@ IOReturn IODataQueueWaitForAvailableData(IODataQueueMemory *dataQueue, mach_port
     return kr;
 }
 
+static IOReturn
+__IODataQueueBlockMach(void *context)
+{
+    struct {
+            mach_msg_header_t msgHdr;
+            mach_msg_trailer_t trailer;
+    } msg;
+    
+    return mach_msg(&msg.msgHdr, MACH_RCV_MSG, 0, sizeof(msg), (mach_port_t)(uintptr_t)context, 0, MACH_PORT_NULL);
+}
+
+IOReturn IODataQueueWaitForAvailableDataAdaptive(IODataQueueMemory *dataQueue, mach_port_t notifyPort, IODataQueueWaiter *waiter)
+{
+    if (notifyPort == MACH_PORT_NULL) {
+        return kIOReturnBadArgument;
+    }
+    
+    return _IODataQueueWaitAdaptive(dataQueue, waiter, &__IODataQueueBlockMach, (void *)(uintptr_t)notifyPort);
+}
+
+static void
+__IODataQueueTelemetrySetNumber(CFMutableDictionaryRef dict, CFStringRef key, uint64_t value)
+{
+    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value);
+    
+    if (number) {
+        CFDictionarySetValue(dict, key, number);
+        CFRelease(number);
+    }
+}
+
+CFDictionaryRef IODataQueueTelemetryCopyDictionary(IODataQueueTelemetry *telemetry)
+{
+    IODataQueueTelemetry    snapshot;
+    CFMutableDictionaryRef  dict;
+    CFMutableArrayRef       sizes;
+    CFNumberRef             number;
+    uint32_t                idx;
+    
+    if (!telemetry) {
+        return NULL;
+    }
+    
+    IODataQueueTelemetryGetSnapshot(telemetry, &snapshot);
+    
+    dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!dict) {
+        return NULL;
+    }
+    
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryQueueSizeKey), snapshot.queueSize);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryOccupancyKey), snapshot.occupancy);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryHighWaterKey), snapshot.highWater);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryEnqueuesKey), snapshot.enqueues);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryEnqueueBytesKey), snapshot.enqueueBytes);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryOverrunsKey), snapshot.overruns);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryWrapsKey), snapshot.wraps);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryDequeuesKey), snapshot.dequeues);
+    __IODataQueueTelemetrySetNumber(dict, CFSTR(kIODataQueueTelemetryDequeueBytesKey), snapshot.dequeueBytes);
+    
+    sizes = CFArrayCreateMutable(kCFAllocatorDefault, kIODataQueueTelemetrySizeBuckets, &kCFTypeArrayCallBacks);
+    if (sizes) {
+        for (idx = 0; idx < kIODataQueueTelemetrySizeBuckets; idx++) {
+            number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &snapshot.dequeueSizes[idx]);
+            if (number) {
+                CFArrayAppendValue(sizes, number);
+                CFRelease(number);
+            }
+        }
+        CFDictionarySetValue(dict, CFSTR(kIODataQueueTelemetryDequeueSizesKey), sizes);
+        CFRelease(sizes);
+    }
+    
+    return dict;
+}
+
 mach_port_t IODataQueueAllocateNotificationPort()
 {
     mach_port_t        port = MACH_PORT_NULL;
@@ -493,3 +1164,14 @@ IOReturn _IODataQueueSendDataAvailableNotification(IODataQueueMemory *dataQueue,
     
     return kr;
 }
+
+#else /* !__MACH__ */
+
+IOReturn
+IODataQueueEnqueue(IODataQueueMemory *dataQueue, void *data, uint32_t dataSize)
+{
+    // without Mach there is no notification port in the appendix
+    return __IODataQueueEnqueue(dataQueue, 0, NULL, NULL, dataSize, data, NULL, NULL, 0);
+}
+
+#endif /* __MACH__ */
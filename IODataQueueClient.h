@@ -27,11 +27,16 @@
 #include <sys/cdefs.h>
 
 __BEGIN_DECLS
+#if __MACH__
 #include <AvailabilityMacros.h>
 #include <libkern/OSTypes.h>
 #include <mach/port.h>
 #include <IOKit/IOReturn.h>
 #include <IOKit/IODataQueueShared.h>
+#include <CoreFoundation/CoreFoundation.h>
+#else
+#include <IOKit/IODataQueueSharedPOSIX.h>
+#endif /* __MACH__ */
 #include <stdint.h> /* uint32_t */
 
 /*!
@@ -62,6 +67,211 @@ IODataQueueEntry *IODataQueuePeek(IODataQueueMemory *dataQueue);
  */
 IOReturn IODataQueueDequeue(IODataQueueMemory *dataQueue, void *data, uint32_t *dataSize);
 
+/*!
+ * @typedef IODataQueueBatchEntry
+ * @abstract A buffer to dequeue one entry into with IODataQueueDequeueBatch.
+ * @field data The memory region to copy the entry data into.
+ * @field dataSize The size of data.  On return, the size of the entry data.
+ */
+typedef struct IODataQueueBatchEntry {
+    void *      data;
+    uint32_t    dataSize;
+} IODataQueueBatchEntry;
+
+/*!
+ * @typedef IODataQueueBatchCallback
+ * @abstract Called by IODataQueueDequeueBatchWithCallback for each entry, in queue order.
+ * @param refcon The refcon passed to IODataQueueDequeueBatchWithCallback.
+ * @param data The entry data, in the queue memory.  It is only valid until the callback returns.
+ * @param dataSize The size of the entry data.
+ */
+typedef void (*IODataQueueBatchCallback)(void *refcon, const void *data, uint32_t dataSize);
+
+/*!
+ * @function IODataQueuePeekBatch
+ * @abstract Used to peek at the next entries on the queue.
+ * @discussion Like IODataQueuePeek, for up to entryCount entries at once.  The tail is read once, so entries enqueued during the call are left for the next one.  Pass the count returned to IODataQueueDequeueBatch with NULL entries to move the head past the entries once they have been used.
+ * @param dataQueue The IODataQueueMemory region mapped from the kernel.
+ * @param entries An array of entryCount pointers, set to the next entries on the queue.
+ * @param entryCount On entry, the number of entries wanted.  On return, the number found.
+ * @result Returns kIOReturnSuccess on success.  Other return values possible are: kIOReturnUnderrun - queue is empty, kIOReturnBadArgument - no dataQueue, entries or entryCount, kIOReturnError - the next entry is not valid.
+ */
+IOReturn IODataQueuePeekBatch(IODataQueueMemory *dataQueue, IODataQueueEntry **entries, uint32_t *entryCount);
+
+/*!
+ * @function IODataQueueDequeueBatch
+ * @abstract Dequeues up to entryCount entries, copying each into the next of the given buffers.
+ * @discussion Like calling IODataQueueDequeue entryCount times, except that the tail is read and the head written once for the whole batch, rather than once per entry.  Dequeueing stops early when the queue is empty or an entry is larger than its buffer; that entry stays on the queue.
+ * @param dataQueue The IODataQueueMemory region mapped from the kernel.
+ * @param entries An array of entryCount buffers.  If this parameter is 0 (NULL), it will simply move the head past the next entryCount entries.
+ * @param entryCount On entry, the most entries to dequeue.  On return, the number dequeued.
+ * @result Returns kIOReturnSuccess if any entry was dequeued.  Other return values possible are: kIOReturnUnderrun - queue is empty, kIOReturnBadArgument - no dataQueue or no entryCount, kIOReturnNoSpace - the first buffer is too small for the first entry, whose size is returned in its dataSize, kIOReturnError - the next entry is not valid.
+ */
+IOReturn IODataQueueDequeueBatch(IODataQueueMemory *dataQueue, IODataQueueBatchEntry *entries, uint32_t *entryCount);
+
+/*!
+ * @function IODataQueueDequeueBatchWithCallback
+ * @abstract Dequeues up to entryCount entries, passing each to a callback in place.
+ * @discussion Like IODataQueueDequeueBatch, without copying: the callback is given each entry's data in the queue memory.  The head is moved past all of them once the last callback returns.
+ * @param dataQueue The IODataQueueMemory region mapped from the kernel.
+ * @param entryCount On entry, the most entries to dequeue.  On return, the number dequeued.
+ * @param callback The function called for each entry.
+ * @param refcon Passed to the callback.
+ * @result Returns kIOReturnSuccess if any entry was dequeued.  Other return values possible are: kIOReturnUnderrun - queue is empty, kIOReturnBadArgument - no dataQueue, entryCount or callback, kIOReturnError - the next entry is not valid.
+ */
+IOReturn IODataQueueDequeueBatchWithCallback(IODataQueueMemory *dataQueue, uint32_t *entryCount, IODataQueueBatchCallback callback, void *refcon);
+
+/*!
+ * @typedef IODataQueueIterator
+ * @abstract The state of an iteration over the entries of a queue, in place.
+ * @discussion The fields are private to IODataQueueIteratorBegin, IODataQueueIteratorNext and IODataQueueIteratorCommit.
+ */
+typedef struct IODataQueueIterator {
+    IODataQueueMemory * dataQueue;
+    uint32_t            queueSize;
+    uint32_t            head;
+    uint32_t            tail;
+    uint32_t            next;
+} IODataQueueIterator;
+
+/*!
+ * @function IODataQueueIteratorBegin
+ * @abstract Starts iterating over the entries on the queue without copying them.
+ * @discussion The iteration covers the entries on the queue when it begins; entries enqueued later are left for the next one.  Each entry is handed out in place by IODataQueueIteratorNext, and stays on the queue until IODataQueueIteratorCommit moves the head past it.
+ * @param dataQueue The IODataQueueMemory region mapped from the kernel.
+ * @param iterator The iterator to set up.
+ * @result Returns kIOReturnSuccess on success.  Other return values possible are: kIOReturnUnderrun - queue is empty, kIOReturnBadArgument - no dataQueue or no iterator.
+ */
+IOReturn IODataQueueIteratorBegin(IODataQueueMemory *dataQueue, IODataQueueIterator *iterator);
+
+/*!
+ * @function IODataQueueIteratorNext
+ * @abstract Returns the data of the next entry in an iteration.
+ * @discussion The entry's bounds are checked against the queue before it is returned.  The data is in the queue memory, and is valid until the entry is committed.
+ * @param iterator An iterator set up by IODataQueueIteratorBegin.
+ * @param dataSize If not 0 (NULL), set to the size of the entry data.
+ * @result Returns a pointer to the entry data, or 0 (NULL) when the iteration is done or the next entry is not valid.
+ */
+const void *IODataQueueIteratorNext(IODataQueueIterator *iterator, uint32_t *dataSize);
+
+/*!
+ * @function IODataQueueIteratorCommit
+ * @abstract Dequeues the entries returned so far by an iteration.
+ * @discussion Moves the head of the queue past every entry returned by IODataQueueIteratorNext, with a single store.  The iteration may go on after a commit.
+ * @param iterator An iterator set up by IODataQueueIteratorBegin.
+ * @result Returns kIOReturnSuccess on success, or kIOReturnBadArgument if iterator was not set up.
+ */
+IOReturn IODataQueueIteratorCommit(IODataQueueIterator *iterator);
+
+/*!
+ * @typedef IODataQueueWaitStatistics
+ * @abstract Counts kept by an IODataQueueWaiter.
+ * @field waits The number of waits.
+ * @field spinHits The number of waits that found data while spinning.
+ * @field blocks The number of waits that blocked for a notification.
+ * @field spuriousWakeups The number of notifications that found the queue still empty.
+ * @field spinTime The time spent spinning, in nanoseconds.
+ * @field spinLimit The time the next wait will spin for, in nanoseconds.
+ */
+typedef struct IODataQueueWaitStatistics {
+    uint64_t            waits;
+    uint64_t            spinHits;
+    uint64_t            blocks;
+    uint64_t            spuriousWakeups;
+    uint64_t            spinTime;
+    uint64_t            spinLimit;
+} IODataQueueWaitStatistics;
+
+/*!
+ * @typedef IODataQueueWaiter
+ * @abstract The state of a consumer that spins before blocking for data.
+ * @discussion The fields are private to IODataQueueWaiterInitialize and the adaptive wait functions.  A waiter is for one consumer thread.
+ */
+typedef struct IODataQueueWaiter {
+    uint64_t                    maxSpin;
+    uint64_t                    averageWait;
+    IODataQueueWaitStatistics   statistics;
+} IODataQueueWaiter;
+
+/*!
+ * @function IODataQueueWaiterInitialize
+ * @abstract Sets up a waiter for an adaptive wait.
+ * @discussion A waiter polls the queue for up to twice the average time its recent waits took, then blocks.  When that average is more than maxSpin it no longer spins, since a producer that slow is better waited for blocked.
+ * @param waiter The waiter to set up.
+ * @param maxSpin The most time to spin for, in nanoseconds.  0 never spins.
+ */
+void IODataQueueWaiterInitialize(IODataQueueWaiter *waiter, uint64_t maxSpin);
+
+/*!
+ * @function IODataQueueWaiterGetStatistics
+ * @abstract Returns the counts kept by a waiter.
+ * @param waiter A waiter set up by IODataQueueWaiterInitialize.
+ * @param statistics Set to the waiter's counts.
+ */
+void IODataQueueWaiterGetStatistics(IODataQueueWaiter *waiter, IODataQueueWaitStatistics *statistics);
+
+#define kIODataQueueTelemetrySizeBuckets    16
+
+/*!
+ * @typedef IODataQueueTelemetry
+ * @abstract Counts of the traffic through a queue, kept by this process.
+ * @discussion Set up by IODataQueueTelemetryStart and updated with relaxed atomics by every enqueue and dequeue on the queue in this process; read the counts with IODataQueueTelemetryGetSnapshot.  Entries enqueued by the kernel or by another process are counted only when dequeued here.
+ * @field dataQueue The queue counted.
+ * @field queueSize The size of the queue when counting started.
+ * @field occupancy The bytes on the queue when the snapshot was taken.  Only set in snapshots.
+ * @field highWater The most bytes on the queue after an enqueue.
+ * @field enqueues The number of entries enqueued.
+ * @field enqueueBytes The data bytes enqueued.
+ * @field overruns The number of enqueues that failed because the queue was full.
+ * @field wraps The number of entries enqueued at the beginning of the queue because there was no room at the end.
+ * @field dequeues The number of entries dequeued.
+ * @field dequeueBytes The data bytes dequeued.
+ * @field dequeueSizes The number of entries dequeued by data size: 16 bytes or less in the first bucket, up to twice that in each following one, and more than 256KB in the last.
+ */
+typedef struct IODataQueueTelemetry {
+    IODataQueueMemory * dataQueue;
+    uint64_t            queueSize;
+    uint64_t            occupancy;
+    uint64_t            highWater;
+    uint64_t            enqueues;
+    uint64_t            enqueueBytes;
+    uint64_t            overruns;
+    uint64_t            wraps;
+    uint64_t            dequeues;
+    uint64_t            dequeueBytes;
+    uint64_t            dequeueSizes[kIODataQueueTelemetrySizeBuckets];
+} IODataQueueTelemetry;
+
+/*!
+ * @function IODataQueueTelemetryStart
+ * @abstract Starts counting the traffic through a queue.
+ * @discussion Zeroes telemetry and attaches it to dataQueue, after which enqueues and dequeues on the queue update it.  Queues without telemetry pay only a check of whether any queue has it.  A queue can have one telemetry block, and up to 32 queues can have one at a time.
+ * @param dataQueue The IODataQueueMemory region to count.
+ * @param telemetry The counts to keep, which must stay valid until IODataQueueTelemetryStop.
+ * @result Returns kIOReturnSuccess on success.  Other return values possible are: kIOReturnBadArgument - no dataQueue or no telemetry, kIOReturnExclusiveAccess - the queue already has telemetry or telemetry is already attached, kIOReturnNoResources - too many queues have telemetry.
+ */
+IOReturn IODataQueueTelemetryStart(IODataQueueMemory *dataQueue, IODataQueueTelemetry *telemetry);
+
+/*!
+ * @function IODataQueueTelemetryStop
+ * @abstract Stops counting the traffic through a queue.
+ * @discussion An enqueue or dequeue running on another thread may still update telemetry; free it only once those are done.
+ * @param telemetry Counts attached by IODataQueueTelemetryStart.
+ * @result Returns kIOReturnSuccess on success, or kIOReturnNotFound if telemetry was not attached to a queue.
+ */
+IOReturn IODataQueueTelemetryStop(IODataQueueTelemetry *telemetry);
+
+/*!
+ * @function IODataQueueTelemetryGetSnapshot
+ * @abstract Copies the counts of a queue, with its current occupancy.
+ * @discussion Each count is read atomically, but the counts are not read at the same instant.
+ * @param telemetry Counts attached by IODataQueueTelemetryStart.
+ * @param snapshot Set to the counts.
+ */
+void IODataQueueTelemetryGetSnapshot(IODataQueueTelemetry *telemetry, IODataQueueTelemetry *snapshot);
+
+#if __MACH__
+
 /*!
  * @function IODataQueueWaitForAvailableData
  * @abstract Wait for an incoming dataAvailable message on the given notifyPort.
@@ -72,6 +282,17 @@ IOReturn IODataQueueDequeue(IODataQueueMemory *dataQueue, void *data, uint32_t *
  */
 IOReturn IODataQueueWaitForAvailableData(IODataQueueMemory *dataQueue, mach_port_t notificationPort);
 
+/*!
+ * @function IODataQueueWaitForAvailableDataAdaptive
+ * @abstract Waits until there is data on the queue, spinning before blocking.
+ * @discussion Polls the queue for the waiter's spin limit, then waits for dataAvailable messages on notificationPort until the queue has data.  Unlike IODataQueueWaitForAvailableData, this returns only once data is available, so a notification left over from an entry already dequeued is absorbed rather than returned.
+ * @param dataQueue The IODataQueueMemory region mapped from the kernel.
+ * @param notificationPort Mach port on which to listen for incoming messages.
+ * @param waiter A waiter set up by IODataQueueWaiterInitialize.
+ * @result Returns kIOReturnSuccess once data is available.  Returns kIOReturnBadArgument if dataQueue or waiter is 0 (NULL) or notifyPort is MACH_PORT_NULL.  Returns the result of a failed mach_msg() listen call on the given port.
+ */
+IOReturn IODataQueueWaitForAvailableDataAdaptive(IODataQueueMemory *dataQueue, mach_port_t notificationPort, IODataQueueWaiter *waiter);
+
 /*!
  * @function IODataQueueAllocateNotificationPort
  * @abstract Allocates and returns a new mach port able to receive data available notifications from an IODataQueue.
@@ -80,6 +301,28 @@ IOReturn IODataQueueWaitForAvailableData(IODataQueueMemory *dataQueue, mach_port
  */
 mach_port_t IODataQueueAllocateNotificationPort();
 
+#define kIODataQueueTelemetryQueueSizeKey       "QueueSize"
+#define kIODataQueueTelemetryOccupancyKey       "Occupancy"
+#define kIODataQueueTelemetryHighWaterKey       "HighWater"
+#define kIODataQueueTelemetryEnqueuesKey        "Enqueues"
+#define kIODataQueueTelemetryEnqueueBytesKey    "EnqueueBytes"
+#define kIODataQueueTelemetryOverrunsKey        "Overruns"
+#define kIODataQueueTelemetryWrapsKey           "Wraps"
+#define kIODataQueueTelemetryDequeuesKey        "Dequeues"
+#define kIODataQueueTelemetryDequeueBytesKey    "DequeueBytes"
+#define kIODataQueueTelemetryDequeueSizesKey    "DequeueSizes"
+
+/*!
+ * @function IODataQueueTelemetryCopyDictionary
+ * @abstract Returns a snapshot of the counts of a queue as a dictionary.
+ * @discussion The dictionary holds the fields of IODataQueueTelemetryGetSnapshot as CFNumbers under the kIODataQueueTelemetry keys, with the dequeue sizes as a CFArray of kIODataQueueTelemetrySizeBuckets CFNumbers.
+ * @param telemetry Counts attached by IODataQueueTelemetryStart.
+ * @result Returns the dictionary, which the caller releases, or 0 (NULL) on failure.
+ */
+CFDictionaryRef IODataQueueTelemetryCopyDictionary(IODataQueueTelemetry *telemetry);
+
+#endif /* __MACH__ */
+
 /*!
  * @function IODataQueueEnqueue
  * @abstract Enqueues a new entry on the queue.
@@ -91,6 +334,8 @@ mach_port_t IODataQueueAllocateNotificationPort();
  */
 IOReturn IODataQueueEnqueue(IODataQueueMemory *dataQueue, void *data, uint32_t dataSize) AVAILABLE_MAC_OS_X_VERSION_10_5_AND_LATER;
 
+#if __MACH__
+
 /*!
  * @function IODataQueueSetNotificationPort
  * @abstract Creates a simple mach message targeting the mach port specified in port.
@@ -101,6 +346,8 @@ IOReturn IODataQueueEnqueue(IODataQueueMemory *dataQueue, void *data, uint32_t d
  */
 IOReturn IODataQueueSetNotificationPort(IODataQueueMemory *dataQueue, mach_port_t notifyPort) AVAILABLE_MAC_OS_X_VERSION_10_5_AND_LATER;
 
+#endif /* __MACH__ */
+
 __END_DECLS
 
 #endif /* _IOKITUSER_IODATAQUEUE_H */
@@ -37,11 +37,21 @@ enum {
 
 typedef uint32_t (*IODataQueueClientEnqueueReadBytesCallback)(void * refcon, void *data, uint32_t dataSize);
 
+/*
+ * Called by an enqueue that finds the queue empty, to wake the consumer.
+ */
+typedef IOReturn (*IODataQueueClientNotifyCallback)(IODataQueueMemory *dataQueue, void * context);
+
+IOReturn
+_IODataQueueEnqueueWithNotifier(IODataQueueMemory *dataQueue, uint64_t queueSize, uint32_t dataSize, void *data, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options, IODataQueueClientNotifyCallback notify, void * notifyContext);
+
+#if __MACH__
 IOReturn
 _IODataQueueEnqueueWithReadCallback(IODataQueueMemory *dataQueue, uint64_t queueSize, mach_msg_header_t *msgh, uint32_t dataSize, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon);
 
 IOReturn
 _IODataQueueEnqueueWithReadCallbackOptions(IODataQueueMemory *dataQueue, uint64_t queueSize, mach_msg_header_t *msgh, uint32_t dataSize, IODataQueueClientEnqueueReadBytesCallback callback, void * refcon, uint32_t options);
+#endif /* __MACH__ */
 
 /*
  * Internal Peek and Dequeue functions. These functions allow us to pass in the
@@ -52,7 +62,51 @@ IODataQueueEntry *_IODataQueuePeek(IODataQueueMemory *dataQueue, uint64_t queueS
 
 IOReturn _IODataQueueDequeue(IODataQueueMemory *dataQueue, uint64_t queueSize, void *data, uint32_t *dataSize);
 
+IOReturn _IODataQueuePeekBatch(IODataQueueMemory *dataQueue, uint64_t queueSize, IODataQueueEntry **entries, uint32_t *entryCount);
+
+IOReturn _IODataQueueDequeueBatchWithCallback(IODataQueueMemory *dataQueue, uint64_t queueSize, uint32_t *entryCount, IODataQueueBatchCallback callback, void *refcon);
+
+IOReturn _IODataQueueIteratorBegin(IODataQueueMemory *dataQueue, uint64_t queueSize, IODataQueueIterator *iterator);
+
+/*
+ * Called by an adaptive wait that found no data while spinning, to block until
+ * a notification arrives.
+ */
+typedef IOReturn (*IODataQueueClientBlockCallback)(void * context);
+
+IOReturn _IODataQueueWaitAdaptive(IODataQueueMemory *dataQueue, IODataQueueWaiter *waiter, IODataQueueClientBlockCallback block, void * context);
+
+#if __MACH__
 IOReturn _IODataQueueSendDataAvailableNotification(IODataQueueMemory *dataQueue, mach_msg_header_t *msgh);
+#endif /* __MACH__ */
+
+#if !__MACH__
+/*
+ * A queue in shared memory with a file descriptor notifier, for running the
+ * queue protocol between processes without Mach: a memfd and an eventfd on
+ * Linux, anonymous shared memory and a pipe elsewhere. Processes forked after
+ * the queue is created share it. Like the kernel's queues, each queue is for
+ * one producer and one consumer.
+ */
+typedef struct _IODataQueuePOSIX * IODataQueuePOSIXRef;
+
+IOReturn _IODataQueuePOSIXCreate(uint32_t queueSize, IODataQueuePOSIXRef *queue);
+
+IODataQueueMemory *_IODataQueuePOSIXGetMemory(IODataQueuePOSIXRef queue);
+
+IOReturn _IODataQueuePOSIXEnqueue(IODataQueuePOSIXRef queue, void *data, uint32_t dataSize);
+
+/*
+ * Waits for an enqueue to find the queue empty, for up to timeout
+ * milliseconds, or forever if timeout is negative. Returns kIOReturnTimeout
+ * if none did.
+ */
+IOReturn _IODataQueuePOSIXWaitForAvailableData(IODataQueuePOSIXRef queue, int timeout);
+
+IOReturn _IODataQueuePOSIXWaitForAvailableDataAdaptive(IODataQueuePOSIXRef queue, IODataQueueWaiter *waiter, int timeout);
+
+void _IODataQueuePOSIXRelease(IODataQueuePOSIXRef queue);
+#endif /* !__MACH__ */
 
 
 __END_DECLS
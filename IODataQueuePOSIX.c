@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#if __linux__
+#define _GNU_SOURCE     // memfd_create
+#endif
+
+#include "IODataQueueClientPrivate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if __linux__
+#include <sys/eventfd.h>
+#endif
+
+struct _IODataQueuePOSIX {
+    IODataQueueMemory * dataQueue;
+    size_t              mapSize;
+    int                 memoryFd;
+    int                 notifyFd[2];    // read and write ends, the same eventfd on Linux
+};
+
+static IOReturn
+__IODataQueuePOSIXNotify(IODataQueueMemory *dataQueue __unused, void * context)
+{
+    IODataQueuePOSIXRef queue = (IODataQueuePOSIXRef)context;
+#if __linux__
+    uint64_t            value = 1;
+#else
+    char                value = 0;
+#endif
+    
+    // A full pipe or eventfd already holds a wakeup, as a Mach port with a
+    // queue limit of one already holds a message
+    if ((write(queue->notifyFd[1], &value, sizeof(value)) < 0) && (errno != EAGAIN)) {
+        return kIOReturnError;
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn
+_IODataQueuePOSIXCreate(uint32_t queueSize, IODataQueuePOSIXRef *queueRef)
+{
+    IODataQueuePOSIXRef queue;
+    
+    if (!queueRef || !queueSize || (queueSize > UINT32_MAX - DATA_QUEUE_MEMORY_HEADER_SIZE - DATA_QUEUE_MEMORY_APPENDIX_SIZE)) {
+        return kIOReturnBadArgument;
+    }
+    
+    queue = (IODataQueuePOSIXRef)calloc(1, sizeof(*queue));
+    if (!queue) {
+        return kIOReturnNoMemory;
+    }
+    queue->memoryFd    = -1;
+    queue->notifyFd[0] = -1;
+    queue->notifyFd[1] = -1;
+    queue->mapSize     = DATA_QUEUE_MEMORY_HEADER_SIZE + queueSize + DATA_QUEUE_MEMORY_APPENDIX_SIZE;
+    
+#if __linux__
+    queue->memoryFd = memfd_create("IODataQueue", MFD_CLOEXEC);
+    if ((queue->memoryFd < 0) || ftruncate(queue->memoryFd, queue->mapSize)) {
+        goto fail;
+    }
+    queue->dataQueue = (IODataQueueMemory *)mmap(NULL, queue->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, queue->memoryFd, 0);
+#else
+    queue->dataQueue = (IODataQueueMemory *)mmap(NULL, queue->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+#endif
+    // checked before anything else can fail, so release never sees MAP_FAILED
+    if (MAP_FAILED == (void *)queue->dataQueue) {
+        queue->dataQueue = NULL;
+        goto fail;
+    }
+    
+#if __linux__
+    queue->notifyFd[0] = queue->notifyFd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (queue->notifyFd[0] < 0) {
+        goto fail;
+    }
+#else
+    if (pipe(queue->notifyFd)
+        || fcntl(queue->notifyFd[0], F_SETFL, O_NONBLOCK) || fcntl(queue->notifyFd[1], F_SETFL, O_NONBLOCK)) {
+        goto fail;
+    }
+#endif
+    
+    // the mapping is zero filled, so head and tail start out equal
+    queue->dataQueue->queueSize = queueSize;
+    *queueRef = queue;
+    
+    return kIOReturnSuccess;
+    
+fail:
+    _IODataQueuePOSIXRelease(queue);
+    return kIOReturnNoMemory;
+}
+
+IODataQueueMemory *
+_IODataQueuePOSIXGetMemory(IODataQueuePOSIXRef queue)
+{
+    return queue ? queue->dataQueue : NULL;
+}
+
+IOReturn
+_IODataQueuePOSIXEnqueue(IODataQueuePOSIXRef queue, void *data, uint32_t dataSize)
+{
+    if (!queue) {
+        return kIOReturnBadArgument;
+    }
+    
+    // the queue size is taken from the creator, not from the shared memory
+    return _IODataQueueEnqueueWithNotifier(queue->dataQueue, queue->mapSize - DATA_QUEUE_MEMORY_HEADER_SIZE - DATA_QUEUE_MEMORY_APPENDIX_SIZE,
+                                           dataSize, data, NULL, NULL, 0, &__IODataQueuePOSIXNotify, queue);
+}
+
+IOReturn
+_IODataQueuePOSIXWaitForAvailableData(IODataQueuePOSIXRef queue, int timeout)
+{
+    struct pollfd   pfd;
+    char            buffer[64];
+    int             result;
+    
+    if (!queue) {
+        return kIOReturnBadArgument;
+    }
+    
+    pfd.fd      = queue->notifyFd[0];
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    do {
+        result = poll(&pfd, 1, timeout);
+    } while ((result < 0) && (errno == EINTR));
+    
+    if (result < 0) {
+        return kIOReturnError;
+    }
+    if (!result) {
+        return kIOReturnTimeout;
+    }
+    
+    // consume the wakeup, an eventfd resets to zero on a read
+    while (read(queue->notifyFd[0], buffer, sizeof(buffer)) > 0) {
+#if __linux__
+        break;
+#endif
+    }
+    
+    return kIOReturnSuccess;
+}
+
+typedef struct {
+    IODataQueuePOSIXRef queue;
+    int                 timeout;
+} __IODataQueuePOSIXBlockContext;
+
+static IOReturn
+__IODataQueuePOSIXBlock(void *context)
+{
+    __IODataQueuePOSIXBlockContext *blockContext = (__IODataQueuePOSIXBlockContext *)context;
+    
+    return _IODataQueuePOSIXWaitForAvailableData(blockContext->queue, blockContext->timeout);
+}
+
+IOReturn
+_IODataQueuePOSIXWaitForAvailableDataAdaptive(IODataQueuePOSIXRef queue, IODataQueueWaiter *waiter, int timeout)
+{
+    __IODataQueuePOSIXBlockContext blockContext;
+    
+    if (!queue) {
+        return kIOReturnBadArgument;
+    }
+    
+    blockContext.queue   = queue;
+    blockContext.timeout = timeout;
+    
+    return _IODataQueueWaitAdaptive(queue->dataQueue, waiter, &__IODataQueuePOSIXBlock, &blockContext);
+}
+
+void
+_IODataQueuePOSIXRelease(IODataQueuePOSIXRef queue)
+{
+    if (!queue) {
+        return;
+    }
+    
+    if (queue->dataQueue) {
+        munmap(queue->dataQueue, queue->mapSize);
+    }
+    if (queue->memoryFd >= 0) {
+        close(queue->memoryFd);
+    }
+    if (queue->notifyFd[0] >= 0) {
+        close(queue->notifyFd[0]);
+    }
+    if ((queue->notifyFd[1] >= 0) && (queue->notifyFd[1] != queue->notifyFd[0])) {
+        close(queue->notifyFd[1]);
+    }
+    free(queue);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * The IODataQueueMemory layout and the few SDK types IODataQueueClient.h
+ * needs, for building the queue protocol where there are no Mach or kernel
+ * IOKit headers. The layout must match IOKit/IODataQueueShared.h.
+ */
+
+#ifndef _IOKITUSER_IODATAQUEUE_SHARED_POSIX_H
+#define _IOKITUSER_IODATAQUEUE_SHARED_POSIX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+#define AVAILABLE_MAC_OS_X_VERSION_10_5_AND_LATER
+
+typedef uint8_t     UInt8;
+typedef uint32_t    UInt32;
+typedef uint8_t     Boolean;
+typedef int         IOReturn;
+
+#define kIOReturnSuccess         0
+#define kIOReturnError           ((IOReturn) 0xe00002bc)
+#define kIOReturnNoMemory        ((IOReturn) 0xe00002bd)
+#define kIOReturnNoResources     ((IOReturn) 0xe00002be)
+#define kIOReturnBadArgument     ((IOReturn) 0xe00002c2)
+#define kIOReturnExclusiveAccess ((IOReturn) 0xe00002c5)
+#define kIOReturnTimeout         ((IOReturn) 0xe00002d6)
+#define kIOReturnNoSpace         ((IOReturn) 0xe00002db)
+#define kIOReturnUnderrun        ((IOReturn) 0xe00002e7)
+#define kIOReturnOverrun         ((IOReturn) 0xe00002e8)
+#define kIOReturnNotFound        ((IOReturn) 0xe00002f0)
+
+typedef struct _IODataQueueEntry {
+    UInt32  size;
+    UInt8   data[4];
+} IODataQueueEntry;
+
+typedef struct _IODataQueueMemory {
+    UInt32            queueSize;
+    volatile UInt32   head;
+    volatile UInt32   tail;
+    IODataQueueEntry  queue[1];
+} IODataQueueMemory;
+
+// the Mach appendix holds the notification message, which isn't used here
+typedef struct _IODataQueueAppendix {
+    UInt32  version;
+    UInt32  reserved[7];
+} IODataQueueAppendix;
+
+#define DATA_QUEUE_ENTRY_HEADER_SIZE        (sizeof(IODataQueueEntry) - 4)
+#define DATA_QUEUE_MEMORY_HEADER_SIZE       (sizeof(IODataQueueMemory) - sizeof(IODataQueueEntry))
+#define DATA_QUEUE_MEMORY_APPENDIX_SIZE     (sizeof(IODataQueueAppendix))
+
+#endif /* _IOKITUSER_IODATAQUEUE_SHARED_POSIX_H */
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+
+runs producers and consumers over IODataQueues in shared memory, checking
+every entry, and reports the throughput
+
+to build, on Linux:
+
+mkdir -p /tmp/iokit && ln -sfn $PWD /tmp/iokit/IOKit
+clang -O2 -I/tmp/iokit IODataQueueClient.c IODataQueuePOSIX.c IODataQueueStress.c -o IODataQueueStress
+clang -O1 -g -fsanitize=thread -I/tmp/iokit IODataQueueClient.c IODataQueuePOSIX.c IODataQueueStress.c -o IODataQueueStressTSan
+
+to run:
+
+./IODataQueueStress
+./IODataQueueStress 4 1000000
+./IODataQueueStressTSan 2 100000 threads
+./IODataQueueStress 2 1000000 processes 20000
+
+The arguments are the number of queues, the entries sent through each,
+"threads" to run each producer and consumer as threads of this process, where
+the thread sanitizer can follow them, instead of as forked processes, and the
+most nanoseconds a consumer spins for data before it blocks, 0 by default.
+Consumers wait with an IODataQueueWaiter, and the spin hits and blocks of all
+of them are reported. Each queue also has telemetry, started before the fork
+in memory shared with the children, and its overruns, wraps and high water
+mark are reported. Each
+queue has one producer and one consumer, as the kernel's queues do. Entries
+run from 16B to 4KB, and the consumer drains them in turn one at a time, in
+batches and with an iterator, so all three dequeue paths race the enqueue
+path. The queue memory and notifier come from _IODataQueuePOSIXCreate.
+
+*/
+
+#include <IOKit/IODataQueueClient.h>
+#include <IOKit/IODataQueueClientPrivate.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define kQueueSize	(64 * 1024)
+#define kMinEntry	16
+#define kMaxEntry	4096
+#define kMaxQueues	64
+#define kBatch		32
+
+typedef struct {
+	IODataQueuePOSIXRef queue;
+	uint64_t	    entries;
+	uint64_t	    maxSpin;
+	uint64_t	    errors;
+	IODataQueueWaitStatistics statistics;
+	IODataQueueTelemetry telemetry;
+} pair_t;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// sizes step through 16B to 4KB, the data is the sequence number repeated
+static uint32_t
+entrySize(uint64_t sequence)
+{
+	return (kMinEntry << (sequence % 9));
+}
+
+static void
+fillEntry(uint64_t * data, uint64_t sequence)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < entrySize(sequence) / sizeof(uint64_t); idx++) data[idx] = sequence + idx;
+}
+
+// entries in the queue are only 4 byte aligned
+static bool
+checkEntry(const void * data, uint32_t size, uint64_t sequence)
+{
+	uint64_t word;
+	uint32_t idx;
+
+	if (size != entrySize(sequence)) return (false);
+	for (idx = 0; idx < size / sizeof(uint64_t); idx++) {
+		memcpy(&word, (const uint64_t *) data + idx, sizeof(word));
+		if (word != sequence + idx) return (false);
+	}
+
+	return (true);
+}
+
+static void *
+produce(void * context)
+{
+	pair_t * pair = (pair_t *) context;
+	uint64_t data[kMaxEntry / sizeof(uint64_t)];
+	uint64_t sequence;
+
+	for (sequence = 0; sequence < pair->entries; sequence++) {
+		fillEntry(data, sequence);
+		// a full queue has nothing to wake the producer, so it polls
+		while (kIOReturnOverrun == _IODataQueuePOSIXEnqueue(pair->queue, data, entrySize(sequence))) sched_yield();
+	}
+
+	return (NULL);
+}
+
+typedef struct {
+	uint64_t	next;
+	uint64_t	errors;
+} check_t;
+
+static void
+checkCallback(void * refcon, const void * data, uint32_t dataSize)
+{
+	check_t * check = (check_t *) refcon;
+
+	if (!checkEntry(data, dataSize, check->next)) check->errors++;
+	check->next++;
+}
+
+static void *
+consume(void * context)
+{
+	static __thread uint64_t buffer[kMaxEntry / sizeof(uint64_t)];
+	pair_t *		 pair  = (pair_t *) context;
+	IODataQueueMemory *	 queue = _IODataQueuePOSIXGetMemory(pair->queue);
+	IODataQueueIterator	 iterator;
+	IODataQueueWaiter	 waiter;
+	const void *		 data;
+	check_t			 check = { 0, 0 };
+	uint32_t		 size, count;
+	int			 mode  = 0;
+
+	IODataQueueWaiterInitialize(&waiter, pair->maxSpin);
+	while (check.next < pair->entries) {
+		if (!IODataQueueDataAvailable(queue)) {
+			// the producer wakes us when it finds the queue empty
+			if (kIOReturnTimeout == _IODataQueuePOSIXWaitForAvailableDataAdaptive(pair->queue, &waiter, 5000)) {
+				fprintf(stderr, "timed out at entry %llu\n", (unsigned long long) check.next);
+				check.errors++;
+				break;
+			}
+			continue;
+		}
+		switch (mode++ % 3) {
+		case 0:
+			size = sizeof(buffer);
+			if (kIOReturnSuccess == IODataQueueDequeue(queue, buffer, &size)) {
+				if (!checkEntry(buffer, size, check.next)) check.errors++;
+				check.next++;
+			}
+			break;
+		case 1:
+			count = kBatch;
+			IODataQueueDequeueBatchWithCallback(queue, &count, &checkCallback, &check);
+			break;
+		default:
+			if (kIOReturnSuccess != IODataQueueIteratorBegin(queue, &iterator)) break;
+			for (count = 0; (count < kBatch) && (data = IODataQueueIteratorNext(&iterator, &size)); count++) {
+				if (!checkEntry(data, size, check.next)) check.errors++;
+				check.next++;
+			}
+			IODataQueueIteratorCommit(&iterator);
+			break;
+		}
+	}
+	pair->errors = check.errors;
+	IODataQueueWaiterGetStatistics(&waiter, &pair->statistics);
+
+	return (NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	pair_t *  pairs;
+	pthread_t threads[2 * kMaxQueues];
+	pid_t	  children[2 * kMaxQueues];
+	long	  queues = 2, idx;
+	uint64_t  entries = 200000, maxSpin = 0, errors = 0, start, elapsed;
+	uint64_t  waits = 0, spinHits = 0, blocks = 0, spurious = 0;
+	uint64_t  overruns = 0, wraps = 0, highWater = 0;
+	IODataQueueTelemetry snapshot;
+	bool	  useThreads = false;
+	int	  status;
+
+	if (argc > 1) queues  = strtol(argv[1], NULL, 0);
+	if (argc > 2) entries = strtoull(argv[2], NULL, 0);
+	if (argc > 3) useThreads = !strcmp(argv[3], "threads");
+	if (argc > 4) maxSpin = strtoull(argv[4], NULL, 0);
+	if ((queues <= 0) || (queues > kMaxQueues) || !entries) {
+		printf("usage: %s [queues, at most %d] [entries per queue] [threads|processes] [max spin ns]\n", argv[0], kMaxQueues);
+		return (1);
+	}
+
+	// the results are shared with forked consumers
+	pairs = mmap(NULL, queues * sizeof(pair_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (MAP_FAILED == (void *) pairs) return (1);
+	for (idx = 0; idx < queues; idx++) {
+		pairs[idx].entries = entries;
+		pairs[idx].maxSpin = maxSpin;
+		if (kIOReturnSuccess != _IODataQueuePOSIXCreate(kQueueSize, &pairs[idx].queue)) {
+			printf("can't make queue %ld\n", idx);
+			return (1);
+		}
+		IODataQueueTelemetryStart(_IODataQueuePOSIXGetMemory(pairs[idx].queue), &pairs[idx].telemetry);
+	}
+
+	start = now();
+	for (idx = 0; idx < 2 * queues; idx++) {
+		void * (*function)(void *) = (idx & 1) ? &consume : &produce;
+
+		if (useThreads) {
+			pthread_create(&threads[idx], NULL, function, &pairs[idx / 2]);
+			continue;
+		}
+		children[idx] = fork();
+		if (children[idx] < 0) return (1);
+		if (!children[idx]) {
+			(*function)(&pairs[idx / 2]);
+			_exit(0);
+		}
+	}
+	for (idx = 0; idx < 2 * queues; idx++) {
+		if (useThreads) pthread_join(threads[idx], NULL);
+		else if ((waitpid(children[idx], &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) errors++;
+	}
+	elapsed = now() - start;
+
+	for (idx = 0; idx < queues; idx++) {
+		errors += pairs[idx].errors;
+		waits    += pairs[idx].statistics.waits;
+		spinHits += pairs[idx].statistics.spinHits;
+		blocks   += pairs[idx].statistics.blocks;
+		spurious += pairs[idx].statistics.spuriousWakeups;
+
+		IODataQueueTelemetryGetSnapshot(&pairs[idx].telemetry, &snapshot);
+		if ((snapshot.enqueues != entries) || (snapshot.dequeues != entries) || (snapshot.enqueueBytes != snapshot.dequeueBytes)) errors++;
+		overruns += snapshot.overruns;
+		wraps    += snapshot.wraps;
+		if (snapshot.highWater > highWater) highWater = snapshot.highWater;
+		IODataQueueTelemetryStop(&pairs[idx].telemetry);
+		_IODataQueuePOSIXRelease(pairs[idx].queue);
+	}
+
+	printf("%ld queues of %llu entries, %s\n", queues, (unsigned long long) entries, useThreads ? "threads" : "processes");
+	printf("%.1f ns/entry, %.2f M entries/s\n", (double) elapsed / (queues * entries),
+	       (queues * entries) * 1000.0 / elapsed);
+	printf("%llu waits, %llu spin hits, %llu blocks, %llu spurious wakeups, %llu ns max spin\n",
+	       (unsigned long long) waits, (unsigned long long) spinHits, (unsigned long long) blocks,
+	       (unsigned long long) spurious, (unsigned long long) maxSpin);
+	printf("%llu overruns, %llu wraps, %llu of %d bytes high water\n", (unsigned long long) overruns,
+	       (unsigned long long) wraps, (unsigned long long) highWater, kQueueSize);
+	if (errors) printf("%llu errors\n", (unsigned long long) errors);
+	munmap(pairs, queues * sizeof(pair_t));
+
+	return (errors ? 1 : 0);
+}
@@ -38,6 +38,8 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -218,15 +220,668 @@ IOCreateReceivePort( uint32_t msgType, mach_port_t * recvPort )
     return res;
 }
 
+/*
+ * Call statistics
+ *
+ * With statistics on, each thread counts its own kernel calls in a table it
+ * alone writes, so recording takes no lock. The tables are linked on a list
+ * that snapshots read, and a thread's counts move to __ioCallStatsRetired
+ * when it exits. Latencies go in log scale buckets, four per power of two.
+ */
+
+#define kIOCallStatsBuckets		160
+#define kIOCallStatsThreadEntries	128
+#define kIOCallStatsMergedEntries	2048
+#define kIOCallStatsMaxConnects	1024
+
+enum {
+    kIOCallStatsIOKitLib = 0		// class index of the calls below
+};
+
+enum {
+    kIOCallStatsServiceOpen = 0,
+    kIOCallStatsServiceClose,
+    kIOCallStatsRegistryEntryGetName,
+    kIOCallStatsRegistryEntryGetNameInPlane,
+    kIOCallStatsRegistryEntryGetLocationInPlane,
+    kIOCallStatsRegistryEntryGetPath,
+    kIOCallStatsRegistryEntryGetRegistryEntryID,
+    kIOCallStatsRegistryEntryGetProperties,
+    kIOCallStatsRegistryEntryGetProperty,
+    kIOCallStatsRegistryEntrySetProperties,
+    kIOCallStatsRegistryEntryGetChildIterator,
+    kIOCallStatsRegistryEntryGetParentIterator,
+    kIOCallStatsOther,			// keys that found a full table
+    kIOCallStatsCallCount
+};
+
+static const char * const __ioCallStatsCallNames[kIOCallStatsCallCount] = {
+    "IOServiceOpen",
+    "IOServiceClose",
+    "IORegistryEntryGetName",
+    "IORegistryEntryGetNameInPlane",
+    "IORegistryEntryGetLocationInPlane",
+    "IORegistryEntryGetPath",
+    "IORegistryEntryGetRegistryEntryID",
+    "IORegistryEntryCreateCFProperties",
+    "IORegistryEntryCreateCFProperty",
+    "IORegistryEntrySetCFProperties",
+    "IORegistryEntryGetChildIterator",
+    "IORegistryEntryGetParentIterator",
+    "Other"
+};
+
+typedef struct IOCallStatsEntry IOCallStatsEntry;
+struct IOCallStatsEntry {
+    uint32_t		classIndex;
+    uint32_t		selector;
+    uint64_t		count;
+    uint64_t		totalTime;
+    uint64_t		maxTime;
+    uint64_t		inbandBytes;
+    uint64_t		outOfLineBytes;
+    uint64_t		buckets[kIOCallStatsBuckets];
+};
+
+typedef struct IOCallStatsTable IOCallStatsTable;
+struct IOCallStatsTable {
+    IOCallStatsTable *	next;
+    io_connect_t	lastConnect;	// the owner's last connect and its class
+    uint32_t		lastClass;
+    uint32_t		lastGeneration;
+    uint32_t		size;
+    IOCallStatsEntry *	other;
+    IOCallStatsEntry *	entries[];	// open addressed, published once
+};
+
+static pthread_mutex_t		__ioCallStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t		__ioCallStatsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t		__ioCallStatsKey;
+static boolean_t		__ioCallStatsKeyValid;
+static boolean_t		__ioCallStatsEnabled;
+static IOCallStatsTable *	__ioCallStatsTables;
+static IOCallStatsTable *	__ioCallStatsRetired;
+static io_name_t *		__ioCallStatsClasses;
+static uint32_t			__ioCallStatsClassCount;
+static CFMutableDictionaryRef	__ioCallStatsConnects;	// io_connect_t -> class index
+static uint32_t			__ioCallStatsConnectGeneration;
+
+static inline void
+__IOCallStatsAdd(uint64_t * counter, uint64_t value)
+{
+    // only the owning thread writes, readers may see a count late
+    __c11_atomic_store((_Atomic uint64_t *)counter,
+        __c11_atomic_load((_Atomic uint64_t *)counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t
+__IOCallStatsBucket(uint64_t time)
+{
+    uint32_t msb, bucket;
+
+    if (time < 4) return ((uint32_t) time);
+    msb = 63 - __builtin_clzll(time);
+    bucket = (msb - 1) * 4 + (uint32_t) ((time >> (msb - 2)) & 3);
+
+    return ((bucket < kIOCallStatsBuckets) ? bucket : (kIOCallStatsBuckets - 1));
+}
+
+// the smallest time that goes in bucket
+static uint64_t
+__IOCallStatsBucketBase(uint32_t bucket)
+{
+    if (bucket < 4) return (bucket);
+    return ((uint64_t) (4 + (bucket & 3))) << ((bucket / 4) - 1);
+}
+
+static IOCallStatsTable *
+__IOCallStatsTableCreate(uint32_t size)
+{
+    IOCallStatsTable * table;
+
+    table = calloc(1, sizeof(IOCallStatsTable) + size * sizeof(IOCallStatsEntry *));
+    if (table) table->size = size;
+
+    return (table);
+}
+
+static void
+__IOCallStatsTableFree(IOCallStatsTable * table)
+{
+    uint32_t idx;
+
+    for (idx = 0; idx < table->size; idx++)
+        if (table->entries[idx]) free(table->entries[idx]);
+    if (table->other) free(table->other);
+    free(table);
+}
+
+// find or add the entry for a key; only the owner of table may add
+static IOCallStatsEntry *
+__IOCallStatsTableEntry(IOCallStatsTable * table, uint32_t classIndex, uint32_t selector)
+{
+    IOCallStatsEntry * entry;
+    uint32_t           idx, probe;
+
+    idx = (classIndex * 0x9E3779B1U) ^ selector;
+    for (probe = 0; probe < table->size; probe++, idx++)
+    {
+        entry = table->entries[idx & (table->size - 1)];
+        if (!entry) break;
+        if ((entry->classIndex == classIndex) && (entry->selector == selector)) return (entry);
+    }
+
+    if (probe < table->size) {
+        entry = calloc(1, sizeof(IOCallStatsEntry));
+        if (entry) {
+            entry->classIndex = classIndex;
+            entry->selector   = selector;
+            __c11_atomic_store((_Atomic(IOCallStatsEntry *) *)&table->entries[idx & (table->size - 1)],
+                                entry, __ATOMIC_RELEASE);
+            return (entry);
+        }
+    }
+
+    if (!table->other) {
+        entry = calloc(1, sizeof(IOCallStatsEntry));
+        if (entry) {
+            entry->classIndex = kIOCallStatsIOKitLib;
+            entry->selector   = kIOCallStatsOther;
+            __c11_atomic_store((_Atomic(IOCallStatsEntry *) *)&table->other, entry, __ATOMIC_RELEASE);
+        }
+    }
+    return (table->other);
+}
+
+static void
+__IOCallStatsEntryAdd(IOCallStatsEntry * to, const IOCallStatsEntry * from)
+{
+    uint64_t value;
+    uint32_t idx;
+
+    to->count          += __c11_atomic_load((_Atomic uint64_t *)&from->count, __ATOMIC_RELAXED);
+    to->totalTime      += __c11_atomic_load((_Atomic uint64_t *)&from->totalTime, __ATOMIC_RELAXED);
+    to->inbandBytes    += __c11_atomic_load((_Atomic uint64_t *)&from->inbandBytes, __ATOMIC_RELAXED);
+    to->outOfLineBytes += __c11_atomic_load((_Atomic uint64_t *)&from->outOfLineBytes, __ATOMIC_RELAXED);
+    value = __c11_atomic_load((_Atomic uint64_t *)&from->maxTime, __ATOMIC_RELAXED);
+    if (value > to->maxTime) to->maxTime = value;
+    for (idx = 0; idx < kIOCallStatsBuckets; idx++)
+        to->buckets[idx] += __c11_atomic_load((_Atomic uint64_t *)&from->buckets[idx], __ATOMIC_RELAXED);
+}
+
+// called with __ioCallStatsLock held
+static void
+__IOCallStatsTableAdd(IOCallStatsTable * to, IOCallStatsTable * from)
+{
+    IOCallStatsEntry ** slot;
+    IOCallStatsEntry *  entry;
+    IOCallStatsEntry *  into;
+    uint32_t            idx;
+
+    for (idx = 0; idx <= from->size; idx++)
+    {
+        slot  = (idx < from->size) ? &from->entries[idx] : &from->other;
+        entry = __c11_atomic_load((_Atomic(IOCallStatsEntry *) *)slot, __ATOMIC_ACQUIRE);
+        if (!entry) continue;
+        into = __IOCallStatsTableEntry(to, entry->classIndex, entry->selector);
+        if (into) __IOCallStatsEntryAdd(into, entry);
+    }
+}
+
+static void
+__IOCallStatsThreadExit(void * value)
+{
+    IOCallStatsTable *  table = (IOCallStatsTable *) value;
+    IOCallStatsTable ** prev;
+
+    pthread_mutex_lock(&__ioCallStatsLock);
+    for (prev = &__ioCallStatsTables; *prev && (*prev != table); prev = &(*prev)->next) {}
+    if (*prev) *prev = table->next;
+    if (!__ioCallStatsRetired) __ioCallStatsRetired = __IOCallStatsTableCreate(kIOCallStatsMergedEntries);
+    if (__ioCallStatsRetired) __IOCallStatsTableAdd(__ioCallStatsRetired, table);
+    pthread_mutex_unlock(&__ioCallStatsLock);
+
+    __IOCallStatsTableFree(table);
+}
+
+static void
+__IOCallStatsInitialize(void)
+{
+    __ioCallStatsKeyValid = (0 == pthread_key_create(&__ioCallStatsKey, &__IOCallStatsThreadExit));
+}
+
+static IOCallStatsTable *
+__IOCallStatsThreadTable(void)
+{
+    IOCallStatsTable * table;
+
+    pthread_once(&__ioCallStatsOnce, &__IOCallStatsInitialize);
+    if (!__ioCallStatsKeyValid) return (NULL);
+
+    table = (IOCallStatsTable *) pthread_getspecific(__ioCallStatsKey);
+    if (table) return (table);
+
+    table = __IOCallStatsTableCreate(kIOCallStatsThreadEntries);
+    if (!table) return (NULL);
+    if (pthread_setspecific(__ioCallStatsKey, table))
+    {
+        free(table);
+        return (NULL);
+    }
+    pthread_mutex_lock(&__ioCallStatsLock);
+    table->next = __ioCallStatsTables;
+    __ioCallStatsTables = table;
+    pthread_mutex_unlock(&__ioCallStatsLock);
+
+    return (table);
+}
+
+// returns zero when statistics are off; pass a non zero result to __IOCallStatsRecord
+static inline uint64_t
+__IOCallStatsBegin(void)
+{
+    if (!__c11_atomic_load((_Atomic boolean_t *)&__ioCallStatsEnabled, __ATOMIC_RELAXED)) return (0);
+    return (clock_gettime_nsec_np(CLOCK_UPTIME_RAW));
+}
+
+static void
+__IOCallStatsRecordClass(IOCallStatsTable * table, uint64_t start, uint32_t classIndex, uint32_t selector,
+                         uint64_t inbandBytes, uint64_t outOfLineBytes)
+{
+    IOCallStatsEntry * entry;
+    uint64_t           time;
+
+    time = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+
+    entry = __IOCallStatsTableEntry(table, classIndex, selector);
+    if (!entry) return;
+
+    __IOCallStatsAdd(&entry->count, 1);
+    __IOCallStatsAdd(&entry->totalTime, time);
+    __IOCallStatsAdd(&entry->inbandBytes, inbandBytes);
+    __IOCallStatsAdd(&entry->outOfLineBytes, outOfLineBytes);
+    __IOCallStatsAdd(&entry->buckets[__IOCallStatsBucket(time)], 1);
+    if (time > entry->maxTime)
+        __c11_atomic_store((_Atomic uint64_t *)&entry->maxTime, time, __ATOMIC_RELAXED);
+}
+
+static void
+__IOCallStatsRecord(uint64_t start, uint32_t call, uint64_t inbandBytes, uint64_t outOfLineBytes)
+{
+    IOCallStatsTable * table;
+
+    if ((table = __IOCallStatsThreadTable()))
+        __IOCallStatsRecordClass(table, start, kIOCallStatsIOKitLib, call, inbandBytes, outOfLineBytes);
+}
+
+// called with __ioCallStatsLock held
+static uint32_t
+__IOCallStatsInternClass(const char * className)
+{
+    io_name_t * classes;
+    uint32_t    idx;
+
+    for (idx = 1; idx < __ioCallStatsClassCount; idx++)
+        if (!strncmp(__ioCallStatsClasses[idx], className, sizeof(io_name_t))) return (idx);
+
+    if (!__ioCallStatsClassCount) __ioCallStatsClassCount = 1;
+    if (!(__ioCallStatsClassCount & (__ioCallStatsClassCount - 1)))
+    {
+        classes = realloc(__ioCallStatsClasses, 2 * __ioCallStatsClassCount * sizeof(io_name_t));
+        if (!classes) return (kIOCallStatsIOKitLib);
+        __ioCallStatsClasses = classes;
+    }
+    strlcpy(__ioCallStatsClasses[__ioCallStatsClassCount], className, sizeof(io_name_t));
+
+    return (__ioCallStatsClassCount++);
+}
+
+static void
+__IOConnectCallStatsRecord(uint64_t start, io_connect_t connect, uint32_t selector,
+                           uint64_t inbandBytes, uint64_t outOfLineBytes)
+{
+    IOCallStatsTable * table;
+    const void *       value = NULL;
+    io_name_t          className;
+    uint32_t           classIndex, generation;
+
+    if ((MACH_PORT_NULL == connect) || !(table = __IOCallStatsThreadTable())) return;
+
+    generation = __c11_atomic_load((_Atomic uint32_t *)&__ioCallStatsConnectGeneration, __ATOMIC_RELAXED);
+    if ((connect == table->lastConnect) && (generation == table->lastGeneration))
+    {
+        classIndex = table->lastClass;
+    }
+    else
+    {
+        pthread_mutex_lock(&__ioCallStatsLock);
+        if (!__ioCallStatsConnects || !CFDictionaryGetValueIfPresent(__ioCallStatsConnects,
+                                            (const void *)(uintptr_t) connect, &value))
+        {
+            // one lookup per connect, kept until IOServiceClose() or its last release
+            pthread_mutex_unlock(&__ioCallStatsLock);
+            if (kIOReturnSuccess != IOObjectGetClass(connect, className))
+                strlcpy(className, "IOUserClient", sizeof(className));
+            pthread_mutex_lock(&__ioCallStatsLock);
+            value = (const void *)(uintptr_t) __IOCallStatsInternClass(className);
+            // releases are only watched while statistics are on
+            if (!__ioCallStatsConnects && __ioCallStatsEnabled)
+                __ioCallStatsConnects = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+            if (__ioCallStatsConnects && (CFDictionaryGetCount(__ioCallStatsConnects) >= kIOCallStatsMaxConnects))
+            {
+                // connects freed without a release are never forgotten; their classes can be looked up again
+                CFDictionaryRemoveAllValues(__ioCallStatsConnects);
+                __c11_atomic_fetch_add((_Atomic uint32_t *)&__ioCallStatsConnectGeneration, 1, __ATOMIC_RELAXED);
+            }
+            if (__ioCallStatsConnects)
+                CFDictionarySetValue(__ioCallStatsConnects, (const void *)(uintptr_t) connect, value);
+        }
+        pthread_mutex_unlock(&__ioCallStatsLock);
+
+        classIndex             = (uint32_t)(uintptr_t) value;
+        table->lastConnect     = connect;
+        table->lastClass       = classIndex;
+        table->lastGeneration  = generation;
+    }
+    // no class name to file it under
+    if (kIOCallStatsIOKitLib == classIndex) selector = kIOCallStatsOther;
+
+    __IOCallStatsRecordClass(table, start, classIndex, selector, inbandBytes, outOfLineBytes);
+}
+
+// called with the lock held
+static void
+__IOConnectCallStatsForgetLocked(io_connect_t connect)
+{
+    if (__ioCallStatsConnects && CFDictionaryContainsKey(__ioCallStatsConnects, (const void *)(uintptr_t) connect))
+    {
+        CFDictionaryRemoveValue(__ioCallStatsConnects, (const void *)(uintptr_t) connect);
+        __c11_atomic_fetch_add((_Atomic uint32_t *)&__ioCallStatsConnectGeneration, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+__IOConnectCallStatsForget(io_connect_t connect)
+{
+    pthread_mutex_lock(&__ioCallStatsLock);
+    __IOConnectCallStatsForgetLocked(connect);
+    pthread_mutex_unlock(&__ioCallStatsLock);
+}
+
+static mach_port_urefs_t
+__IOObjectGetUserReferences(io_object_t object);
+
+// called before the owner releases a reference on the name. The table is
+// emptied whenever statistics are turned on or off, so with them off there
+// is nothing to forget.
+static void
+__IOConnectCallStatsRelease(io_connect_t connect)
+{
+    if (!__c11_atomic_load((_Atomic boolean_t *)&__ioCallStatsEnabled, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&__ioCallStatsLock);
+    if (__ioCallStatsConnects && CFDictionaryContainsKey(__ioCallStatsConnects, (const void *)(uintptr_t) connect)
+     && (__IOObjectGetUserReferences(connect) <= 1))
+        __IOConnectCallStatsForgetLocked(connect);
+    pthread_mutex_unlock(&__ioCallStatsLock);
+}
+
+static CFNumberRef
+__IOCallStatsCreateNumber(uint64_t value)
+{
+    return (CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &value));
+}
+
+static void
+__IOCallStatsSetNumber(CFMutableDictionaryRef dict, CFStringRef key, uint64_t value)
+{
+    CFNumberRef number;
+
+    if ((number = __IOCallStatsCreateNumber(value)))
+    {
+        CFDictionarySetValue(dict, key, number);
+        CFRelease(number);
+    }
+}
+
+// the upper end of the bucket the permille'th call falls in
+static uint64_t
+__IOCallStatsPercentile(const IOCallStatsEntry * entry, uint64_t permille)
+{
+    uint64_t rank, seen = 0;
+    uint32_t idx;
+
+    rank = (entry->count * permille + 999) / 1000;
+    for (idx = 0; idx < kIOCallStatsBuckets; idx++)
+    {
+        seen += entry->buckets[idx];
+        if (seen >= rank) break;
+    }
+    if (idx >= (kIOCallStatsBuckets - 1)) return (entry->maxTime);
+
+    rank = __IOCallStatsBucketBase(idx + 1) - 1;
+    return ((rank < entry->maxTime) ? rank : entry->maxTime);
+}
+
+static CFDictionaryRef
+__IOCallStatsCreateDictionary(IOCallStatsTable * merged)
+{
+    CFMutableDictionaryRef result, calls, stats;
+    CFStringRef            className, selector;
+    IOCallStatsEntry *     entry;
+    uint32_t               idx;
+
+    result = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!result) return (NULL);
+
+    for (idx = 0; idx <= merged->size; idx++)
+    {
+        entry = (idx < merged->size) ? merged->entries[idx] : merged->other;
+        if (!entry || !entry->count) continue;
+
+        if (kIOCallStatsIOKitLib == entry->classIndex) {
+            className = CFSTR("IOKitLib");
+            CFRetain(className);
+            selector  = CFStringCreateWithCString(kCFAllocatorDefault,
+                            __ioCallStatsCallNames[entry->selector], kCFStringEncodingUTF8);
+        } else {
+            className = CFStringCreateWithCString(kCFAllocatorDefault,
+                            __ioCallStatsClasses[entry->classIndex], kCFStringEncodingUTF8);
+            selector  = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%u"), entry->selector);
+        }
+        stats = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                    &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        calls = className ? (CFMutableDictionaryRef) CFDictionaryGetValue(result, className) : NULL;
+        if (className && !calls && (calls = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                    &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks)))
+        {
+            CFDictionarySetValue(result, className, calls);
+            CFRelease(calls);
+        }
+
+        if (calls && selector && stats)
+        {
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsCountKey), entry->count);
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsTotalTimeKey), entry->totalTime);
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsMaxTimeKey), entry->maxTime);
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsP50Key), __IOCallStatsPercentile(entry, 500));
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsP90Key), __IOCallStatsPercentile(entry, 900));
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsP99Key), __IOCallStatsPercentile(entry, 990));
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsP999Key), __IOCallStatsPercentile(entry, 999));
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsInbandBytesKey), entry->inbandBytes);
+            __IOCallStatsSetNumber(stats, CFSTR(kIOCallStatisticsOutOfLineBytesKey), entry->outOfLineBytes);
+            CFDictionarySetValue(calls, selector, stats);
+        }
+        if (stats)     CFRelease(stats);
+        if (selector)  CFRelease(selector);
+        if (className) CFRelease(className);
+    }
+
+    return (result);
+}
+
+// called with __ioCallStatsLock held
+static void
+__IOCallStatsResetLocked(void)
+{
+    IOCallStatsTable *  table;
+    IOCallStatsEntry ** slot;
+    IOCallStatsEntry *  entry;
+    uint32_t            idx, bucket;
+
+    for (table = __ioCallStatsTables; table; table = table->next)
+    {
+        for (idx = 0; idx <= table->size; idx++)
+        {
+            slot  = (idx < table->size) ? &table->entries[idx] : &table->other;
+            entry = __c11_atomic_load((_Atomic(IOCallStatsEntry *) *)slot, __ATOMIC_ACQUIRE);
+            if (!entry) continue;
+            // racing with the owner may keep a call or two from before the reset
+            __c11_atomic_store((_Atomic uint64_t *)&entry->count, 0, __ATOMIC_RELAXED);
+            __c11_atomic_store((_Atomic uint64_t *)&entry->totalTime, 0, __ATOMIC_RELAXED);
+            __c11_atomic_store((_Atomic uint64_t *)&entry->maxTime, 0, __ATOMIC_RELAXED);
+            __c11_atomic_store((_Atomic uint64_t *)&entry->inbandBytes, 0, __ATOMIC_RELAXED);
+            __c11_atomic_store((_Atomic uint64_t *)&entry->outOfLineBytes, 0, __ATOMIC_RELAXED);
+            for (bucket = 0; bucket < kIOCallStatsBuckets; bucket++)
+                __c11_atomic_store((_Atomic uint64_t *)&entry->buckets[bucket], 0, __ATOMIC_RELAXED);
+        }
+    }
+    if (__ioCallStatsRetired)
+    {
+        __IOCallStatsTableFree(__ioCallStatsRetired);
+        __ioCallStatsRetired = NULL;
+    }
+}
+
+kern_return_t
+IOCallStatisticsSetEnabled(
+	boolean_t		enable )
+{
+    pthread_once(&__ioCallStatsOnce, &__IOCallStatsInitialize);
+    if (!__ioCallStatsKeyValid) return (kIOReturnNoResources);
+
+    pthread_mutex_lock(&__ioCallStatsLock);
+    __c11_atomic_store((_Atomic boolean_t *)&__ioCallStatsEnabled, enable, __ATOMIC_RELAXED);
+    // releases aren't watched while off, so names seen before may since have been reused
+    if (__ioCallStatsConnects)
+    {
+        CFRelease(__ioCallStatsConnects);
+        __ioCallStatsConnects = NULL;
+        __c11_atomic_fetch_add((_Atomic uint32_t *)&__ioCallStatsConnectGeneration, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&__ioCallStatsLock);
+
+    return (kIOReturnSuccess);
+}
+
+CFDictionaryRef
+IOCallStatisticsCopySnapshot(
+	IOOptionBits		options )
+{
+    IOCallStatsTable * merged;
+    IOCallStatsTable * table;
+    CFDictionaryRef    result;
+
+    merged = __IOCallStatsTableCreate(kIOCallStatsMergedEntries);
+    if (!merged) return (NULL);
+
+    pthread_mutex_lock(&__ioCallStatsLock);
+    for (table = __ioCallStatsTables; table; table = table->next)
+        __IOCallStatsTableAdd(merged, table);
+    if (__ioCallStatsRetired)
+        __IOCallStatsTableAdd(merged, __ioCallStatsRetired);
+    result = __IOCallStatsCreateDictionary(merged);
+    if (kIOCallStatisticsReset & options)
+        __IOCallStatsResetLocked();
+    pthread_mutex_unlock(&__ioCallStatsLock);
+
+    __IOCallStatsTableFree(merged);
+
+    return (result);
+}
+
+void
+IOCallStatisticsReset( void )
+{
+    pthread_mutex_lock(&__ioCallStatsLock);
+    __IOCallStatsResetLocked();
+    pthread_mutex_unlock(&__ioCallStatsLock);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 /*
  * IOObject
  */
 
+static uint64_t			__ioRegistryCacheMaxAge;
+static CFIndex			__ioMatchingCacheIteratorCount;
+
+static void
+__IORegistryCacheForgetObject(io_object_t object);
+
+typedef struct IOMatchingCacheSet IOMatchingCacheSet;
+
+// the IOObject calls answer for the cache's iterators as the kernel does for its IOUserIterator
+#define kIOMatchingCacheIteratorClass		"IOUserIterator"
+#define kIOMatchingCacheIteratorClassCount	3
+
+static const char * const __ioMatchingCacheIteratorClasses[kIOMatchingCacheIteratorClassCount] = {
+    kIOMatchingCacheIteratorClass, "OSIterator", "OSObject"
+};
+
+static IOMatchingCacheSet *
+__IOMatchingCacheCopySet(mach_port_t masterPort, CFDictionaryRef matching);
+static void
+__IOMatchingCacheSetRelease(IOMatchingCacheSet * set);
+static kern_return_t
+__IOMatchingCacheCreateIterator(IOMatchingCacheSet * set, io_iterator_t * iterator);
+static boolean_t
+__IOMatchingCacheIteratorNext(io_iterator_t iterator, io_object_t * next);
+static boolean_t
+__IOMatchingCacheIteratorReset(io_iterator_t iterator);
+static boolean_t
+__IOMatchingCacheIteratorIsValid(io_iterator_t iterator, boolean_t * valid);
+static boolean_t
+__IOMatchingCacheIsIterator(io_object_t object);
+static void
+__IOMatchingCacheForgetIterator(io_iterator_t iterator);
+static kern_return_t
+__IOServiceGetMatchingServices(mach_port_t _masterPort, CFDictionaryRef matching, io_iterator_t * existing);
+
+// The user references on a name, whether its port is alive or dead
+static mach_port_urefs_t
+__IOObjectGetUserReferences(io_object_t object)
+{
+    mach_port_urefs_t urefs = 0;
+
+    if ((KERN_SUCCESS != mach_port_get_refs(mach_task_self(), object, MACH_PORT_RIGHT_SEND, &urefs)) || !urefs)
+    {
+        if (KERN_SUCCESS != mach_port_get_refs(mach_task_self(), object, MACH_PORT_RIGHT_DEAD_NAME, &urefs))
+            urefs = 0;
+    }
+
+    return (urefs);
+}
+
+// Drops one reference on a name. What the library keeps about the name is
+// forgotten only with the last reference, since the name can be reused after.
+static kern_return_t
+__IOObjectDeallocate(io_object_t object)
+{
+    __IORegistryCacheForgetObject(object);
+    __IOConnectCallStatsRelease(object);
+    __IOMatchingCacheForgetIterator(object);
+
+    return (mach_port_deallocate(mach_task_self(), object));
+}
+
 kern_return_t
 IOObjectRelease(
 	io_object_t	object )
 {
-    return( mach_port_deallocate( mach_task_self(), object ));
+    return( __IOObjectDeallocate( object ));
 }
 
 kern_return_t
@@ -267,6 +922,11 @@ _IOObjectGetClass(
     CFTypeRef overrideType  = NULL;
     boolean_t override      = false;
 
+    if ( __IOMatchingCacheIsIterator(object) ) {
+        strlcpy(className, kIOMatchingCacheIteratorClass, sizeof(io_name_t));
+        return kIOReturnSuccess;
+    }
+
 #if !TARGET_OS_SIMULATOR
     if ( (options & kIOClassNameOverrideNone) == 0 ) {
         overrideType = IORegistryEntryCreateCFProperty(object, CFSTR(kIOClassNameOverrideKey), kCFAllocatorDefault, 0);
@@ -392,6 +1052,13 @@ _IOObjectConformsTo(
 	uint64_t        options)
 {
     boolean_t	conforms;
+    unsigned	idx;
+
+    if( __IOMatchingCacheIsIterator( object )) {
+	for( conforms = 0, idx = 0; !conforms && (idx < kIOMatchingCacheIteratorClassCount); idx++ )
+	    conforms = (0 == strcmp( className, __ioMatchingCacheIteratorClasses[idx] ));
+	return( conforms );
+    }
 
     if( kIOReturnSuccess != io_object_conforms_to(
 		object, (char *) className, &conforms ))
@@ -431,6 +1098,10 @@ IOObjectGetKernelRetainCount(
 {
     uint32_t	count;
 
+    // the set behind a cached iterator is only the library's
+    if( __IOMatchingCacheIsIterator( object ))
+	return( 1 );
+
     if( kIOReturnSuccess != io_object_get_retain_count( object, &count))
 	count = 0;
 
@@ -450,6 +1121,10 @@ IOObjectGetUserRetainCount(
 {
     mach_port_urefs_t urefs;
 
+    // a cached iterator is a dead name, one of whose references is the cache's
+    if( __IOMatchingCacheIsIterator( object ))
+	return( __IOObjectGetUserReferences( object ) - 1 );
+
     if( kIOReturnSuccess != mach_port_get_refs( mach_task_self(), object, MACH_PORT_RIGHT_SEND, &urefs))
 	urefs = 0;
 
@@ -466,6 +1141,9 @@ IOIteratorNext(
 {
     io_object_t	next;
 
+    if( __IOMatchingCacheIteratorNext( iterator, &next ))
+	return( next );
+
     if( kIOReturnSuccess != io_iterator_next( iterator, &next))
 	next = 0;
 
@@ -476,6 +1154,9 @@ void
 IOIteratorReset(
 	io_iterator_t	iterator )
 {
+    if( __IOMatchingCacheIteratorReset( iterator ))
+	return;
+
     io_iterator_reset( iterator );
 }
 
@@ -485,6 +1166,9 @@ IOIteratorIsValid(
 {
     boolean_t	valid;
 
+    if( __IOMatchingCacheIteratorIsValid( iterator, &valid ))
+	return( valid );
+
     if( kIOReturnSuccess != io_iterator_is_valid( iterator, &valid ))
 	valid = FALSE;
 
@@ -508,10 +1192,24 @@ IOServiceGetMatchingService(
     mach_port_t		masterPort;
     io_service_t        service = MACH_PORT_NULL;
     bool                ool;
-    
+    IOMatchingCacheSet *	set;
+    io_iterator_t	iter;
+
     if( !matching)
 	return( MACH_PORT_NULL);
 
+    if ((set = __IOMatchingCacheCopySet(_masterPort, matching)))
+    {
+	CFRelease( matching );
+	if (kIOReturnSuccess == __IOMatchingCacheCreateIterator(set, &iter))
+	{
+	    service = IOIteratorNext(iter);
+	    IOObjectRelease(iter);
+	}
+	__IOMatchingCacheSetRelease(set);
+	return( service );
+    }
+
     if (MACH_PORT_NULL == _masterPort)
 	masterPort = __IOGetDefaultMasterPort();
     else
@@ -570,6 +1268,29 @@ IOServiceGetMatchingServices(
         mach_port_t	_masterPort,
 	CFDictionaryRef	matching,
 	io_iterator_t * existing )
+{
+    IOMatchingCacheSet * set;
+    kern_return_t	 kr;
+
+    if( !matching)
+	return( kIOReturnBadArgument);
+
+    if ((set = __IOMatchingCacheCopySet(_masterPort, matching)))
+    {
+	CFRelease( matching );
+	kr = __IOMatchingCacheCreateIterator(set, existing);
+	__IOMatchingCacheSetRelease(set);
+	return( kr );
+    }
+
+    return( __IOServiceGetMatchingServices(_masterPort, matching, existing) );
+}
+
+static kern_return_t
+__IOServiceGetMatchingServices(
+        mach_port_t	_masterPort,
+	CFDictionaryRef	matching,
+	io_iterator_t * existing )
 {
     kern_return_t	kr;
     CFDataRef		data;
@@ -818,12 +1539,323 @@ IOServiceAddInterestNotification(
     return( kr );
 }
 
-IONotificationPortRef
-IONotificationPortCreate(
-	mach_port_t	masterPort )
-{
-    kern_return_t 	        kr;
-    IONotificationPort     *notify;
+/*
+ * Notification coalescing
+ */
+
+typedef struct IONotificationCoalesceEntry IONotificationCoalesceEntry;
+struct IONotificationCoalesceEntry {
+    io_iterator_t		notifier;	// holds the send right of the first message
+    IOServiceMatchingCallback	callback;
+    void *			refcon;
+    uint64_t			deadline;
+};
+
+struct IONotificationCoalescing {
+    pthread_mutex_t		lock;
+    uint64_t			window;
+    uint64_t			armed;		// deadline of the pending flush, or zero
+    boolean_t			cancelled;
+    CFRunLoopTimerRef		timer;
+    CFIndex			count;		// in deadline order
+    CFIndex			capacity;
+    IONotificationCoalesceEntry * entries;
+};
+
+static void
+IONotificationPortRelease(void *ctxt);
+
+static void
+__IONotificationPortFlush(IONotificationPortRef notify, dispatch_queue_t queue, uint64_t armed);
+
+static void
+__IODispatchCallout(void *_msg, IONotificationPortRef notify, dispatch_queue_t queue);
+
+static void
+__IONotificationPortCallout(CFMachPortRef port, void *msg, CFIndex size, void *info);
+
+static boolean_t
+__IONotificationPortNotifierLive(io_iterator_t notifier)
+{
+    kern_return_t	kr;
+    mach_port_urefs_t	urefs;
+
+    // one ref carried by the message - < 2 means owner has released the notifier
+    kr = mach_port_get_refs(mach_task_self(), notifier, MACH_PORT_RIGHT_SEND, &urefs);
+    return ((KERN_SUCCESS == kr) && (urefs >= 2));
+}
+
+struct IONotificationFlushContext {
+    IONotificationPortRef	notify;
+    dispatch_queue_t		queue;		// the queue that armed the flush
+    uint64_t			deadline;	// what it was armed for
+};
+
+static void
+__IONotificationPortFlushDispatch(void * ctxt)
+{
+    struct IONotificationFlushContext * context = ctxt;
+
+    // the port may have moved since, but entries armed here still drain here
+    __IONotificationPortFlush(context->notify, context->queue, context->deadline);
+    IONotificationPortRelease(context->notify);
+    dispatch_release(context->queue);
+    free(context);
+}
+
+static void
+__IONotificationPortFlushTimer(CFRunLoopTimerRef timer __unused, void * info)
+{
+    // the one timer is always set for the deadline armed last
+    __IONotificationPortFlush((IONotificationPortRef) info, NULL, 0);
+}
+
+// the timer holds a reference on the port, like the dispatch source
+static const void *
+__IONotificationPortTimerRetain(const void * info)
+{
+    OSAtomicIncrement32(&((IONotificationPortRef) info)->refcount);
+    return (info);
+}
+
+static void
+__IONotificationPortTimerRelease(const void * info)
+{
+    IONotificationPortRelease((void *) info);
+}
+
+// called with the coalescing lock held
+static void
+__IONotificationPortArm(IONotificationPortRef notify, dispatch_queue_t queue,
+			uint64_t deadline, uint64_t now)
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+    struct IONotificationFlushContext * flush;
+    uint64_t				delta, previous;
+    CFRunLoopTimerContext		context = { 0, notify, &__IONotificationPortTimerRetain,
+                                                    &__IONotificationPortTimerRelease, NULL };
+
+    // a flush is due by then already
+    if (state->armed && (state->armed <= deadline))
+        return;
+    previous     = state->armed;
+    state->armed = deadline;
+    delta = (deadline > now) ? (deadline - now) : 0;
+
+    if (queue) {
+        flush = malloc(sizeof(*flush));
+        if (!flush) {
+            state->armed = previous;
+            return;
+        }
+        // the block owns a reference, like the dispatch source
+        OSAtomicIncrement32(&notify->refcount);
+        dispatch_retain(queue);
+        flush->notify   = notify;
+        flush->queue    = queue;
+        flush->deadline = deadline;
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (int64_t) delta), queue,
+                         flush, &__IONotificationPortFlushDispatch);
+    } else if (state->timer) {
+        CFRunLoopTimerSetNextFireDate(state->timer, CFAbsoluteTimeGetCurrent() + delta / 1e9);
+    } else {
+        // repeating so it can be rearmed, the interval is never reached
+        state->timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                            CFAbsoluteTimeGetCurrent() + delta / 1e9, 1.0e10, 0, 0,
+                            &__IONotificationPortFlushTimer, &context);
+        if (!state->timer) {
+            state->armed = 0;
+            return;
+        }
+        // messages are handled on this run loop; fire in any mode a later one could arrive in
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), state->timer, kCFRunLoopCommonModes);
+    }
+}
+
+// armed is the deadline a dispatched flush was set for, zero for the timer.
+// A dispatched flush that was superseded by an earlier one leaves it armed.
+static void
+__IONotificationPortFlush(IONotificationPortRef notify, dispatch_queue_t queue, uint64_t armed)
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+    IONotificationCoalesceEntry *	due = NULL;
+    CFIndex				idx, dueCount;
+    uint64_t				now;
+    boolean_t				cancelled;
+
+    now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    pthread_mutex_lock(&state->lock);
+    if (!armed || (armed == state->armed))
+        state->armed = 0;
+    cancelled = state->cancelled;
+    for (dueCount = 0; (dueCount < state->count) && (state->entries[dueCount].deadline <= now); dueCount++) {}
+    if (dueCount)
+        due = malloc(dueCount * sizeof(*due));
+    if (due) {
+        memcpy(due, state->entries, dueCount * sizeof(*due));
+        state->count -= dueCount;
+        memmove(state->entries, state->entries + dueCount, state->count * sizeof(*due));
+    } else
+        dueCount = 0;
+    if (state->count && !cancelled)
+        __IONotificationPortArm(notify, queue, state->entries[0].deadline, now);
+    pthread_mutex_unlock(&state->lock);
+
+    for (idx = 0; idx < dueCount; idx++) {
+        if (!cancelled && __IONotificationPortNotifierLive(due[idx].notifier)) {
+            due[idx].callback(due[idx].refcon, due[idx].notifier);
+            __c11_atomic_fetch_add((_Atomic uint64_t *)&notify->statistics.delivered, 1, __ATOMIC_RELAXED);
+        }
+        mach_port_deallocate(mach_task_self(), due[idx].notifier);
+    }
+    if (due)
+        free(due);
+}
+
+// takes over the message's notifier reference when it returns true
+static boolean_t
+__IONotificationPortCoalesce(IONotificationPortRef notify, dispatch_queue_t queue,
+			     io_iterator_t notifier, NotificationHeader * header)
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+    IONotificationCoalesceEntry *	entry;
+    CFIndex				idx, capacity;
+    uint64_t				now;
+    boolean_t				taken = false;
+
+    if (!state)
+        return (false);
+    switch (kIOKitNoticationTypeMask & header->type)
+    {
+	case kIOServicePublishNotificationType:
+	case kIOServiceMatchedNotificationType:
+	case kIOServiceTerminatedNotificationType:
+	    break;
+	default:
+	    return (false);
+    }
+
+    now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    pthread_mutex_lock(&state->lock);
+    if (state->window && !state->cancelled)
+    {
+        for (idx = 0; (idx < state->count) && (state->entries[idx].notifier != notifier); idx++) {}
+
+        if (idx < state->count) {
+            // the pending callout finds this arrival in the iterator
+            mach_port_deallocate(mach_task_self(), notifier);
+            __c11_atomic_fetch_add((_Atomic uint64_t *)&notify->statistics.coalesced, 1, __ATOMIC_RELAXED);
+            taken = true;
+        } else {
+            if (state->count == state->capacity) {
+                capacity = state->capacity ? (2 * state->capacity) : 8;
+                entry = realloc(state->entries, capacity * sizeof(*entry));
+                if (entry) {
+                    state->entries  = entry;
+                    state->capacity = capacity;
+                }
+            }
+            if (state->count < state->capacity) {
+                // the window may have shrunk since earlier entries were made
+                for (idx = state->count; (idx > 0) && (state->entries[idx - 1].deadline > now + state->window); idx--) {}
+                memmove(&state->entries[idx + 1], &state->entries[idx], (state->count - idx) * sizeof(*entry));
+                state->count++;
+                entry = &state->entries[idx];
+                entry->notifier = notifier;
+                entry->callback = (IOServiceMatchingCallback) header->reference[kIOMatchingCalloutFuncIndex];
+                entry->refcon   = (void *) header->reference[kIOMatchingCalloutRefconIndex];
+                entry->deadline = now + state->window;
+                // rearms earlier if this is the new head
+                __IONotificationPortArm(notify, queue, state->entries[0].deadline, now);
+                taken = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return (taken);
+}
+
+static void
+__IONotificationPortCancelCoalescing(IONotificationPortRef notify)
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+
+    if (!state)
+        return;
+
+    pthread_mutex_lock(&state->lock);
+    state->cancelled = true;
+    if (state->timer) {
+        CFRunLoopTimerInvalidate(state->timer);
+        CFRelease(state->timer);
+        state->timer = NULL;
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+static void
+__IONotificationPortFreeCoalescing(IONotificationPortRef notify)
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+    CFIndex				idx;
+
+    if (!state)
+        return;
+
+    for (idx = 0; idx < state->count; idx++)
+        mach_port_deallocate(mach_task_self(), state->entries[idx].notifier);
+    if (state->entries)
+        free(state->entries);
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+    notify->coalescing = NULL;
+}
+
+kern_return_t
+IONotificationPortSetCoalescing(
+	IONotificationPortRef	notify,
+	uint64_t		window )
+{
+    struct IONotificationCoalescing * state = notify->coalescing;
+
+    if (!state) {
+        if (!window)
+            return (kIOReturnSuccess);
+        state = calloc(1, sizeof(*state));
+        if (!state)
+            return (kIOReturnNoMemory);
+        pthread_mutex_init(&state->lock, NULL);
+        __c11_atomic_store((_Atomic(struct IONotificationCoalescing *) *)&notify->coalescing, state, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->window = window;
+    pthread_mutex_unlock(&state->lock);
+
+    return (kIOReturnSuccess);
+}
+
+void
+IONotificationPortGetStatistics(
+	IONotificationPortRef	notify,
+	IONotificationPortStatistics * statistics )
+{
+    statistics->received  = __c11_atomic_load((_Atomic uint64_t *)&notify->statistics.received, __ATOMIC_RELAXED);
+    statistics->coalesced = __c11_atomic_load((_Atomic uint64_t *)&notify->statistics.coalesced, __ATOMIC_RELAXED);
+    statistics->delivered = __c11_atomic_load((_Atomic uint64_t *)&notify->statistics.delivered, __ATOMIC_RELAXED);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+IONotificationPortRef
+IONotificationPortCreate(
+	mach_port_t	masterPort )
+{
+    kern_return_t 	        kr;
+    IONotificationPort     *notify;
 
     if (MACH_PORT_NULL == masterPort) {
         masterPort = __IOGetDefaultMasterPort();
@@ -866,6 +1898,10 @@ IONotificationPortRelease(void *ctxt)
 		mach_port_mod_refs(mach_task_self(), notify->wakePort,
 				MACH_PORT_RIGHT_RECEIVE, -1);
 		mach_port_deallocate(mach_task_self(), notify->masterPort);
+		if (notify->dispatchQueue) {
+			dispatch_release(notify->dispatchQueue);
+		}
+		__IONotificationPortFreeCoalescing(notify);
 		free( notify );
 	}
 }
@@ -888,6 +1924,8 @@ IONotificationPortDestroy(
 		dispatch_release(notify->dispatchSource);
 	}
 
+	__IONotificationPortCancelCoalescing(notify);
+
 	IONotificationPortRelease(notify);
 }
 
@@ -908,7 +1946,7 @@ IONotificationPortGetRunLoopSource(
     context.copyDescription = NULL;
 
     notify->cfmachPort = CFMachPortCreateWithPort(NULL, notify->wakePort,
-        IODispatchCalloutFromCFMessage, &context, &cfReusedPort);
+        __IONotificationPortCallout, &context, &cfReusedPort);
     if (!notify->cfmachPort)
         return NULL;
     
@@ -967,7 +2005,9 @@ boolean_t _IODispatchCalloutWithDispatch(mach_msg_header_t *msg, mach_msg_header
     mig_reply_setup(msg, reply);
     ((mig_reply_error_t*)reply)->RetCode = MIG_NO_REPLY;
 
-    IODispatchCalloutFromCFMessage(NULL, msg, msg->msgh_size, dispatch_mach_msg_get_context(msg));
+    IONotificationPortRef notify = dispatch_mach_msg_get_context(msg);
+
+    __IODispatchCallout(msg, notify, notify->dispatchQueue);
     return TRUE;
 }
 
@@ -983,9 +2023,16 @@ IONotificationPortSetDispatchQueue(IONotificationPortRef notify, dispatch_queue_
 		dispatch_release(notify->dispatchSource);
 		notify->dispatchSource = NULL;
 	}
+	if (notify->dispatchQueue) {
+		dispatch_release(notify->dispatchQueue);
+		notify->dispatchQueue = NULL;
+	}
 
 	if (!queue) return;
 
+	dispatch_retain(queue);
+	notify->dispatchQueue = queue;
+
 	OSAtomicIncrement32(&notify->refcount);
 	dispatchSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_MACH_RECV, notify->wakePort, 0, queue);
 	dispatch_set_context(dispatchSource, notify);
@@ -1132,6 +2179,457 @@ IOOpenFirmwarePathMatching(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * Client side matching. A matching dictionary is compiled once into a list of
+ * instructions, one per key the kernel's IOService::matchInternal() and
+ * matchPassive() understand, in the order they check them, with the operands
+ * pulled out of the dictionary ahead of time. Keys that need state only the
+ * kernel has compile to kIOMatchingOpUnknown.
+ */
+#define kIOMatchingProgramMaxDepth	32
+
+enum {
+    kIOMatchingOpProviderClass = 1,	// value: class name
+    kIOMatchingOpName,			// value: CFArray of names, data: CFArray of their UTF-8 bytes
+    kIOMatchingOpLocation,		// value: location
+    kIOMatchingOpProperties,		// keys/values/ends: the alternatives, flattened
+    kIOMatchingOpPropertyExists,	// value: CFArray of keys
+    kIOMatchingOpPath,			// value: service plane path
+    kIOMatchingOpEntryID,		// number
+    kIOMatchingOpProperty,		// key, value
+    kIOMatchingOpUnknown
+};
+
+typedef struct {
+    uint32_t		op;
+    CFTypeRef		key;
+    CFTypeRef		value;
+    CFArrayRef		data;
+    uint64_t		number;
+    CFIndex		count;
+    const void **	keys;
+    const void **	values;
+    CFIndex *		ends;
+} IOMatchingInstruction;
+
+struct IOMatchingProgram {
+    IOMatchingProgramRef	parent;		// IOParentMatch, any provider up to the root
+    IOMatchingProgramRef	location;	// IOLocationMatch dictionary, whichever provider answers
+    CFIndex			count;
+    IOMatchingInstruction	instructions[];
+};
+
+typedef struct {
+    IOMatchingProgramRef	program;
+    IOOptionBits		options;
+    CFIndex			depth;
+    boolean_t			failed;
+} IOMatchingCompiler;
+
+static IOMatchingProgramRef __IOMatchingProgramCompile(CFDictionaryRef matching, IOOptionBits options, CFIndex depth);
+
+static void
+__IOMatchingCollectStrings(const void * value, void * context)
+{
+    if (CFStringGetTypeID() == CFGetTypeID(value)) CFArrayAppendValue((CFMutableArrayRef) context, value);
+}
+
+static void
+__IOMatchingCollectKeys(const void * key, const void * value __unused, void * context)
+{
+    __IOMatchingCollectStrings(key, context);
+}
+
+// strings from a string, or the members of an array, set or the keys of a
+// dictionary, as OSCollectionIterator hands them to the kernel.
+static CFArrayRef
+__IOMatchingCopyStrings(CFTypeRef obj)
+{
+    CFMutableArrayRef	array;
+    CFTypeID		type = CFGetTypeID(obj);
+
+    array = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+    if (!array) return (NULL);
+
+    if (CFStringGetTypeID() == type)
+        CFArrayAppendValue(array, obj);
+    else if (CFArrayGetTypeID() == type)
+        CFArrayApplyFunction((CFArrayRef) obj, CFRangeMake(0, CFArrayGetCount((CFArrayRef) obj)),
+                                &__IOMatchingCollectStrings, array);
+    else if (CFSetGetTypeID() == type)
+        CFSetApplyFunction((CFSetRef) obj, &__IOMatchingCollectStrings, array);
+    else if (CFDictionaryGetTypeID() == type)
+        CFDictionaryApplyFunction((CFDictionaryRef) obj, &__IOMatchingCollectKeys, array);
+    else
+    {
+        CFRelease(array);
+        array = NULL;
+    }
+
+    return (array);
+}
+
+static void
+__IOMatchingCollectDictionaries(const void * value, void * context)
+{
+    if (CFDictionaryGetTypeID() == CFGetTypeID(value)) CFArrayAppendValue((CFMutableArrayRef) context, value);
+}
+
+static IOMatchingInstruction *
+__IOMatchingEmit(IOMatchingCompiler * compiler, uint32_t op, CFTypeRef key, CFTypeRef value)
+{
+    IOMatchingInstruction * inst;
+
+    inst = &compiler->program->instructions[compiler->program->count++];
+    inst->op    = op;
+    inst->key   = key   ? CFRetain(key)   : NULL;
+    inst->value = value ? CFRetain(value) : NULL;
+
+    return (inst);
+}
+
+static void
+__IOMatchingCompileKey(const void * _key, const void * obj, void * context)
+{
+    IOMatchingCompiler *    compiler = (IOMatchingCompiler *) context;
+    IOMatchingInstruction * inst;
+    CFStringRef		    key = (CFStringRef) _key;
+    CFTypeID		    type = CFGetTypeID(obj);
+    CFMutableArrayRef	    alternatives;
+    CFMutableArrayRef	    data;
+    CFArrayRef		    strings;
+    CFDataRef		    bytes;
+    CFDictionaryRef	    dict;
+    CFIndex		    idx, count, total;
+
+    if (compiler->failed || (CFStringGetTypeID() != CFGetTypeID(key))) return;
+
+    if (CFEqual(key, CFSTR(kIOProviderClassKey)) && (CFStringGetTypeID() == type))
+    {
+        __IOMatchingEmit(compiler, kIOMatchingOpProviderClass, key, obj);
+    }
+    else if (CFEqual(key, CFSTR(kIONameMatchKey)) && (strings = __IOMatchingCopyStrings(obj)))
+    {
+        inst = __IOMatchingEmit(compiler, kIOMatchingOpName, key, strings);
+        data = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+        for (idx = 0; data && (idx < CFArrayGetCount(strings)); idx++)
+        {
+            bytes = CFStringCreateExternalRepresentation(kCFAllocatorDefault,
+                        CFArrayGetValueAtIndex(strings, idx), kCFStringEncodingUTF8, 0);
+            if (!bytes) continue;
+            CFArrayAppendValue(data, bytes);
+            CFRelease(bytes);
+        }
+        inst->data = data;
+        CFRelease(strings);
+    }
+    else if (CFEqual(key, CFSTR(kIOLocationMatchKey)) && (CFStringGetTypeID() == type))
+    {
+        __IOMatchingEmit(compiler, kIOMatchingOpLocation, key, obj);
+    }
+    else if (CFEqual(key, CFSTR(kIOPropertyMatchKey)))
+    {
+        alternatives = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+        if (!alternatives) { compiler->failed = true; return; }
+        if (CFDictionaryGetTypeID() == type)
+            CFArrayAppendValue(alternatives, obj);
+        else if (CFArrayGetTypeID() == type)
+            CFArrayApplyFunction((CFArrayRef) obj, CFRangeMake(0, CFArrayGetCount((CFArrayRef) obj)),
+                                    &__IOMatchingCollectDictionaries, alternatives);
+        else if (CFSetGetTypeID() == type)
+            CFSetApplyFunction((CFSetRef) obj, &__IOMatchingCollectDictionaries, alternatives);
+
+        // the dictionaries stay retained by value, so keys and values needn't be
+        count = CFArrayGetCount(alternatives);
+        for (total = 0, idx = 0; idx < count; idx++)
+            total += CFDictionaryGetCount(CFArrayGetValueAtIndex(alternatives, idx));
+
+        inst = __IOMatchingEmit(compiler, kIOMatchingOpProperties, key, alternatives);
+        CFRelease(alternatives);
+        inst->count  = count;
+        inst->keys   = (const void **) calloc(total ? total : 1, sizeof(void *));
+        inst->values = (const void **) calloc(total ? total : 1, sizeof(void *));
+        inst->ends   = (CFIndex *) calloc(count ? count : 1, sizeof(CFIndex));
+        if (!inst->keys || !inst->values || !inst->ends) { compiler->failed = true; return; }
+        for (total = 0, idx = 0; idx < count; idx++)
+        {
+            dict = CFArrayGetValueAtIndex(alternatives, idx);
+            CFDictionaryGetKeysAndValues(dict, &inst->keys[total], &inst->values[total]);
+            total += CFDictionaryGetCount(dict);
+            inst->ends[idx] = total;
+        }
+    }
+    else if (CFEqual(key, CFSTR(kIOPropertyExistsMatchKey)))
+    {
+        // neither a key nor a collection of them, which the kernel doesn't match
+        if (!(strings = __IOMatchingCopyStrings(obj)))
+            strings = CFArrayCreate(kCFAllocatorDefault, NULL, 0, &kCFTypeArrayCallBacks);
+        if (!strings) { compiler->failed = true; return; }
+        __IOMatchingEmit(compiler, kIOMatchingOpPropertyExists, key, strings);
+        CFRelease(strings);
+    }
+    else if (CFEqual(key, CFSTR(kIOPathMatchKey)) && (CFStringGetTypeID() == type)
+             && CFStringHasPrefix(obj, CFSTR(kIOServicePlane ":")))
+    {
+        // other planes and aliases would need IORegistryEntry::fromPath()
+        __IOMatchingEmit(compiler, kIOMatchingOpPath, key, obj);
+    }
+    else if (CFEqual(key, CFSTR(kIORegistryEntryIDKey)) && (CFNumberGetTypeID() == type))
+    {
+        inst = __IOMatchingEmit(compiler, kIOMatchingOpEntryID, key, obj);
+        CFNumberGetValue(obj, kCFNumberSInt64Type, &inst->number);
+    }
+    else if (CFEqual(key, CFSTR(kIOBSDNameKey)) || CFEqual(key, CFSTR(kIOBSDMajorKey))
+          || CFEqual(key, CFSTR(kIOBSDMinorKey)) || CFEqual(key, CFSTR(kIOBSDUnitKey)))
+    {
+        __IOMatchingEmit(compiler, kIOMatchingOpProperty, key, obj);
+    }
+    else if (CFEqual(key, CFSTR(kIOParentMatchKey)) && (CFDictionaryGetTypeID() == type))
+    {
+        compiler->program->parent = __IOMatchingProgramCompile(obj, compiler->options, compiler->depth + 1);
+        if (!compiler->program->parent) compiler->failed = true;
+    }
+    else if (CFEqual(key, CFSTR(kIOLocationMatchKey)) && (CFDictionaryGetTypeID() == type))
+    {
+        compiler->program->location = __IOMatchingProgramCompile(obj, compiler->options, compiler->depth + 1);
+        if (!compiler->program->location) compiler->failed = true;
+    }
+    else if (!(kIOMatchingProgramIgnoreUnknownKeys & compiler->options)
+          || CFEqual(key, CFSTR(kIOResourceMatchKey))
+          || CFEqual(key, CFSTR(kIOMatchedServiceCountKey))
+          || CFEqual(key, CFSTR(kIOCompatibilityMatchKey)))
+    {
+        // IOResourceMatch, counts of matched services, IOCompatibilityMatch and
+        // the keys handed to the class's matchPropertyTable()
+        __IOMatchingEmit(compiler, kIOMatchingOpUnknown, key, obj);
+    }
+}
+
+static int
+__IOMatchingCompareInstructions(const void * a, const void * b)
+{
+    const IOMatchingInstruction * ia = (const IOMatchingInstruction *) a;
+    const IOMatchingInstruction * ib = (const IOMatchingInstruction *) b;
+
+    return ((ia->op < ib->op) ? -1 : (ia->op > ib->op));
+}
+
+static IOMatchingProgramRef
+__IOMatchingProgramCompile(CFDictionaryRef matching, IOOptionBits options, CFIndex depth)
+{
+    IOMatchingCompiler compiler;
+    CFIndex	       count;
+
+    if ((depth > kIOMatchingProgramMaxDepth) || (CFDictionaryGetTypeID() != CFGetTypeID(matching))) return (NULL);
+
+    count = CFDictionaryGetCount(matching);
+    compiler.program = (IOMatchingProgramRef) calloc(1, sizeof(struct IOMatchingProgram)
+                                                + count * sizeof(IOMatchingInstruction));
+    if (!compiler.program) return (NULL);
+    compiler.options = options;
+    compiler.depth   = depth;
+    compiler.failed  = false;
+
+    CFDictionaryApplyFunction(matching, &__IOMatchingCompileKey, &compiler);
+    if (compiler.failed)
+    {
+        IOMatchingProgramRelease(compiler.program);
+        return (NULL);
+    }
+    // dictionary order is arbitrary, the kernel's is cheapest first
+    qsort(compiler.program->instructions, compiler.program->count, sizeof(IOMatchingInstruction),
+            &__IOMatchingCompareInstructions);
+
+    return (compiler.program);
+}
+
+IOMatchingProgramRef
+IOMatchingProgramCreate(
+	CFDictionaryRef		matching,
+	IOOptionBits		options )
+{
+    if (!matching) return (NULL);
+    return (__IOMatchingProgramCompile(matching, options, 0));
+}
+
+void
+IOMatchingProgramRelease(
+	IOMatchingProgramRef	program )
+{
+    IOMatchingInstruction * inst;
+    CFIndex		    idx;
+
+    if (!program) return;
+
+    for (idx = 0; idx < program->count; idx++)
+    {
+        inst = &program->instructions[idx];
+        if (inst->key)    CFRelease(inst->key);
+        if (inst->value)  CFRelease(inst->value);
+        if (inst->data)   CFRelease(inst->data);
+        if (inst->keys)   free(inst->keys);
+        if (inst->values) free(inst->values);
+        if (inst->ends)   free(inst->ends);
+    }
+    IOMatchingProgramRelease(program->parent);
+    IOMatchingProgramRelease(program->location);
+    free(program);
+}
+
+// device tree nubs also match on their "name" and "compatible" properties,
+// which hold one or more zero terminated strings.
+static boolean_t
+__IOMatchingCompareNubNames(IOMatchingInstruction * inst, CFTypeRef prop)
+{
+    const UInt8 * bytes;
+    const UInt8 * end;
+    CFIndex	  len, idx;
+    CFDataRef	  name;
+
+    if (!prop || !inst->data || (CFDataGetTypeID() != CFGetTypeID(prop))) return (false);
+
+    bytes = CFDataGetBytePtr(prop);
+    end   = bytes + CFDataGetLength(prop);
+    while (bytes < end)
+    {
+        len = strnlen((const char *) bytes, end - bytes);
+        for (idx = 0; idx < CFArrayGetCount(inst->data); idx++)
+        {
+            name = CFArrayGetValueAtIndex(inst->data, idx);
+            if ((len == CFDataGetLength(name)) && !memcmp(bytes, CFDataGetBytePtr(name), len)) return (true);
+        }
+        bytes += len + 1;
+    }
+
+    return (false);
+}
+
+static IOMatchingProgramResult
+__IOMatchingProgramEvaluate(IOMatchingProgramRef program, const IOMatchingSnapshot * snapshot)
+{
+    IOMatchingProgramResult   result = kIOMatchingProgramMatch;
+    IOMatchingProgramResult   parent, ancestor;
+    IOMatchingInstruction *   inst;
+    const IOMatchingSnapshot * where;
+    CFDictionaryRef	      properties = snapshot->properties;
+    CFTypeRef		      prop;
+    CFIndex		      idx, alt, start;
+    boolean_t		      unknown, match;
+
+    for (idx = 0; idx < program->count; idx++)
+    {
+        inst    = &program->instructions[idx];
+        unknown = false;
+        match   = false;
+
+        switch (inst->op)
+        {
+            case kIOMatchingOpProviderClass:
+                if (!snapshot->classes) unknown = true;
+                else match = CFArrayContainsValue(snapshot->classes,
+                                CFRangeMake(0, CFArrayGetCount(snapshot->classes)), inst->value);
+                break;
+
+            case kIOMatchingOpName:
+                if (snapshot->name) match = CFArrayContainsValue(inst->value,
+                                CFRangeMake(0, CFArrayGetCount(inst->value)), snapshot->name);
+                if (!match && properties)
+                {
+                    match = __IOMatchingCompareNubNames(inst, CFDictionaryGetValue(properties, CFSTR("name")))
+                         || __IOMatchingCompareNubNames(inst, CFDictionaryGetValue(properties, CFSTR("compatible")));
+                }
+                unknown = (!match && !snapshot->name);
+                break;
+
+            case kIOMatchingOpLocation:
+                if (!snapshot->location) unknown = true;
+                else match = CFEqual(snapshot->location, inst->value);
+                break;
+
+            case kIOMatchingOpProperties:
+                if (!properties) { unknown = true; break; }
+                for (start = 0, alt = 0; !match && (alt < inst->count); start = inst->ends[alt++])
+                {
+                    for (match = true, prop = NULL; match && (start < inst->ends[alt]); start++)
+                    {
+                        prop  = CFDictionaryGetValue(properties, inst->keys[start]);
+                        match = (prop && CFEqual(prop, inst->values[start]));
+                    }
+                }
+                break;
+
+            case kIOMatchingOpPropertyExists:
+                if (!CFArrayGetCount(inst->value)) break;
+                if (!properties) { unknown = true; break; }
+                for (alt = 0; !match && (alt < CFArrayGetCount(inst->value)); alt++)
+                    match = CFDictionaryContainsKey(properties, CFArrayGetValueAtIndex(inst->value, alt));
+                break;
+
+            case kIOMatchingOpPath:
+                // the kernel also takes aliases and other spellings, so only equality is conclusive
+                if (snapshot->path) match = CFEqual(snapshot->path, inst->value);
+                unknown = !match;
+                break;
+
+            case kIOMatchingOpEntryID:
+                if (!snapshot->entryID) unknown = true;
+                else match = (snapshot->entryID == inst->number);
+                break;
+
+            case kIOMatchingOpProperty:
+                if (!properties) { unknown = true; break; }
+                prop  = CFDictionaryGetValue(properties, inst->key);
+                match = (prop && CFEqual(prop, inst->value));
+                break;
+
+            default:
+                unknown = true;
+                break;
+        }
+        if (unknown) result = kIOMatchingProgramUnknown;
+        else if (!match) return (kIOMatchingProgramNoMatch);
+    }
+
+    if (program->parent)
+    {
+        // any provider on the way to the root will do
+        for (parent = kIOMatchingProgramNoMatch, where = snapshot->provider;
+             where && (kIOMatchingProgramMatch != parent);
+             where = where->provider)
+        {
+            ancestor = __IOMatchingProgramEvaluate(program->parent, where);
+            if (kIOMatchingProgramNoMatch != ancestor) parent = ancestor;
+        }
+        if (kIOMatchingProgramMatch != parent) result = parent;
+    }
+    else if (program->location)
+    {
+        // the provider's matchLocation() picks the entry compared, by default
+        // asking its own provider, so only a miss all the way up is known
+        for (parent = kIOMatchingProgramNoMatch, where = snapshot->provider;
+             where && (kIOMatchingProgramNoMatch == parent);
+             where = where->provider)
+        {
+            if (kIOMatchingProgramNoMatch != __IOMatchingProgramEvaluate(program->location, where))
+                parent = kIOMatchingProgramUnknown;
+        }
+        if (kIOMatchingProgramMatch != parent) result = parent;
+    }
+
+    return (result);
+}
+
+IOMatchingProgramResult
+IOMatchingProgramEvaluate(
+	IOMatchingProgramRef	program,
+	const IOMatchingSnapshot * snapshot )
+{
+    if (!program || !snapshot) return (kIOMatchingProgramUnknown);
+    return (__IOMatchingProgramEvaluate(program, snapshot));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 kern_return_t
 OSGetNotificationFromMessage(
 	mach_msg_header_t	 *msg,
@@ -1182,6 +2680,19 @@ IODispatchCalloutFromMessage(void *cfPort, mach_msg_header_t *msg, void *info)
 void
 IODispatchCalloutFromCFMessage(CFMachPortRef port __unused,
 			void *_msg, CFIndex size __unused, void *info __unused)
+{
+    __IODispatchCallout(_msg, NULL, NULL);
+}
+
+static void
+__IONotificationPortCallout(CFMachPortRef port __unused,
+			void *msg, CFIndex size __unused, void *info)
+{
+    __IODispatchCallout(msg, (IONotificationPortRef) info, NULL);
+}
+
+static void
+__IODispatchCallout(void *_msg, IONotificationPortRef notify, dispatch_queue_t queue)
 {
     struct ComplexMsg {
         mach_msg_header_t		msgHdr;
@@ -1198,6 +2709,9 @@ IODispatchCalloutFromCFMessage(CFMachPortRef port __unused,
     if( msg->msgh_id != kOSNotificationMessageID)
 	return;
 
+    if( notify)
+	__c11_atomic_fetch_add((_Atomic uint64_t *)&notify->statistics.received, 1, __ATOMIC_RELAXED);
+
     if( MACH_MSGH_BITS_COMPLEX & msg->msgh_bits) {
 
 	complexMsg = (struct ComplexMsg *)_msg;
@@ -1214,7 +2728,13 @@ IODispatchCalloutFromCFMessage(CFMachPortRef port __unused,
     // remote port is the notification (an iterator_t) that fired
     notifier = msg->msgh_remote_port;
 
-    if( MACH_PORT_NULL != notifier) {
+    if( notify && (MACH_PORT_NULL != notifier)
+     && __IONotificationPortCoalesce(notify, queue, notifier, header)) {
+	// a callout at the end of the coalescing window owns the notifier now
+	notifier = MACH_PORT_NULL;
+	deliver = false;
+    }
+    else if( MACH_PORT_NULL != notifier) {
 	kern_return_t kr;
 	mach_port_urefs_t urefs;
 
@@ -1285,15 +2805,18 @@ IODispatchCalloutFromCFMessage(CFMachPortRef port __unused,
 		notifier);
 	    break;
       }
+      if( notify)
+	__c11_atomic_fetch_add((_Atomic uint64_t *)&notify->statistics.delivered, 1, __ATOMIC_RELAXED);
     }
 
+    // caches keyed by these names forget them with their last reference
     if( MACH_PORT_NULL != notifier)
-	mach_port_deallocate( mach_task_self(), notifier );
+	__IOObjectDeallocate( notifier );
     if( complexMsg)
     {
 	uint32_t i;
 	for( i = 0; i < complexMsg->msgBody.msgh_descriptor_count; i++)
-	    mach_port_deallocate( mach_task_self(), complexMsg->ports[i].name );
+	    __IOObjectDeallocate( complexMsg->ports[i].name );
     }
 }
 
@@ -1465,9 +2988,12 @@ IOServiceOpen(
 {
     kern_return_t	kr;
     kern_return_t	result;
+    uint64_t		start;
 
+    start = __IOCallStatsBegin();
     kr = io_service_open_extended( service,
 	owningTask, type, NDR_record, NULL, 0, &result, connect );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsServiceOpen, 0, 0);
 
     if (KERN_SUCCESS == kr)
         kr = result;
@@ -1480,8 +3006,12 @@ IOServiceClose(
 	io_connect_t	connect )
 {
     kern_return_t	kr;
+    uint64_t		start;
 
+    start = __IOCallStatsBegin();
     kr = io_service_close( connect);
+    if (start) __IOCallStatsRecord(start, kIOCallStatsServiceClose, 0, 0);
+    __IOConnectCallStatsForget( connect );
     IOObjectRelease( connect );
 
     return( kr );
@@ -1837,6 +3367,7 @@ IOConnectCallMethod(
     mach_vm_size_t		 ool_output_size = 0;
     io_buf_ptr_t                 var_output      = NULL;
     mach_msg_type_number_t       var_output_size = 0;
+    uint64_t			 start;
 
     if (inputStructCnt <= sizeof(io_struct_inband_t)) {
 	inb_input      = (void *) inputStruct;
@@ -1857,6 +3388,7 @@ IOConnectCallMethod(
 
 	if (size == (size_t) kIOConnectMethodVarOutputSize) {
 
+	    start = __IOCallStatsBegin();
 	    rtn = io_connect_method_var_output(
 	    			    connection,         selector,
 				    (uint64_t *) input, inputCnt,
@@ -1865,6 +3397,9 @@ IOConnectCallMethod(
 				    inb_output,         &inb_output_size,
 				    output,             outputCnt,
 				    &var_output,	&var_output_size);
+	    if (start) __IOConnectCallStatsRecord(start, connection, selector,
+				    (inputCnt + *outputCnt) * sizeof(uint64_t) + inb_input_size + inb_output_size,
+				    ool_input_size + var_output_size);
 
 	    *(void **)outputStruct = var_output;
 	    *outputStructCntP      = var_output_size;
@@ -1882,6 +3417,7 @@ IOConnectCallMethod(
 	}
     }
 
+    start = __IOCallStatsBegin();
     rtn = io_connect_method(connection,         selector,
 			    (uint64_t *) input, inputCnt,
 			    inb_input,          inb_input_size,
@@ -1889,6 +3425,9 @@ IOConnectCallMethod(
 			    inb_output,         &inb_output_size,
 			    output,             outputCnt,
 			    ool_output,         &ool_output_size);
+    if (start) __IOConnectCallStatsRecord(start, connection, selector,
+			    (inputCnt + *outputCnt) * sizeof(uint64_t) + inb_input_size + inb_output_size,
+			    ool_input_size + ool_output_size);
 
     if (outputStructCntP) {
 	if (*outputStructCntP <= sizeof(io_struct_inband_t))
@@ -1928,6 +3467,7 @@ IOConnectCallAsyncMethod(
     mach_vm_address_t		 ool_output      = 0;
     mach_vm_size_t		 ool_output_size = 0;
     static uint64_t		 temp_reference[1] = {0};
+    uint64_t			 start;
 
     if (inputStructCnt <= sizeof(io_struct_inband_t)) {
 	inb_input      = (void *) inputStruct;
@@ -1961,6 +3501,7 @@ IOConnectCallAsyncMethod(
         referenceCnt = 1;
     }
 
+    start = __IOCallStatsBegin();
     rtn = io_connect_async_method(connection,         wakePort,
 				  reference,          referenceCnt,
 				  selector,
@@ -1970,6 +3511,9 @@ IOConnectCallAsyncMethod(
 				  inb_output,         &inb_output_size,
 				  output,             outputCnt,
 				  ool_output,         &ool_output_size);
+    if (start) __IOConnectCallStatsRecord(start, connection, selector,
+				  (inputCnt + *outputCnt) * sizeof(uint64_t) + inb_input_size + inb_output_size,
+				  ool_input_size + ool_output_size);
 
     if (outputStructCntP) {
 	if (*outputStructCntP <= sizeof(io_struct_inband_t))
@@ -2055,299 +3599,2689 @@ IOConnectCallAsyncScalarMethod(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-kern_return_t
-IOConnectTrap0(io_connect_t	connect,
-	       uint32_t		index)
-{
-    return iokit_user_client_trap(connect, index, 0, 0, 0, 0, 0, 0);
+/*
+ * IOConnectBatch
+ *
+ * A batch appends commands to the ring and keeps completionEnd, where the
+ * completion ring's tail will be once every appended command has completed,
+ * so a command is only appended when its completion is sure to fit. Submitting
+ * runs the commands and copies the completions off the ring into results,
+ * leaving both rings empty.
+ */
+
+#define kIOConnectBatchEmulatedSize	(sizeof(IOConnectBatchRing) + 64 * 1024)
+
+typedef struct IOConnectBatch IOConnectBatch;
+struct IOConnectBatch {
+    io_connect_t		connect;
+    uint32_t			memoryType;
+    uint32_t			submitSelector;
+    IOConnectBatchRing *	ring;
+    size_t			size;
+    mach_vm_address_t		mapped;		// zero unless mapped from the user client
+    boolean_t			ownsRing;
+    IOConnectBatchTransport	transport;
+    void *			context;
+    uint32_t			completionEnd;
+    uint32_t			count;		// calls in the batch
+    boolean_t			submitted;
+    size_t *			resultOffsets;	// by index into results, SIZE_MAX until complete
+    uint32_t			resultCapacity;
+    char *			results;
+    size_t			resultsSize;
+    size_t			resultsCapacity;
+};
+
+static inline uint32_t
+__IOConnectBatchRound(uint64_t size)
+{
+    return ((uint32_t) ((size + 7) & ~7ULL));
+}
+
+// bytes a record of size takes at pos, with the pad in front of it if it would wrap
+static inline uint32_t
+__IOConnectBatchPlace(uint32_t pos, uint32_t size, uint32_t ringSize)
+{
+    uint32_t offset = pos & (ringSize - 1);
+
+    return ((offset + size > ringSize) ? (ringSize - offset + size) : size);
+}
+
+static boolean_t
+__IOConnectBatchRingValid(const IOConnectBatchRing * ring, size_t size)
+{
+    if (!ring || (size < sizeof(IOConnectBatchRing)))                      return (false);
+    if ((kIOConnectBatchRingMagic != ring->magic)
+     || (kIOConnectBatchRingVersion != ring->version))                     return (false);
+    if ((ring->commandSize < sizeof(IOConnectBatchCommand))
+     || (ring->commandSize & (ring->commandSize - 1))
+     || (ring->completionSize < sizeof(IOConnectBatchCompletion))
+     || (ring->completionSize & (ring->completionSize - 1)))              return (false);
+    if ((ring->commandOffset < sizeof(IOConnectBatchRing)) || (ring->commandOffset & 7)
+     || (ring->completionOffset < sizeof(IOConnectBatchRing)) || (ring->completionOffset & 7)
+     || (((uint64_t) ring->commandOffset + ring->commandSize) > size)
+     || (((uint64_t) ring->completionOffset + ring->completionSize) > size)) return (false);
+    if ((ring->commandOffset < ring->completionOffset)
+      ? ((ring->commandOffset + ring->commandSize) > ring->completionOffset)
+      : ((ring->completionOffset + ring->completionSize) > ring->commandOffset)) return (false);
+
+    return (true);
 }
 
 kern_return_t
-IOConnectTrap1(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1 )
+IOConnectBatchRingInitialize(
+	void *			memory,
+	size_t			size )
 {
-    return iokit_user_client_trap(connect, index, p1, 0, 0, 0, 0, 0);
+    IOConnectBatchRing * ring = (IOConnectBatchRing *) memory;
+    size_t               ringSize;
+
+    if (!ring || (size < sizeof(IOConnectBatchRing)) || ((uintptr_t) memory & 7))
+        return (kIOReturnBadArgument);
+
+    // two equal rings, the largest powers of two that fit
+    for (ringSize = 64; ((ringSize * 4) <= (size - sizeof(IOConnectBatchRing))) && (ringSize < 0x40000000); ringSize *= 2) {}
+    if ((ringSize * 2) > (size - sizeof(IOConnectBatchRing)))
+        return (kIOReturnNoSpace);
+
+    bzero(ring, sizeof(IOConnectBatchRing));
+    ring->magic            = kIOConnectBatchRingMagic;
+    ring->version          = kIOConnectBatchRingVersion;
+    ring->commandOffset    = sizeof(IOConnectBatchRing);
+    ring->commandSize      = (uint32_t) ringSize;
+    ring->completionOffset = (uint32_t) (sizeof(IOConnectBatchRing) + ringSize);
+    ring->completionSize   = (uint32_t) ringSize;
+
+    return (kIOReturnSuccess);
 }
 
 kern_return_t
-IOConnectTrap2(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1,
-	       uintptr_t	p2 )
+IOConnectBatchRingServe(
+	void *			memory,
+	size_t			size,
+	IOConnectBatchHandler	handler,
+	void *			context )
+{
+    IOConnectBatchRing *	ring = (IOConnectBatchRing *) memory;
+    IOConnectBatchCommand *	command;
+    IOConnectBatchCommand	header;
+    IOConnectBatchCompletion *	completion;
+    IOConnectBatchRecord *	pad;
+    char *			commands;
+    char *			completions;
+    uint64_t *			structOutput;
+    uint32_t			head, tail, completionHead, completionTail;
+    uint32_t			offset, recordSize, need, place, outputCnt, outputStructCnt;
+    IOReturn			result;
+    kern_return_t		kr = kIOReturnSuccess;
+
+    if (!handler || !__IOConnectBatchRingValid(ring, size)) return (kIOReturnBadArgument);
+
+    commands       = (char *) ring + ring->commandOffset;
+    completions    = (char *) ring + ring->completionOffset;
+    head           = ring->commandHead;
+    tail           = __c11_atomic_load((_Atomic uint32_t *)&ring->commandTail, __ATOMIC_ACQUIRE);
+    completionHead = __c11_atomic_load((_Atomic uint32_t *)&ring->completionHead, __ATOMIC_ACQUIRE);
+    completionTail = ring->completionTail;
+
+    while (head != tail)
+    {
+        offset     = head & (ring->commandSize - 1);
+        command    = (IOConnectBatchCommand *) (commands + offset);
+        recordSize = command->record.size;
+        if ((recordSize < sizeof(IOConnectBatchRecord)) || (recordSize & 7)
+         || (recordSize > (tail - head)) || (recordSize > (ring->commandSize - offset))) {
+            kr = kIOReturnBadArgument;
+            break;
+        }
+        if (kIOConnectBatchRecordPad == command->record.type) {
+            head += recordSize;
+            continue;
+        }
+
+        // the client can write the ring while we read it, so work from a copy
+        if (recordSize < sizeof(IOConnectBatchCommand)) {
+            kr = kIOReturnBadArgument;
+            break;
+        }
+        header = *command;
+        if ((kIOConnectBatchRecordCommand != header.record.type)
+         || (header.scalarInputCount  > kIOConnectBatchMaxScalars)
+         || (header.scalarOutputCount > kIOConnectBatchMaxScalars)
+         || (header.structInputSize   > kIOConnectBatchMaxStructSize)
+         || (header.structOutputSize  > kIOConnectBatchMaxStructSize)
+         || ((sizeof(IOConnectBatchCommand) + header.scalarInputCount * sizeof(uint64_t)
+              + __IOConnectBatchRound(header.structInputSize)) > recordSize)) {
+            kr = kIOReturnBadArgument;
+            break;
+        }
+
+        need  = (uint32_t) (sizeof(IOConnectBatchCompletion) + header.scalarOutputCount * sizeof(uint64_t)
+                 + __IOConnectBatchRound(header.structOutputSize));
+        place = __IOConnectBatchPlace(completionTail, need, ring->completionSize);
+        if (((completionTail - completionHead) + place) > ring->completionSize) {
+            kr = kIOReturnNoSpace;
+            break;
+        }
+        if (place != need) {
+            pad = (IOConnectBatchRecord *) (completions + (completionTail & (ring->completionSize - 1)));
+            pad->size = place - need;
+            pad->type = kIOConnectBatchRecordPad;
+            completionTail += place - need;
+        }
+
+        completion      = (IOConnectBatchCompletion *) (completions + (completionTail & (ring->completionSize - 1)));
+        structOutput    = completion->data + header.scalarOutputCount;
+        outputCnt       = header.scalarOutputCount;
+        outputStructCnt = header.structOutputSize;
+        result = handler(context, header.selector,
+                         command->data, header.scalarInputCount,
+                         header.structInputSize ? (command->data + header.scalarInputCount) : NULL,
+                         header.structInputSize,
+                         completion->data, &outputCnt,
+                         outputStructCnt ? structOutput : NULL, &outputStructCnt);
+        if (outputCnt > header.scalarOutputCount)       outputCnt       = header.scalarOutputCount;
+        if (outputStructCnt > header.structOutputSize)  outputStructCnt = header.structOutputSize;
+        // the structure output follows the scalars actually returned
+        if (outputStructCnt && (outputCnt < header.scalarOutputCount))
+            memmove(completion->data + outputCnt, structOutput, outputStructCnt);
+
+        completion->record.size        = need;
+        completion->record.type        = kIOConnectBatchRecordCompletion;
+        completion->index              = header.index;
+        completion->result             = result;
+        completion->scalarOutputCount  = outputCnt;
+        completion->structOutputSize   = outputStructCnt;
+        completionTail += need;
+        head += recordSize;
+    }
+
+    __c11_atomic_store((_Atomic uint32_t *)&ring->completionTail, completionTail, __ATOMIC_RELEASE);
+    __c11_atomic_store((_Atomic uint32_t *)&ring->commandHead, head, __ATOMIC_RELEASE);
+
+    return (kr);
+}
+
+static IOReturn
+__IOConnectBatchCallMethod(void * context, uint32_t selector,
+			   const uint64_t * input, uint32_t inputCnt,
+			   const void * inputStruct, uint32_t inputStructCnt,
+			   uint64_t * output, uint32_t * outputCnt,
+			   void * outputStruct, uint32_t * outputStructCnt)
 {
-    return iokit_user_client_trap(connect, index, p1, p2, 0, 0, 0, 0);
+    IOConnectBatch * batch = (IOConnectBatch *) context;
+    size_t           structCnt = *outputStructCnt;
+    kern_return_t    kr;
+
+    kr = IOConnectCallMethod(batch->connect, selector, input, inputCnt, inputStruct, inputStructCnt,
+                             output, outputCnt, outputStruct, outputStruct ? &structCnt : NULL);
+    *outputStructCnt = outputStruct ? (uint32_t) structCnt : 0;
+
+    return (kr);
+}
+
+// the user client does not map a ring, so serve one here a call at a time
+static kern_return_t
+__IOConnectBatchEmulate(void * ring, void * context)
+{
+    IOConnectBatch * batch = (IOConnectBatch *) context;
+
+    return (IOConnectBatchRingServe(ring, batch->size, &__IOConnectBatchCallMethod, batch));
+}
+
+static kern_return_t
+__IOConnectBatchRun(IOConnectBatch * batch)
+{
+    IOConnectBatchRing *	ring = batch->ring;
+    IOConnectBatchCompletion *	completion;
+    char *			completions;
+    char *			results;
+    uint64_t			tail;
+    uint32_t			head, end, offset, recordSize;
+    size_t			capacity;
+    kern_return_t		kr;
+
+    tail = ring->commandTail;
+    if (__c11_atomic_load((_Atomic uint32_t *)&ring->commandHead, __ATOMIC_ACQUIRE) == (uint32_t) tail)
+        return (kIOReturnSuccess);
+
+    if (batch->transport)
+        kr = batch->transport(ring, batch->context);
+    else
+        kr = IOConnectCallScalarMethod(batch->connect, batch->submitSelector, &tail, 1, NULL, NULL);
+
+    completions = (char *) ring + ring->completionOffset;
+    head        = ring->completionHead;
+    end         = __c11_atomic_load((_Atomic uint32_t *)&ring->completionTail, __ATOMIC_ACQUIRE);
+    while (head != end)
+    {
+        offset     = head & (ring->completionSize - 1);
+        completion = (IOConnectBatchCompletion *) (completions + offset);
+        recordSize = completion->record.size;
+        if ((recordSize < sizeof(IOConnectBatchRecord)) || (recordSize & 7)
+         || (recordSize > (end - head)) || (recordSize > (ring->completionSize - offset))) {
+            if (kIOReturnSuccess == kr) kr = kIOReturnInternalError;
+            break;
+        }
+        if ((kIOConnectBatchRecordCompletion == completion->record.type)
+         && (recordSize >= sizeof(IOConnectBatchCompletion))
+         && (completion->index < batch->count))
+        {
+            if ((batch->resultsSize + recordSize) > batch->resultsCapacity)
+            {
+                for (capacity = batch->resultsCapacity ? batch->resultsCapacity : 4096;
+                     capacity < (batch->resultsSize + recordSize); capacity *= 2) {}
+                results = realloc(batch->results, capacity);
+                if (!results) {
+                    kr = kIOReturnNoMemory;
+                    break;
+                }
+                batch->results         = results;
+                batch->resultsCapacity = capacity;
+            }
+            bcopy(completion, batch->results + batch->resultsSize, recordSize);
+            batch->resultOffsets[completion->index] = batch->resultsSize;
+            batch->resultsSize += recordSize;
+        }
+        head += recordSize;
+    }
+
+    // commands the user client did not get to are dropped, their results stay missing
+    ring->commandTail = __c11_atomic_load((_Atomic uint32_t *)&ring->commandHead, __ATOMIC_ACQUIRE);
+    __c11_atomic_store((_Atomic uint32_t *)&ring->completionHead, end, __ATOMIC_RELEASE);
+    batch->completionEnd = end;
+
+    return (kr);
 }
 
 kern_return_t
-IOConnectTrap3(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1,
-	       uintptr_t	p2,
-	       uintptr_t	p3 )
+IOConnectBatchCreateWithTransport(
+	void *			ring,
+	size_t			size,
+	IOConnectBatchTransport	transport,
+	void *			context,
+	IOConnectBatchRef *	batchRef )
 {
-    return iokit_user_client_trap(connect, index, p1, p2, p3, 0, 0, 0);
+    IOConnectBatch * batch;
+
+    if (!transport || !__IOConnectBatchRingValid((IOConnectBatchRing *) ring, size))
+        return (kIOReturnBadArgument);
+
+    batch = calloc(1, sizeof(IOConnectBatch));
+    if (!batch)
+        return (kIOReturnNoMemory);
+
+    batch->ring          = (IOConnectBatchRing *) ring;
+    batch->size          = size;
+    batch->transport     = transport;
+    batch->context       = context;
+    batch->completionEnd = batch->ring->completionTail;
+    *batchRef = batch;
+
+    return (kIOReturnSuccess);
 }
 
 kern_return_t
-IOConnectTrap4(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1,
-	       uintptr_t	p2,
-	       uintptr_t	p3,
-	       uintptr_t	p4 )
+IOConnectBatchCreate(
+	io_connect_t		connect,
+	uint32_t		memoryType,
+	uint32_t		submitSelector,
+	IOOptionBits		options __unused,
+	IOConnectBatchRef *	batchRef )
 {
-    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, 0, 0);
+    IOConnectBatch *	batch;
+    mach_vm_address_t	address = 0;
+    mach_vm_size_t	size = 0;
+    kern_return_t	kr;
+
+    batch = calloc(1, sizeof(IOConnectBatch));
+    if (!batch)
+        return (kIOReturnNoMemory);
+
+    batch->connect        = connect;
+    batch->memoryType     = memoryType;
+    batch->submitSelector = submitSelector;
+
+    kr = IOConnectMapMemory64(connect, memoryType, mach_task_self(), &address, &size, kIOMapAnywhere);
+    if ((kIOReturnSuccess == kr) && __IOConnectBatchRingValid((IOConnectBatchRing *)(uintptr_t) address, (size_t) size))
+    {
+        batch->ring   = (IOConnectBatchRing *)(uintptr_t) address;
+        batch->size   = (size_t) size;
+        batch->mapped = address;
+    }
+    else
+    {
+        if (kIOReturnSuccess == kr)
+            IOConnectUnmapMemory64(connect, memoryType, mach_task_self(), address);
+        batch->ring = calloc(1, kIOConnectBatchEmulatedSize);
+        if (!batch->ring || (kIOReturnSuccess != IOConnectBatchRingInitialize(batch->ring, kIOConnectBatchEmulatedSize)))
+        {
+            if (batch->ring) free(batch->ring);
+            free(batch);
+            return (kIOReturnNoMemory);
+        }
+        batch->size      = kIOConnectBatchEmulatedSize;
+        batch->ownsRing  = true;
+        batch->transport = &__IOConnectBatchEmulate;
+        batch->context   = batch;
+    }
+    batch->completionEnd = batch->ring->completionTail;
+    *batchRef = batch;
+
+    return (kIOReturnSuccess);
 }
 
 kern_return_t
-IOConnectTrap5(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1,
-	       uintptr_t	p2,
-	       uintptr_t	p3,
-	       uintptr_t	p4,
-	       uintptr_t	p5 )
+IOConnectBatchAppend(
+	IOConnectBatchRef	batch,
+	uint32_t		selector,
+	const uint64_t *	input,
+	uint32_t		inputCnt,
+	const void *		inputStruct,
+	size_t			inputStructCnt,
+	uint32_t		outputCnt,
+	size_t			outputStructCnt,
+	uint32_t *		index )
+{
+    IOConnectBatchRing *	ring = batch->ring;
+    IOConnectBatchCommand *	command;
+    IOConnectBatchRecord *	pad;
+    size_t *			offsets;
+    uint32_t			recordSize, need, place, completionPlace, tail, head, capacity;
+    int				attempt;
+    kern_return_t		kr;
+
+    if ((inputCnt > kIOConnectBatchMaxScalars) || (outputCnt > kIOConnectBatchMaxScalars)
+     || (inputStructCnt > kIOConnectBatchMaxStructSize) || (outputStructCnt > kIOConnectBatchMaxStructSize)
+     || (inputCnt && !input) || (inputStructCnt && !inputStruct))
+        return (kIOReturnBadArgument);
+
+    if (batch->submitted)
+    {
+        batch->submitted   = false;
+        batch->count       = 0;
+        batch->resultsSize = 0;
+    }
+    if (batch->count == batch->resultCapacity)
+    {
+        capacity = batch->resultCapacity ? (2 * batch->resultCapacity) : 64;
+        offsets  = realloc(batch->resultOffsets, capacity * sizeof(size_t));
+        if (!offsets)
+            return (kIOReturnNoMemory);
+        batch->resultOffsets  = offsets;
+        batch->resultCapacity = capacity;
+    }
+
+    recordSize = (uint32_t) (sizeof(IOConnectBatchCommand) + inputCnt * sizeof(uint64_t)
+                  + __IOConnectBatchRound(inputStructCnt));
+    need       = (uint32_t) (sizeof(IOConnectBatchCompletion) + outputCnt * sizeof(uint64_t)
+                  + __IOConnectBatchRound(outputStructCnt));
+    // a record of at most half a ring always fits an empty one, whatever the pad
+    if ((recordSize > (ring->commandSize / 2)) || (need > (ring->completionSize / 2)))
+        return (kIOReturnNoSpace);
+
+    for (attempt = 0; ; attempt++)
+    {
+        tail            = ring->commandTail;
+        head            = __c11_atomic_load((_Atomic uint32_t *)&ring->commandHead, __ATOMIC_ACQUIRE);
+        place           = __IOConnectBatchPlace(tail, recordSize, ring->commandSize);
+        completionPlace = __IOConnectBatchPlace(batch->completionEnd, need, ring->completionSize);
+        if ((((tail - head) + place) <= ring->commandSize)
+         && (((batch->completionEnd - ring->completionHead) + completionPlace) <= ring->completionSize))
+            break;
+        if (attempt)
+            return (kIOReturnNoSpace);
+        if (kIOReturnSuccess != (kr = __IOConnectBatchRun(batch)))
+            return (kr);
+    }
+
+    if (place != recordSize)
+    {
+        pad = (IOConnectBatchRecord *) ((char *) ring + ring->commandOffset + (tail & (ring->commandSize - 1)));
+        pad->size = place - recordSize;
+        pad->type = kIOConnectBatchRecordPad;
+        tail += place - recordSize;
+    }
+    command = (IOConnectBatchCommand *) ((char *) ring + ring->commandOffset + (tail & (ring->commandSize - 1)));
+    command->record.size       = recordSize;
+    command->record.type       = kIOConnectBatchRecordCommand;
+    command->selector          = selector;
+    command->index             = batch->count;
+    command->scalarInputCount  = inputCnt;
+    command->structInputSize   = (uint32_t) inputStructCnt;
+    command->scalarOutputCount = outputCnt;
+    command->structOutputSize  = (uint32_t) outputStructCnt;
+    if (inputCnt)
+        bcopy(input, command->data, inputCnt * sizeof(uint64_t));
+    if (inputStructCnt)
+        bcopy(inputStruct, command->data + inputCnt, inputStructCnt);
+
+    batch->resultOffsets[batch->count] = SIZE_MAX;
+    batch->completionEnd += completionPlace;
+    __c11_atomic_store((_Atomic uint32_t *)&ring->commandTail, tail + recordSize, __ATOMIC_RELEASE);
+
+    if (index)
+        *index = batch->count;
+    batch->count++;
+
+    return (kIOReturnSuccess);
+}
+
+kern_return_t
+IOConnectBatchSubmit(
+	IOConnectBatchRef	batch )
 {
-    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, p5, 0);
+    kern_return_t kr;
+
+    kr = __IOConnectBatchRun(batch);
+    batch->submitted = true;
+
+    return (kr);
 }
 
 kern_return_t
-IOConnectTrap6(io_connect_t	connect,
-	       uint32_t		index,
-	       uintptr_t	p1,
-	       uintptr_t	p2,
-	       uintptr_t	p3,
-	       uintptr_t	p4,
-	       uintptr_t	p5,
-	       uintptr_t	p6 )
+IOConnectBatchGetResult(
+	IOConnectBatchRef	batch,
+	uint32_t		index,
+	uint64_t *		output,
+	uint32_t *		outputCnt,
+	void *			outputStruct,
+	size_t *		outputStructCnt )
+{
+    IOConnectBatchCompletion *	completion;
+    uint32_t			scalars;
+    size_t			structSize;
+
+    if (index >= batch->count)
+        return (kIOReturnBadArgument);
+    if (!batch->submitted)
+        return (kIOReturnNotReady);
+    if (SIZE_MAX == batch->resultOffsets[index])
+        return (kIOReturnAborted);
+
+    completion = (IOConnectBatchCompletion *) (batch->results + batch->resultOffsets[index]);
+    scalars    = completion->scalarOutputCount;
+    structSize = completion->structOutputSize;
+    if ((scalars > kIOConnectBatchMaxScalars) || (structSize > kIOConnectBatchMaxStructSize)
+     || ((sizeof(IOConnectBatchCompletion) + scalars * sizeof(uint64_t) + structSize) > completion->record.size))
+        return (kIOReturnInternalError);
+
+    if (outputCnt)
+    {
+        if (scalars > *outputCnt) scalars = *outputCnt;
+        if (output && scalars) bcopy(completion->data, output, scalars * sizeof(uint64_t));
+        *outputCnt = scalars;
+    }
+    if (outputStructCnt)
+    {
+        if (structSize > *outputStructCnt) structSize = *outputStructCnt;
+        if (outputStruct && structSize)
+            bcopy(completion->data + completion->scalarOutputCount, outputStruct, structSize);
+        *outputStructCnt = structSize;
+    }
+
+    return (completion->result);
+}
+
+void
+IOConnectBatchRelease(
+	IOConnectBatchRef	batch )
 {
-    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, p5, p6);
+    if (batch->mapped)
+        IOConnectUnmapMemory64(batch->connect, batch->memoryType, mach_task_self(), batch->mapped);
+    else if (batch->ownsRing)
+        free(batch->ring);
+    if (batch->resultOffsets)
+        free(batch->resultOffsets);
+    if (batch->results)
+        free(batch->results);
+    free(batch);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * IOConnect buffer pools
+ *
+ * Client buffers are wired once at registration, so passing them out of line
+ * finds their pages resident rather than faulting them in on every call.
+ * Buffers mapped from the user client are not passed at all: their memory
+ * type, offset and length go as scalars.
+ */
+
+#define kIOConnectBufferPoolScalars	3	// memory type, offset, length
+
+typedef struct IOConnectBuffer IOConnectBuffer;
+struct IOConnectBuffer {
+    uint32_t			handle;		// zero when the slot is free
+    uint32_t			memoryType;
+    char *			address;
+    size_t			size;
+    boolean_t			mapped;
+    boolean_t			wired;
+    uint32_t			busy;		// calls in flight, unregister waits for none
+    uint64_t			uses;
+};
+
+typedef struct IOConnectBufferPool IOConnectBufferPool;
+struct IOConnectBufferPool {
+    io_connect_t		connect;
+    pthread_mutex_t		lock;
+    uint32_t			nextHandle;
+    CFIndex			count;
+    CFIndex			capacity;
+    IOConnectBuffer *		buffers;
+    IOConnectBufferPoolStatistics statistics;
+};
+
+// mlock() isn't counted, so pages shared by buffers are unwired with the last of them
+static pthread_mutex_t		__ioConnectWiredLock = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef	__ioConnectWiredPages;		// page address to wiring count
+
+static boolean_t
+__IOConnectBufferWire(char * address, size_t size)
+{
+    CFIndex	count;
+    size_t	offset;
+
+    pthread_mutex_lock(&__ioConnectWiredLock);
+    if (!__ioConnectWiredPages)
+        __ioConnectWiredPages = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    if (!__ioConnectWiredPages || mlock(address, size))
+    {
+        pthread_mutex_unlock(&__ioConnectWiredLock);
+        return (false);
+    }
+    for (offset = 0; offset < size; offset += vm_page_size)
+    {
+        count = (CFIndex)(uintptr_t) CFDictionaryGetValue(__ioConnectWiredPages, address + offset);
+        CFDictionarySetValue(__ioConnectWiredPages, address + offset, (const void *)(uintptr_t) (count + 1));
+    }
+    pthread_mutex_unlock(&__ioConnectWiredLock);
+
+    return (true);
+}
+
+static void
+__IOConnectBufferUnwire(char * address, size_t size)
+{
+    CFIndex	count;
+    size_t	offset, start;
+
+    pthread_mutex_lock(&__ioConnectWiredLock);
+    // unwire each run of pages no other buffer holds
+    for (offset = 0, start = 0; offset <= size; offset += vm_page_size)
+    {
+        count = 0;
+        if (offset < size)
+        {
+            count = (CFIndex)(uintptr_t) CFDictionaryGetValue(__ioConnectWiredPages, address + offset) - 1;
+            if (count > 0)
+                CFDictionarySetValue(__ioConnectWiredPages, address + offset, (const void *)(uintptr_t) count);
+            else
+                CFDictionaryRemoveValue(__ioConnectWiredPages, address + offset);
+        }
+        if ((count > 0) || (offset == size))
+        {
+            if (offset > start)
+                munlock(address + start, offset - start);
+            start = offset + vm_page_size;
+        }
+    }
+    pthread_mutex_unlock(&__ioConnectWiredLock);
+}
+
+// called with the pool lock held
+static IOConnectBuffer *
+__IOConnectBufferFind(IOConnectBufferPool * pool, uint32_t handle)
+{
+    CFIndex idx;
+
+    if (kIOConnectBufferNone == handle)
+        return (NULL);
+    for (idx = 0; idx < pool->count; idx++)
+        if (handle == pool->buffers[idx].handle) return (&pool->buffers[idx]);
+
+    return (NULL);
+}
+
+// called with the pool lock held
+static kern_return_t
+__IOConnectBufferAdd(IOConnectBufferPool * pool, char * address, size_t size, IOConnectBuffer ** buffer)
+{
+    IOConnectBuffer * buffers;
+    CFIndex           idx, capacity;
+
+    for (idx = 0; idx < pool->count; idx++)
+    {
+        if ((address < (pool->buffers[idx].address + pool->buffers[idx].size))
+         && (pool->buffers[idx].address < (address + size)))
+        {
+            // wiring isn't counted, the first unregister would unwire both
+            pool->statistics.overlappingRegistrations++;
+            return (kIOReturnExclusiveAccess);
+        }
+    }
+    if (pool->count == pool->capacity)
+    {
+        capacity = pool->capacity ? (2 * pool->capacity) : 8;
+        buffers  = realloc(pool->buffers, capacity * sizeof(IOConnectBuffer));
+        if (!buffers)
+            return (kIOReturnNoMemory);
+        pool->buffers  = buffers;
+        pool->capacity = capacity;
+    }
+    if (!++pool->nextHandle)
+        pool->nextHandle = 1;
+
+    bzero(&pool->buffers[pool->count], sizeof(IOConnectBuffer));
+    pool->buffers[pool->count].handle  = pool->nextHandle;
+    pool->buffers[pool->count].address = address;
+    pool->buffers[pool->count].size    = size;
+    *buffer = &pool->buffers[pool->count++];
+
+    return (kIOReturnSuccess);
+}
+
+static void
+__IOConnectBufferRemove(IOConnectBufferPool * pool, IOConnectBuffer * buffer)
+{
+    if (buffer->mapped)
+        IOConnectUnmapMemory64(pool->connect, buffer->memoryType, mach_task_self(),
+                               (mach_vm_address_t)(uintptr_t) buffer->address);
+    else if (buffer->wired)
+        __IOConnectBufferUnwire(buffer->address, buffer->size);
+
+    pool->statistics.registeredBytes -= buffer->size;
+    if (buffer->wired)
+        pool->statistics.wiredBytes -= buffer->size;
+    *buffer = pool->buffers[--pool->count];
+}
+
 kern_return_t
-IOConnectSetCFProperties(
-	io_connect_t	connect,
-	CFTypeRef	properties )
+IOConnectBufferPoolCreate(
+	io_connect_t		connect,
+	IOOptionBits		options __unused,
+	IOConnectBufferPoolRef * poolRef )
 {
-    CFDataRef		data;
+    IOConnectBufferPool * pool;
+
+    pool = calloc(1, sizeof(IOConnectBufferPool));
+    if (!pool)
+        return (kIOReturnNoMemory);
+
+    pool->connect = connect;
+    pthread_mutex_init(&pool->lock, NULL);
+    *poolRef = pool;
+
+    return (kIOReturnSuccess);
+}
+
+void
+IOConnectBufferPoolRelease(
+	IOConnectBufferPoolRef	pool )
+{
+    while (pool->count)
+        __IOConnectBufferRemove(pool, &pool->buffers[pool->count - 1]);
+    if (pool->buffers)
+        free(pool->buffers);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+kern_return_t
+IOConnectBufferPoolRegister(
+	IOConnectBufferPoolRef	pool,
+	void *			address,
+	size_t			size,
+	uint32_t *		handle )
+{
+    IOConnectBuffer *	buffer;
+    volatile char *	page;
+    size_t		offset;
     kern_return_t	kr;
-    kern_return_t	result;
 
-    data = IOCFSerialize( properties, gIOKitLibSerializeOptions );
-    if( !data)
-	return( kIOReturnUnsupported );
+    if (!address || !size || ((uintptr_t) address & vm_page_mask) || (size & vm_page_mask))
+        return (kIOReturnNotAligned);
 
-    kr = io_connect_set_properties( connect,
-            (char *) CFDataGetBytePtr(data), CFDataGetLength(data),
-            &result );
+    pthread_mutex_lock(&pool->lock);
+    kr = __IOConnectBufferAdd(pool, (char *) address, size, &buffer);
+    if (kIOReturnSuccess != kr)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return (kr);
+    }
 
-    CFRelease(data);
+    buffer->wired = __IOConnectBufferWire((char *) address, size);
+    if (!buffer->wired)
+    {
+        // over the wired memory limit, at least have the pages present
+        for (offset = 0; offset < size; offset += vm_page_size)
+        {
+            page  = (volatile char *) address + offset;
+            *page = *page;
+        }
+    }
+    else
+        pool->statistics.wiredBytes += size;
+    pool->statistics.registeredBytes += size;
+    *handle = buffer->handle;
+    pthread_mutex_unlock(&pool->lock);
 
-    if( KERN_SUCCESS == kr)
-        kr = result;
+    return (kIOReturnSuccess);
+}
 
-    return( kr );
+kern_return_t
+IOConnectBufferPoolRegisterMemoryType(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		memoryType,
+	uint32_t *		handle,
+	void **			address,
+	size_t *		size )
+{
+    IOConnectBuffer *	buffer;
+    mach_vm_address_t	mapAddress = 0;
+    mach_vm_size_t	mapSize = 0;
+    kern_return_t	kr;
+
+    kr = IOConnectMapMemory64(pool->connect, memoryType, mach_task_self(), &mapAddress, &mapSize, kIOMapAnywhere);
+    if (kIOReturnSuccess != kr)
+        return (kr);
+
+    pthread_mutex_lock(&pool->lock);
+    kr = __IOConnectBufferAdd(pool, (char *)(uintptr_t) mapAddress, (size_t) mapSize, &buffer);
+    if (kIOReturnSuccess == kr)
+    {
+        buffer->mapped     = true;
+        buffer->memoryType = memoryType;
+        pool->statistics.registeredBytes += buffer->size;
+        *handle  = buffer->handle;
+        *address = buffer->address;
+        *size    = buffer->size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (kIOReturnSuccess != kr)
+        IOConnectUnmapMemory64(pool->connect, memoryType, mach_task_self(), mapAddress);
+
+    return (kr);
 }
 
 kern_return_t
-IOConnectSetCFProperty(
-	io_connect_t	connect,
-        CFStringRef	propertyName,
-	CFTypeRef	property )
+IOConnectBufferPoolUnregister(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		handle )
 {
-    CFDictionaryRef	dict;
+    IOConnectBuffer * buffer;
+    kern_return_t     kr = kIOReturnBadArgument;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((buffer = __IOConnectBufferFind(pool, handle)))
+    {
+        // a call in flight still has the kernel using the memory
+        kr = buffer->busy ? kIOReturnBusy : kIOReturnSuccess;
+        if (kIOReturnSuccess == kr)
+            __IOConnectBufferRemove(pool, buffer);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return (kr);
+}
+
+void
+IOConnectBufferPoolGetStatistics(
+	IOConnectBufferPoolRef	pool,
+	IOConnectBufferPoolStatistics * statistics )
+{
+    pthread_mutex_lock(&pool->lock);
+    *statistics = pool->statistics;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+kern_return_t
+IOConnectCallMethodWithBuffers(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		selector,
+	const uint64_t *	input,
+	uint32_t		inputCnt,
+	uint32_t		inputBuffer,
+	size_t			inputOffset,
+	size_t			inputSize,
+	uint64_t *		output,
+	uint32_t *		outputCnt,
+	uint32_t		outputBuffer,
+	size_t			outputOffset,
+	size_t *		outputSize )
+{
+    IOConnectBuffer *	in;
+    IOConnectBuffer *	out;
+    uint64_t		scalars[kIOConnectBatchMaxScalars];
+    uint64_t		results[kIOConnectBatchMaxScalars];
+    uint32_t		scalarCnt, resultCnt, userCnt;
+    const void *	inputStruct = NULL;
+    void *		outputStruct = NULL;
+    size_t		outputStructCnt = 0;
+    size_t		outputRoom = outputSize ? *outputSize : 0;
     kern_return_t	kr;
- 
-    CFTypeRef name = propertyName;
-    dict = CFDictionaryCreate( kCFAllocatorDefault,
-		    &name, &property, 1,
-		    &kCFTypeDictionaryKeyCallBacks,
-		    &kCFTypeDictionaryValueCallBacks );
-    if( !dict)
-	return( kIOReturnNoMemory );
 
-    kr = IOConnectSetCFProperties( connect, dict );
-    CFRelease( dict );
+    userCnt = outputCnt ? *outputCnt : 0;
+    if ((inputCnt && !input) || (userCnt && !output)
+     || ((inputCnt + 2 * kIOConnectBufferPoolScalars) > kIOConnectBatchMaxScalars)
+     || ((userCnt + 1) > kIOConnectBatchMaxScalars))
+        return (kIOReturnBadArgument);
+
+    pthread_mutex_lock(&pool->lock);
+    in  = __IOConnectBufferFind(pool, inputBuffer);
+    out = __IOConnectBufferFind(pool, outputBuffer);
+    if (((kIOConnectBufferNone != inputBuffer) && (!in || (inputOffset > in->size) || (inputSize > (in->size - inputOffset))))
+     || ((kIOConnectBufferNone != outputBuffer) && (!out || (outputOffset > out->size) || (outputRoom > (out->size - outputOffset)))))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return (kIOReturnBadArgument);
+    }
+
+    pool->statistics.calls++;
+    if (in)
+        in->busy++;
+    if (out)
+        out->busy++;
+    if (in)
+    {
+        if (in->uses++) pool->statistics.reuses++;
+        pool->statistics.inputBytes += inputSize;
+    }
+    if (out && (out != in))
+    {
+        if (out->uses++) pool->statistics.reuses++;
+    }
+    if (in && out && inputSize && outputRoom
+     && ((in->address + inputOffset) < (out->address + outputOffset + outputRoom))
+     && ((out->address + outputOffset) < (in->address + inputOffset + inputSize)))
+        pool->statistics.overlaps++;
+    if ((in && in->mapped) || (out && out->mapped))
+        pool->statistics.mappedCalls++;
+
+    // build the call while the buffers are known to be registered
+    scalarCnt = inputCnt;
+    resultCnt = userCnt;
+    if (in && in->mapped)
+    {
+        scalars[scalarCnt++] = in->memoryType;
+        scalars[scalarCnt++] = inputOffset;
+        scalars[scalarCnt++] = inputSize;
+    }
+    else if (in)
+        inputStruct = in->address + inputOffset;
+    if (out && out->mapped)
+    {
+        scalars[scalarCnt++] = out->memoryType;
+        scalars[scalarCnt++] = outputOffset;
+        scalars[scalarCnt++] = outputRoom;
+        // the user client returns the length it wrote as one more scalar
+        resultCnt++;
+    }
+    else if (out)
+    {
+        outputStruct    = out->address + outputOffset;
+        outputStructCnt = outputRoom;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (inputCnt)
+        bcopy(input, scalars, inputCnt * sizeof(uint64_t));
+
+    kr = IOConnectCallMethod(pool->connect, selector,
+                             scalars, scalarCnt,
+                             inputStruct, inputStruct ? inputSize : 0,
+                             results, &resultCnt,
+                             outputStruct, outputStruct ? &outputStructCnt : NULL);
+
+    if (out && !outputStruct)
+    {
+        // the last scalar is the length written to the mapped buffer
+        outputStructCnt = resultCnt ? results[--resultCnt] : 0;
+        if (outputStructCnt > outputRoom) outputStructCnt = outputRoom;
+    }
+    if (resultCnt > userCnt)
+        resultCnt = userCnt;
+    if (resultCnt)
+        bcopy(results, output, resultCnt * sizeof(uint64_t));
+    if (outputCnt)
+        *outputCnt = resultCnt;
+    if (outputSize)
+        *outputSize = out ? outputStructCnt : 0;
+
+    // the buffers may have moved in the table, but can't have been unregistered
+    pthread_mutex_lock(&pool->lock);
+    if ((in = __IOConnectBufferFind(pool, inputBuffer)))
+        in->busy--;
+    if ((out = __IOConnectBufferFind(pool, outputBuffer)))
+        out->busy--;
+    if (kIOReturnSuccess == kr)
+        pool->statistics.outputBytes += outputStructCnt;
+    pthread_mutex_unlock(&pool->lock);
+
+    return (kr);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+kern_return_t
+IOConnectTrap0(io_connect_t	connect,
+	       uint32_t		index)
+{
+    return iokit_user_client_trap(connect, index, 0, 0, 0, 0, 0, 0);
+}
+
+kern_return_t
+IOConnectTrap1(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1 )
+{
+    return iokit_user_client_trap(connect, index, p1, 0, 0, 0, 0, 0);
+}
+
+kern_return_t
+IOConnectTrap2(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1,
+	       uintptr_t	p2 )
+{
+    return iokit_user_client_trap(connect, index, p1, p2, 0, 0, 0, 0);
+}
+
+kern_return_t
+IOConnectTrap3(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1,
+	       uintptr_t	p2,
+	       uintptr_t	p3 )
+{
+    return iokit_user_client_trap(connect, index, p1, p2, p3, 0, 0, 0);
+}
+
+kern_return_t
+IOConnectTrap4(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1,
+	       uintptr_t	p2,
+	       uintptr_t	p3,
+	       uintptr_t	p4 )
+{
+    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, 0, 0);
+}
+
+kern_return_t
+IOConnectTrap5(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1,
+	       uintptr_t	p2,
+	       uintptr_t	p3,
+	       uintptr_t	p4,
+	       uintptr_t	p5 )
+{
+    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, p5, 0);
+}
+
+kern_return_t
+IOConnectTrap6(io_connect_t	connect,
+	       uint32_t		index,
+	       uintptr_t	p1,
+	       uintptr_t	p2,
+	       uintptr_t	p3,
+	       uintptr_t	p4,
+	       uintptr_t	p5,
+	       uintptr_t	p6 )
+{
+    return iokit_user_client_trap(connect, index, p1, p2, p3, p4, p5, p6);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+kern_return_t
+IOConnectSetCFProperties(
+	io_connect_t	connect,
+	CFTypeRef	properties )
+{
+    CFDataRef		data;
+    kern_return_t	kr;
+    kern_return_t	result;
+
+    data = IOCFSerialize( properties, gIOKitLibSerializeOptions );
+    if( !data)
+	return( kIOReturnUnsupported );
+
+    kr = io_connect_set_properties( connect,
+            (char *) CFDataGetBytePtr(data), CFDataGetLength(data),
+            &result );
+
+    CFRelease(data);
+
+    if( KERN_SUCCESS == kr)
+        kr = result;
+
+    return( kr );
+}
+
+kern_return_t
+IOConnectSetCFProperty(
+	io_connect_t	connect,
+        CFStringRef	propertyName,
+	CFTypeRef	property )
+{
+    CFDictionaryRef	dict;
+    kern_return_t	kr;
+ 
+    CFTypeRef name = propertyName;
+    dict = CFDictionaryCreate( kCFAllocatorDefault,
+		    &name, &property, 1,
+		    &kCFTypeDictionaryKeyCallBacks,
+		    &kCFTypeDictionaryValueCallBacks );
+    if( !dict)
+	return( kIOReturnNoMemory );
+
+    kr = IOConnectSetCFProperties( connect, dict );
+    CFRelease( dict );
+
+    return( kr );
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * IORegistry accessors
+ */
+
+kern_return_t
+IORegistryCreateIterator(
+        mach_port_t	_masterPort,
+	const io_name_t	plane,
+	IOOptionBits	options,
+	io_iterator_t * iterator )
+{
+    kern_return_t	kr;
+    mach_port_t		masterPort;
+
+    if (MACH_PORT_NULL == _masterPort)
+	masterPort = __IOGetDefaultMasterPort();
+    else
+	masterPort = _masterPort;
+
+    kr = io_registry_create_iterator( masterPort, (char *) plane,
+		options, iterator);
+
+    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
+	mach_port_deallocate(mach_task_self(), masterPort);
+
+    return( kr );
+}
+
+kern_return_t
+IORegistryEntryCreateIterator(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	IOOptionBits		options,
+	io_iterator_t 	      * iterator )
+{
+    return( io_registry_entry_create_iterator( entry, (char *) plane,
+		options, iterator));
+}
+
+kern_return_t
+IORegistryIteratorEnterEntry(
+	io_iterator_t	iterator )
+{
+    // as the kernel answers for iterators that aren't over the registry
+    if( __IOMatchingCacheIsIterator( iterator ))
+	return( kIOReturnBadArgument );
+
+    return( io_registry_iterator_enter_entry( iterator));
+}
+
+
+kern_return_t
+IORegistryIteratorExitEntry(
+	io_iterator_t	iterator )
+{
+    if( __IOMatchingCacheIsIterator( iterator ))
+	return( kIOReturnBadArgument );
+
+    return( io_registry_iterator_exit_entry( iterator));
+}
+
+/*
+ * Parallel registry walk. Each entry is an item; expanding an item reads its
+ * children (or parents) in the plane and queues them as new items. Workers
+ * keep their own deque, working from the tail of it and stealing from the
+ * head of the others' when it is empty. As with the kernel's IORegistryIterator
+ * an entry is recursed into once, so each entry ID is claimed by the first
+ * item to reach it; the order results are delivered in is fixed afterwards by
+ * a depth first pass over the finished tree, and doesn't depend on which
+ * worker got where first.
+ */
+#define kIORegistryWalkMaxWorkers	16
+
+typedef struct IORegistryWalkItem IORegistryWalkItem;
+struct IORegistryWalkItem {
+    io_registry_entry_t		entry;
+    uint64_t			entryID;	// zero if it couldn't be read
+    CFDictionaryRef		properties;
+    IORegistryWalkItem **	children;
+    CFIndex			childCount;
+};
+
+typedef struct {
+    pthread_mutex_t		lock;
+    IORegistryWalkItem **	items;
+    CFIndex			head;
+    CFIndex			tail;
+    CFIndex			capacity;
+} IORegistryWalkDeque;
+
+typedef struct {
+    const char *		plane;
+    IOOptionBits		options;
+    size_t			workers;
+    IORegistryWalkDeque *	deques;
+    pthread_mutex_t		lock;
+    pthread_cond_t		wake;
+    CFIndex			pending;	// items queued or being expanded
+    uint64_t			generation;	// bumped on every push
+    CFMutableDictionaryRef	claimed;	// entry ID to the item that expands it
+    boolean_t			failed;		// set by any worker, atomically
+    IORegistryWalkNode *	nodes;
+    CFIndex			nodeCount;
+    CFIndex			nodeCapacity;
+} IORegistryWalk;
+
+static void
+__IORegistryWalkFail(IORegistryWalk * walk)
+{
+    __c11_atomic_store((_Atomic boolean_t *)&walk->failed, true, __ATOMIC_RELAXED);
+}
+
+static IORegistryWalkItem *
+__IORegistryWalkItemCreate(io_registry_entry_t entry)
+{
+    IORegistryWalkItem * item;
+
+    item = (IORegistryWalkItem *) calloc(1, sizeof(IORegistryWalkItem));
+    if (!item) return (NULL);
+    item->entry = entry;
+    if (kIOReturnSuccess != IORegistryEntryGetRegistryEntryID(entry, &item->entryID)) item->entryID = 0;
+
+    return (item);
+}
+
+// releases whatever the output pass didn't take
+static void
+__IORegistryWalkItemFree(IORegistryWalkItem * item)
+{
+    CFIndex idx;
+
+    for (idx = 0; idx < item->childCount; idx++) __IORegistryWalkItemFree(item->children[idx]);
+    if (item->children) free(item->children);
+    if (item->entry) IOObjectRelease(item->entry);
+    if (item->properties) CFRelease(item->properties);
+    free(item);
+}
+
+static void
+__IORegistryWalkPush(IORegistryWalk * walk, size_t worker, IORegistryWalkItem ** items, CFIndex count)
+{
+    IORegistryWalkDeque * deque = &walk->deques[worker];
+    IORegistryWalkItem ** grown;
+    CFIndex		  idx;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head == deque->tail) deque->head = deque->tail = 0;
+    if ((deque->tail + count) > deque->capacity)
+    {
+        idx = deque->capacity ? deque->capacity : 64;
+        while (idx < (deque->tail + count)) idx *= 2;
+        grown = (IORegistryWalkItem **) realloc(deque->items, idx * sizeof(IORegistryWalkItem *));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            // the items still belong to their parent, they just won't be expanded
+            __IORegistryWalkFail(walk);
+            return;
+        }
+        deque->items    = grown;
+        deque->capacity = idx;
+    }
+    // reversed, so the owner pops the first child first
+    for (idx = count - 1; idx >= 0; idx--) deque->items[deque->tail++] = items[idx];
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->pending += count;
+    walk->generation++;
+    pthread_cond_broadcast(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static IORegistryWalkItem *
+__IORegistryWalkPop(IORegistryWalk * walk, size_t worker)
+{
+    IORegistryWalkDeque * deque;
+    IORegistryWalkItem *  item = NULL;
+    size_t		  idx;
+
+    // own tail first, then the heads of the others
+    for (idx = 0; !item && (idx < walk->workers); idx++)
+    {
+        deque = &walk->deques[(worker + idx) % walk->workers];
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head != deque->tail)
+            item = idx ? deque->items[deque->head++] : deque->items[--deque->tail];
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    return (item);
+}
+
+static void
+__IORegistryWalkExpand(IORegistryWalk * walk, size_t worker, IORegistryWalkItem * item)
+{
+    CFMutableDictionaryRef properties;
+    IORegistryWalkItem *   child;
+    IORegistryWalkItem **  grown;
+    io_iterator_t	   iter;
+    io_registry_entry_t	   next;
+    CFIndex		   capacity = 0;
+    boolean_t		   claimed;
+
+    // an entry whose ID can't be read has most likely gone; it is reported
+    // but not recursed into, since it can't be told apart from another copy
+    if (!item->entryID) return;
+
+    pthread_mutex_lock(&walk->lock);
+    claimed = !CFDictionaryContainsKey(walk->claimed, (void *)(uintptr_t) item->entryID);
+    if (claimed) CFDictionarySetValue(walk->claimed, (void *)(uintptr_t) item->entryID, item);
+    pthread_mutex_unlock(&walk->lock);
+    if (!claimed) return;
+
+    if ((kIORegistryWalkProperties & walk->options)
+      && (kIOReturnSuccess == IORegistryEntryCreateCFProperties(item->entry, &properties,
+                                                        kCFAllocatorDefault, kNilOptions)))
+    {
+        item->properties = properties;
+    }
+
+    if (kIOReturnSuccess != IORegistryEntryCreateIterator(item->entry, walk->plane,
+                                (kIORegistryIterateParents & walk->options), &iter))
+    {
+        __IORegistryWalkFail(walk);
+        return;
+    }
+    while ((next = IOIteratorNext(iter)))
+    {
+        if (item->childCount == capacity)
+        {
+            capacity = capacity ? (capacity * 2) : 8;
+            grown = (IORegistryWalkItem **) realloc(item->children, capacity * sizeof(IORegistryWalkItem *));
+            if (!grown) break;
+            item->children = grown;
+        }
+        child = __IORegistryWalkItemCreate(next);
+        if (!child) break;
+        item->children[item->childCount++] = child;
+    }
+    if (next)
+    {
+        IOObjectRelease(next);
+        __IORegistryWalkFail(walk);
+    }
+    IOObjectRelease(iter);
+
+    if (item->childCount) __IORegistryWalkPush(walk, worker, item->children, item->childCount);
+}
+
+static void
+__IORegistryWalkWorker(void * context, size_t worker)
+{
+    IORegistryWalk *	 walk = (IORegistryWalk *) context;
+    IORegistryWalkItem * item;
+    uint64_t		 generation;
+    boolean_t		 done = false;
+
+    while (!done)
+    {
+        pthread_mutex_lock(&walk->lock);
+        generation = walk->generation;
+        pthread_mutex_unlock(&walk->lock);
+
+        if ((item = __IORegistryWalkPop(walk, worker)))
+        {
+            __IORegistryWalkExpand(walk, worker, item);
+            pthread_mutex_lock(&walk->lock);
+            if (!--walk->pending) pthread_cond_broadcast(&walk->wake);
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+
+        // nothing to steal; sleep until something is pushed or all is done
+        pthread_mutex_lock(&walk->lock);
+        while (walk->pending && (generation == walk->generation))
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        done = !walk->pending;
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void
+__IORegistryWalkEmit(IORegistryWalk * walk, IORegistryWalkItem * item, uint32_t depth, CFIndex parent)
+{
+    IORegistryWalkItem * expanded;
+    IORegistryWalkNode * node;
+    IORegistryWalkNode * grown;
+    CFIndex		 idx, index;
+
+    if (walk->nodeCount == walk->nodeCapacity)
+    {
+        walk->nodeCapacity = walk->nodeCapacity ? (walk->nodeCapacity * 2) : 256;
+        grown = (IORegistryWalkNode *) realloc(walk->nodes, walk->nodeCapacity * sizeof(IORegistryWalkNode));
+        if (!grown)
+        {
+            __IORegistryWalkFail(walk);
+            return;
+        }
+        walk->nodes = grown;
+    }
+    index = walk->nodeCount++;
+    node  = &walk->nodes[index];
+    node->entry   = item->entry;
+    node->entryID = item->entryID;
+    node->depth   = depth;
+    node->parent  = parent;
+    node->properties = NULL;
+    item->entry   = MACH_PORT_NULL;
+
+    // later copies of an entry are reported, but not recursed into again
+    if (!node->entryID) return;
+    expanded = (IORegistryWalkItem *) CFDictionaryGetValue(walk->claimed, (void *)(uintptr_t) node->entryID);
+    if (!expanded) return;
+    CFDictionaryRemoveValue(walk->claimed, (void *)(uintptr_t) node->entryID);
+
+    node->properties     = expanded->properties;
+    expanded->properties = NULL;
+    for (idx = 0; idx < expanded->childCount; idx++)
+        __IORegistryWalkEmit(walk, expanded->children[idx], depth + 1, index);
+}
+
+kern_return_t
+IORegistryEntryCopyTree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	IOOptionBits		options,
+	IORegistryWalkNode **	nodes,
+	CFIndex *		count )
+{
+    IORegistryWalk	 walk;
+    IORegistryWalkItem * root;
+    long		 cpus;
+    size_t		 idx;
+
+    if (!entry || !plane || !nodes || !count) return (kIOReturnBadArgument);
+    *nodes = NULL;
+    *count = 0;
+
+    bzero(&walk, sizeof(walk));
+    walk.plane   = plane;
+    walk.options = options;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.workers = (cpus < 1) ? 1 : ((cpus > kIORegistryWalkMaxWorkers) ? kIORegistryWalkMaxWorkers : cpus);
+    walk.deques  = (IORegistryWalkDeque *) calloc(walk.workers, sizeof(IORegistryWalkDeque));
+    walk.claimed = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    IOObjectRetain(entry);
+    root = __IORegistryWalkItemCreate(entry);
+    if (!walk.deques || !walk.claimed || !root)
+    {
+        if (walk.deques) free(walk.deques);
+        if (walk.claimed) CFRelease(walk.claimed);
+        if (root) __IORegistryWalkItemFree(root);
+        else IOObjectRelease(entry);
+        return (kIOReturnNoMemory);
+    }
+    for (idx = 0; idx < walk.workers; idx++) pthread_mutex_init(&walk.deques[idx].lock, NULL);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+
+    __IORegistryWalkPush(&walk, 0, &root, 1);
+    if (walk.workers > 1)
+        dispatch_apply_f(walk.workers, DISPATCH_APPLY_AUTO, &walk, &__IORegistryWalkWorker);
+    else
+        __IORegistryWalkWorker(&walk, 0);
+
+    __IORegistryWalkEmit(&walk, root, 0, -1);
+    __IORegistryWalkItemFree(root);
+
+    for (idx = 0; idx < walk.workers; idx++)
+    {
+        pthread_mutex_destroy(&walk.deques[idx].lock);
+        if (walk.deques[idx].items) free(walk.deques[idx].items);
+    }
+    free(walk.deques);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.wake);
+    CFRelease(walk.claimed);
+
+    if (__c11_atomic_load((_Atomic boolean_t *)&walk.failed, __ATOMIC_RELAXED))
+    {
+        IORegistryWalkNodesRelease(walk.nodes, walk.nodeCount);
+        return (kIOReturnNoMemory);
+    }
+    *nodes = walk.nodes;
+    *count = walk.nodeCount;
+
+    return (kIOReturnSuccess);
+}
+
+void
+IORegistryWalkNodesRelease(
+	IORegistryWalkNode *	nodes,
+	CFIndex			count )
+{
+    CFIndex idx;
+
+    if (!nodes) return;
+    for (idx = 0; idx < count; idx++)
+    {
+        if (nodes[idx].entry) IOObjectRelease(nodes[idx].entry);
+        if (nodes[idx].properties) CFRelease(nodes[idx].properties);
+    }
+    free(nodes);
+}
+
+kern_return_t
+IORegistryEntryWalkTree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	IOOptionBits		options,
+	IORegistryWalkCallback	callback,
+	void *			refcon )
+{
+    IORegistryWalkNode * nodes;
+    CFIndex		 count, idx;
+    kern_return_t	 kr;
+
+    if (!callback) return (kIOReturnBadArgument);
+
+    kr = IORegistryEntryCopyTree(entry, plane, options, &nodes, &count);
+    if (kIOReturnSuccess != kr) return (kr);
+
+    for (idx = 0; idx < count; idx++) callback(refcon, &nodes[idx], idx);
+    IORegistryWalkNodesRelease(nodes, count);
+
+    return (kIOReturnSuccess);
+}
+
+io_registry_entry_t
+IORegistryEntryFromPath(
+        mach_port_t		_masterPort,
+	const io_string_t	path )
+{
+    kern_return_t	kr;
+    io_registry_entry_t	entry;
+    mach_port_t		masterPort;
+
+    if (MACH_PORT_NULL == _masterPort)
+	masterPort = __IOGetDefaultMasterPort();
+    else
+	masterPort = _masterPort;
+
+    kr = io_registry_entry_from_path( masterPort, (char *) path, &entry );
+    if( kIOReturnSuccess != kr)
+	entry = 0;
+
+    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
+	mach_port_deallocate(mach_task_self(), masterPort);
+
+    return( entry );
+}
+
+io_registry_entry_t
+IORegistryEntryCopyFromPath(
+	mach_port_t	_masterPort,
+	CFStringRef	cfpath )
+{
+#if IOKIT_SERVER_VERSION < 20150715
+    return (MACH_PORT_NULL);
+#else
+
+    kern_return_t	   kr;
+    kern_return_t          result;
+    io_registry_entry_t	   entry;
+    mach_port_t		   masterPort;
+    io_buf_ptr_t           path_ool;
+    mach_msg_type_number_t path_oolCnt;
+    char                 * path;
+    size_t                 pathLen;
+    void                 * buffer;
+
+    if (MACH_PORT_NULL == _masterPort)
+	masterPort = __IOGetDefaultMasterPort();
+    else
+	masterPort = _masterPort;
+
+    buffer      = NULL;
+    pathLen     = 0;
+    path_ool    = NULL;
+    path_oolCnt = 0;
+    path = (char *) CFStringGetCStringPtr(cfpath, kCFStringEncodingUTF8);
+    if (!path)
+    {
+	CFIndex bufferSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(cfpath),
+	       kCFStringEncodingUTF8) + sizeof('\0');
+        buffer = malloc(bufferSize);
+        if (buffer && CFStringGetCString(cfpath, buffer, bufferSize, kCFStringEncodingUTF8))
+            path = buffer;
+    }
+    if (!path) kr = kIOReturnBadArgument;
+    else
+    {
+ 	pathLen = strlen(path);
+ 	if (pathLen > sizeof(io_string_inband_t))
+	{
+	    path_ool = path;
+	    path_oolCnt = pathLen + 1;
+	    path = "\0";
+	}
+
+	kr = io_registry_entry_from_path_ool(masterPort, path, path_ool, path_oolCnt, &result, &entry);
+    }
+
+    if ((kIOReturnSuccess != kr) || (kIOReturnSuccess != result)) entry = 0;
+
+    if (buffer) free(buffer);
+
+    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
+	mach_port_deallocate(mach_task_self(), masterPort);
+
+    return( entry );
+#endif /* IOKIT_SERVER_VERSION < 20150715 */
+}
+
+io_registry_entry_t
+IORegistryGetRootEntry(
+        mach_port_t	_masterPort )
+{
+    kern_return_t	kr;
+    mach_port_t		masterPort;
+    io_registry_entry_t	entry;
+
+    if (MACH_PORT_NULL == _masterPort)
+	masterPort = __IOGetDefaultMasterPort();
+    else
+	masterPort = _masterPort;
+
+    kr = io_registry_get_root_entry( masterPort, &entry );
+    if( kIOReturnSuccess != kr)
+	entry = 0;
+
+    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
+	mach_port_deallocate(mach_task_self(), masterPort);
+
+    return( entry );
+}
+
+/*
+ * Registry snapshot cache. While IORegistrySetSnapshotCache() has it on,
+ * entry IDs, names, paths and property tables read through the functions
+ * below are kept per registry entry ID and handed back until they are older
+ * than the cache's maximum age. A record is dropped early when its service
+ * posts a general interest message, and every record is dropped when the
+ * IOCatalogue generation moves, which is checked at most every
+ * kIORegistryCacheGenerationInterval. io_object_t names are mapped to entry
+ * IDs while the cache holds a send right reference of its own on them, so a
+ * name can't be reused for another entry while it is mapped; the reference
+ * is dropped with the owner's last IOObjectRelease(). At most
+ * kIORegistryCacheMaxRecords records are kept, the oldest making way for new
+ * ones, and the name map is emptied when it outgrows kIORegistryCacheMaxObjects.
+ */
+#define kIORegistryCacheGenerationInterval	(100 * NSEC_PER_MSEC)
+#define kIORegistryCacheMaxRecords		256
+#define kIORegistryCacheMaxObjects		(4 * kIORegistryCacheMaxRecords)
+
+kern_return_t
+IOCatlogueGetGenCount(mach_port_t masterPort, uint32_t * genCount);
+
+typedef struct {
+    uint64_t			entryID;
+    uint64_t			time;		// uptime in ns when the record was made
+    io_object_t			interest;
+    boolean_t			hasName;
+    io_name_t			name;
+    CFDictionaryRef		properties;
+    CFMutableDictionaryRef	paths;		// plane name to path
+} IORegistryCacheRecord;
+
+static pthread_mutex_t		__ioRegistryCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t			__ioRegistryCacheMaxAge;	// ns, zero when off
+static CFMutableDictionaryRef	__ioRegistryCacheRecords;	// entry ID to IORegistryCacheRecord *
+static CFMutableDictionaryRef	__ioRegistryCacheObjects;	// io_object_t name to entry ID
+static IONotificationPortRef	__ioRegistryCacheNotify;
+static dispatch_queue_t		__ioRegistryCacheQueue;
+static uint32_t			__ioRegistryCacheGeneration;
+static uint64_t			__ioRegistryCacheGenerationTime;
+
+static void
+__IORegistryCacheRecordFree(IORegistryCacheRecord * record)
+{
+    // not IOObjectRelease, which would come back here
+    if (record->interest) mach_port_deallocate(mach_task_self(), record->interest);
+    if (record->properties) CFRelease(record->properties);
+    if (record->paths) CFRelease(record->paths);
+    free(record);
+}
+
+// called with the lock held
+static void
+__IORegistryCacheRemoveRecord(CFNumberRef key)
+{
+    IORegistryCacheRecord * record;
+
+    record = (IORegistryCacheRecord *) CFDictionaryGetValue(__ioRegistryCacheRecords, key);
+    if (!record) return;
+    CFDictionaryRemoveValue(__ioRegistryCacheRecords, key);
+    __IORegistryCacheRecordFree(record);
+}
+
+static void
+__IORegistryCacheFreeApplier(const void * key __unused, const void * value, void * context __unused)
+{
+    __IORegistryCacheRecordFree((IORegistryCacheRecord *) value);
+}
+
+// called with the lock held, entry IDs don't change so the name map is kept
+static void
+__IORegistryCacheRemoveAll(void)
+{
+    if (!__ioRegistryCacheRecords) return;
+    CFDictionaryApplyFunction(__ioRegistryCacheRecords, &__IORegistryCacheFreeApplier, NULL);
+    CFDictionaryRemoveAllValues(__ioRegistryCacheRecords);
+}
+
+static void
+__IORegistryCacheUnmapApplier(const void * key, const void * value __unused, void * context __unused)
+{
+    mach_port_deallocate(mach_task_self(), (mach_port_name_t)(uintptr_t) key);
+}
+
+// called with the lock held
+static void
+__IORegistryCacheUnmapAll(void)
+{
+    if (!__ioRegistryCacheObjects) return;
+    CFDictionaryApplyFunction(__ioRegistryCacheObjects, &__IORegistryCacheUnmapApplier, NULL);
+    CFDictionaryRemoveAllValues(__ioRegistryCacheObjects);
+}
+
+// called with the lock held. The cache takes a reference of its own on the
+// name so it keeps naming the same entry for as long as it is mapped.
+static void
+__IORegistryCacheMapObject(io_registry_entry_t entry, CFNumberRef key)
+{
+    if (!__ioRegistryCacheObjects || CFDictionaryContainsKey(__ioRegistryCacheObjects, (void *)(uintptr_t) entry)) return;
+    if (CFDictionaryGetCount(__ioRegistryCacheObjects) >= kIORegistryCacheMaxObjects)
+        __IORegistryCacheUnmapAll();
+    if (KERN_SUCCESS != mach_port_mod_refs(mach_task_self(), entry, MACH_PORT_RIGHT_SEND, 1)) return;
+    CFDictionarySetValue(__ioRegistryCacheObjects, (void *)(uintptr_t) entry, key);
+}
+
+static void
+__IORegistryCacheOldestApplier(const void * key, const void * value, void * context)
+{
+    IORegistryCacheRecord * record = (IORegistryCacheRecord *) value;
+    const void **	    oldest = (const void **) context;
+
+    if (!oldest[0] || (record->time < ((IORegistryCacheRecord *) oldest[1])->time))
+    {
+        oldest[0] = key;
+        oldest[1] = record;
+    }
+}
+
+// called with the lock held
+static void
+__IORegistryCacheRemoveOldest(void)
+{
+    const void * oldest[2] = { NULL, NULL };
+
+    CFDictionaryApplyFunction(__ioRegistryCacheRecords, &__IORegistryCacheOldestApplier, oldest);
+    if (!oldest[0]) return;
+    // the key is the dictionary's own, keep it through the removal
+    CFRetain(oldest[0]);
+    __IORegistryCacheRemoveRecord((CFNumberRef) oldest[0]);
+    CFRelease(oldest[0]);
+}
+
+static void
+__IORegistryCacheInterest(void * refcon, io_service_t service __unused,
+			  uint32_t messageType __unused, void * messageArgument __unused)
+{
+    uint64_t    entryID = (uint64_t)(uintptr_t) refcon;
+    CFNumberRef key;
+
+    key = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &entryID);
+    if (!key) return;
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    if (__ioRegistryCacheRecords) __IORegistryCacheRemoveRecord(key);
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+    CFRelease(key);
+}
+
+// called before the owner releases a reference on the name
+static void
+__IORegistryCacheForgetObject(io_object_t object)
+{
+    if (!__ioRegistryCacheMaxAge) return;
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    // the one being released and the cache's own are the last two
+    if (__ioRegistryCacheObjects && CFDictionaryContainsKey(__ioRegistryCacheObjects, (void *)(uintptr_t) object)
+     && (__IOObjectGetUserReferences(object) <= 2))
+    {
+        CFDictionaryRemoveValue(__ioRegistryCacheObjects, (void *)(uintptr_t) object);
+        mach_port_deallocate(mach_task_self(), object);
+    }
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+}
+
+// the entry ID of a mapped name, without asking the kernel
+static boolean_t
+__IORegistryCacheLookupEntryID(io_registry_entry_t entry, uint64_t * entryID)
+{
+    CFNumberRef key = NULL;
+
+    if (!__ioRegistryCacheMaxAge || !entry) return (false);
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    if (__ioRegistryCacheObjects) key = (CFNumberRef) CFDictionaryGetValue(__ioRegistryCacheObjects, (void *)(uintptr_t) entry);
+    if (key) CFNumberGetValue(key, kCFNumberSInt64Type, entryID);
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+
+    return (NULL != key);
+}
+
+// drops everything if the catalogue generation has moved since the last look
+static void
+__IORegistryCacheCheckGeneration(uint64_t now)
+{
+    uint32_t  generation;
+    boolean_t check;
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    check = ((now - __ioRegistryCacheGenerationTime) >= kIORegistryCacheGenerationInterval);
+    if (check) __ioRegistryCacheGenerationTime = now;
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+    if (!check) return;
+
+    if (kIOReturnSuccess != IOCatlogueGetGenCount(MACH_PORT_NULL, &generation)) return;
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    if (generation != __ioRegistryCacheGeneration)
+    {
+        __ioRegistryCacheGeneration = generation;
+        __IORegistryCacheRemoveAll();
+    }
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+}
+
+// returns the entry's record with the lock held, or NULL with it unlocked.
+// The entry ID is fetched if the object hasn't been seen; with create, a
+// missing record is made. Calls to the kernel are made unlocked.
+static IORegistryCacheRecord *
+__IORegistryCacheLock(io_registry_entry_t entry, boolean_t create)
+{
+    IORegistryCacheRecord * record = NULL;
+    CFNumberRef             key = NULL;
+    io_object_t             interest = MACH_PORT_NULL;
+    uint64_t                now, entryID;
+
+    if (!__ioRegistryCacheMaxAge || !entry) return (NULL);
+
+    now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    __IORegistryCacheCheckGeneration(now);
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    do
+    {
+        if (!__ioRegistryCacheRecords) break;
+
+        key = (CFNumberRef) CFDictionaryGetValue(__ioRegistryCacheObjects, (void *)(uintptr_t) entry);
+        if (key) CFRetain(key);
+        else
+        {
+            pthread_mutex_unlock(&__ioRegistryCacheLock);
+            if (kIOReturnSuccess != io_registry_entry_get_registry_entry_id(entry, &entryID)) return (NULL);
+            key = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &entryID);
+            if (!key) return (NULL);
+            pthread_mutex_lock(&__ioRegistryCacheLock);
+            if (!__ioRegistryCacheRecords) break;
+            __IORegistryCacheMapObject(entry, key);
+        }
+
+        record = (IORegistryCacheRecord *) CFDictionaryGetValue(__ioRegistryCacheRecords, key);
+        if (record && ((now - record->time) > __ioRegistryCacheMaxAge))
+        {
+            __IORegistryCacheRemoveRecord(key);
+            record = NULL;
+        }
+        if (record || !create) break;
+
+        // only services take interest notifications, other entries just age
+        CFNumberGetValue(key, kCFNumberSInt64Type, &entryID);
+        pthread_mutex_unlock(&__ioRegistryCacheLock);
+        if (kIOReturnSuccess != IOServiceAddInterestNotification(__ioRegistryCacheNotify, entry, kIOGeneralInterest,
+                                &__IORegistryCacheInterest, (void *)(uintptr_t) entryID, &interest))
+        {
+            interest = MACH_PORT_NULL;
+        }
+        pthread_mutex_lock(&__ioRegistryCacheLock);
+
+        // the cache may have been turned off, or the record made by another thread
+        if (!__ioRegistryCacheRecords) break;
+        record = (IORegistryCacheRecord *) CFDictionaryGetValue(__ioRegistryCacheRecords, key);
+        if (record) break;
+
+        if (CFDictionaryGetCount(__ioRegistryCacheRecords) >= kIORegistryCacheMaxRecords)
+            __IORegistryCacheRemoveOldest();
+        record = (IORegistryCacheRecord *) calloc(1, sizeof(IORegistryCacheRecord));
+        if (!record) break;
+        record->entryID  = entryID;
+        record->time     = now;
+        record->interest = interest;
+        interest         = MACH_PORT_NULL;
+        CFDictionarySetValue(__ioRegistryCacheRecords, key, record);
+    }
+    while (false);
+
+    if (!record) pthread_mutex_unlock(&__ioRegistryCacheLock);
+    // not IOObjectRelease, which could come back for the lock
+    if (interest) mach_port_deallocate(mach_task_self(), interest);
+    if (key) CFRelease(key);
+
+    return (record);
+}
+
+static void
+__IORegistryCacheUnlock(void)
+{
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+}
+
+kern_return_t
+IORegistrySetSnapshotCache(
+	uint64_t		maxAge )
+{
+    kern_return_t kr = kIOReturnSuccess;
+
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    if (maxAge && !__ioRegistryCacheRecords)
+    {
+        if (!__ioRegistryCacheNotify)
+        {
+            __ioRegistryCacheQueue  = dispatch_queue_create("com.apple.iokit.registrycache", DISPATCH_QUEUE_SERIAL);
+            __ioRegistryCacheNotify = IONotificationPortCreate(MACH_PORT_NULL);
+            if (__ioRegistryCacheNotify && __ioRegistryCacheQueue)
+                IONotificationPortSetDispatchQueue(__ioRegistryCacheNotify, __ioRegistryCacheQueue);
+        }
+        __ioRegistryCacheRecords = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                            &kCFTypeDictionaryKeyCallBacks, NULL);
+        __ioRegistryCacheObjects = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                            NULL, &kCFTypeDictionaryValueCallBacks);
+        if (!__ioRegistryCacheNotify || !__ioRegistryCacheRecords || !__ioRegistryCacheObjects)
+        {
+            if (__ioRegistryCacheRecords) CFRelease(__ioRegistryCacheRecords);
+            if (__ioRegistryCacheObjects) CFRelease(__ioRegistryCacheObjects);
+            __ioRegistryCacheRecords = __ioRegistryCacheObjects = NULL;
+            kr = kIOReturnNoMemory;
+        }
+        // the generation is read on first use
+        __ioRegistryCacheGeneration     = 0;
+        __ioRegistryCacheGenerationTime = 0;
+    }
+    else if (!maxAge && __ioRegistryCacheRecords)
+    {
+        __IORegistryCacheRemoveAll();
+        __IORegistryCacheUnmapAll();
+        CFRelease(__ioRegistryCacheRecords);
+        CFRelease(__ioRegistryCacheObjects);
+        __ioRegistryCacheRecords = __ioRegistryCacheObjects = NULL;
+    }
+    __ioRegistryCacheMaxAge = (kIOReturnSuccess == kr) ? maxAge : 0;
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+
+    return (kr);
+}
+
+void
+IORegistryFlushSnapshotCache( void )
+{
+    pthread_mutex_lock(&__ioRegistryCacheLock);
+    __IORegistryCacheRemoveAll();
+    pthread_mutex_unlock(&__ioRegistryCacheLock);
+}
+
+kern_return_t
+IORegistryEntryPrefetchSubtree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane )
+{
+    kern_return_t		kr;
+    io_iterator_t		iter;
+    io_registry_entry_t		next;
+    CFMutableDictionaryRef	properties;
+    uint64_t			entryID;
+    io_name_t			name;
+    io_string_t			path;
+
+    if (!__ioRegistryCacheMaxAge) return (kIOReturnNotReady);
+
+    kr = IORegistryEntryCreateIterator(entry, plane, kIORegistryIterateRecursively, &iter);
+    if (kIOReturnSuccess != kr) return (kr);
+
+    IOObjectRetain(entry);
+    for (next = entry; next; next = IOIteratorNext(iter))
+    {
+        IORegistryEntryGetRegistryEntryID(next, &entryID);
+        IORegistryEntryGetName(next, name);
+        IORegistryEntryGetPath(next, plane, path);
+        if (kIOReturnSuccess == IORegistryEntryCreateCFProperties(next, &properties, kCFAllocatorDefault, kNilOptions))
+            CFRelease(properties);
+        IOObjectRelease(next);
+    }
+    IOObjectRelease(iter);
+
+    return (kIOReturnSuccess);
+}
+
+/*
+ * Matching services cache. While IOServiceSetMatchingCache() has it on,
+ * the services IOServiceGetMatchingServices() and IOServiceGetMatchingService()
+ * find for a matching dictionary are kept, keyed by the dictionary's contents,
+ * and later calls with an equal dictionary are answered from them. A set is
+ * dropped when it is older than the cache's maximum age, when matched or
+ * terminated notifications for its dictionary fire, or when the IOCatalogue
+ * generation moves; a notification only affects the set of the dictionary it
+ * was armed for. The matched notification hands back the services already
+ * matched, the same ones IOServiceGetMatchingServices() finds, so arming it
+ * reads the set. Callers get a client side iterator over the set: a dead name
+ * that IOIteratorNext(), IOIteratorReset(), IOIteratorIsValid(),
+ * IOObjectRelease(), IOObjectRetain(), the IOObject class and retain count
+ * calls and IORegistryIteratorEnter/ExitEntry() answer for as the kernel would
+ * for an IOUserIterator. The cache holds a reference of its own on the name,
+ * so the name isn't reused while the iterator is known, and forgets it when
+ * IOObjectRelease() takes the caller's last reference. Iterators whose
+ * callers dropped their references some other way are swept up as more are made.
+ */
+#define kIOMatchingCacheMaxEntries	64
+#define kIOMatchingCacheSweepMin	64
+
+struct IOMatchingCacheSet {
+    uint32_t			refs;		// under the lock
+    boolean_t			valid;
+    CFIndex			count;
+    io_service_t		services[];
+};
+
+typedef struct IOMatchingCacheEntry IOMatchingCacheEntry;
+struct IOMatchingCacheEntry {
+    uint64_t			tag;		// notification refcon
+    uint64_t			time;
+    IOMatchingCacheSet *	set;
+    io_iterator_t		matched;
+    io_iterator_t		terminated;
+    boolean_t			changed;	// a notification fired while the set was read
+    IOMatchingCacheEntry *	nextFill;
+};
+
+typedef struct {
+    IOMatchingCacheSet *	set;
+    CFIndex			next;
+} IOMatchingCacheIterator;
+
+static pthread_mutex_t		__ioMatchingCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t			__ioMatchingCacheMaxAge;	// ns, zero when off
+static CFMutableDictionaryRef	__ioMatchingCacheEntries;	// matching to IOMatchingCacheEntry *
+static CFMutableDictionaryRef	__ioMatchingCacheIterators;	// io_iterator_t name to IOMatchingCacheIterator *
+static CFIndex			__ioMatchingCacheIteratorCount;
+static CFIndex			__ioMatchingCacheIteratorSweep = kIOMatchingCacheSweepMin;
+static IONotificationPortRef	__ioMatchingCacheNotify;
+static dispatch_queue_t		__ioMatchingCacheQueue;
+static uint64_t			__ioMatchingCacheTag;
+static IOMatchingCacheEntry *	__ioMatchingCacheFills;		// entries whose set is being read
+static uint32_t			__ioMatchingCacheGeneration;
+static uint64_t			__ioMatchingCacheGenerationTime;
+
+// CFHash() of a dictionary is only its count, so hash the contents. Members
+// of dictionaries and sets are summed so their order doesn't matter.
+static CFHashCode
+__IOMatchingCacheHash(const void * value)
+{
+    CFTypeID	  type = CFGetTypeID(value);
+    CFHashCode	  hash, sum;
+    CFIndex	  idx, count;
+    const void ** keys;
+    const void ** values;
+
+    if (CFDictionaryGetTypeID() == type)
+    {
+        count = CFDictionaryGetCount(value);
+        keys  = (const void **) malloc(2 * (count ? count : 1) * sizeof(void *));
+        if (!keys) return (count);
+        values = keys + count;
+        CFDictionaryGetKeysAndValues(value, keys, values);
+        for (sum = count, idx = 0; idx < count; idx++)
+            sum += (__IOMatchingCacheHash(keys[idx]) * 31) ^ __IOMatchingCacheHash(values[idx]);
+        free(keys);
+        return (sum);
+    }
+    if (CFSetGetTypeID() == type)
+    {
+        count = CFSetGetCount(value);
+        keys  = (const void **) malloc((count ? count : 1) * sizeof(void *));
+        if (!keys) return (count);
+        CFSetGetValues(value, keys);
+        for (sum = count, idx = 0; idx < count; idx++) sum += __IOMatchingCacheHash(keys[idx]);
+        free(keys);
+        return (sum);
+    }
+    if (CFArrayGetTypeID() == type)
+    {
+        count = CFArrayGetCount(value);
+        for (hash = count, idx = 0; idx < count; idx++)
+            hash = (hash * 33) ^ __IOMatchingCacheHash(CFArrayGetValueAtIndex(value, idx));
+        return (hash);
+    }
+
+    return (CFHash(value));
+}
+
+static void
+__IOMatchingCacheSetRelease(IOMatchingCacheSet * set)
+{
+    CFIndex idx;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    set->refs--;
+    if (set->refs)
+    {
+        pthread_mutex_unlock(&__ioMatchingCacheLock);
+        return;
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    for (idx = 0; idx < set->count; idx++) __IOObjectDeallocate(set->services[idx]);
+    free(set);
+}
+
+static void
+__IOMatchingCacheEntryFree(IOMatchingCacheEntry * entry)
+{
+    // not IOObjectRelease, which takes the lock
+    if (entry->matched) mach_port_deallocate(mach_task_self(), entry->matched);
+    if (entry->terminated) mach_port_deallocate(mach_task_self(), entry->terminated);
+    free(entry);
+}
+
+// called with the lock held; the caller releases the set once unlocked
+static IOMatchingCacheSet *
+__IOMatchingCacheRemoveEntry(CFDictionaryRef matching)
+{
+    IOMatchingCacheEntry * entry;
+    IOMatchingCacheSet *   set;
+
+    entry = (IOMatchingCacheEntry *) CFDictionaryGetValue(__ioMatchingCacheEntries, matching);
+    if (!entry) return (NULL);
+    set = entry->set;
+    set->valid = false;
+    CFDictionaryRemoveValue(__ioMatchingCacheEntries, matching);
+    __IOMatchingCacheEntryFree(entry);
+
+    return (set);
+}
+
+typedef struct {
+    uint64_t	      tag;
+    uint64_t	      oldest;
+    CFDictionaryRef   matching;
+} IOMatchingCacheSearch;
+
+static void
+__IOMatchingCacheFindApplier(const void * key, const void * value, void * context)
+{
+    IOMatchingCacheEntry *  entry  = (IOMatchingCacheEntry *) value;
+    IOMatchingCacheSearch * search = (IOMatchingCacheSearch *) context;
+
+    if (search->tag ? (entry->tag == search->tag) : (entry->time < search->oldest))
+    {
+        search->oldest   = entry->time;
+        search->matching = (CFDictionaryRef) key;
+    }
+}
+
+static void
+__IOMatchingCacheRemoveAll(void)
+{
+    IOMatchingCacheSearch  search;
+    IOMatchingCacheSet *   set;
+    IOMatchingCacheEntry * fill;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    for (fill = __ioMatchingCacheFills; fill; fill = fill->nextFill) fill->changed = true;
+    while (__ioMatchingCacheEntries && CFDictionaryGetCount(__ioMatchingCacheEntries))
+    {
+        search.tag      = 0;
+        search.oldest   = UINT64_MAX;
+        search.matching = NULL;
+        CFDictionaryApplyFunction(__ioMatchingCacheEntries, &__IOMatchingCacheFindApplier, &search);
+        set = __IOMatchingCacheRemoveEntry(search.matching);
+        pthread_mutex_unlock(&__ioMatchingCacheLock);
+        if (set) __IOMatchingCacheSetRelease(set);
+        pthread_mutex_lock(&__ioMatchingCacheLock);
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+}
+
+// the entry goes with its first notification, so the iterator isn't drained
+// to rearm it; a fill may still be reading the services from it
+static void
+__IOMatchingCacheChanged(void * refcon, io_iterator_t iterator __unused)
+{
+    IOMatchingCacheSearch  search;
+    IOMatchingCacheSet *   set = NULL;
+    IOMatchingCacheEntry * fill;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    // a set still being read for the dictionary isn't kept
+    for (fill = __ioMatchingCacheFills; fill; fill = fill->nextFill)
+    {
+        if (fill->tag == (uint64_t)(uintptr_t) refcon) fill->changed = true;
+    }
+    if (__ioMatchingCacheEntries)
+    {
+        search.tag      = (uint64_t)(uintptr_t) refcon;
+        search.matching = NULL;
+        CFDictionaryApplyFunction(__ioMatchingCacheEntries, &__IOMatchingCacheFindApplier, &search);
+        if (search.matching) set = __IOMatchingCacheRemoveEntry(search.matching);
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    if (set) __IOMatchingCacheSetRelease(set);
+}
+
+static void
+__IOMatchingCacheCheckGeneration(uint64_t now)
+{
+    uint32_t  generation;
+    boolean_t check, changed = false;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    check = ((now - __ioMatchingCacheGenerationTime) >= kIORegistryCacheGenerationInterval);
+    if (check) __ioMatchingCacheGenerationTime = now;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+    if (!check) return;
+
+    if (kIOReturnSuccess != IOCatlogueGetGenCount(MACH_PORT_NULL, &generation)) return;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    if (generation != __ioMatchingCacheGeneration)
+    {
+        __ioMatchingCacheGeneration = generation;
+        changed = true;
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    if (changed) __IOMatchingCacheRemoveAll();
+}
+
+// the set is read by arming the matched notification, after the
+// terminated one, so that a set which may have changed while it was read is
+// not kept.
+static IOMatchingCacheSet *
+__IOMatchingCacheFill(CFDictionaryRef matching, uint64_t now)
+{
+    IOMatchingCacheEntry *  entry;
+    IOMatchingCacheEntry ** link;
+    IOMatchingCacheSet *    set = NULL;
+    IOMatchingCacheSet *    grown;
+    IOMatchingCacheSet *    old = NULL;
+    IOMatchingCacheSearch   search;
+    io_object_t		    object;
+    CFDictionaryRef	    key = NULL;
+    CFIndex		    idx, count = 0, capacity = 16;
+    kern_return_t	    kr;
+
+    entry = (IOMatchingCacheEntry *) calloc(1, sizeof(IOMatchingCacheEntry));
+    if (!entry) return (NULL);
+    entry->time = now;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    entry->tag             = ++__ioMatchingCacheTag;
+    entry->nextFill        = __ioMatchingCacheFills;
+    __ioMatchingCacheFills = entry;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    CFRetain(matching);
+    kr = IOServiceAddMatchingNotification(__ioMatchingCacheNotify, kIOTerminatedNotification, matching,
+                        &__IOMatchingCacheChanged, (void *)(uintptr_t) entry->tag, &entry->terminated);
+    if (kIOReturnSuccess == kr)
+    {
+        while ((object = IOIteratorNext(entry->terminated))) IOObjectRelease(object);
+        CFRetain(matching);
+        kr = IOServiceAddMatchingNotification(__ioMatchingCacheNotify, kIOMatchedNotification, matching,
+                        &__IOMatchingCacheChanged, (void *)(uintptr_t) entry->tag, &entry->matched);
+    }
+    if (kIOReturnSuccess == kr)
+    {
+        // drained to the end either way, which arms it
+        set = (IOMatchingCacheSet *) malloc(sizeof(IOMatchingCacheSet) + capacity * sizeof(io_service_t));
+        while ((object = IOIteratorNext(entry->matched)))
+        {
+            if (set && (count == capacity))
+            {
+                grown = (IOMatchingCacheSet *) realloc(set, sizeof(IOMatchingCacheSet) + 2 * capacity * sizeof(io_service_t));
+                if (grown) capacity *= 2;
+                else
+                {
+                    for (idx = 0; idx < count; idx++) IOObjectRelease(set->services[idx]);
+                    free(set);
+                }
+                set = grown;
+            }
+            if (set) set->services[count++] = object;
+            else     IOObjectRelease(object);
+        }
+    }
+    if (set)
+    {
+        set->count = count;
+        set->refs  = 1;
+        set->valid = true;
+        // our own copy, in case the caller changes theirs
+        key = CFPropertyListCreateDeepCopy(kCFAllocatorDefault, matching, kCFPropertyListImmutable);
+    }
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    for (link = &__ioMatchingCacheFills; *link != entry; link = &(*link)->nextFill) {}
+    *link = entry->nextFill;
+    if (key && __ioMatchingCacheEntries && !entry->changed)
+    {
+        if (CFDictionaryGetCount(__ioMatchingCacheEntries) >= kIOMatchingCacheMaxEntries)
+        {
+            search.tag      = 0;
+            search.oldest   = UINT64_MAX;
+            search.matching = NULL;
+            CFDictionaryApplyFunction(__ioMatchingCacheEntries, &__IOMatchingCacheFindApplier, &search);
+            if (search.matching) old = __IOMatchingCacheRemoveEntry(search.matching);
+        }
+        if (!CFDictionaryContainsKey(__ioMatchingCacheEntries, key))
+        {
+            entry->set = set;
+            set->refs++;
+            CFDictionarySetValue(__ioMatchingCacheEntries, key, entry);
+            entry = NULL;
+        }
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    if (entry) __IOMatchingCacheEntryFree(entry);
+    if (old) __IOMatchingCacheSetRelease(old);
+    if (key) CFRelease(key);
+
+    return (set);
+}
+
+// returns the services for matching, retained, or NULL if the cache is off
+static IOMatchingCacheSet *
+__IOMatchingCacheCopySet(mach_port_t masterPort, CFDictionaryRef matching)
+{
+    IOMatchingCacheEntry * entry;
+    IOMatchingCacheSet *   set = NULL;
+    IOMatchingCacheSet *   old = NULL;
+    uint64_t		   now;
+
+    if (!__ioMatchingCacheMaxAge || (MACH_PORT_NULL != masterPort)) return (NULL);
+    if (CFDictionaryGetTypeID() != CFGetTypeID(matching)) return (NULL);
+
+    now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    __IOMatchingCacheCheckGeneration(now);
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    if (!__ioMatchingCacheEntries)
+    {
+        pthread_mutex_unlock(&__ioMatchingCacheLock);
+        return (NULL);
+    }
+    entry = (IOMatchingCacheEntry *) CFDictionaryGetValue(__ioMatchingCacheEntries, matching);
+    if (entry && ((now - entry->time) > __ioMatchingCacheMaxAge))
+    {
+        old = __IOMatchingCacheRemoveEntry(matching);
+        entry = NULL;
+    }
+    if (entry)
+    {
+        set = entry->set;
+        set->refs++;
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    if (old) __IOMatchingCacheSetRelease(old);
+    if (!set) set = __IOMatchingCacheFill(matching, now);
+
+    return (set);
+}
+
+static void
+__IOMatchingCacheRemoveIterator(io_iterator_t iterator, IOMatchingCacheIterator * iter)
+{
+    __IOMatchingCacheSetRelease(iter->set);
+    free(iter);
+    mach_port_mod_refs(mach_task_self(), iterator, MACH_PORT_RIGHT_DEAD_NAME, -1);
+}
+
+typedef struct {
+    CFIndex			count;
+    io_iterator_t *		names;
+    IOMatchingCacheIterator **	iters;
+} IOMatchingCacheSweep;
+
+static void
+__IOMatchingCacheSweepApplier(const void * key, const void * value, void * context)
+{
+    IOMatchingCacheSweep * sweep = (IOMatchingCacheSweep *) context;
+    mach_port_urefs_t	   urefs;
+
+    // only the cache's reference is left
+    if ((KERN_SUCCESS == mach_port_get_refs(mach_task_self(), (mach_port_name_t)(uintptr_t) key,
+                            MACH_PORT_RIGHT_DEAD_NAME, &urefs)) && (urefs <= 1))
+    {
+        sweep->names[sweep->count] = (io_iterator_t)(uintptr_t) key;
+        sweep->iters[sweep->count] = (IOMatchingCacheIterator *) value;
+        sweep->count++;
+    }
+}
+
+// frees the iterators callers are done with, each time their number doubles
+static void
+__IOMatchingCacheSweepIterators(void)
+{
+    IOMatchingCacheSweep sweep;
+    CFIndex		 idx;
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    if (!__ioMatchingCacheIterators || (__ioMatchingCacheIteratorCount < __ioMatchingCacheIteratorSweep))
+    {
+        pthread_mutex_unlock(&__ioMatchingCacheLock);
+        return;
+    }
+    sweep.count = 0;
+    sweep.names = (io_iterator_t *) malloc(__ioMatchingCacheIteratorCount * (sizeof(io_iterator_t) + sizeof(void *)));
+    sweep.iters = (IOMatchingCacheIterator **)(sweep.names + __ioMatchingCacheIteratorCount);
+    if (sweep.names)
+    {
+        CFDictionaryApplyFunction(__ioMatchingCacheIterators, &__IOMatchingCacheSweepApplier, &sweep);
+        for (idx = 0; idx < sweep.count; idx++)
+            CFDictionaryRemoveValue(__ioMatchingCacheIterators, (void *)(uintptr_t) sweep.names[idx]);
+        __ioMatchingCacheIteratorCount -= sweep.count;
+    }
+    __ioMatchingCacheIteratorSweep = 2 * __ioMatchingCacheIteratorCount;
+    if (__ioMatchingCacheIteratorSweep < kIOMatchingCacheSweepMin)
+        __ioMatchingCacheIteratorSweep = kIOMatchingCacheSweepMin;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    return( kr );
+    for (idx = 0; idx < sweep.count; idx++) __IOMatchingCacheRemoveIterator(sweep.names[idx], sweep.iters[idx]);
+    if (sweep.names) free(sweep.names);
 }
 
+static kern_return_t
+__IOMatchingCacheCreateIterator(IOMatchingCacheSet * set, io_iterator_t * iterator)
+{
+    IOMatchingCacheIterator * iter;
+    mach_port_t		      name;
+    kern_return_t	      kr;
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+    iter = (IOMatchingCacheIterator *) calloc(1, sizeof(IOMatchingCacheIterator));
+    if (!iter) return (kIOReturnNoMemory);
 
-/*
- * IORegistry accessors
- */
+    // a send right whose receive right is gone is a dead name, so a stray
+    // MIG call on the iterator fails rather than waiting on us
+    kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &name);
+    if (KERN_SUCCESS == kr)
+    {
+        kr = mach_port_insert_right(mach_task_self(), name, name, MACH_MSG_TYPE_MAKE_SEND);
+        mach_port_mod_refs(mach_task_self(), name, MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+    if (KERN_SUCCESS != kr)
+    {
+        free(iter);
+        return (kr);
+    }
 
-kern_return_t
-IORegistryCreateIterator(
-        mach_port_t	_masterPort,
-	const io_name_t	plane,
-	IOOptionBits	options,
-	io_iterator_t * iterator )
-{
-    kern_return_t	kr;
-    mach_port_t		masterPort;
+    // the cache's own reference, the caller has the other
+    kr = mach_port_mod_refs(mach_task_self(), name, MACH_PORT_RIGHT_DEAD_NAME, 1);
+    if (KERN_SUCCESS != kr)
+    {
+        free(iter);
+        mach_port_deallocate(mach_task_self(), name);
+        return (kr);
+    }
 
-    if (MACH_PORT_NULL == _masterPort)
-	masterPort = __IOGetDefaultMasterPort();
-    else
-	masterPort = _masterPort;
+    __IOMatchingCacheSweepIterators();
 
-    kr = io_registry_create_iterator( masterPort, (char *) plane,
-		options, iterator);
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    if (!__ioMatchingCacheIterators)
+        __ioMatchingCacheIterators = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
+    if (__ioMatchingCacheIterators)
+    {
+        iter->set = set;
+        set->refs++;
+        CFDictionarySetValue(__ioMatchingCacheIterators, (void *)(uintptr_t) name, iter);
+        __ioMatchingCacheIteratorCount++;
+        iter = NULL;
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
-	mach_port_deallocate(mach_task_self(), masterPort);
+    if (iter)
+    {
+        free(iter);
+        mach_port_mod_refs(mach_task_self(), name, MACH_PORT_RIGHT_DEAD_NAME, -2);
+        return (kIOReturnNoMemory);
+    }
+    *iterator = name;
 
-    return( kr );
+    return (kIOReturnSuccess);
 }
 
-kern_return_t
-IORegistryEntryCreateIterator(
-	io_registry_entry_t	entry,
-	const io_name_t		plane,
-	IOOptionBits		options,
-	io_iterator_t 	      * iterator )
+// returns the iterator's record with the lock held, or NULL with it unlocked
+static IOMatchingCacheIterator *
+__IOMatchingCacheLockIterator(io_iterator_t iterator)
 {
-    return( io_registry_entry_create_iterator( entry, (char *) plane,
-		options, iterator));
+    IOMatchingCacheIterator * iter;
+
+    if (!__ioMatchingCacheIteratorCount || !iterator) return (NULL);
+
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    iter = __ioMatchingCacheIterators
+            ? (IOMatchingCacheIterator *) CFDictionaryGetValue(__ioMatchingCacheIterators, (void *)(uintptr_t) iterator)
+            : NULL;
+    if (!iter) pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    return (iter);
 }
 
-kern_return_t
-IORegistryIteratorEnterEntry(
-	io_iterator_t	iterator )
+static boolean_t
+__IOMatchingCacheIteratorNext(io_iterator_t iterator, io_object_t * next)
 {
-    return( io_registry_iterator_enter_entry( iterator));
-}
+    IOMatchingCacheIterator * iter;
+    io_service_t	      service;
 
+    if (!(iter = __IOMatchingCacheLockIterator(iterator))) return (false);
 
-kern_return_t
-IORegistryIteratorExitEntry(
-	io_iterator_t	iterator )
-{
-    return( io_registry_iterator_exit_entry( iterator));
+    *next = MACH_PORT_NULL;
+    while (iter->next < iter->set->count)
+    {
+        service = iter->set->services[iter->next++];
+        // a service that went away has left a dead name
+        if (KERN_SUCCESS == mach_port_mod_refs(mach_task_self(), service, MACH_PORT_RIGHT_SEND, 1))
+        {
+            *next = service;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    return (true);
 }
 
-io_registry_entry_t
-IORegistryEntryFromPath(
-        mach_port_t		_masterPort,
-	const io_string_t	path )
+static boolean_t
+__IOMatchingCacheIteratorReset(io_iterator_t iterator)
 {
-    kern_return_t	kr;
-    io_registry_entry_t	entry;
-    mach_port_t		masterPort;
+    IOMatchingCacheIterator * iter;
 
-    if (MACH_PORT_NULL == _masterPort)
-	masterPort = __IOGetDefaultMasterPort();
-    else
-	masterPort = _masterPort;
+    if (!(iter = __IOMatchingCacheLockIterator(iterator))) return (false);
+    iter->next = 0;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    kr = io_registry_entry_from_path( masterPort, (char *) path, &entry );
-    if( kIOReturnSuccess != kr)
-	entry = 0;
+    return (true);
+}
 
-    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
-	mach_port_deallocate(mach_task_self(), masterPort);
+static boolean_t
+__IOMatchingCacheIteratorIsValid(io_iterator_t iterator, boolean_t * valid)
+{
+    IOMatchingCacheIterator * iter;
 
-    return( entry );
+    if (!(iter = __IOMatchingCacheLockIterator(iterator))) return (false);
+    *valid = iter->set->valid;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
+
+    return (true);
 }
 
-io_registry_entry_t
-IORegistryEntryCopyFromPath(
-	mach_port_t	_masterPort,
-	CFStringRef	cfpath )
+static boolean_t
+__IOMatchingCacheIsIterator(io_object_t object)
 {
-#if IOKIT_SERVER_VERSION < 20150715
-    return (MACH_PORT_NULL);
-#else
+    if (!__IOMatchingCacheLockIterator(object)) return (false);
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    kern_return_t	   kr;
-    kern_return_t          result;
-    io_registry_entry_t	   entry;
-    mach_port_t		   masterPort;
-    io_buf_ptr_t           path_ool;
-    mach_msg_type_number_t path_oolCnt;
-    char                 * path;
-    size_t                 pathLen;
-    void                 * buffer;
+    return (true);
+}
 
-    if (MACH_PORT_NULL == _masterPort)
-	masterPort = __IOGetDefaultMasterPort();
-    else
-	masterPort = _masterPort;
+// called before the caller releases a reference on the name
+static void
+__IOMatchingCacheForgetIterator(io_iterator_t iterator)
+{
+    IOMatchingCacheIterator * iter;
 
-    buffer      = NULL;
-    pathLen     = 0;
-    path_ool    = NULL;
-    path_oolCnt = 0;
-    path = (char *) CFStringGetCStringPtr(cfpath, kCFStringEncodingUTF8);
-    if (!path)
-    {
-	CFIndex bufferSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(cfpath),
-	       kCFStringEncodingUTF8) + sizeof('\0');
-        buffer = malloc(bufferSize);
-        if (buffer && CFStringGetCString(cfpath, buffer, bufferSize, kCFStringEncodingUTF8))
-            path = buffer;
-    }
-    if (!path) kr = kIOReturnBadArgument;
-    else
+    if (!(iter = __IOMatchingCacheLockIterator(iterator))) return;
+    // the caller's last reference and the cache's
+    if (__IOObjectGetUserReferences(iterator) > 2)
     {
- 	pathLen = strlen(path);
- 	if (pathLen > sizeof(io_string_inband_t))
-	{
-	    path_ool = path;
-	    path_oolCnt = pathLen + 1;
-	    path = "\0";
-	}
-
-	kr = io_registry_entry_from_path_ool(masterPort, path, path_ool, path_oolCnt, &result, &entry);
+        pthread_mutex_unlock(&__ioMatchingCacheLock);
+        return;
     }
+    CFDictionaryRemoveValue(__ioMatchingCacheIterators, (void *)(uintptr_t) iterator);
+    __ioMatchingCacheIteratorCount--;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    if ((kIOReturnSuccess != kr) || (kIOReturnSuccess != result)) entry = 0;
-
-    if (buffer) free(buffer);
-
-    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
-	mach_port_deallocate(mach_task_self(), masterPort);
-
-    return( entry );
-#endif /* IOKIT_SERVER_VERSION < 20150715 */
+    __IOMatchingCacheRemoveIterator(iterator, iter);
 }
 
-io_registry_entry_t
-IORegistryGetRootEntry(
-        mach_port_t	_masterPort )
+kern_return_t
+IOServiceSetMatchingCache(
+	uint64_t		maxAge )
 {
-    kern_return_t	kr;
-    mach_port_t		masterPort;
-    io_registry_entry_t	entry;
+    kern_return_t		kr = kIOReturnSuccess;
+    CFDictionaryKeyCallBacks	keyCallBacks = kCFTypeDictionaryKeyCallBacks;
 
-    if (MACH_PORT_NULL == _masterPort)
-	masterPort = __IOGetDefaultMasterPort();
-    else
-	masterPort = _masterPort;
+    keyCallBacks.hash = &__IOMatchingCacheHash;
 
-    kr = io_registry_get_root_entry( masterPort, &entry );
-    if( kIOReturnSuccess != kr)
-	entry = 0;
+    // whatever was kept is stale once the settings change
+    __IOMatchingCacheRemoveAll();
 
-    if ((masterPort != MACH_PORT_NULL) && (masterPort != _masterPort))
-	mach_port_deallocate(mach_task_self(), masterPort);
+    pthread_mutex_lock(&__ioMatchingCacheLock);
+    if (maxAge && !__ioMatchingCacheEntries)
+    {
+        if (!__ioMatchingCacheNotify)
+        {
+            __ioMatchingCacheQueue  = dispatch_queue_create("com.apple.iokit.matchingcache", DISPATCH_QUEUE_SERIAL);
+            __ioMatchingCacheNotify = IONotificationPortCreate(MACH_PORT_NULL);
+            if (__ioMatchingCacheNotify && __ioMatchingCacheQueue)
+                IONotificationPortSetDispatchQueue(__ioMatchingCacheNotify, __ioMatchingCacheQueue);
+        }
+        // kept once made, so a fill racing with turning the cache off has somewhere to go
+        if (__ioMatchingCacheNotify)
+            __ioMatchingCacheEntries = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &keyCallBacks, NULL);
+        if (!__ioMatchingCacheEntries) kr = kIOReturnNoMemory;
+    }
+    __ioMatchingCacheGeneration     = 0;
+    __ioMatchingCacheGenerationTime = 0;
+    __ioMatchingCacheMaxAge = (kIOReturnSuccess == kr) ? maxAge : 0;
+    pthread_mutex_unlock(&__ioMatchingCacheLock);
 
-    return( entry );
+    return (kr);
+}
+
+void
+IOServiceFlushMatchingCache( void )
+{
+    __IOMatchingCacheRemoveAll();
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 kern_return_t
 IORegistryEntryGetPath(
 	io_registry_entry_t	entry,
 	const io_name_t		plane,
 	io_string_t		path )
 {
-    return io_registry_entry_get_path( entry, (char *) plane, path );
+    IORegistryCacheRecord *	record;
+    CFStringRef			planeKey, cached;
+    kern_return_t		kr;
+    uint64_t			start;
+
+    if (!__ioRegistryCacheMaxAge || !plane)
+    {
+        start = __IOCallStatsBegin();
+        kr = io_registry_entry_get_path( entry, (char *) plane, path );
+        if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetPath, sizeof(io_string_t), 0);
+        return (kr);
+    }
+
+    planeKey = CFStringCreateWithCString(kCFAllocatorDefault, plane, kCFStringEncodingUTF8);
+    if ((record = __IORegistryCacheLock(entry, false)))
+    {
+        cached = (planeKey && record->paths) ? CFDictionaryGetValue(record->paths, planeKey) : NULL;
+        if (cached && CFStringGetCString(cached, path, sizeof(io_string_t), kCFStringEncodingUTF8))
+        {
+            __IORegistryCacheUnlock();
+            CFRelease(planeKey);
+            return (kIOReturnSuccess);
+        }
+        __IORegistryCacheUnlock();
+    }
+
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_path( entry, (char *) plane, path );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetPath, sizeof(io_string_t), 0);
+
+    if ((kIOReturnSuccess == kr) && planeKey && (record = __IORegistryCacheLock(entry, true)))
+    {
+        if (!record->paths) record->paths = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        cached = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+        if (record->paths && cached) CFDictionarySetValue(record->paths, planeKey, cached);
+        if (cached) CFRelease(cached);
+        __IORegistryCacheUnlock();
+    }
+    if (planeKey) CFRelease(planeKey);
+
+    return (kr);
 }
 
 CFStringRef
@@ -2402,47 +6336,207 @@ IORegistryEntryGetName(
 	io_registry_entry_t	entry,
 	io_name_t 	        name )
 {
-    return io_registry_entry_get_name( entry, name );
+    IORegistryCacheRecord *	record;
+    kern_return_t		kr;
+    uint64_t			start;
+
+    if ((record = __IORegistryCacheLock(entry, false)))
+    {
+        boolean_t hit = record->hasName;
+        if (hit) strlcpy(name, record->name, sizeof(io_name_t));
+        __IORegistryCacheUnlock();
+        if (hit) return (kIOReturnSuccess);
+    }
+
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_name( entry, name );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetName, sizeof(io_name_t), 0);
+
+    if ((kIOReturnSuccess == kr) && (record = __IORegistryCacheLock(entry, true)))
+    {
+        strlcpy(record->name, name, sizeof(io_name_t));
+        record->hasName = true;
+        __IORegistryCacheUnlock();
+    }
+
+    return (kr);
+}
+
+kern_return_t
+IORegistryEntryGetNameInPlane(
+	io_registry_entry_t	entry,
+	const io_name_t 	plane,
+	io_name_t 	        name )
+{
+    kern_return_t	kr;
+    uint64_t		start;
+
+    if( NULL == plane)
+        plane = "";
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_name_in_plane( entry,
+                                                                 (char *) plane, name );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetNameInPlane, sizeof(io_name_t), 0);
+
+    return( kr );
+}
+
+kern_return_t
+IORegistryEntryGetLocationInPlane(
+	io_registry_entry_t	entry,
+	const io_name_t 	plane,
+	io_name_t 	        location )
+{
+    kern_return_t	kr;
+    uint64_t		start;
+
+    if( NULL == plane)
+        plane = "";
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_location_in_plane( entry,
+                                                                     (char *) plane, location );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetLocationInPlane, sizeof(io_name_t), 0);
+
+    return( kr );
+}
+
+kern_return_t
+IORegistryEntryGetRegistryEntryID(
+	io_registry_entry_t	entry,
+	uint64_t *		entryID )
+{
+    kern_return_t		kr;
+    uint64_t			start;
+
+    // a mapped name answers without a record, which would cost an interest notification
+    if (__IORegistryCacheLookupEntryID(entry, entryID))
+        return (kIOReturnSuccess);
+
+    start = __IOCallStatsBegin();
+    kr =  io_registry_entry_get_registry_entry_id(entry, entryID);
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetRegistryEntryID, sizeof(uint64_t), 0);
+    if (KERN_SUCCESS != kr)
+	*entryID = 0;
+
+    return (kr);
+}
+
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+/*
+ * Property reads give the kernel a receive buffer so replies that fit are
+ * copied out in line, rather than in out of line memory that costs a
+ * vm_allocate and vm_deallocate per call. Replies up to 2048 bytes use a stack
+ * buffer. The first time a thread gets an out of line reply, it gets its own
+ * heap buffer of that size (rounded up to a power of two, at most
+ * kIOReceiveBufferMaxSize), which grows as larger replies are seen and is
+ * reused until the thread exits.
+ */
+#define kIOReceiveBufferMaxSize		(256 * 1024)
+
+typedef struct {
+    char *		buffer;
+    mach_vm_size_t	capacity;
+    boolean_t		busy;
+} IOReceiveBuffer;
+
+static pthread_once_t	__ioReceiveBufferOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t	__ioReceiveBufferKey;
+static boolean_t	__ioReceiveBufferKeyValid;
+static uint64_t		__ioReceiveBufferInline;
+static uint64_t		__ioReceiveBufferOutOfLine;
+
+static void
+__IOReceiveBufferFree(void * value)
+{
+    IOReceiveBuffer * receive = (IOReceiveBuffer *) value;
+
+    if (receive->buffer) free(receive->buffer);
+    free(receive);
+}
+
+static void
+__IOReceiveBufferInitialize(void)
+{
+    __ioReceiveBufferKeyValid = (0 == pthread_key_create(&__ioReceiveBufferKey, &__IOReceiveBufferFree));
 }
 
-kern_return_t
-IORegistryEntryGetNameInPlane(
-	io_registry_entry_t	entry,
-	const io_name_t 	plane,
-	io_name_t 	        name )
+// swaps in the thread's buffer if it is larger than *buffer. The result goes
+// to __IOReceiveBufferRelease once the reply has been used, or the call failed.
+static IOReceiveBuffer *
+__IOReceiveBufferAcquire(char ** buffer, mach_vm_size_t * size)
 {
+    IOReceiveBuffer * receive;
 
-    if( NULL == plane)
-        plane = "";
-    return ( io_registry_entry_get_name_in_plane( entry,
-                                                                 (char *) plane, name ));
-}
+    pthread_once(&__ioReceiveBufferOnce, &__IOReceiveBufferInitialize);
+    if (!__ioReceiveBufferKeyValid) return (NULL);
 
-kern_return_t
-IORegistryEntryGetLocationInPlane(
-	io_registry_entry_t	entry,
-	const io_name_t 	plane,
-	io_name_t 	        location )
-{
+    receive = (IOReceiveBuffer *) pthread_getspecific(__ioReceiveBufferKey);
+    if (!receive)
+    {
+        receive = (IOReceiveBuffer *) calloc(1, sizeof(IOReceiveBuffer));
+        if (!receive) return (NULL);
+        if (pthread_setspecific(__ioReceiveBufferKey, receive))
+        {
+            free(receive);
+            return (NULL);
+        }
+    }
+    // a CF allocator that reads properties while we unserialize
+    if (receive->busy) return (NULL);
+    receive->busy = true;
 
-    if( NULL == plane)
-        plane = "";
-    return io_registry_entry_get_location_in_plane( entry,
-                                                                     (char *) plane, location );
+    if (receive->capacity > *size)
+    {
+        *buffer = receive->buffer;
+        *size   = receive->capacity;
+    }
+
+    return (receive);
 }
 
-kern_return_t
-IORegistryEntryGetRegistryEntryID(
-	io_registry_entry_t	entry,
-	uint64_t *		entryID )
+static void
+__IOReceiveBufferRelease(IOReceiveBuffer * receive, boolean_t replied, char * outOfLine, uint32_t outOfLineSize)
 {
-    kern_return_t kr;
+    mach_vm_size_t capacity;
+    char *         buffer;
 
-    kr =  io_registry_entry_get_registry_entry_id(entry, entryID);
-    if (KERN_SUCCESS != kr)
-	*entryID = 0;
+    // a failed call is counted as neither kind of reply
+    if (replied && !outOfLine)
+    {
+        __c11_atomic_fetch_add((_Atomic uint64_t *)&__ioReceiveBufferInline, 1, __ATOMIC_RELAXED);
+    }
+    else if (replied)
+    {
+        __c11_atomic_fetch_add((_Atomic uint64_t *)&__ioReceiveBufferOutOfLine, 1, __ATOMIC_RELAXED);
+        if (receive && (outOfLineSize <= kIOReceiveBufferMaxSize) && (outOfLineSize > receive->capacity))
+        {
+            for (capacity = 4096; capacity < outOfLineSize; capacity <<= 1) {}
+            // nothing to keep, so don't realloc
+            buffer = (char *) malloc(capacity);
+            if (buffer)
+            {
+                if (receive->buffer) free(receive->buffer);
+                receive->buffer   = buffer;
+                receive->capacity = capacity;
+            }
+        }
+    }
+    if (receive) receive->busy = false;
+}
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 
-    return (kr);
+void
+IORegistryEntryGetReceiveBufferStatistics(
+	uint64_t *		inlineCount,
+	uint64_t *		outOfLineCount )
+{
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (inlineCount)    *inlineCount    = __c11_atomic_load((_Atomic uint64_t *)&__ioReceiveBufferInline, __ATOMIC_RELAXED);
+    if (outOfLineCount) *outOfLineCount = __c11_atomic_load((_Atomic uint64_t *)&__ioReceiveBufferOutOfLine, __ATOMIC_RELAXED);
+#else
+    if (inlineCount)    *inlineCount    = 0;
+    if (outOfLineCount) *outOfLineCount = 0;
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 }
 
 kern_return_t
@@ -2457,17 +6551,40 @@ IORegistryEntryCreateCFProperties(
     char *		propertiesBuffer;
     CFStringRef		errorString;
     const char *	cstr;
+    IORegistryCacheRecord * record;
+    CFDictionaryRef	cached;
+    uint64_t		start;
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
     char		sBuf[2048];
+    char *		rBuf = sBuf;
     mach_vm_size_t      sBufSize = sizeof(sBuf);
+    IOReceiveBuffer *	receive = NULL;
+    boolean_t		received = false;
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 
+    if ((record = __IORegistryCacheLock(entry, false)))
+    {
+        cached = record->properties ? CFRetain(record->properties) : NULL;
+        __IORegistryCacheUnlock();
+        if (cached)
+        {
+            // the caller gets containers it may change, as from the kernel
+            *properties = (CFMutableDictionaryRef) CFPropertyListCreateDeepCopy(allocator, cached,
+                                                        kCFPropertyListMutableContainers);
+            CFRelease(cached);
+            return( *properties ? kIOReturnSuccess : kIOReturnNoMemory );
+        }
+    }
+
+    start = __IOCallStatsBegin();
 #if IOKIT_SERVER_VERSION >= 20140421
     if (kIOCFSerializeToBinary & gIOKitLibSerializeOptions)
     {
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+	receive = __IOReceiveBufferAcquire(&rBuf, &sBufSize);
+	received = true;
 	kr = io_registry_entry_get_properties_bin_buf(entry,
-	    (mach_vm_address_t)sBuf, &sBufSize, &propertiesBuffer, &size);
+	    (mach_vm_address_t)rBuf, &sBufSize, &propertiesBuffer, &size);
 #else
 	kr = io_registry_entry_get_properties_bin(entry, &propertiesBuffer, &size);
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
@@ -2478,19 +6595,36 @@ IORegistryEntryCreateCFProperties(
 	kr = io_registry_entry_get_properties(entry, &propertiesBuffer, &size);
     }
 
-    if (kr != kIOReturnSuccess) return (kr);
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetProperties,
+                    ((kIOReturnSuccess == kr) && !propertiesBuffer) ? sBufSize : 0,
+                    ((kIOReturnSuccess == kr) && propertiesBuffer) ? size : 0);
+#else
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetProperties,
+                    0, (kIOReturnSuccess == kr) ? size : 0);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+
+    if (kr != kIOReturnSuccess) {
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        if (received) __IOReceiveBufferRelease(receive, false, NULL, 0);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        return (kr);
+    }
 
     if (propertiesBuffer) {
 	    *properties = (CFMutableDictionaryRef) IOCFUnserializeWithSize(propertiesBuffer, size, allocator,
 									  0, &errorString);
     } else {
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
-        *properties = (CFMutableDictionaryRef) IOCFUnserializeWithSize(sBuf, sBufSize, allocator,
+        *properties = (CFMutableDictionaryRef) IOCFUnserializeWithSize(rBuf, sBufSize, allocator,
                                         0, &errorString);
 #else
         *properties = NULL;
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
     }
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (received) __IOReceiveBufferRelease(receive, true, propertiesBuffer, size);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 
     if (!(*properties) && errorString)
     {
@@ -2503,9 +6637,335 @@ IORegistryEntryCreateCFProperties(
 	    vm_deallocate(mach_task_self(), (vm_address_t)propertiesBuffer, size);
     }
 
+    if (*properties && (record = __IORegistryCacheLock(entry, true)))
+    {
+        if (!record->properties) record->properties = CFPropertyListCreateDeepCopy(kCFAllocatorDefault,
+                                                        *properties, kCFPropertyListImmutable);
+        __IORegistryCacheUnlock();
+    }
+
     return( *properties ? kIOReturnSuccess : kIOReturnInternalError );
 }
 
+kern_return_t
+IORegistryEntryCreatePropertiesView(
+	io_registry_entry_t	entry,
+	IOCFBinaryViewRef     * view,
+	IOOptionBits		options __unused )
+{
+#if IOKIT_SERVER_VERSION >= 20140421
+    kern_return_t	kr;
+    uint32_t		size;
+    char *		propertiesBuffer;
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    char *		copy;
+    char		sBuf[2048];
+    mach_vm_size_t      sBufSize = sizeof(sBuf);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+
+    if (!view) return (kIOReturnBadArgument);
+    *view = NULL;
+
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    kr = io_registry_entry_get_properties_bin_buf(entry,
+        (mach_vm_address_t)sBuf, &sBufSize, &propertiesBuffer, &size);
+#else
+    kr = io_registry_entry_get_properties_bin(entry, &propertiesBuffer, &size);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (kr != kIOReturnSuccess) return (kr);
+
+    if (propertiesBuffer) {
+        // the view takes over the out of line buffer
+        *view = IOCFBinaryViewCreate(propertiesBuffer, size, kIOCFBinaryViewDeallocateBuffer, NULL);
+        if (!*view) vm_deallocate(mach_task_self(), (vm_address_t)propertiesBuffer, size);
+    }
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    else if ((copy = malloc(sBufSize))) {
+        // the reply landed on our stack, so keep a copy
+        bcopy(sBuf, copy, sBufSize);
+        *view = IOCFBinaryViewCreate(copy, sBufSize, kIOCFBinaryViewFreeBuffer, NULL);
+        if (!*view) free(copy);
+    }
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+
+    return( *view ? kIOReturnSuccess : kIOReturnInternalError );
+#else
+    return( kIOReturnUnsupported );
+#endif /* IOKIT_SERVER_VERSION >= 20140421 */
+}
+
+/*
+ * Batched property reads. The entries are shared out to a small number of
+ * workers, each of which keeps its own request in flight and decodes the reply
+ * on its own thread, so the decode of one entry overlaps the kernel's
+ * serialization of the next. With a key filter only the wanted values are
+ * created, straight from the binary reply.
+ */
+#define kIORegistryEntriesMaxWorkers	8
+
+typedef struct {
+    const io_registry_entry_t *		entries;
+    CFIndex				count;
+    CFIndex				next;
+    CFArrayRef				keys;
+    const char **			keyStrings;
+    CFAllocatorRef			allocator;
+    IORegistryEntryPropertiesTransport	transport;
+    void *				context;
+    CFTypeRef *				results;
+} IORegistryEntriesBatch;
+
+static CFMutableDictionaryRef
+__IORegistryEntriesCopyKeys(IORegistryEntriesBatch * batch, IOCFBinaryViewRef view)
+{
+    CFMutableDictionaryRef	dict;
+    IOCFBinaryViewNode		root;
+    IOCFBinaryViewNode		node;
+    CFTypeRef			value;
+    CFIndex			idx;
+
+    root = IOCFBinaryViewGetRoot(view);
+    if (CFDictionaryGetTypeID() != IOCFBinaryViewGetTypeID(view, root)) return (NULL);
+
+    dict = CFDictionaryCreateMutable(batch->allocator, 0,
+		&kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!dict) return (NULL);
+
+    for (idx = 0; idx < CFArrayGetCount(batch->keys); idx++)
+    {
+        if (!batch->keyStrings[idx]) continue;
+        node = IOCFBinaryViewGetValue(view, root, batch->keyStrings[idx]);
+        if (!node) continue;
+        value = IOCFBinaryViewCreateCFObject(view, node, batch->allocator);
+        if (!value) continue;
+        CFDictionarySetValue(dict, CFArrayGetValueAtIndex(batch->keys, idx), value);
+        CFRelease(value);
+    }
+
+    return (dict);
+}
+
+static CFTypeRef
+__IORegistryEntriesCopyOne(IORegistryEntriesBatch * batch, io_registry_entry_t entry)
+{
+    CFMutableDictionaryRef	properties = NULL;
+    IOCFBinaryViewRef		view;
+    CFDataRef			data;
+
+    if (batch->transport)
+    {
+        data = batch->transport(entry, batch->context);
+        if (!data) return (NULL);
+        if (!batch->keys)
+        {
+            properties = (CFMutableDictionaryRef) IOCFUnserializeWithSize(
+                            (const char *) CFDataGetBytePtr(data), CFDataGetLength(data),
+                            batch->allocator, 0, NULL);
+        }
+        else if ((view = IOCFBinaryViewCreate(CFDataGetBytePtr(data), CFDataGetLength(data), 0, NULL)))
+        {
+            properties = __IORegistryEntriesCopyKeys(batch, view);
+            IOCFBinaryViewRelease(view);
+        }
+        CFRelease(data);
+    }
+    else if (!batch->keys)
+    {
+        // goes through the snapshot cache and the thread's receive buffer
+        if (kIOReturnSuccess != IORegistryEntryCreateCFProperties(entry, &properties,
+                                                        batch->allocator, kNilOptions)) properties = NULL;
+    }
+    else if (kIOReturnSuccess == IORegistryEntryCreatePropertiesView(entry, &view, kNilOptions))
+    {
+        properties = __IORegistryEntriesCopyKeys(batch, view);
+        IOCFBinaryViewRelease(view);
+    }
+
+    if (properties && (CFDictionaryGetTypeID() != CFGetTypeID(properties)))
+    {
+        CFRelease(properties);
+        properties = NULL;
+    }
+
+    return (properties);
+}
+
+static void
+__IORegistryEntriesWorker(void * context, size_t worker __unused)
+{
+    IORegistryEntriesBatch * batch = (IORegistryEntriesBatch *) context;
+    CFIndex		     idx;
+
+    while ((idx = __c11_atomic_fetch_add((_Atomic CFIndex *)&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+    {
+        batch->results[idx] = __IORegistryEntriesCopyOne(batch, batch->entries[idx]);
+    }
+}
+
+kern_return_t
+IORegistryEntriesCreateCFPropertiesWithTransport(
+	const io_registry_entry_t * entries,
+	CFIndex			count,
+	CFArrayRef		keys,
+	CFArrayRef *		properties,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options __unused,
+	IORegistryEntryPropertiesTransport transport,
+	void *			context )
+{
+    IORegistryEntriesBatch	batch;
+    CFStringRef			key;
+    CFIndex			idx, keyCount, length;
+    size_t			workers;
+    char *			strings = NULL;
+    char *			next;
+
+    if (!properties || (count < 0) || (count && !entries)) return (kIOReturnBadArgument);
+    *properties = NULL;
+
+    bzero(&batch, sizeof(batch));
+    batch.entries   = entries;
+    batch.count     = count;
+    batch.keys      = keys;
+    batch.allocator = allocator;
+    batch.transport = transport;
+    batch.context   = context;
+
+    if (keys)
+    {
+        // convert the keys once, rather than per entry
+        keyCount = CFArrayGetCount(keys);
+        for (length = 0, idx = 0; idx < keyCount; idx++)
+        {
+            key = CFArrayGetValueAtIndex(keys, idx);
+            if (CFStringGetTypeID() != CFGetTypeID(key)) return (kIOReturnBadArgument);
+            length += CFStringGetMaximumSizeForEncoding(CFStringGetLength(key), kCFStringEncodingUTF8) + 1;
+        }
+        batch.keyStrings = (const char **) calloc(keyCount ? keyCount : 1, sizeof(char *));
+        strings = (char *) malloc(length ? (size_t) length : 1);
+        if (!batch.keyStrings || !strings)
+        {
+            if (batch.keyStrings) free(batch.keyStrings);
+            if (strings) free(strings);
+            return (kIOReturnNoMemory);
+        }
+        for (next = strings, idx = 0; idx < keyCount; idx++)
+        {
+            key = CFArrayGetValueAtIndex(keys, idx);
+            length = CFStringGetMaximumSizeForEncoding(CFStringGetLength(key), kCFStringEncodingUTF8) + 1;
+            if (!CFStringGetCString(key, next, length, kCFStringEncodingUTF8)) continue;
+            batch.keyStrings[idx] = next;
+            next += strlen(next) + 1;
+        }
+    }
+
+    batch.results = (CFTypeRef *) calloc(count ? count : 1, sizeof(CFTypeRef));
+    if (batch.results)
+    {
+        workers = (count < kIORegistryEntriesMaxWorkers) ? count : kIORegistryEntriesMaxWorkers;
+        if (workers > 1)
+            dispatch_apply_f(workers, DISPATCH_APPLY_AUTO, &batch, &__IORegistryEntriesWorker);
+        else
+            __IORegistryEntriesWorker(&batch, 0);
+
+        for (idx = 0; idx < count; idx++)
+        {
+            if (!batch.results[idx]) batch.results[idx] = CFRetain(kCFNull);
+        }
+        *properties = CFArrayCreate(allocator, batch.results, count, &kCFTypeArrayCallBacks);
+        for (idx = 0; idx < count; idx++) CFRelease(batch.results[idx]);
+        free(batch.results);
+    }
+
+    if (batch.keyStrings) free(batch.keyStrings);
+    if (strings) free(strings);
+
+    return( *properties ? kIOReturnSuccess : kIOReturnNoMemory );
+}
+
+kern_return_t
+IORegistryEntriesCreateCFProperties(
+	const io_registry_entry_t * entries,
+	CFIndex			count,
+	CFArrayRef		keys,
+	CFArrayRef *		properties,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options )
+{
+    return (IORegistryEntriesCreateCFPropertiesWithTransport(entries, count, keys, properties,
+                                                        allocator, options, NULL, NULL));
+}
+
+/*
+ * Key C strings
+ *
+ * Keys are passed to the kernel as MacRoman C strings. Keys whose
+ * CFStringGetCStringPtr fails are converted once and cached by hash, with an
+ * immutable copy of the key to check hits with CFEqual, so a mutable key or
+ * one made with another allocator hits the cache without any allocation.
+ */
+
+#define kIOKeyCacheSize		64
+
+typedef struct IOKeyCacheEntry IOKeyCacheEntry;
+struct IOKeyCacheEntry {
+    CFStringRef		key;
+    io_name_t		cStr;
+};
+
+static pthread_mutex_t	__ioKeyCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static IOKeyCacheEntry	__ioKeyCache[kIOKeyCacheSize];
+
+// Returns the key in buffer, or in *allocated for keys longer than a name,
+// which the caller frees.
+static const char *
+__IOKeyGetCString(CFStringRef key, io_name_t buffer, char ** allocated)
+{
+    IOKeyCacheEntry *	entry;
+    CFStringRef		copy, old;
+    const char *	cStr;
+    CFIndex		bufferSize;
+
+    *allocated = NULL;
+    if ((cStr = CFStringGetCStringPtr(key, kCFStringEncodingMacRoman)))
+        return (cStr);
+
+    entry = &__ioKeyCache[CFHash(key) % kIOKeyCacheSize];
+    pthread_mutex_lock(&__ioKeyCacheLock);
+    if (entry->key && ((key == entry->key) || CFEqual(key, entry->key)))
+    {
+        strlcpy(buffer, entry->cStr, sizeof(io_name_t));
+        cStr = buffer;
+    }
+    pthread_mutex_unlock(&__ioKeyCacheLock);
+    if (cStr)
+        return (cStr);
+
+    if (CFStringGetCString(key, buffer, sizeof(io_name_t), kCFStringEncodingMacRoman))
+    {
+        // only a miss copies, a copy of an immutable key is the key itself
+        copy = CFStringCreateCopy(kCFAllocatorDefault, key);
+        if (copy)
+        {
+            pthread_mutex_lock(&__ioKeyCacheLock);
+            old = entry->key;
+            entry->key = copy;
+            strlcpy(entry->cStr, buffer, sizeof(io_name_t));
+            pthread_mutex_unlock(&__ioKeyCacheLock);
+            if (old) CFRelease(old);
+        }
+        return (buffer);
+    }
+
+    bufferSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(key),
+                    kCFStringEncodingMacRoman) + sizeof('\0');
+    *allocated = malloc(bufferSize);
+    if (*allocated && CFStringGetCString(key, *allocated, bufferSize, kCFStringEncodingMacRoman))
+        return (*allocated);
+
+    return (NULL);
+}
+
 CFTypeRef
 IORegistryEntryCreateCFProperty(
 	io_registry_entry_t	entry,
@@ -2516,11 +6976,13 @@ IORegistryEntryCreateCFProperty(
     return (IORegistryEntrySearchCFProperty(entry, NULL, key, allocator, kNilOptions));
 }
 
-CFTypeRef
-IORegistryEntrySearchCFProperty(
+// keyPath, if any, is looked up in the value found for key.
+static CFTypeRef
+__IORegistryEntrySearchCFProperty(
 	io_registry_entry_t	entry,
 	const io_name_t		plane,
-	CFStringRef		key,
+	const char *		key,
+	CFArrayRef		keyPath,
         CFAllocatorRef		allocator,
 	IOOptionBits		options )
 {
@@ -2530,57 +6992,80 @@ IORegistryEntrySearchCFProperty(
     char *		propertiesBuffer;
     CFStringRef		errorString;
     const char *	cStr;
-    char *		buffer = NULL;
+    uint64_t		start;
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
     char		sBuf[2048];
+    char *		rBuf = sBuf;
     mach_vm_size_t      sBufSize = sizeof(sBuf);
+    IOReceiveBuffer *	receive = NULL;
+    boolean_t		received = false;
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 
-    cStr = CFStringGetCStringPtr( key, kCFStringEncodingMacRoman);
-    if( !cStr)
-    {
-	CFIndex bufferSize = CFStringGetMaximumSizeForEncoding( CFStringGetLength(key),
-	       kCFStringEncodingMacRoman) + sizeof('\0');
-        buffer = malloc( bufferSize);
-        if( buffer && CFStringGetCString( key, buffer, bufferSize, kCFStringEncodingMacRoman))
-            cStr = buffer;
-    }
-    if (!cStr) kr = kIOReturnError;
+    start = __IOCallStatsBegin();
 #if IOKIT_SERVER_VERSION >= 20140421
-    else if (kIOCFSerializeToBinary & gIOKitLibSerializeOptions)
+    if (kIOCFSerializeToBinary & gIOKitLibSerializeOptions)
     {
 	if (!(kIORegistryIterateRecursively & options)) plane = "\0";
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
-        kr = io_registry_entry_get_property_bin_buf(entry, (char *) plane, (char *) cStr,
-            options, (mach_vm_address_t)sBuf, &sBufSize, &propertiesBuffer, &size);
+        receive = __IOReceiveBufferAcquire(&rBuf, &sBufSize);
+        received = true;
+        kr = io_registry_entry_get_property_bin_buf(entry, (char *) plane, (char *) key,
+            options, (mach_vm_address_t)rBuf, &sBufSize, &propertiesBuffer, &size);
 #else
-        kr = io_registry_entry_get_property_bin(entry, (char *) plane, (char *) cStr,
+        kr = io_registry_entry_get_property_bin(entry, (char *) plane, (char *) key,
                                                 options, &propertiesBuffer, &size);
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
     }
+    else
 #endif /* IOKIT_SERVER_VERSION >= 20140421 */
-    else if (kIORegistryIterateRecursively & options)
+    if (kIORegistryIterateRecursively & options)
     {
-        kr = io_registry_entry_get_property_recursively(entry, (char *) plane, (char *) cStr,
+        kr = io_registry_entry_get_property_recursively(entry, (char *) plane, (char *) key,
                                                         options, &propertiesBuffer, &size);
     }
     else
     {
-        kr = io_registry_entry_get_property(entry, (char *) cStr, &propertiesBuffer, &size);
+        kr = io_registry_entry_get_property(entry, (char *) key, &propertiesBuffer, &size);
     }
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetProperty,
+                    ((kIOReturnSuccess == kr) && !propertiesBuffer) ? sBufSize : 0,
+                    ((kIOReturnSuccess == kr) && propertiesBuffer) ? size : 0);
+#else
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetProperty,
+                    0, (kIOReturnSuccess == kr) ? size : 0);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
 
-    if (buffer) free(buffer);
-    if (kr != kIOReturnSuccess) return (NULL);
+    if (kr != kIOReturnSuccess) {
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        if (received) __IOReceiveBufferRelease(receive, false, NULL, 0);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        return (NULL);
+    }
 
-    if (propertiesBuffer) {
+    if (keyPath) {
+        // only the value at the end of the path is created
+        if (propertiesBuffer) {
+            type = IOCFUnserializeBinaryValueForKeyPath(propertiesBuffer, size, keyPath, allocator,
+                                        0, &errorString);
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        } else {
+            type = IOCFUnserializeBinaryValueForKeyPath(rBuf, sBufSize, keyPath, allocator,
+                                        0, &errorString);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
+        }
+    } else if (propertiesBuffer) {
         type = (CFMutableDictionaryRef) IOCFUnserializeWithSize(propertiesBuffer, size, allocator,
                                     0, &errorString);
 #if IOKIT_HAS_GET_PROPERTY_WITH_BUF
     } else {
-	    type = (CFMutableDictionaryRef) IOCFUnserializeWithSize(sBuf, sBufSize, allocator,
+	    type = (CFMutableDictionaryRef) IOCFUnserializeWithSize(rBuf, sBufSize, allocator,
 								    0, &errorString);
 #endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
     }
+#if IOKIT_HAS_GET_PROPERTY_WITH_BUF
+    if (received) __IOReceiveBufferRelease(receive, true, propertiesBuffer, size);
+#endif // IOKIT_HAS_GET_PROPERTY_WITH_BUF
     if (!type && errorString)
     {
         if ((cStr = CFStringGetCStringPtr(errorString, kCFStringEncodingMacRoman))) printf("%s\n", cStr);
@@ -2595,6 +7080,81 @@ IORegistryEntrySearchCFProperty(
     return( type );
 }
 
+CFTypeRef
+IORegistryEntrySearchCFProperty(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	CFStringRef		key,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options )
+{
+    CFTypeRef		type;
+    const char *	cStr;
+    char *		allocated;
+    io_name_t		buffer;
+
+    cStr = __IOKeyGetCString(key, buffer, &allocated);
+    type = cStr ? __IORegistryEntrySearchCFProperty(entry, plane, cStr, NULL, allocator, options) : NULL;
+    if (allocated) free(allocated);
+
+    return (type);
+}
+
+CFTypeRef
+IORegistryEntryCreateCFPropertyWithCString(
+	io_registry_entry_t	entry,
+	const char *		key,
+        CFAllocatorRef		allocator,
+	IOOptionBits   options __unused )
+{
+    return (__IORegistryEntrySearchCFProperty(entry, NULL, key, NULL, allocator, kNilOptions));
+}
+
+CFTypeRef
+IORegistryEntrySearchCFPropertyWithCString(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	const char *		key,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options )
+{
+    return (__IORegistryEntrySearchCFProperty(entry, plane, key, NULL, allocator, options));
+}
+
+CFTypeRef
+IORegistryEntrySearchCFPropertyKeyPath(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	CFArrayRef		keyPath,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options )
+{
+    CFTypeRef		type;
+    CFArrayRef		rest;
+    CFIndex		count;
+    const void **	keys;
+    const char *	cStr;
+    char *		allocated;
+    io_name_t		buffer;
+
+    if (!keyPath || !(count = CFArrayGetCount(keyPath))) return (NULL);
+    if (CFStringGetTypeID() != CFGetTypeID(CFArrayGetValueAtIndex(keyPath, 0))) return (NULL);
+    if (count == 1) return (IORegistryEntrySearchCFProperty(entry, plane,
+                        (CFStringRef) CFArrayGetValueAtIndex(keyPath, 0), allocator, options));
+
+    keys = (const void **) malloc(count * sizeof(void *));
+    if (!keys) return (NULL);
+    CFArrayGetValues(keyPath, CFRangeMake(0, count), keys);
+    rest = CFArrayCreate(kCFAllocatorDefault, &keys[1], count - 1, &kCFTypeArrayCallBacks);
+    cStr = __IOKeyGetCString((CFStringRef) keys[0], buffer, &allocated);
+    type = (rest && cStr) ? __IORegistryEntrySearchCFProperty(entry, plane, cStr, rest, allocator, options) : NULL;
+    if (allocated) free(allocated);
+    if (rest) CFRelease(rest);
+    free(keys);
+
+    return (type);
+}
+
 kern_return_t
 IORegistryEntryGetProperty(
 	io_registry_entry_t	entry,
@@ -2614,14 +7174,17 @@ IORegistryEntrySetCFProperties(
     CFDataRef		data;
     kern_return_t	kr;
     kern_return_t	result;
+    uint64_t		start;
 
     data = IOCFSerialize( properties, gIOKitLibSerializeOptions );
     if( !data)
 	return( kIOReturnUnsupported );
 
+    start = __IOCallStatsBegin();
     kr = io_registry_entry_set_properties( entry,
             (char *) CFDataGetBytePtr(data), CFDataGetLength(data),
             &result );
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntrySetProperties, 0, CFDataGetLength(data));
 
     CFRelease(data);
 
@@ -2659,8 +7222,15 @@ IORegistryEntryGetChildIterator(
 	const io_name_t		plane,
 	io_iterator_t	      * iterator )
 {
-    return( io_registry_entry_get_child_iterator( entry,
-						(char *) plane, iterator));
+    kern_return_t	kr;
+    uint64_t		start;
+
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_child_iterator( entry,
+						(char *) plane, iterator);
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetChildIterator, 0, 0);
+
+    return( kr );
 }
 
 kern_return_t
@@ -2669,8 +7239,15 @@ IORegistryEntryGetParentIterator(
 	const io_name_t		plane,
 	io_iterator_t	      * iterator )
 {
-    return( io_registry_entry_get_parent_iterator( entry,
-						(char *) plane, iterator));
+    kern_return_t	kr;
+    uint64_t		start;
+
+    start = __IOCallStatsBegin();
+    kr = io_registry_entry_get_parent_iterator( entry,
+						(char *) plane, iterator);
+    if (start) __IOCallStatsRecord(start, kIOCallStatsRegistryEntryGetParentIterator, 0, 0);
+
+    return( kr );
 }
 
 kern_return_t
@@ -900,6 +900,227 @@ AVAILABLE_MAC_OS_X_VERSION_10_5_AND_LATER;
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// Batched IOUserClient::externalMethod calls through a shared memory ring
+
+typedef struct IOConnectBatch * IOConnectBatchRef;
+
+/*! @function IOConnectBatchCreate
+    @abstract Create a batch of method calls on a connection.
+    @discussion Calls appended to a batch are written to a command ring in memory shared with the user client, and all of them are handed to the user client by one method call when the batch is submitted. The user client writes the results to a completion ring in the same memory. The ring layout is in IOKitLibPrivate.h. If the user client does not map the ring memory, each call is made with IOConnectCallMethod when the batch is submitted, so the batch still works, without the savings.
+    @param connect The connect handle created by IOServiceOpen.
+    @param memoryType The type passed to IOConnectMapMemory64 to map the ring memory.
+    @param submitSelector The selector of the method that runs the commands in the ring. It is called with one scalar input, the ring's command tail.
+    @param options No options are currently defined.
+    @param batch The new batch is returned on success. It should be released with IOConnectBatchRelease.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IOConnectBatchCreate(
+	io_connect_t		connect,
+	uint32_t		memoryType,
+	uint32_t		submitSelector,
+	IOOptionBits		options,
+	IOConnectBatchRef *	batch );
+
+/*! @function IOConnectBatchAppend
+    @abstract Append a method call to a batch.
+    @discussion The arguments are copied into the command ring, so the buffers can be reused once this returns. Room is kept in the completion ring for outputCnt scalar outputs and outputStructCnt bytes of structure output. If either ring is full, the calls appended so far are submitted first. Appending after IOConnectBatchSubmit starts a new batch and discards the results of the last one.
+    @param batch The batch.
+    @param selector The selector of the method to call.
+    @param input Up to 16 scalar inputs.
+    @param inputCnt The number of scalar inputs.
+    @param inputStruct Structure input, at most 4096 bytes.
+    @param inputStructCnt The size of the structure input.
+    @param outputCnt The most scalar outputs the call returns.
+    @param outputStructCnt The most bytes of structure output the call returns, at most 4096. A call whose command or completion would take more than half of its ring is refused with kIOReturnNoSpace.
+    @param index The index of the call in the batch is returned, to get its result with IOConnectBatchGetResult.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IOConnectBatchAppend(
+	IOConnectBatchRef	batch,
+	uint32_t		selector,
+	const uint64_t *	input,
+	uint32_t		inputCnt,
+	const void *		inputStruct,
+	size_t			inputStructCnt,
+	uint32_t		outputCnt,
+	size_t			outputStructCnt,
+	uint32_t *		index );
+
+/*! @function IOConnectBatchSubmit
+    @abstract Run the calls appended to a batch.
+    @discussion The calls run in the order they were appended. Their results are available with IOConnectBatchGetResult until the next call is appended.
+    @param batch The batch.
+    @result A kern_return_t error code for the submission as a whole. Each call's own result comes from IOConnectBatchGetResult. */
+
+kern_return_t
+IOConnectBatchSubmit(
+	IOConnectBatchRef	batch );
+
+/*! @function IOConnectBatchGetResult
+    @abstract Get the result of a call in a submitted batch.
+    @param batch The batch.
+    @param index The index returned by IOConnectBatchAppend.
+    @param output Returns the scalar outputs, may be NULL.
+    @param outputCnt On entry, the room in output; on return the number of scalar outputs. May be NULL.
+    @param outputStruct Returns the structure output, may be NULL.
+    @param outputStructCnt On entry, the room in outputStruct; on return the size of the structure output. May be NULL.
+    @result The call's result, kIOReturnNotReady if the batch has not been submitted, or kIOReturnBadArgument for an unknown index. */
+
+kern_return_t
+IOConnectBatchGetResult(
+	IOConnectBatchRef	batch,
+	uint32_t		index,
+	uint64_t *		output,
+	uint32_t *		outputCnt,
+	void *			outputStruct,
+	size_t *		outputStructCnt );
+
+/*! @function IOConnectBatchRelease
+    @abstract Release a batch.
+    @discussion Calls appended but not submitted are dropped, and the ring memory is unmapped.
+    @param batch The batch. */
+
+void
+IOConnectBatchRelease(
+	IOConnectBatchRef	batch );
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Large structure arguments from registered buffers
+
+typedef struct IOConnectBufferPool * IOConnectBufferPoolRef;
+
+enum {
+    kIOConnectBufferNone = 0
+};
+
+typedef struct IOConnectBufferPoolStatistics {
+    uint64_t	registeredBytes;	// bytes in registered buffers
+    uint64_t	wiredBytes;		// of those, bytes wired at registration
+    uint64_t	overlappingRegistrations; // registrations refused for overlapping a buffer
+    uint64_t	calls;			// calls made with IOConnectCallMethodWithBuffers
+    uint64_t	reuses;			// buffers passed to a call after their first
+    uint64_t	overlaps;		// calls whose input and output ranges overlap
+    uint64_t	mappedCalls;		// calls passing a mapped buffer by offset
+    uint64_t	inputBytes;
+    uint64_t	outputBytes;
+} IOConnectBufferPoolStatistics;
+
+/*! @function IOConnectBufferPoolCreate
+    @abstract Create a pool of buffers for large structure arguments to a connection.
+    @discussion Each large structure argument to IOConnectCallMethod has its pages faulted in and wired by the kernel for the call. Buffers registered with a pool are wired once, when they are registered, and are then named in calls by handle and offset with IOConnectCallMethodWithBuffers. Buffers mapped from the user client with IOConnectBufferPoolRegisterMemoryType are not copied or wired per call at all.
+    @param connect The connect handle created by IOServiceOpen.
+    @param options No options are currently defined.
+    @param pool The new pool is returned on success. It should be released with IOConnectBufferPoolRelease.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IOConnectBufferPoolCreate(
+	io_connect_t		connect,
+	IOOptionBits		options,
+	IOConnectBufferPoolRef * pool );
+
+/*! @function IOConnectBufferPoolRegister
+    @abstract Register a buffer in the caller's memory with a pool.
+    @discussion The buffer is wired until it is unregistered. If it cannot be wired, for example over the task's wired memory limit, its pages are touched so they are at least present. A buffer may not overlap one already registered with the pool.
+    @param pool The pool.
+    @param address The page aligned address of the buffer.
+    @param size The size of the buffer, a multiple of the page size.
+    @param handle The handle naming the buffer in IOConnectCallMethodWithBuffers is returned.
+    @result A kern_return_t error code, kIOReturnNotAligned if the buffer is not page aligned, kIOReturnExclusiveAccess if it overlaps a registered buffer or kIOReturnNoMemory if the pool can't grow. */
+
+kern_return_t
+IOConnectBufferPoolRegister(
+	IOConnectBufferPoolRef	pool,
+	void *			address,
+	size_t			size,
+	uint32_t *		handle );
+
+/*! @function IOConnectBufferPoolRegisterMemoryType
+    @abstract Map memory from the user client and register it with a pool.
+    @discussion The memory is mapped with IOConnectMapMemory64. Calls passing it with IOConnectCallMethodWithBuffers pass the memory type, offset and length as three more scalar inputs in place of a structure, input buffer first. When the output buffer is mapped memory, the user client returns the number of bytes it wrote as one more scalar output, after the caller's.
+    @param pool The pool.
+    @param memoryType The memory type passed to IOConnectMapMemory64.
+    @param handle The handle naming the buffer in IOConnectCallMethodWithBuffers is returned.
+    @param address The address of the mapping is returned.
+    @param size The size of the mapping is returned.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IOConnectBufferPoolRegisterMemoryType(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		memoryType,
+	uint32_t *		handle,
+	void **			address,
+	size_t *		size );
+
+/*! @function IOConnectBufferPoolUnregister
+    @abstract Unregister a buffer from a pool.
+    @discussion The buffer is unwired, or unmapped if it was mapped from the user client. Pages shared with other registered buffers stay wired until the last of them is unregistered.
+    @param pool The pool.
+    @param handle The handle returned when the buffer was registered.
+    @result A kern_return_t error code, kIOReturnBadArgument for an unknown handle or kIOReturnBusy while a call is using the buffer. */
+
+kern_return_t
+IOConnectBufferPoolUnregister(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		handle );
+
+/*! @function IOConnectCallMethodWithBuffers
+    @abstract Call a method with structure arguments in registered buffers.
+    @discussion Like IOConnectCallMethod, with the structure input and output given by a registered buffer handle and an offset into it, or kIOConnectBufferNone. The input and output may be in the same buffer, and may overlap. At most 10 scalar inputs and 15 scalar outputs may be passed.
+    @param pool The pool the buffers are registered with.
+    @param selector The selector of the method to call.
+    @param input The scalar inputs.
+    @param inputCnt The number of scalar inputs.
+    @param inputBuffer The handle of the buffer holding the structure input, or kIOConnectBufferNone.
+    @param inputOffset The offset of the structure input in its buffer.
+    @param inputSize The size of the structure input.
+    @param output Returns the scalar outputs.
+    @param outputCnt On entry, the room in output; on return the number of scalar outputs. May be NULL.
+    @param outputBuffer The handle of the buffer to receive the structure output, or kIOConnectBufferNone.
+    @param outputOffset The offset of the structure output in its buffer.
+    @param outputSize On entry, the room for the structure output; on return its size. May be NULL.
+    @result A kern_return_t error code, kIOReturnBadArgument for an unknown handle or a range outside its buffer. */
+
+kern_return_t
+IOConnectCallMethodWithBuffers(
+	IOConnectBufferPoolRef	pool,
+	uint32_t		selector,
+	const uint64_t *	input,
+	uint32_t		inputCnt,
+	uint32_t		inputBuffer,
+	size_t			inputOffset,
+	size_t			inputSize,
+	uint64_t *		output,
+	uint32_t *		outputCnt,
+	uint32_t		outputBuffer,
+	size_t			outputOffset,
+	size_t *		outputSize );
+
+/*! @function IOConnectBufferPoolGetStatistics
+    @abstract Get the counters kept by a pool.
+    @param pool The pool.
+    @param statistics Returns the counters. */
+
+void
+IOConnectBufferPoolGetStatistics(
+	IOConnectBufferPoolRef	pool,
+	IOConnectBufferPoolStatistics * statistics );
+
+/*! @function IOConnectBufferPoolRelease
+    @abstract Release a pool.
+    @discussion Buffers still registered are unregistered.
+    @param pool The pool. */
+
+void
+IOConnectBufferPoolRelease(
+	IOConnectBufferPoolRef	pool );
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 kern_return_t
 IOConnectTrap0(io_connect_t	connect,
 	       uint32_t		index ) __UNAVAILABLE_PUBLIC_IOS;
@@ -1046,6 +1267,73 @@ IORegistryEntryCreateIterator(
 	IOOptionBits		options,
 	io_iterator_t 	      * iterator );
 
+// options for IORegistryEntryCopyTree(), IORegistryEntryWalkTree()
+enum {
+    kIORegistryWalkProperties		= 0x00010000
+};
+
+/*! @typedef IORegistryWalkNode
+    @abstract One registry entry found by IORegistryEntryCopyTree or IORegistryEntryWalkTree.
+    @field entry The registry entry handle.
+    @field entryID The entry's registry entry ID, or zero if the entry was terminated before it could be read; such an entry is not recursed into.
+    @field depth The number of levels below the root entry, which is at depth zero.
+    @field parent The index of the node the entry was found under, or -1 for the root.
+    @field properties The entry's property table if kIORegistryWalkProperties was given, otherwise zero. */
+
+typedef struct IORegistryWalkNode {
+    io_registry_entry_t	entry;
+    uint64_t		entryID;
+    uint32_t		depth;
+    CFIndex		parent;
+    CFDictionaryRef	properties;
+} IORegistryWalkNode;
+
+typedef void (*IORegistryWalkCallback)(void * refcon, const IORegistryWalkNode * node, CFIndex index);
+
+/*! @function IORegistryEntryCopyTree
+    @abstract Read a registry entry and everything below it in a plane, on several threads.
+    @discussion This function finds the same entries, in the same order, as iterating with IORegistryEntryCreateIterator and kIORegistryIterateRecursively, with the root entry first. The children of different entries are read concurrently on a pool of threads, so the time taken grows with the size of the tree divided by the number of processors, rather than with its size. As with the iterator, an entry that is found more than once is only recursed into the first time.
+    @param entry The root entry to begin at.
+    @param plane The name of an existing registry plane. Plane names are defined in IOKitKeys.h, eg. kIOServicePlane.
+    @param options kIORegistryIterateParents may be set to walk the parents of each entry, by default the children are walked. kIORegistryWalkProperties may be set to also read the property table of each entry.
+    @param nodes An array of the entries found is returned, to be released with IORegistryWalkNodesRelease by the caller.
+    @param count The number of entries in nodes.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IORegistryEntryCopyTree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	IOOptionBits		options,
+	IORegistryWalkNode **	nodes,
+	CFIndex *		count );
+
+/*! @function IORegistryWalkNodesRelease
+    @abstract Release the entries and properties returned by IORegistryEntryCopyTree, and the array itself. */
+
+void
+IORegistryWalkNodesRelease(
+	IORegistryWalkNode *	nodes,
+	CFIndex			count );
+
+/*! @function IORegistryEntryWalkTree
+    @abstract Call a function for a registry entry and everything below it in a plane.
+    @discussion This function reads the tree as IORegistryEntryCopyTree does, then calls the callback on the calling thread once for each entry, in order. The nodes are only valid during the callback; retain the entry or properties to keep them.
+    @param entry The root entry to begin at.
+    @param plane The name of an existing registry plane.
+    @param options As for IORegistryEntryCopyTree.
+    @param callback The function to call for each entry.
+    @param refcon A reference constant passed to the callback.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IORegistryEntryWalkTree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	IOOptionBits		options,
+	IORegistryWalkCallback	callback,
+	void *			refcon );
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 /*
@@ -1174,6 +1462,26 @@ IORegistryEntryCreateCFProperties(
         CFAllocatorRef		allocator,
 	IOOptionBits		options );
 
+/*! @function IORegistryEntriesCreateCFProperties
+    @abstract Create CF dictionary representations of the property tables of several registry entries.
+    @discussion This function reads the property tables of a number of registry entries in one call, with the same semantics as IORegistryEntryCreateCFProperties for each. The entries are read and their properties unserialized concurrently, on a small number of threads. When keys is given, only the properties it names are created for each entry, and properties an entry does not have are left out of its dictionary.
+    @param entries An array of count registry entry handles.
+    @param count The number of entries.
+    @param keys An optional CFArray of CFStrings naming the properties to copy, or zero for all of them.
+    @param properties A CFArray is created and returned the caller on success, holding one CFDictionary per entry in the order of entries, or kCFNull for an entry whose properties could not be read. The caller should release with CFRelease.
+    @param allocator The CF allocator to use when creating the CF containers.
+    @param options No options are currently defined.
+    @result A kern_return_t error code. */
+
+kern_return_t
+IORegistryEntriesCreateCFProperties(
+	const io_registry_entry_t * entries,
+	CFIndex			count,
+	CFArrayRef		keys,
+	CFArrayRef *		properties,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options );
+
 /*! @function IORegistryEntryCreateCFProperty
     @abstract Create a CF representation of a registry entry's property.
     @discussion This function creates an instantaneous snapshot of a registry entry property, creating a CF container analogue in the caller's task. Not every object available in the kernel is represented as a CF container; currently OSDictionary, OSArray, OSSet, OSSymbol, OSString, OSData, OSNumber, OSBoolean are created as their CF counterparts. 
@@ -1209,6 +1517,58 @@ IORegistryEntrySearchCFProperty(
         CFAllocatorRef		allocator,
 	IOOptionBits		options ) CF_RETURNS_RETAINED;
 
+/*! @function IORegistryEntrySearchCFPropertyKeyPath
+    @abstract Create a CF representation of a value nested in a registry entry's property.
+    @discussion This function searches for the property named by the first key of keyPath, as IORegistryEntrySearchCFProperty does, then looks up each following key in turn in the dictionary found so far. Only the value at the end of the path is created in the caller's task; when the property is returned in binary form the rest of it is stepped over without creating CF objects for it.
+    @param entry The registry entry at which to start the search.
+    @param plane The name of an existing registry plane. Plane names are defined in IOKitKeys.h, eg. kIOServicePlane.
+    @param keyPath A CFArray of CFStrings, the property name followed by the keys of the nested dictionaries.
+    @param allocator The CF allocator to use when creating the CF container.
+    @param options As for IORegistryEntrySearchCFProperty.
+    @result A CF container is created and returned the caller on success, or zero if any key along the path is not found. The caller should release with CFRelease. */
+
+CFTypeRef
+IORegistryEntrySearchCFPropertyKeyPath(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	CFArrayRef		keyPath,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options ) CF_RETURNS_RETAINED;
+
+/*! @function IORegistryEntryCreateCFPropertyWithCString
+    @abstract Create a CF representation of a registry entry's property, named by a C string.
+    @discussion As IORegistryEntryCreateCFProperty, for callers that have the property name as a C string, which saves converting a CFString on each call.
+    @param entry The registry entry handle whose property to copy.
+    @param key A MacRoman C string specifying the property name.
+    @param allocator The CF allocator to use when creating the CF container.
+    @param options No options are currently defined.
+    @result A CF container is created and returned the caller on success. The caller should release with CFRelease. */
+
+CFTypeRef
+IORegistryEntryCreateCFPropertyWithCString(
+	io_registry_entry_t	entry,
+	const char *		key,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options ) CF_RETURNS_RETAINED;
+
+/*! @function IORegistryEntrySearchCFPropertyWithCString
+    @abstract Search for a registry entry's property named by a C string.
+    @discussion As IORegistryEntrySearchCFProperty, for callers that have the property name as a C string.
+    @param entry The registry entry at which to start the search.
+    @param plane The name of an existing registry plane. Plane names are defined in IOKitKeys.h, eg. kIOServicePlane.
+    @param key A MacRoman C string specifying the property name.
+    @param allocator The CF allocator to use when creating the CF container.
+    @param options As for IORegistryEntrySearchCFProperty.
+    @result A CF container is created and returned the caller on success. The caller should release with CFRelease. */
+
+CFTypeRef
+IORegistryEntrySearchCFPropertyWithCString(
+	io_registry_entry_t	entry,
+	const io_name_t		plane,
+	const char *		key,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options ) CF_RETURNS_RETAINED;
+
 /*  @function IORegistryEntryGetProperty - deprecated,
     use IORegistryEntryCreateCFProperty */
 
@@ -26,9 +26,17 @@
 
 #include <sys/cdefs.h>
 #include <CoreFoundation/CFMachPort.h>
+#include <IOKit/IOCFUnserialize.h>
 
 __BEGIN_DECLS
 
+typedef struct IONotificationPortStatistics IONotificationPortStatistics;
+struct IONotificationPortStatistics {
+    uint64_t			received;	// notification messages taken off the port
+    uint64_t			coalesced;	// folded into a callout already pending
+    uint64_t			delivered;	// callouts made
+};
+
 #if !__has_feature(objc_arc)
 struct IONotificationPort
 {
@@ -38,6 +46,9 @@ struct IONotificationPort
     CFRunLoopSourceRef	source;
     dispatch_source_t	dispatchSource;
     int32_t			refcount;
+    dispatch_queue_t	dispatchQueue;
+    struct IONotificationCoalescing * coalescing;
+    IONotificationPortStatistics statistics;
 };
 typedef struct IONotificationPort IONotificationPort;
 #endif
@@ -108,6 +119,317 @@ _IOObjectCopyClass(
 	io_object_t     object,
 	uint64_t        options);
 
+/*
+ * Fetches the binary serialized properties of entry and returns a view over
+ * them (see IOCFUnserialize.h), without creating any CF objects. The view owns
+ * the reply buffer; release it with IOCFBinaryViewRelease().
+ */
+kern_return_t
+IORegistryEntryCreatePropertiesView(
+	io_registry_entry_t	entry,
+	IOCFBinaryViewRef     * view,
+	IOOptionBits		options );
+
+/*
+ * IORegistryEntriesCreateCFProperties() with the kernel read replaced by a
+ * caller supplied function, so the batching and decoding can be exercised and
+ * measured against canned replies. The transport returns the binary serialized
+ * (kOSSerializeBinarySignature) properties of entry, or NULL if they can't be
+ * read; it is called concurrently from several threads.
+ */
+typedef CFDataRef (*IORegistryEntryPropertiesTransport)(io_registry_entry_t entry, void * context);
+
+kern_return_t
+IORegistryEntriesCreateCFPropertiesWithTransport(
+	const io_registry_entry_t * entries,
+	CFIndex			count,
+	CFArrayRef		keys,
+	CFArrayRef *		properties,
+        CFAllocatorRef		allocator,
+	IOOptionBits		options,
+	IORegistryEntryPropertiesTransport transport,
+	void *			context );
+
+/*
+ * Client side evaluation of matching dictionaries, for callers that already
+ * hold the properties of the entries they filter. IOMatchingProgramCreate()
+ * compiles matching once; IOMatchingProgramEvaluate() then checks it against a
+ * snapshot of an entry with the semantics of IOServiceMatchPropertyTable().
+ * IOProviderClass, IONameMatch, IOLocationMatch, IOPropertyMatch,
+ * IOPropertyExistsMatch, IOPathMatch (service plane paths only),
+ * IORegistryEntryID, the BSD keys and IOParentMatch are evaluated. Other keys,
+ * and keys whose part of the snapshot is missing, give
+ * kIOMatchingProgramUnknown, in which case the kernel has to be asked. A
+ * nested IOLocationMatch dictionary can only be ruled out: which provider
+ * answers for it is up to the providers' matchLocation().
+ */
+typedef struct IOMatchingProgram * IOMatchingProgramRef;
+
+typedef struct IOMatchingSnapshot IOMatchingSnapshot;
+struct IOMatchingSnapshot {
+    CFDictionaryRef		properties;	// IORegistryEntryCreateCFProperties()
+    CFArrayRef			classes;	// class names, the entry's class first
+    CFStringRef			name;		// IORegistryEntryGetName()
+    CFStringRef			location;	// IORegistryEntryGetLocationInPlane()
+    CFStringRef			path;		// IORegistryEntryGetPath() in kIOServicePlane
+    uint64_t			entryID;	// IORegistryEntryGetRegistryEntryID(), or zero
+    const IOMatchingSnapshot *	provider;	// the parent in kIOServicePlane
+};
+
+enum {
+    kIOMatchingProgramNoMatch = 0,
+    kIOMatchingProgramMatch   = 1,
+    kIOMatchingProgramUnknown = 2
+};
+typedef uint32_t IOMatchingProgramResult;
+
+enum {
+    // keys only a driver's matchPropertyTable() looks at are taken to match,
+    // as IOService's own does
+    kIOMatchingProgramIgnoreUnknownKeys = 0x00000001
+};
+
+IOMatchingProgramRef
+IOMatchingProgramCreate(
+	CFDictionaryRef		matching,
+	IOOptionBits		options );
+
+void
+IOMatchingProgramRelease(
+	IOMatchingProgramRef	program );
+
+IOMatchingProgramResult
+IOMatchingProgramEvaluate(
+	IOMatchingProgramRef	program,
+	const IOMatchingSnapshot * snapshot );
+
+/*
+ * Counts of binary property reads whose reply fit the receive buffer and was
+ * copied in line, and of those that came back in out of line memory.
+ */
+void
+IORegistryEntryGetReceiveBufferStatistics(
+	uint64_t *		inlineCount,
+	uint64_t *		outOfLineCount );
+
+/*
+ * Opt in client side cache for registry entry reads. With a non zero maxAge
+ * (in nanoseconds), IORegistryEntryGetRegistryEntryID, IORegistryEntryGetName,
+ * IORegistryEntryGetPath and IORegistryEntryCreateCFProperties answer from
+ * values read before for the same entry while they are younger than maxAge.
+ * A service's values are also dropped when it posts a general interest
+ * message, and all values when the IOCatalogue generation count changes.
+ * Property changes that post no message are seen once the values age out.
+ * io_object_t names are matched to entries until released, so objects must be
+ * released with IOObjectRelease() while the cache is on. A maxAge of zero
+ * turns the cache off and empties it.
+ */
+kern_return_t
+IORegistrySetSnapshotCache(
+	uint64_t		maxAge );
+
+void
+IORegistryFlushSnapshotCache( void );
+
+/*
+ * Opt in cache for IOServiceGetMatchingServices() and
+ * IOServiceGetMatchingService() with the default main port. With a non zero
+ * maxAge (in nanoseconds), the services found for a matching dictionary are
+ * kept and later calls with an equal dictionary are answered from them, until
+ * they are older than maxAge, first match or terminated notifications fire
+ * for the dictionary, or the IOCatalogue generation count changes. Filling an
+ * entry costs two notification requests besides the lookup. Iterators handed
+ * out from the cache work with IOIteratorNext(), IOIteratorReset(),
+ * IOIteratorIsValid() and IOObjectRelease() only. A maxAge of zero turns the
+ * cache off and empties it.
+ */
+kern_return_t
+IOServiceSetMatchingCache(
+	uint64_t		maxAge );
+
+void
+IOServiceFlushMatchingCache( void );
+
+/*
+ * Matching notifications (first publish, first match, publish, match and
+ * terminate) that arrive on notify for the same notifier within window
+ * nanoseconds of the first are folded into a single callout made at the end
+ * of the window; the notifier iterator returns every service that arrived
+ * meanwhile. Interest and async completion messages are delivered as they
+ * arrive. Works with both IONotificationPortGetRunLoopSource() and
+ * IONotificationPortSetDispatchQueue(). A window of zero turns coalescing off;
+ * callouts already pending are still made when their window ends.
+ */
+kern_return_t
+IONotificationPortSetCoalescing(
+	IONotificationPortRef	notify,
+	uint64_t		window );
+
+void
+IONotificationPortGetStatistics(
+	IONotificationPortRef	notify,
+	IONotificationPortStatistics * statistics );
+
+/*
+ * Opt in per thread timing of IOConnectCallMethod(), IOConnectCallAsyncMethod()
+ * and the methods built on them, IOServiceOpen(), IOServiceClose(), and the
+ * IORegistryEntry calls that go to the kernel. A call that is answered from a
+ * client side cache is not counted. Statistics stay across
+ * IOCallStatisticsSetEnabled(false) until they are reset.
+ *
+ * IOCallStatisticsCopySnapshot() returns a dictionary keyed by the user client
+ * class name, or "IOKitLib" for calls that are not a user client method, of
+ * dictionaries keyed by the selector in decimal, or the function name, of
+ * dictionaries with the keys below. Times are in nanoseconds; percentiles are
+ * the upper end of a bucket a quarter of a power of two wide.
+ * kIOCallStatisticsReset resets the statistics once they are copied.
+ */
+#define kIOCallStatisticsCountKey		"Count"
+#define kIOCallStatisticsTotalTimeKey		"TotalTime"
+#define kIOCallStatisticsMaxTimeKey		"MaxTime"
+#define kIOCallStatisticsP50Key			"P50"
+#define kIOCallStatisticsP90Key			"P90"
+#define kIOCallStatisticsP99Key			"P99"
+#define kIOCallStatisticsP999Key		"P999"
+#define kIOCallStatisticsInbandBytesKey		"InbandBytes"
+#define kIOCallStatisticsOutOfLineBytesKey	"OutOfLineBytes"
+
+enum {
+    kIOCallStatisticsReset = 0x00000001
+};
+
+kern_return_t
+IOCallStatisticsSetEnabled(
+	boolean_t		enable );
+
+CFDictionaryRef
+IOCallStatisticsCopySnapshot(
+	IOOptionBits		options );
+
+void
+IOCallStatisticsReset( void );
+
+/*
+ * Reads entry and everything below it in plane into the snapshot cache.
+ * Returns kIOReturnNotReady if the cache is off.
+ */
+kern_return_t
+IORegistryEntryPrefetchSubtree(
+	io_registry_entry_t	entry,
+	const io_name_t		plane );
+
+/*
+ * IOConnectBatch ring memory. The header is at offset zero, followed by the
+ * command and completion rings, each a power of two bytes long. Head and tail
+ * are running byte counts, the offset into a ring is the count modulo its
+ * size. The client writes commands and moves commandTail and completionHead,
+ * the user client consumes commands and moves commandHead and
+ * completionTail, writing one completion per command in order. Records are a
+ * multiple of 8 bytes and never wrap; a pad record fills the end of a ring
+ * when the next record does not fit there.
+ */
+#define kIOConnectBatchRingMagic	0x494f4342	/* 'IOCB' */
+#define kIOConnectBatchRingVersion	1
+#define kIOConnectBatchMaxScalars	16
+#define kIOConnectBatchMaxStructSize	4096
+
+enum {
+    kIOConnectBatchRecordPad        = 0,
+    kIOConnectBatchRecordCommand    = 1,
+    kIOConnectBatchRecordCompletion = 2
+};
+
+typedef struct IOConnectBatchRing IOConnectBatchRing;
+struct IOConnectBatchRing {
+    uint32_t		magic;
+    uint32_t		version;
+    uint32_t		commandOffset;		// from the start of the ring memory
+    uint32_t		commandSize;
+    uint32_t		completionOffset;
+    uint32_t		completionSize;
+    uint32_t		commandHead;
+    uint32_t		commandTail;
+    uint32_t		completionHead;
+    uint32_t		completionTail;
+    uint32_t		reserved[6];
+};
+
+typedef struct IOConnectBatchRecord IOConnectBatchRecord;
+struct IOConnectBatchRecord {
+    uint32_t		size;			// of the whole record
+    uint32_t		type;
+};
+
+typedef struct IOConnectBatchCommand IOConnectBatchCommand;
+struct IOConnectBatchCommand {
+    IOConnectBatchRecord record;
+    uint32_t		selector;
+    uint32_t		index;
+    uint32_t		scalarInputCount;
+    uint32_t		structInputSize;
+    uint32_t		scalarOutputCount;	// room the caller has
+    uint32_t		structOutputSize;
+    uint64_t		data[];			// scalar inputs, then structure input
+};
+
+typedef struct IOConnectBatchCompletion IOConnectBatchCompletion;
+struct IOConnectBatchCompletion {
+    IOConnectBatchRecord record;
+    uint32_t		index;
+    int32_t		result;
+    uint32_t		scalarOutputCount;
+    uint32_t		structOutputSize;
+    uint64_t		data[];			// room for the command's outputs,
+						// scalars then structure
+};
+
+/*
+ * Lays out a ring in size bytes of memory, for user clients and tests.
+ */
+kern_return_t
+IOConnectBatchRingInitialize(
+	void *			memory,
+	size_t			size );
+
+/*
+ * Runs the commands in ring through handler and writes their completions,
+ * checking every record. The struct output buffer handed to handler has room
+ * for *outputStructCnt bytes.
+ */
+typedef IOReturn (*IOConnectBatchHandler)(
+	void *			context,
+	uint32_t		selector,
+	const uint64_t *	input,
+	uint32_t		inputCnt,
+	const void *		inputStruct,
+	uint32_t		inputStructCnt,
+	uint64_t *		output,
+	uint32_t *		outputCnt,
+	void *			outputStruct,
+	uint32_t *		outputStructCnt );
+
+kern_return_t
+IOConnectBatchRingServe(
+	void *			ring,
+	size_t			size,
+	IOConnectBatchHandler	handler,
+	void *			context );
+
+/*
+ * A batch on ring memory the caller provides. Submitting calls transport
+ * instead of the user client's submit method; transport has run the commands
+ * when it returns.
+ */
+typedef kern_return_t (*IOConnectBatchTransport)(void * ring, void * context);
+
+kern_return_t
+IOConnectBatchCreateWithTransport(
+	void *			ring,
+	size_t			size,
+	IOConnectBatchTransport	transport,
+	void *			context,
+	IOConnectBatchRef *	batch );
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
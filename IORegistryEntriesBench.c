@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/*
+
+compares reading the properties of every registry entry one at a time with
+IORegistryEntriesCreateCFProperties()
+
+to build:
+
+cc -O2 -framework IOKit -framework CoreFoundation IORegistryEntriesBench.c -o IORegistryEntriesBench
+
+to run:
+
+./IORegistryEntriesBench
+./IORegistryEntriesBench IOClass IOProviderClass
+
+Any arguments are property names, passed as the key filter. The "loopback"
+line replays replies read from the kernel beforehand through a transport, so
+it measures the batching and decoding alone.
+
+*/
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOKitLibPrivate.h>
+#include <IOKit/IOCFSerialize.h>
+#include <IOKit/IOCFUnserialize.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mach/mach_time.h>
+
+typedef struct {
+	io_registry_entry_t * entries;
+	CFDataRef *	      replies;
+	CFIndex		      count;
+} registry_t;
+
+static double
+nanoseconds(uint64_t delta)
+{
+	static mach_timebase_info_data_t timebase;
+
+	if (!timebase.denom) mach_timebase_info(&timebase);
+	return ((double) delta * timebase.numer / timebase.denom);
+}
+
+static int
+readRegistry(registry_t * registry)
+{
+	CFMutableDictionaryRef	properties;
+	io_iterator_t		iter;
+	io_registry_entry_t	entry;
+	CFIndex			capacity = 0;
+
+	if (KERN_SUCCESS != IORegistryCreateIterator(kIOMainPortDefault, kIOServicePlane,
+						     kIORegistryIterateRecursively, &iter)) return (0);
+
+	while ((entry = IOIteratorNext(iter))) {
+		if (registry->count == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			registry->entries = realloc(registry->entries, capacity * sizeof(*registry->entries));
+			registry->replies = realloc(registry->replies, capacity * sizeof(*registry->replies));
+			if (!registry->entries || !registry->replies) return (0);
+		}
+		registry->replies[registry->count] = NULL;
+		if (KERN_SUCCESS == IORegistryEntryCreateCFProperties(entry, &properties,
+								       kCFAllocatorDefault, kNilOptions)) {
+			registry->replies[registry->count] = IOCFSerialize(properties, kIOCFSerializeToBinary);
+			CFRelease(properties);
+		}
+		registry->entries[registry->count++] = entry;
+	}
+	IOObjectRelease(iter);
+
+	return (registry->count > 0);
+}
+
+static CFDataRef
+loopback(io_registry_entry_t entry, void * context)
+{
+	registry_t * registry = (registry_t *) context;
+
+	// the entries were handed out as indexes
+	if ((entry >= registry->count) || !registry->replies[entry]) return (NULL);
+	return (CFRetain(registry->replies[entry]));
+}
+
+static double
+serial(registry_t * registry)
+{
+	CFMutableDictionaryRef properties;
+	uint64_t	       start;
+	CFIndex		       idx;
+
+	start = mach_absolute_time();
+	for (idx = 0; idx < registry->count; idx++) {
+		if (KERN_SUCCESS == IORegistryEntryCreateCFProperties(registry->entries[idx], &properties,
+								       kCFAllocatorDefault, kNilOptions)) {
+			CFRelease(properties);
+		}
+	}
+	return (nanoseconds(mach_absolute_time() - start));
+}
+
+static double
+batched(registry_t * registry, CFArrayRef keys, IORegistryEntryPropertiesTransport transport,
+	const io_registry_entry_t * entries)
+{
+	CFArrayRef properties;
+	uint64_t   start;
+
+	start = mach_absolute_time();
+	if (KERN_SUCCESS == IORegistryEntriesCreateCFPropertiesWithTransport(entries, registry->count,
+						keys, &properties, kCFAllocatorDefault, kNilOptions,
+						transport, registry)) {
+		CFRelease(properties);
+	}
+	return (nanoseconds(mach_absolute_time() - start));
+}
+
+int
+main(int argc, char **argv)
+{
+	registry_t	      registry = { 0 };
+	io_registry_entry_t * indexes;
+	CFMutableArrayRef     keys = NULL;
+	CFStringRef	      key;
+	double		      one, all, loop;
+	CFIndex		      idx;
+	int		      i;
+
+	if (!readRegistry(&registry)) {
+		printf("can't read the registry\n");
+		return (1);
+	}
+
+	if (argc > 1) {
+		keys = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+		for (i = 1; i < argc; i++) {
+			key = CFStringCreateWithCString(kCFAllocatorDefault, argv[i], kCFStringEncodingUTF8);
+			CFArrayAppendValue(keys, key);
+			CFRelease(key);
+		}
+	}
+
+	indexes = (io_registry_entry_t *) malloc(registry.count * sizeof(*indexes));
+	if (!indexes) return (1);
+	for (idx = 0; idx < registry.count; idx++) indexes[idx] = (io_registry_entry_t) idx;
+
+	one  = serial(&registry);
+	all  = batched(&registry, keys, NULL, registry.entries);
+	loop = batched(&registry, keys, &loopback, indexes);
+
+	printf("%ld entries\n", (long) registry.count);
+	printf("one at a time %10.1f ms\n", one / 1e6);
+	printf("batched       %10.1f ms %5.2fx\n", all / 1e6, one / all);
+	printf("loopback      %10.1f ms\n", loop / 1e6);
+
+	for (idx = 0; idx < registry.count; idx++) {
+		IOObjectRelease(registry.entries[idx]);
+		if (registry.replies[idx]) CFRelease(registry.replies[idx]);
+	}
+	free(registry.entries);
+	free(registry.replies);
+	free(indexes);
+	if (keys) CFRelease(keys);
+
+	return (0);
+}
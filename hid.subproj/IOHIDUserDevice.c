@@ -894,6 +894,21 @@ void IOHIDUserDeviceRegisterSetReportBlock(IOHIDUserDeviceRef device,
     ((a < b) ? a:b)
 #endif
 
+//------------------------------------------------------------------------------
+// __IOHIDUserDeviceQueueNext
+//------------------------------------------------------------------------------
+static const void * __IOHIDUserDeviceQueueNext(IOHIDUserDeviceRef device, IODataQueueIterator * iterator, uint32_t * entrySize)
+{
+    const void * entryData = IODataQueueIteratorNext(iterator, entrySize);
+
+    // look for more enqueued since the iteration began
+    if (!entryData && (IODataQueueIteratorBegin(device->queue.data, iterator) == kIOReturnSuccess)) {
+        entryData = IODataQueueIteratorNext(iterator, entrySize);
+    }
+
+    return entryData;
+}
+
 //------------------------------------------------------------------------------
 // __IOHIDUserDeviceQueueCallback
 //------------------------------------------------------------------------------
@@ -912,14 +927,17 @@ void __IOHIDUserDeviceQueueCallback(CFMachPortRef port __unused, void *msg __unu
 
     __IOHIDUserDeviceUpdateUsageAnalytics(device);
 
-    // check entry size
-    IODataQueueEntry *  nextEntry;
-    uint32_t            dataSize;
+    // entries are handled in place, and dequeued one by one once handled
+    IODataQueueIterator iterator;
+    const void *        entryData;
+    uint32_t            entrySize;
+
+    IODataQueueIteratorBegin(device->queue.data, &iterator);
 
     // if queue empty, then stop
-    while ((nextEntry = IODataQueuePeek(device->queue.data))) {
+    while ((entryData = __IOHIDUserDeviceQueueNext(device, &iterator, &entrySize))) {
 
-        IOHIDResourceDataQueueHeader *  header                                                  = (IOHIDResourceDataQueueHeader*)&(nextEntry->data);
+        IOHIDResourceDataQueueHeader *  header                                                  = (IOHIDResourceDataQueueHeader*)entryData;
         uint64_t                        response[kIOHIDResourceUserClientResponseIndexCount]    = {kIOReturnUnsupported,header->token};
         uint8_t *                       responseReport  = NULL;
         CFIndex                         responseLength  = 0;
@@ -933,17 +951,17 @@ void __IOHIDUserDeviceQueueCallback(CFMachPortRef port __unused, void *msg __unu
             uint8_t *   report           = NULL;
 
             if (reportFlags & kIOHIDResourceOOBReport) {
-                require_action(nextEntry->size >= sizeof(IOHIDResourceOOBReportInfo) + sizeof(IOHIDResourceDataQueueHeader),
+                require_action(entrySize >= sizeof(IOHIDResourceOOBReportInfo) + sizeof(IOHIDResourceDataQueueHeader),
                                exit,
                                IOHIDUDLogError("Packet size is to small for large report, but large report flag is set. reportFlags:%#x entrySize:%u",
-                                               reportFlags, (uint32_t)nextEntry->size));
+                                               reportFlags, entrySize));
 
                 IOHIDResourceOOBReportInfo *info = (void*)payload;
                 report = (uint8_t*)info->token;
                 reportLength = info->length;
             } else {
                 report = payload;
-                reportLength = min(header->length, (nextEntry->size - sizeof(IOHIDResourceDataQueueHeader)));
+                reportLength = min(header->length, (entrySize - sizeof(IOHIDResourceDataQueueHeader)));
             }
 
 
@@ -1004,9 +1022,8 @@ void __IOHIDUserDeviceQueueCallback(CFMachPortRef port __unused, void *msg __unu
             free(responseReport);
 
         // dequeue the item
-        dataSize = 0;
         device->dequeueTS = mach_continuous_time();
-        IODataQueueDequeue(device->queue.data, NULL, &dataSize);
+        IODataQueueIteratorCommit(&iterator);
     }
 }
 
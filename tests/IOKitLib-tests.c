@@ -1,7 +1,11 @@
 #include <darwintest.h>
 
 #include <IOKit/IOKitLib.h>
+#include <IOKit/IOKitLibPrivate.h>
+#include <IOKit/IOCFSerialize.h>
+#include <IOKit/IODataQueueClient.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <sys/mman.h>
 
 T_DECL(IOMasterPort,
        "check if one can retrieve mach port for communicating with IOKit",
@@ -61,3 +65,550 @@ T_DECL(OSNumberFloats,
 	CFRelease(dict);
 	CFRelease(props);
 }
+
+T_DECL(IORegistryEntryCreatePropertiesView,
+       "check that a properties view agrees with the unserialized properties",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IOCFBinaryViewRef view = NULL;
+	IOCFBinaryViewNode root, node;
+	CFMutableDictionaryRef props = NULL;
+	CFTypeRef obj;
+	const char * str;
+	size_t len;
+
+	io_service_t
+	service = IORegistryEntryFromPath(kIOMasterPortDefault, kIOServicePlane ":/IOResources");
+    T_EXPECT_NE(MACH_PORT_NULL, service, NULL);
+
+    T_EXPECT_MACH_SUCCESS(IORegistryEntryCreatePropertiesView(service, &view, 0), NULL);
+    T_EXPECT_NE(NULL, view, NULL);
+    T_EXPECT_MACH_SUCCESS(IORegistryEntryCreateCFProperties(service, &props, kCFAllocatorDefault, 0), NULL);
+
+	root = IOCFBinaryViewGetRoot(view);
+    T_EXPECT_EQ(IOCFBinaryViewGetTypeID(view, root), CFDictionaryGetTypeID(), NULL);
+
+	node = IOCFBinaryViewGetValue(view, root, kIOClassKey);
+	str = IOCFBinaryViewGetStringPtr(view, node, &len);
+    T_EXPECT_NE(NULL, str, NULL);
+    T_EXPECT_EQ(len, strlen("IOResources"), NULL);
+    T_EXPECT_EQ(0, strncmp(str, "IOResources", len), NULL);
+
+	obj = IOCFBinaryViewCreateCFObject(view, node, kCFAllocatorDefault);
+    T_EXPECT_TRUE(CFEqual(obj, CFDictionaryGetValue(props, CFSTR(kIOClassKey))), NULL);
+    T_EXPECT_EQ(IOCFBinaryViewGetValue(view, root, "no such key"), (IOCFBinaryViewNode) kIOCFBinaryViewNodeNull, NULL);
+
+	CFRelease(obj);
+	CFRelease(props);
+	IOCFBinaryViewRelease(view);
+	IOObjectRelease(service);
+}
+
+T_DECL(IOCFSerializeIndexed,
+       "check that single values of an indexed serialization match the whole",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	CFMutableDictionaryRef props = NULL;
+	CFDataRef data;
+	CFTypeRef obj;
+	const char * bytes;
+	size_t len;
+
+	io_service_t
+	service = IORegistryEntryFromPath(kIOMasterPortDefault, kIOServicePlane ":/IOResources");
+    T_EXPECT_NE(MACH_PORT_NULL, service, NULL);
+    T_EXPECT_MACH_SUCCESS(IORegistryEntryCreateCFProperties(service, &props, kCFAllocatorDefault, 0), NULL);
+
+	data = IOCFSerialize(props, kIOCFSerializeToBinary | kIOCFSerializeIndexed);
+    T_EXPECT_NE(NULL, data, NULL);
+	bytes = (const char *) CFDataGetBytePtr(data);
+	len = CFDataGetLength(data);
+
+	obj = IOCFUnserializeBinary(bytes, len, kCFAllocatorDefault, 0, NULL);
+    T_EXPECT_TRUE(obj && CFEqual(obj, props), NULL);
+	if (obj) CFRelease(obj);
+
+	obj = IOCFUnserializeBinaryValueForKey(bytes, len, CFSTR(kIOClassKey), kCFAllocatorDefault, 0, NULL);
+    T_EXPECT_TRUE(obj && CFEqual(obj, CFDictionaryGetValue(props, CFSTR(kIOClassKey))), NULL);
+	if (obj) CFRelease(obj);
+    T_EXPECT_EQ(NULL, IOCFUnserializeBinaryValueForKey(bytes, len, CFSTR("no such key"), kCFAllocatorDefault, 0, NULL), NULL);
+
+	CFRelease(data);
+	CFRelease(props);
+	IOObjectRelease(service);
+}
+
+static CFArrayRef
+copyClasses(io_object_t object)
+{
+	CFMutableArrayRef classes = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+	CFStringRef name, next;
+
+	for (name = IOObjectCopyClass(object); name; name = next) {
+		CFArrayAppendValue(classes, name);
+		next = IOObjectCopySuperclassForClass(name);
+		CFRelease(name);
+	}
+	return classes;
+}
+
+static IOMatchingSnapshot *
+createSnapshot(io_registry_entry_t entry)
+{
+	IOMatchingSnapshot * snapshot = calloc(1, sizeof(IOMatchingSnapshot));
+	CFMutableDictionaryRef props = NULL;
+	io_name_t name;
+	io_string_t path;
+	io_registry_entry_t parent;
+
+	IORegistryEntryCreateCFProperties(entry, &props, kCFAllocatorDefault, 0);
+	snapshot->properties = props;
+	snapshot->classes = copyClasses(entry);
+	if (KERN_SUCCESS == IORegistryEntryGetName(entry, name))
+		snapshot->name = CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8);
+	if (KERN_SUCCESS == IORegistryEntryGetLocationInPlane(entry, kIOServicePlane, name))
+		snapshot->location = CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8);
+	if (KERN_SUCCESS == IORegistryEntryGetPath(entry, kIOServicePlane, path))
+		snapshot->path = CFStringCreateWithCString(kCFAllocatorDefault, path, kCFStringEncodingUTF8);
+	IORegistryEntryGetRegistryEntryID(entry, &snapshot->entryID);
+	if (KERN_SUCCESS == IORegistryEntryGetParentEntry(entry, kIOServicePlane, &parent)) {
+		snapshot->provider = createSnapshot(parent);
+		IOObjectRelease(parent);
+	}
+	return snapshot;
+}
+
+static void
+releaseSnapshot(const IOMatchingSnapshot * snapshot)
+{
+	if (!snapshot) return;
+	if (snapshot->properties) CFRelease(snapshot->properties);
+	if (snapshot->classes) CFRelease(snapshot->classes);
+	if (snapshot->name) CFRelease(snapshot->name);
+	if (snapshot->location) CFRelease(snapshot->location);
+	if (snapshot->path) CFRelease(snapshot->path);
+	releaseSnapshot(snapshot->provider);
+	free((void *) snapshot);
+}
+
+T_DECL(IOMatchingProgram,
+       "check client side matching against IOServiceMatchPropertyTable",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	CFMutableDictionaryRef matching[5], parent;
+	IOMatchingProgramRef program[5];
+	IOMatchingSnapshot * snapshot;
+	IOMatchingProgramResult result;
+	io_iterator_t iter;
+	io_service_t service;
+	boolean_t matches;
+	int idx, entries, evaluated = 0;
+
+	matching[0] = IOServiceMatching("IOService");
+	matching[1] = IOServiceMatching("IOResources");
+	matching[2] = IOServiceNameMatching("IOResources");
+	matching[3] = IOServiceMatching("IOService");
+	CFDictionarySetValue(matching[3], CFSTR(kIOPropertyExistsMatchKey), CFSTR(kIOUserClientClassKey));
+	matching[4] = IOServiceMatching("IOService");
+	parent = IOServiceMatching("IOPlatformExpertDevice");
+	CFDictionarySetValue(matching[4], CFSTR(kIOParentMatchKey), parent);
+	CFRelease(parent);
+
+	for (idx = 0; idx < 5; idx++) {
+		program[idx] = IOMatchingProgramCreate(matching[idx], 0);
+		T_EXPECT_NE(NULL, program[idx], NULL);
+	}
+
+	T_EXPECT_MACH_SUCCESS(IORegistryCreateIterator(kIOMasterPortDefault, kIOServicePlane,
+	    kIORegistryIterateRecursively, &iter), NULL);
+	for (entries = 0; (entries < 200) && (service = IOIteratorNext(iter)); entries++) {
+		snapshot = createSnapshot(service);
+		for (idx = 0; idx < 5; idx++) {
+			result = IOMatchingProgramEvaluate(program[idx], snapshot);
+			if (kIOMatchingProgramUnknown == result) continue;
+			T_QUIET; T_EXPECT_MACH_SUCCESS(IOServiceMatchPropertyTable(service, matching[idx], &matches), NULL);
+			T_QUIET; T_EXPECT_EQ(result, (IOMatchingProgramResult)(matches ? kIOMatchingProgramMatch : kIOMatchingProgramNoMatch), "matching %d", idx);
+			evaluated++;
+		}
+		releaseSnapshot(snapshot);
+		IOObjectRelease(service);
+	}
+	IOObjectRelease(iter);
+	T_EXPECT_GT(evaluated, 0, NULL);
+
+	for (idx = 0; idx < 5; idx++) {
+		IOMatchingProgramRelease(program[idx]);
+		CFRelease(matching[idx]);
+	}
+}
+
+T_DECL(IOServiceMatchingCacheIterator,
+       "check that a cached iterator outlives a release balanced by a retain and answers as an iterator",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	io_iterator_t iter;
+	io_service_t service;
+	io_name_t className;
+
+	T_ASSERT_MACH_SUCCESS(IOServiceSetMatchingCache(10000000000ULL), NULL);
+	T_ASSERT_MACH_SUCCESS(IOServiceGetMatchingServices(kIOMasterPortDefault,
+	    IOServiceMatching("IOResources"), &iter), NULL);
+
+	T_EXPECT_MACH_SUCCESS(IOObjectGetClass(iter, className), NULL);
+	T_EXPECT_TRUE(IOObjectConformsTo(iter, "OSIterator"), NULL);
+	T_EXPECT_FALSE(IOObjectConformsTo(iter, "IOService"), NULL);
+	T_EXPECT_EQ(IOObjectGetUserRetainCount(iter), 1U, NULL);
+
+	T_EXPECT_MACH_SUCCESS(IOObjectRetain(iter), NULL);
+	T_EXPECT_MACH_SUCCESS(IOObjectRelease(iter), NULL);
+	service = IOIteratorNext(iter);
+	T_EXPECT_NE(service, MACH_PORT_NULL, NULL);
+	if (service) IOObjectRelease(service);
+	T_EXPECT_MACH_SUCCESS(IOObjectRelease(iter), NULL);
+
+	T_EXPECT_MACH_SUCCESS(IOServiceSetMatchingCache(0), NULL);
+}
+
+T_DECL(IOCallStatistics,
+       "check that registry calls are counted once statistics are on",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	CFDictionaryRef snapshot, calls, stats;
+	CFNumberRef count;
+	int64_t value = 0;
+	io_name_t name;
+	int idx;
+
+	io_service_t
+	service = IORegistryEntryFromPath(kIOMasterPortDefault, kIOServicePlane ":/IOResources");
+    T_EXPECT_NE(MACH_PORT_NULL, service, NULL);
+
+    T_EXPECT_MACH_SUCCESS(IOCallStatisticsSetEnabled(true), NULL);
+	IOCallStatisticsReset();
+	for (idx = 0; idx < 10; idx++) {
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IORegistryEntryGetNameInPlane(service, kIOServicePlane, name), NULL);
+	}
+
+	snapshot = IOCallStatisticsCopySnapshot(kIOCallStatisticsReset);
+    T_EXPECT_NE(NULL, snapshot, NULL);
+	calls = CFDictionaryGetValue(snapshot, CFSTR("IOKitLib"));
+    T_EXPECT_NE(NULL, calls, NULL);
+	stats = calls ? CFDictionaryGetValue(calls, CFSTR("IORegistryEntryGetNameInPlane")) : NULL;
+    T_EXPECT_NE(NULL, stats, NULL);
+	count = stats ? CFDictionaryGetValue(stats, CFSTR(kIOCallStatisticsCountKey)) : NULL;
+	if (count) CFNumberGetValue(count, kCFNumberSInt64Type, &value);
+    T_EXPECT_EQ(value, 10LL, NULL);
+
+    T_EXPECT_MACH_SUCCESS(IOCallStatisticsSetEnabled(false), NULL);
+	CFRelease(snapshot);
+	IOObjectRelease(service);
+}
+
+static IOReturn
+batchHandler(void * context, uint32_t selector,
+	const uint64_t * input, uint32_t inputCnt,
+	const void * inputStruct, uint32_t inputStructCnt,
+	uint64_t * output, uint32_t * outputCnt,
+	void * outputStruct, uint32_t * outputStructCnt)
+{
+	if (*outputCnt > inputCnt) *outputCnt = inputCnt;
+	for (uint32_t idx = 0; idx < *outputCnt; idx++) output[idx] = input[idx] + selector;
+	if (*outputStructCnt > inputStructCnt) *outputStructCnt = inputStructCnt;
+	if (*outputStructCnt) memcpy(outputStruct, inputStruct, *outputStructCnt);
+	return (selector ? kIOReturnSuccess : kIOReturnUnsupported);
+}
+
+static kern_return_t
+batchTransport(void * ring, void * context)
+{
+	return (IOConnectBatchRingServe(ring, *(size_t *) context, &batchHandler, NULL));
+}
+
+T_DECL(IOConnectBatch,
+       "check that calls through a batch ring come back in order, across ring wraps",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	static uint64_t memory[(sizeof(IOConnectBatchRing) + 2 * 8192) / sizeof(uint64_t)];
+	size_t size = sizeof(memory);
+	IOConnectBatchRef batch;
+	uint64_t input[3], output[3];
+	uint32_t outputCnt, idx;
+	char str[64];
+	size_t strCnt;
+	int round;
+
+    T_EXPECT_MACH_SUCCESS(IOConnectBatchRingInitialize(memory, size), NULL);
+    T_EXPECT_MACH_SUCCESS(IOConnectBatchCreateWithTransport(memory, size, &batchTransport, &size, &batch), NULL);
+
+	for (round = 0; round < 4; round++) {
+		for (idx = 0; idx < 200; idx++) {
+			input[0] = idx; input[1] = round; input[2] = ~idx;
+			snprintf(str, sizeof(str), "call %u", idx);
+			T_QUIET; T_EXPECT_MACH_SUCCESS(IOConnectBatchAppend(batch, idx % 7, input, 3,
+			    str, strlen(str) + 1, 3, sizeof(str), NULL), NULL);
+		}
+		T_EXPECT_MACH_SUCCESS(IOConnectBatchSubmit(batch), NULL);
+		for (idx = 0; idx < 200; idx++) {
+			outputCnt = 3;
+			strCnt = sizeof(str);
+			if (!(idx % 7)) {
+				T_QUIET; T_EXPECT_EQ(IOConnectBatchGetResult(batch, idx, output, &outputCnt, str, &strCnt),
+				    kIOReturnUnsupported, NULL);
+				continue;
+			}
+			T_QUIET; T_EXPECT_MACH_SUCCESS(IOConnectBatchGetResult(batch, idx, output, &outputCnt, str, &strCnt), NULL);
+			T_QUIET; T_EXPECT_EQ(outputCnt, 3U, NULL);
+			T_QUIET; T_EXPECT_EQ(output[0], (uint64_t) idx + idx % 7, NULL);
+			T_QUIET; T_EXPECT_EQ(output[1], (uint64_t) round + idx % 7, NULL);
+			T_QUIET; T_EXPECT_EQ(strtoul(str + strlen("call "), NULL, 10), (unsigned long) idx, NULL);
+		}
+	}
+    T_EXPECT_EQ(IOConnectBatchGetResult(batch, 200, NULL, NULL, NULL, NULL), kIOReturnBadArgument, NULL);
+
+	IOConnectBatchRelease(batch);
+}
+
+T_DECL(IOConnectBufferPool,
+       "check buffer pool registration, overlap and range checks",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IOConnectBufferPoolRef pool;
+	IOConnectBufferPoolStatistics stats;
+	size_t size = 8 * vm_page_size;
+	uint32_t first, second;
+	char * buffer;
+
+	buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	T_ASSERT_NE(buffer, MAP_FAILED, NULL);
+
+    T_EXPECT_MACH_SUCCESS(IOConnectBufferPoolCreate(MACH_PORT_NULL, 0, &pool), NULL);
+    T_EXPECT_EQ(IOConnectBufferPoolRegister(pool, buffer + 1, vm_page_size, &first), kIOReturnNotAligned, NULL);
+    T_EXPECT_MACH_SUCCESS(IOConnectBufferPoolRegister(pool, buffer, size / 2, &first), NULL);
+    T_EXPECT_EQ(IOConnectBufferPoolRegister(pool, buffer + vm_page_size, size / 2, &second), kIOReturnExclusiveAccess, NULL);
+    T_EXPECT_MACH_SUCCESS(IOConnectBufferPoolRegister(pool, buffer + size / 2, size / 2, &second), NULL);
+    T_EXPECT_EQ(IOConnectCallMethodWithBuffers(pool, 0, NULL, 0, first, size / 2, 1,
+        NULL, NULL, kIOConnectBufferNone, 0, NULL), kIOReturnBadArgument, NULL);
+
+	IOConnectBufferPoolGetStatistics(pool, &stats);
+    T_EXPECT_EQ(stats.registeredBytes, (uint64_t) size, NULL);
+    T_EXPECT_EQ(stats.overlappingRegistrations, 1ULL, NULL);
+
+    T_EXPECT_MACH_SUCCESS(IOConnectBufferPoolUnregister(pool, first), NULL);
+    T_EXPECT_EQ(IOConnectBufferPoolUnregister(pool, first), kIOReturnBadArgument, NULL);
+	IOConnectBufferPoolRelease(pool);
+	munmap(buffer, size);
+}
+
+T_DECL(IORegistryEntryCreateCFPropertyWithCString,
+       "check that properties named by C strings and by CFStrings agree",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	static const UniChar chars[] = { 'I', 'O', 'C', 'l', 'a', 's', 's' };
+	CFStringRef key;
+	CFMutableStringRef mutableKey;
+	CFTypeRef byName, byKey;
+	int round;
+
+	io_service_t
+	service = IORegistryEntryFromPath(kIOMasterPortDefault, kIOServicePlane ":/IOResources");
+    T_EXPECT_NE(MACH_PORT_NULL, service, NULL);
+
+	// a UTF-16 backed key has no C string pointer, so it goes through the cache
+	key = CFStringCreateWithCharacters(kCFAllocatorDefault, chars, sizeof(chars) / sizeof(chars[0]));
+	byName = IORegistryEntryCreateCFPropertyWithCString(service, kIOClassKey, kCFAllocatorDefault, 0);
+    T_EXPECT_NE(NULL, byName, NULL);
+	for (round = 0; round < 2; round++) {
+		byKey = IORegistryEntrySearchCFProperty(service, kIOServicePlane, key, kCFAllocatorDefault, 0);
+	    T_EXPECT_TRUE(byKey && CFEqual(byKey, byName), NULL);
+		if (byKey) CFRelease(byKey);
+	}
+	// a mutable key equal to a cached one is served from the cache
+	mutableKey = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, key);
+	T_ASSERT_NOTNULL(mutableKey, NULL);
+	byKey = IORegistryEntrySearchCFProperty(service, kIOServicePlane, mutableKey, kCFAllocatorDefault, 0);
+	T_EXPECT_TRUE(byKey && CFEqual(byKey, byName), NULL);
+	if (byKey) CFRelease(byKey);
+	CFRelease(mutableKey);
+    T_EXPECT_EQ(NULL, IORegistryEntrySearchCFPropertyWithCString(service, kIOServicePlane, "no such key",
+	    kCFAllocatorDefault, 0), NULL);
+
+	if (byName) CFRelease(byName);
+	CFRelease(key);
+	IOObjectRelease(service);
+}
+
+T_DECL(IODataQueueDequeueBatch,
+       "check that batched dequeues keep order across queue wraps",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IODataQueueMemory * queue;
+	IODataQueueEntry * peeked[8];
+	IODataQueueBatchEntry entries[8];
+	uint32_t buffers[8][4], data[4] = { 0 };
+	uint32_t next, count, enqueued, idx;
+
+	queue = calloc(1, DATA_QUEUE_MEMORY_HEADER_SIZE + 64 + DATA_QUEUE_MEMORY_APPENDIX_SIZE);
+	T_ASSERT_NOTNULL(queue, NULL);
+	queue->queueSize = 64;
+
+	count = 8;
+    T_EXPECT_EQ(IODataQueuePeekBatch(queue, peeked, &count), kIOReturnUnderrun, NULL);
+
+	for (next = 0; next < 1000; next += enqueued) {
+		for (enqueued = 0; ; enqueued++) {
+			data[0] = next + enqueued;
+			if (kIOReturnSuccess != IODataQueueEnqueue(queue, data, 4 + (data[0] % 3) * 4)) break;
+		}
+		count = 8;
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueuePeekBatch(queue, peeked, &count), NULL);
+		T_QUIET; T_EXPECT_EQ(count, enqueued, NULL);
+		for (idx = 0; idx < count; idx++) {
+			T_QUIET; T_EXPECT_EQ(*(uint32_t *) peeked[idx]->data, next + idx, NULL);
+		}
+
+		for (idx = 0; idx < 8; idx++) {
+			entries[idx].data     = buffers[idx];
+			entries[idx].dataSize = sizeof(buffers[idx]);
+		}
+		count = 8;
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueDequeueBatch(queue, entries, &count), NULL);
+		T_QUIET; T_EXPECT_EQ(count, enqueued, NULL);
+		for (idx = 0; idx < count; idx++) {
+			T_QUIET; T_EXPECT_EQ(buffers[idx][0], next + idx, NULL);
+		}
+		T_QUIET; T_EXPECT_FALSE(IODataQueueDataAvailable(queue), NULL);
+	}
+
+	free(queue);
+}
+
+T_DECL(IODataQueueIterator,
+       "check that an iterator hands out entries in place and dequeues them on commit",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IODataQueueMemory * queue;
+	IODataQueueIterator iterator;
+	const void * data;
+	uint32_t next, size, count, enqueued, value[4] = { 0 };
+
+	queue = calloc(1, DATA_QUEUE_MEMORY_HEADER_SIZE + 64 + DATA_QUEUE_MEMORY_APPENDIX_SIZE);
+	T_ASSERT_NOTNULL(queue, NULL);
+	queue->queueSize = 64;
+
+	T_EXPECT_EQ(IODataQueueIteratorBegin(queue, &iterator), kIOReturnUnderrun, NULL);
+	T_EXPECT_NULL(IODataQueueIteratorNext(&iterator, &size), NULL);
+
+	for (next = 0; next < 1000; next += enqueued) {
+		for (enqueued = 0; ; enqueued++) {
+			value[0] = next + enqueued;
+			if (kIOReturnSuccess != IODataQueueEnqueue(queue, value, 4 + (value[0] % 3) * 4)) break;
+		}
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueIteratorBegin(queue, &iterator), NULL);
+		for (count = 0; (data = IODataQueueIteratorNext(&iterator, &size)); count++) {
+			T_QUIET; T_EXPECT_EQ(*(const uint32_t *) data, next + count, NULL);
+			T_QUIET; T_EXPECT_EQ(size, 4 + ((next + count) % 3) * 4, NULL);
+		}
+		T_QUIET; T_EXPECT_EQ(count, enqueued, NULL);
+		T_QUIET; T_EXPECT_TRUE(IODataQueueDataAvailable(queue), NULL);
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueIteratorCommit(&iterator), NULL);
+		T_QUIET; T_EXPECT_FALSE(IODataQueueDataAvailable(queue), NULL);
+	}
+
+	free(queue);
+}
+
+T_DECL(IODataQueueWaitForAvailableDataAdaptive,
+       "check that an adaptive wait finds queued data without blocking and keeps its spin limit in bounds",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IODataQueueMemory * queue;
+	IODataQueueWaiter waiter;
+	IODataQueueWaitStatistics statistics;
+	mach_port_t port;
+	uint32_t idx, value = 0;
+
+	queue = calloc(1, DATA_QUEUE_MEMORY_HEADER_SIZE + 64 + DATA_QUEUE_MEMORY_APPENDIX_SIZE);
+	T_ASSERT_NOTNULL(queue, NULL);
+	queue->queueSize = 64;
+	port = IODataQueueAllocateNotificationPort();
+	T_ASSERT_NE(port, MACH_PORT_NULL, NULL);
+
+	IODataQueueWaiterInitialize(&waiter, 100000);
+	T_EXPECT_EQ(IODataQueueWaitForAvailableDataAdaptive(queue, MACH_PORT_NULL, &waiter), kIOReturnBadArgument, NULL);
+	T_EXPECT_EQ(IODataQueueWaitForAvailableDataAdaptive(queue, port, NULL), kIOReturnBadArgument, NULL);
+
+	for (idx = 0; idx < 100; idx++) {
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueEnqueue(queue, &value, sizeof(value)), NULL);
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueWaitForAvailableDataAdaptive(queue, port, &waiter), NULL);
+		T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueDequeue(queue, NULL, NULL), NULL);
+	}
+
+	IODataQueueWaiterGetStatistics(&waiter, &statistics);
+	T_EXPECT_EQ(statistics.waits, 100ULL, NULL);
+	T_EXPECT_EQ(statistics.spinHits, 100ULL, NULL);
+	T_EXPECT_EQ(statistics.blocks, 0ULL, NULL);
+	T_EXPECT_LE(statistics.spinLimit, 100000ULL, NULL);
+
+	mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+	free(queue);
+}
+
+T_DECL(IODataQueueTelemetry,
+       "check that queue telemetry counts enqueues, overruns and dequeues and snapshots them into a dictionary",
+       T_META_NAMESPACE("IOKitUser.IOKitLib")
+       )
+{
+	IODataQueueMemory * queue;
+	IODataQueueTelemetry telemetry, other;
+	CFDictionaryRef dict;
+	CFArrayRef sizes;
+	uint64_t number;
+	uint32_t count, value = 0;
+
+	queue = calloc(1, DATA_QUEUE_MEMORY_HEADER_SIZE + 64 + DATA_QUEUE_MEMORY_APPENDIX_SIZE);
+	T_ASSERT_NOTNULL(queue, NULL);
+	queue->queueSize = 64;
+
+	T_ASSERT_MACH_SUCCESS(IODataQueueTelemetryStart(queue, &telemetry), NULL);
+	T_EXPECT_EQ(IODataQueueTelemetryStart(queue, &other), kIOReturnExclusiveAccess, NULL);
+
+	for (count = 0; kIOReturnSuccess == IODataQueueEnqueue(queue, &value, sizeof(value)); count++) {
+	}
+	T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueDequeue(queue, NULL, NULL), NULL);
+	T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueDequeue(queue, NULL, NULL), NULL);
+	T_QUIET; T_EXPECT_MACH_SUCCESS(IODataQueueEnqueue(queue, &value, sizeof(value)), NULL);
+
+	dict = IODataQueueTelemetryCopyDictionary(&telemetry);
+	T_ASSERT_NOTNULL(dict, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryEnqueuesKey)), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, (uint64_t) count + 1, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryOverrunsKey)), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, 1ULL, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryWrapsKey)), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, 1ULL, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryHighWaterKey)), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, (uint64_t) count * 8, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryDequeuesKey)), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, 2ULL, NULL);
+	sizes = CFDictionaryGetValue(dict, CFSTR(kIODataQueueTelemetryDequeueSizesKey));
+	T_ASSERT_NOTNULL(sizes, NULL);
+	T_EXPECT_EQ(CFArrayGetCount(sizes), (CFIndex) kIODataQueueTelemetrySizeBuckets, NULL);
+	T_EXPECT_TRUE(CFNumberGetValue(CFArrayGetValueAtIndex(sizes, 0), kCFNumberSInt64Type, &number), NULL);
+	T_EXPECT_EQ(number, 2ULL, NULL);
+	CFRelease(dict);
+
+	T_EXPECT_MACH_SUCCESS(IODataQueueTelemetryStop(&telemetry), NULL);
+	T_EXPECT_EQ(IODataQueueTelemetryStop(&telemetry), kIOReturnNotFound, NULL);
+	free(queue);
+}